@@ -1,26 +1,15 @@
 #include "basic_block_hashtable.h"
 //#include "../../core/x86/instrument.h"
 #include "crowd_safe_util.h"
-
-#define HASHTABLE_NAME_KEY bb_hashtable
-#define HASHTABLE_PAYLOAD_TYPE bb_state_t
-#define HASHTABLE_INIT_EMPTY { 0ULL, 0, false }
-#define HASHTABLE_IS_EMPTY(x) x.hash == 0ULL
-#include "../drcontainers/drhashtable.h"
-
-#define HASHTABLE_NAME_KEY bb_hashtable
-#define HASHTABLE_PAYLOAD_TYPE bb_state_t
-#define HASHTABLE_INIT_EMPTY { 0ULL, 0, false }
-#define HASHTABLE_IS_EMPTY(x) x.hash == 0ULL
-#include "../drcontainers/drhashtablex.h"
+#include "bb_state_table.h"
 
 /**** private fields ****/
 
-#define BB_KEY_SIZE 13
+#define BB_KEY_SIZE 14
 #define TAG_VERSION_KEY_SIZE 9
 #define DSO_KEY_SIZE 9
 
-static bb_hashtable_t *bb_table;
+static bb_state_table_t *bb_table;
 static hashtable_t *dso_table;
 
 typedef struct dynamic_syscall_observation_t dynamic_syscall_observation_t;
@@ -36,22 +25,17 @@ free_dso(void *dso);
 static bool
 observe_sysnum(dynamic_syscall_observation_t *dso, int sysnum);
 
+static void
+deactivate_bb_state(app_pc tag, bb_state_t *state);
+
 /**** public functions ****/
 
 void
 init_bb_hashtable() {
     CROWD_SAFE_DEBUG_HOOK_VOID(__FUNCTION__);
 
-    bb_table = (bb_hashtable_t*)CS_ALLOC(sizeof(bb_hashtable_t));
-    bb_hashtable_init_ex(
-        bb_table,
-        BB_KEY_SIZE,
-        HASH_INTPTR,
-        false,
-        false,
-        NULL,
-        NULL, /* no custom hashing */
-        NULL);
+    bb_table = (bb_state_table_t*)CS_ALLOC(sizeof(bb_state_table_t));
+    bb_state_table_init(bb_table, BB_KEY_SIZE);
 
     dso_table = (hashtable_t*)CS_ALLOC(sizeof(hashtable_t));
     hashtable_init_ex(
@@ -64,7 +48,7 @@ init_bb_hashtable() {
         NULL, /* no custom hashing */
         NULL);
 
-    CS_LOG("\t>> Created BB hashtable at "PX"; table entries at "PX".\n", p2int(bb_table), p2int(bb_table->table));
+    CS_LOG("\t>> Created BB hashtable at "PX"; table entries at "PX".\n", p2int(bb_table), p2int(bb_table->probe));
 }
 
 void
@@ -77,7 +61,7 @@ insert_bb_hash(app_pc tag, bb_hash_t hash) {
     state.hash = hash;
     state.tag_version = 0;
     state.flags = BB_STATE_LIVE;
-    bb_hashtable_add_replace(bb_table, tag, state);
+    bb_state_table_insert(bb_table, tag, state);
 }
 
 bb_state_t *
@@ -87,7 +71,7 @@ insert_bb_state(app_pc tag, bb_state_t state) {
 
     assert_hashcode_lock();
 
-    inserted = bb_hashtable_add_replace(bb_table, tag, state);
+    inserted = bb_state_table_insert(bb_table, tag, state);
     return inserted;
 }
 
@@ -96,7 +80,7 @@ get_bb_hash(app_pc tag) {
     CROWD_SAFE_DEBUG_HOOK(__FUNCTION__, NULL);
 
     assert_hashcode_lock();
-    return bb_hashtable_lookup(bb_table, tag)->hash;
+    return bb_state_table_lookup(bb_table, tag)->hash;
 }
 
 byte
@@ -106,7 +90,7 @@ get_tag_version(app_pc tag) {
     CROWD_SAFE_DEBUG_HOOK(__FUNCTION__, NULL);
 
     assert_hashcode_lock();
-    state = bb_hashtable_lookup(bb_table, tag);
+    state = bb_state_table_lookup(bb_table, tag);
     if (state == NULL) {
         CS_ERR("No state for tag version request "PX"\n", tag);
     } else {
@@ -124,7 +108,7 @@ get_bb_state(app_pc tag) {
     CROWD_SAFE_DEBUG_HOOK(__FUNCTION__, NULL);
 
     assert_hashcode_lock();
-    return bb_hashtable_lookup(bb_table, tag);
+    return bb_state_table_lookup(bb_table, tag);
 }
 
 void
@@ -136,14 +120,13 @@ deactivate_bb(app_pc tag) {
 
     CS_DET("Deactivate BB "PX"\n", tag);
 
-    state = bb_hashtable_lookup(bb_table, tag);
-    ASSERT(state->hash != 0ULL);
-    ASSERT(IS_BB_LIVE(state));
-
+    state = bb_state_table_lookup(bb_table, tag);
     if (state == NULL) {
         CS_ERR("Failed to locate bb state for tag "PX"\n", tag);
         return;
     }
+    ASSERT(state->hash != 0ULL);
+    ASSERT(IS_BB_LIVE(state));
 
     if (!IS_BB_LIVE(state))
         CS_WARN("Deactivating an inactive BB "PX"\n", tag);
@@ -152,32 +135,11 @@ deactivate_bb(app_pc tag) {
     UNSET_BB_UNEXPECTED_RETURN(state);
 }
 
-void
-remove_module_data(app_pc start_pc, app_pc end_pc) {
-    CROWD_SAFE_DEBUG_HOOK_VOID(__FUNCTION__);
-
-    CS_DET("Remove module data "PX" - "PX"\n", start_pc, end_pc);
-
-    assert_hashcode_lock();
-    bb_hashtable_remove_range(bb_table, start_pc, end_pc);
-    hashtable_remove_range(dso_table, start_pc, end_pc);
-}
-
 void
 deactivate_all() {
-    uint i;
-
     assert_hashcode_lock();
 
-    for (i = 0; i < HASHTABLE_SIZE(bb_table->table_bits); i++) {
-        bb_hashtable_entry_t *e = bb_table->table[i];
-        while (e != NULL) {
-            bb_hashtable_entry_t *nexte = e->next;
-            if (!IS_BB_SINGLETON(&(e->payload)))
-                DEACTIVATE_BB(&(e->payload));
-            e = nexte;
-        }
-    }
+    bb_state_table_for_each(bb_table, deactivate_bb_state);
 }
 
 void
@@ -217,10 +179,11 @@ void
 destroy_bb_hashtable() {
     CROWD_SAFE_DEBUG_HOOK_VOID(__FUNCTION__);
 
-    CS_LOG("\t>> Destroyed BB hashtable at "PX".\n", p2int(bb_table));
+    CS_LOG("\t>> Destroyed BB hashtable at "PX" with %d entries in %d bytes.\n", p2int(bb_table),
+           bb_table->entries, bb_state_table_footprint(bb_table));
 
-    bb_hashtable_delete(bb_table);
-    dr_global_free(bb_table, sizeof(bb_hashtable_t));
+    bb_state_table_delete(bb_table);
+    dr_global_free(bb_table, sizeof(bb_state_table_t));
 
     hashtable_delete(dso_table);
     dr_global_free(dso_table, sizeof(hashtable_t));
@@ -228,6 +191,12 @@ destroy_bb_hashtable() {
 
 /**** private functions ****/
 
+static void
+deactivate_bb_state(app_pc tag, bb_state_t *state) {
+    if (!IS_BB_SINGLETON(state))
+        DEACTIVATE_BB(state);
+}
+
 static void
 free_dso(void *dso) {
     dr_global_free(dso, sizeof(dynamic_syscall_observation_t));
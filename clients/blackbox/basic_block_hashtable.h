@@ -27,9 +27,6 @@ get_bb_state(app_pc tag);
 void
 deactivate_bb(app_pc tag);
 
-void
-remove_module_data(app_pc start_pc, app_pc end_pc);
-
 void
 deactivate_all();
 
@@ -10,6 +10,8 @@
 #include "indirect_link_hashtable.h"
 #include "execution_monitor.h"
 #include "blacklist.h"
+#include "crowd_safe_block_hash.h"
+#include "crowd_safe_probes.h"
 
 #ifdef WINDOWS
 # include <windows.h>
@@ -62,9 +64,6 @@ do { \
 
 //CS_TRACK(instr, sizeof(instr_t));
 
-#define SHIFT_IN_EMPTY_BYTES(data, bytes_to_keep) \
-    (data << ((4 - bytes_to_keep)*8)) >> ((4 - bytes_to_keep)*8)
-
 #define IS_CALL_GATE(i) ((instr_get_length(i) == 7) && (*(uint*)instr_get_translation(i) == 0xc015ff64) && \
     ((*((uint*)instr_get_translation(i) + 1) << 0x10) == 0))
 
@@ -110,7 +109,10 @@ static app_pc *libiomp5md_start;
 /**** Private Prototypes ****/
 
 static bb_hash_t
-hash_bits(bb_hash_t hash, uint length, byte *bits);
+hash_instruction(bb_hash_t hash, block_hash_stream_t *stream, uint length, byte *bits, bool in_place);
+
+static bb_hash_t
+finish_block_hash(bb_hash_t hash, block_hash_stream_t *stream);
 
 static bool
 commit_basic_block(dcontext_t *dcontext, app_pc tag, bb_hash_t hash,
@@ -209,6 +211,8 @@ notify_basic_block_constructed(dcontext_t *dcontext, app_pc tag,
     module_location_t *location;
     short next_relocation;
     byte normalization_buffer[15];
+    block_hash_stream_t stream;
+    extern uint block_hash_version;
     app_pc continuation_pc = NULL;
     app_pc pending_cti_target_pc = NULL;
     byte current_ordinal = 0;
@@ -282,9 +286,11 @@ notify_basic_block_constructed(dcontext_t *dcontext, app_pc tag,
 
             if ((target_module->type == module_type_anonymous) && (i3 != NULL) && (instr_get_opcode(i3) == OP_jmp_ind)) {
                 int i2_opcode = instr_get_opcode(i2);
-                hash = hash_bits(hash, instr_length(dcontext, i), instr_get_raw_bits(i));
-                hash = hash_bits(hash, 4, (byte *) &i2_opcode);
-                hash = hash_bits(hash, instr_length(dcontext, i3), instr_get_raw_bits(i3));
+                block_hash_stream_init(&stream);
+                hash = hash_instruction(hash, &stream, instr_length(dcontext, i), instr_get_raw_bits(i), false);
+                hash = hash_instruction(hash, &stream, 4, (byte *) &i2_opcode, false);
+                hash = hash_instruction(hash, &stream, instr_length(dcontext, i3), instr_get_raw_bits(i3), false);
+                hash = finish_block_hash(hash, &stream);
 
                 CS_DET("Normalized hash for syscall hook "PX" -> "PX" is 0x%llx\n", tag, target_address, hash);
             }
@@ -292,11 +298,13 @@ notify_basic_block_constructed(dcontext_t *dcontext, app_pc tag,
     }
 
     if (hash == 0ULL) {
+        block_hash_stream_init(&stream);
         for (; i != NULL; i = instr_get_next(i)) {
             ushort length = (ushort)instr_length(dcontext, i);
             uint opcode = instr_get_opcode(i);
             byte *instr_bits = instr_get_raw_bits(i);
             byte *norm_instr_bits = instr_bits;
+            bool is_truncated = false;
             ushort b;
 
             bb_size += length;
@@ -385,6 +393,7 @@ notify_basic_block_constructed(dcontext_t *dcontext, app_pc tag,
             } else {
                 if (has_relocatable_operands(i)) {
                     length = get_opcode_length(instr_bits);
+                    is_truncated = true;
                 }
 
 #if (CROWD_SAFE_LOG_LEVEL >= CS_LOG_DETAILS) || defined(LOG_ANONYMOUS_ASSEMBLY)
@@ -392,8 +401,14 @@ notify_basic_block_constructed(dcontext_t *dcontext, app_pc tag,
 #endif
             }
 
-            hash = hash_bits(hash, length, norm_instr_bits);
+            if (is_truncated && (block_hash_version != BLOCK_HASH_LEGACY)) {
+                byte truncated_length = (byte) length; // the stripe hash does not see boundaries
+                block_hash_stream_append(&stream, &truncated_length, 1);
+            }
+            hash = hash_instruction(hash, &stream, length, norm_instr_bits,
+                                    (norm_instr_bits == instr_bits) && !is_truncated);
         }
+        hash = finish_block_hash(hash, &stream);
     }
 
 #if (CROWD_SAFE_LOG_LEVEL >= CS_LOG_DETAILS) || defined(LOG_ANONYMOUS_ASSEMBLY)
@@ -503,25 +518,32 @@ close_basic_block_observer() {
 
 /**** Private Functions ****/
 
+/* The legacy hash folds each instruction into `hash`; the others collect the block in `stream`.
+ * Bits `in_place` are the app's own, and stay valid until the block hash is finished. */
 static inline bb_hash_t
-hash_bits(bb_hash_t hash, uint length, byte *bits) {
-    ushort b;
+hash_instruction(bb_hash_t hash, block_hash_stream_t *stream, uint length, byte *bits, bool in_place) {
+    extern uint block_hash_version;
 
-    while (length > 3) {
-        hash = hash ^ (hash << 5) ^ *(uint *)(bits);
-        length -= 4;
-        bits += 4;
-    }
-    if (length != 0) {
-        uint tail = 0UL;
-        for (b = 0; b < length; b++)
-            tail |= ((uint)(*(bits + b)) << (b * 8));
-        tail = SHIFT_IN_EMPTY_BYTES(tail, length);
-        hash = hash ^ (hash << 5) ^ tail;
-    }
+    if (block_hash_version == BLOCK_HASH_LEGACY)
+        return block_hash_fold(hash, length, bits);
+
+    if (in_place)
+        block_hash_stream_append_stable(stream, bits, length);
+    else
+        block_hash_stream_append(stream, bits, length);
+    return hash;
+}
+
+static inline bb_hash_t
+finish_block_hash(bb_hash_t hash, block_hash_stream_t *stream) {
+    extern uint block_hash_version;
+
+    if (block_hash_version == BLOCK_HASH_LEGACY)
+        return hash;
 
+    hash = block_hash_stream_finish(stream);
     if (hash == 0ULL)
-        return 0xffffffULL; // cannot use a zero hash, so substitute with a very unlikely hash
+        return 0xffffffULL; // cannot use a zero hash, as in the legacy fold
     else
         return hash;
 }
@@ -533,6 +555,7 @@ commit_basic_block(dcontext_t *dcontext, app_pc tag, bb_hash_t hash,
     crowd_safe_thread_local_t *cstl = GET_CSTL(dcontext);
     bb_state_t *state;
     bool is_new_tag_version = false;
+    uint64 probe = probe_start(probe_commit_basic_block);
 
     ASSERT(IS_BUILDING_TAG(cstl, tag));
     hashcode_lock_acquire();
@@ -655,6 +678,7 @@ commit_basic_block(dcontext_t *dcontext, app_pc tag, bb_hash_t hash,
 
     hashcode_lock_release();
 
+    probe_end(cstl, probe_commit_basic_block, probe);
     return true;
 }
 
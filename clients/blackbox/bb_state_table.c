@@ -0,0 +1,281 @@
+#include "bb_state_table.h"
+
+/**** private fields ****/
+
+#define BB_STATE_TABLE_SIZE(bits) (1U << (bits))
+#define BB_STATE_TABLE_MASK(bits) (BB_STATE_TABLE_SIZE(bits) - 1)
+#define BB_STATE_PROBE_BYTES(bits) \
+    (sizeof(bb_state_probe_t) + ((BB_STATE_TABLE_SIZE(bits) - 1) * sizeof(bb_state_slot_t)))
+
+/* Resize when live states and tombstones exceed 3/4 of the slots. */
+#define BB_STATE_TABLE_FULL(used, bits) (((used) * 4) > (BB_STATE_TABLE_SIZE(bits) * 3))
+
+#define BB_STATE_TOMBSTONE 0xffffffffU
+#define IS_LIVE_SLOT(slot) (((slot)->record != 0U) && ((slot)->record != BB_STATE_TOMBSTONE))
+#define TAG_LOW(tag) ((uint) (ptr_uint_t) (tag))
+
+#define BB_STATE_CHUNK_BITS 10
+#define BB_STATE_CHUNK_COUNT (1U << BB_STATE_CHUNK_BITS)
+
+/* packed like bb_state_t, so a record is 28 bytes on x64 */
+#pragma pack(push, 4)
+typedef struct bb_state_record_t bb_state_record_t;
+struct bb_state_record_t {
+    app_pc tag; // while free: the index + 1 of the next free record
+    bb_state_t state;
+};
+#pragma pack(pop)
+
+struct bb_state_chunk_t {
+    bb_state_record_t records[BB_STATE_CHUNK_COUNT];
+};
+
+/**** private prototypes ****/
+
+static inline uint
+hash_tag(uint tag_low, uint table_bits);
+
+static inline bb_state_record_t *
+get_record(bb_state_table_t *table, uint record);
+
+static bb_state_probe_t *
+create_probe(uint table_bits);
+
+static void
+resize_table(bb_state_table_t *table);
+
+static uint
+allocate_record(bb_state_table_t *table);
+
+static void
+free_record(bb_state_table_t *table, uint record);
+
+/**** public functions ****/
+
+void
+bb_state_table_init(bb_state_table_t *table, uint table_bits) {
+    table->probe = create_probe(table_bits);
+    table->entries = 0U;
+    table->used_slots = 0U;
+    table->chunks = NULL;
+    table->chunk_count = 0U;
+    table->chunk_capacity = 0U;
+    table->free_record = 0U;
+    table->next_record = 0U;
+}
+
+bb_state_t *
+bb_state_table_lookup(bb_state_table_t *table, app_pc tag) {
+    bb_state_probe_t *probe = table->probe;
+    uint tag_low = TAG_LOW(tag), mask = BB_STATE_TABLE_MASK(probe->table_bits);
+    uint index = hash_tag(tag_low, probe->table_bits);
+
+    while (true) {
+        bb_state_slot_t *slot = &probe->slots[index];
+
+        if (slot->record == 0U)
+            return NULL;
+        if ((slot->tag_low == tag_low) && (slot->record != BB_STATE_TOMBSTONE)) {
+            bb_state_record_t *record = get_record(table, slot->record);
+
+            if (record->tag == tag)
+                return &record->state;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+bb_state_t *
+bb_state_table_insert(bb_state_table_t *table, app_pc tag, bb_state_t state) {
+    bb_state_probe_t *probe;
+    bb_state_slot_t *target = NULL;
+    bb_state_record_t *stored;
+    uint tag_low = TAG_LOW(tag), mask, index;
+
+    if (BB_STATE_TABLE_FULL(table->used_slots + 1, table->probe->table_bits))
+        resize_table(table);
+
+    probe = table->probe;
+    mask = BB_STATE_TABLE_MASK(probe->table_bits);
+    index = hash_tag(tag_low, probe->table_bits);
+    while (true) {
+        bb_state_slot_t *slot = &probe->slots[index];
+
+        if (slot->record == 0U) {
+            if (target == NULL) {
+                target = slot;
+                table->used_slots++;
+            }
+            break;
+        }
+        if (slot->record == BB_STATE_TOMBSTONE) {
+            if (target == NULL)
+                target = slot; // reuse the first tombstone, but keep looking for the tag
+        } else if (slot->tag_low == tag_low) {
+            stored = get_record(table, slot->record);
+            if (stored->tag == tag) {
+                stored->state = state; // in place: existing pointers to the state stay valid
+                return &stored->state;
+            }
+        }
+        index = (index + 1) & mask;
+    }
+
+    target->tag_low = tag_low;
+    target->record = allocate_record(table);
+    stored = get_record(table, target->record);
+    stored->tag = tag;
+    stored->state = state;
+    table->entries++;
+    return &stored->state;
+}
+
+bool
+bb_state_table_remove_range(bb_state_table_t *table, app_pc start, app_pc end) {
+    bb_state_probe_t *probe = table->probe;
+    uint i;
+    bool removed = false;
+
+    for (i = 0; i < BB_STATE_TABLE_SIZE(probe->table_bits); i++) {
+        bb_state_slot_t *slot = &probe->slots[i];
+
+        if (IS_LIVE_SLOT(slot)) {
+            app_pc tag = get_record(table, slot->record)->tag;
+
+            if ((tag >= start) && (tag < end)) {
+                free_record(table, slot->record);
+                slot->record = BB_STATE_TOMBSTONE;
+                table->entries--;
+                removed = true;
+            }
+        }
+    }
+    return removed;
+}
+
+void
+bb_state_table_for_each(bb_state_table_t *table, void (*visit)(app_pc tag, bb_state_t *state)) {
+    bb_state_probe_t *probe = table->probe;
+    uint i;
+
+    for (i = 0; i < BB_STATE_TABLE_SIZE(probe->table_bits); i++) {
+        bb_state_slot_t *slot = &probe->slots[i];
+
+        if (IS_LIVE_SLOT(slot)) {
+            bb_state_record_t *record = get_record(table, slot->record);
+
+            visit(record->tag, &record->state);
+        }
+    }
+}
+
+size_t
+bb_state_table_footprint(bb_state_table_t *table) {
+    return BB_STATE_PROBE_BYTES(table->probe->table_bits) +
+        (table->chunk_capacity * sizeof(bb_state_chunk_t *)) +
+        (table->chunk_count * sizeof(bb_state_chunk_t));
+}
+
+void
+bb_state_table_delete(bb_state_table_t *table) {
+    uint i;
+
+    for (i = 0; i < table->chunk_count; i++)
+        dr_global_free(table->chunks[i], sizeof(bb_state_chunk_t));
+    if (table->chunks != NULL)
+        dr_global_free(table->chunks, table->chunk_capacity * sizeof(bb_state_chunk_t *));
+    dr_global_free(table->probe, BB_STATE_PROBE_BYTES(table->probe->table_bits));
+    table->probe = NULL;
+    table->chunks = NULL;
+    table->chunk_count = 0U;
+    table->chunk_capacity = 0U;
+    table->free_record = 0U;
+    table->next_record = 0U;
+    table->entries = 0U;
+}
+
+/**** private functions ****/
+
+/* Fibonacci hashing: code addresses are clustered, so mix all bits into the top ones. */
+static inline uint
+hash_tag(uint tag_low, uint table_bits) {
+    return (uint) ((((uint64) tag_low) * 0x9e3779b97f4a7c15ULL) >> (64 - table_bits));
+}
+
+/* `record` is the index + 1, as stored in a slot. */
+static inline bb_state_record_t *
+get_record(bb_state_table_t *table, uint record) {
+    record--;
+    return &table->chunks[record >> BB_STATE_CHUNK_BITS]->records[record & (BB_STATE_CHUNK_COUNT - 1)];
+}
+
+static bb_state_probe_t *
+create_probe(uint table_bits) {
+    bb_state_probe_t *probe = (bb_state_probe_t *) CS_ALLOC(BB_STATE_PROBE_BYTES(table_bits));
+
+    memset(probe, 0, BB_STATE_PROBE_BYTES(table_bits));
+    probe->table_bits = table_bits;
+    return probe;
+}
+
+/* Rehash into a new probe array, doubling it unless most of the used slots are tombstones.
+ * The slots carry the low tag bits that select their home slot, so the records are not read. */
+static void
+resize_table(bb_state_table_t *table) {
+    bb_state_probe_t *old_probe = table->probe, *new_probe;
+    uint table_bits = old_probe->table_bits, i;
+
+    if (((table->entries + 1) * 2) > BB_STATE_TABLE_SIZE(table_bits))
+        table_bits++;
+
+    new_probe = create_probe(table_bits);
+    for (i = 0; i < BB_STATE_TABLE_SIZE(old_probe->table_bits); i++) {
+        bb_state_slot_t *slot = &old_probe->slots[i];
+
+        if (IS_LIVE_SLOT(slot)) {
+            uint index = hash_tag(slot->tag_low, table_bits);
+
+            while (new_probe->slots[index].record != 0U)
+                index = (index + 1) & BB_STATE_TABLE_MASK(table_bits);
+            new_probe->slots[index] = *slot;
+        }
+    }
+
+    table->probe = new_probe;
+    table->used_slots = table->entries;
+    dr_global_free(old_probe, BB_STATE_PROBE_BYTES(old_probe->table_bits));
+}
+
+/* Returns the index + 1 of an unused record. */
+static uint
+allocate_record(bb_state_table_t *table) {
+    uint record;
+
+    if (table->free_record != 0U) {
+        record = table->free_record;
+        table->free_record = (uint) (ptr_uint_t) get_record(table, record)->tag;
+        return record;
+    }
+
+    if ((table->next_record >> BB_STATE_CHUNK_BITS) == table->chunk_count) {
+        if (table->chunk_count == table->chunk_capacity) {
+            uint capacity = (table->chunk_capacity == 0U) ? 0x10 : (table->chunk_capacity * 2);
+            bb_state_chunk_t **chunks = (bb_state_chunk_t **) CS_ALLOC(capacity * sizeof(bb_state_chunk_t *));
+
+            if (table->chunks != NULL) {
+                memcpy(chunks, table->chunks, table->chunk_count * sizeof(bb_state_chunk_t *));
+                dr_global_free(table->chunks, table->chunk_capacity * sizeof(bb_state_chunk_t *));
+            }
+            table->chunks = chunks;
+            table->chunk_capacity = capacity;
+        }
+        table->chunks[table->chunk_count++] = (bb_state_chunk_t *) CS_ALLOC(sizeof(bb_state_chunk_t));
+    }
+    return ++table->next_record;
+}
+
+static void
+free_record(bb_state_table_t *table, uint record) {
+    get_record(table, record)->tag = (app_pc) (ptr_uint_t) table->free_record;
+    table->free_record = record;
+}
@@ -0,0 +1,84 @@
+#ifndef BB_STATE_TABLE_H
+#define BB_STATE_TABLE_H 1
+
+/* Open-addressed table of bb_state_t keyed by tag, with linear probing and power-of-two growth.
+ * A probe slot is 8 bytes: the low 32 bits of the tag, which also select the home slot, and the
+ * index of a record that holds the full tag beside its state. The records are kept in slabs, so
+ * a bb_state_t never moves while it is in the table, because other structures (such as
+ * module_location_t.black_box_singleton_state) hold pointers to it across inserts.
+ *
+ * Not synchronized: every call, including lookups, must hold the includer's lock (the hashcode
+ * lock in basic_block_hashtable.c), and so must any read of a returned state, since an insert
+ * overwrites an existing state in place. */
+
+#include "crowd_safe_portable.h"
+#ifdef CROWD_SAFE_PORTABLE
+/* same layout as the client's bb_state_t in crowd_safe_util.h */
+# pragma pack(push, 2)
+typedef struct _bb_state_t {
+    ushort image_instance_id;
+    ushort flags;
+    uint64 hash;
+    int meta_type;
+    byte tag_version;
+    ushort size;
+} bb_state_t;
+# pragma pack(pop)
+#else
+# include "crowd_safe_util.h"
+#endif
+
+typedef struct bb_state_slot_t bb_state_slot_t;
+struct bb_state_slot_t {
+    uint tag_low;
+    uint record; // 0: never used; BB_STATE_TOMBSTONE: removed; else the record index + 1
+};
+
+typedef struct bb_state_probe_t bb_state_probe_t;
+struct bb_state_probe_t {
+    uint table_bits;
+    bb_state_slot_t slots[1]; // (1 << table_bits) slots
+};
+
+typedef struct bb_state_chunk_t bb_state_chunk_t;
+
+typedef struct bb_state_table_t bb_state_table_t;
+struct bb_state_table_t {
+    bb_state_probe_t *probe;
+    uint entries;    // live states
+    uint used_slots; // live states and tombstones
+    bb_state_chunk_t **chunks; // record index / BB_STATE_CHUNK_COUNT
+    uint chunk_count;
+    uint chunk_capacity;
+    uint free_record;  // index + 1 of a free record, linked through their tags; 0 if none
+    uint next_record;  // next never used record index
+};
+
+/**** public functions ****/
+
+void
+bb_state_table_init(bb_state_table_t *table, uint table_bits);
+
+/* Returns the state for `tag`, or NULL. */
+bb_state_t *
+bb_state_table_lookup(bb_state_table_t *table, app_pc tag);
+
+/* Adds `state` for `tag`, or overwrites the existing state in place. Returns the stored state. */
+bb_state_t *
+bb_state_table_insert(bb_state_table_t *table, app_pc tag, bb_state_t state);
+
+/* Removes every tag in [start, end). Returns true if any was removed. */
+bool
+bb_state_table_remove_range(bb_state_table_t *table, app_pc start, app_pc end);
+
+void
+bb_state_table_for_each(bb_state_table_t *table, void (*visit)(app_pc tag, bb_state_t *state));
+
+/* Returns the bytes allocated by the table, including the record slabs. */
+size_t
+bb_state_table_footprint(bb_state_table_t *table);
+
+void
+bb_state_table_delete(bb_state_table_t *table);
+
+#endif
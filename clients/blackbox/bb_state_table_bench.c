@@ -0,0 +1,332 @@
+/* Blackbox bb_state table benchmarking standalone app. */
+
+/* This is a standalone app that compares the open-addressed bb_state table against the chained
+ * table it replaced. The chained table is reproduced here with the layout and policies of a
+ * drhashtablex.h instantiation with HASH_INTPTR keys and an inline bb_state_t payload: one heap
+ * node per entry, buckets selected by the low bits of the tag, and doubling above 75% load.
+ * Tags are synthetic code addresses in a few modules, inserted in discovery order, and then
+ * looked up at random with a share of misses. Reports lookups/sec, heap bytes per entry and
+ * the growth of peak RSS while inserting. The chained table runs first, so the open table may
+ * reuse its freed pages; use -table open or -table chained to compare RSS in isolation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __GLIBC__
+# include <malloc.h>
+#endif
+#ifdef WINDOWS
+# include <windows.h>
+#else
+# include <time.h>
+# include <sys/resource.h>
+#endif
+
+#include "bb_state_table.h"
+
+#define DEFAULT_ENTRY_COUNT 1000000
+#define DEFAULT_LOOKUP_COUNT 20000000
+#define MISS_PERCENT 10
+#define MODULE_COUNT 16
+#define INITIAL_TABLE_BITS 14 // BB_KEY_SIZE
+
+/**** chained table, as instantiated from drhashtablex.h ****/
+
+typedef struct chained_entry_t chained_entry_t;
+struct chained_entry_t {
+    app_pc key;
+    bb_state_t payload;
+    chained_entry_t *next;
+};
+
+typedef struct chained_table_t chained_table_t;
+struct chained_table_t {
+    chained_entry_t **table;
+    uint table_bits;
+    uint entries;
+};
+
+static void
+chained_init(chained_table_t *table, uint table_bits) {
+    table->table_bits = table_bits;
+    table->entries = 0;
+    table->table = (chained_entry_t **) calloc(1U << table_bits, sizeof(chained_entry_t *));
+}
+
+static inline uint
+chained_hash(app_pc key, uint table_bits) {
+    return ((uint) (ptr_uint_t) key) & ((~0U) >> (32 - table_bits));
+}
+
+static bb_state_t *
+chained_lookup(chained_table_t *table, app_pc key) {
+    chained_entry_t *e;
+
+    for (e = table->table[chained_hash(key, table->table_bits)]; e != NULL; e = e->next) {
+        if (e->key == key)
+            return &e->payload;
+    }
+    return NULL;
+}
+
+static void
+chained_resize(chained_table_t *table) {
+    uint old_bits = table->table_bits, i;
+    chained_entry_t **old_table = table->table;
+
+    chained_init(table, old_bits + 1);
+    for (i = 0; i < (1U << old_bits); i++) {
+        chained_entry_t *e = old_table[i], *next;
+
+        for (; e != NULL; e = next) {
+            uint index = chained_hash(e->key, table->table_bits);
+
+            next = e->next;
+            e->next = table->table[index];
+            table->table[index] = e;
+        }
+    }
+    free(old_table);
+}
+
+static void
+chained_add(chained_table_t *table, app_pc key, bb_state_t payload) {
+    chained_entry_t *e = (chained_entry_t *) malloc(sizeof(chained_entry_t));
+    uint index = chained_hash(key, table->table_bits);
+
+    e->key = key;
+    e->payload = payload;
+    e->next = table->table[index];
+    table->table[index] = e;
+    table->entries++;
+    if (table->entries * 100 > 75 * (1U << table->table_bits))
+        chained_resize(table);
+}
+
+static void
+chained_delete(chained_table_t *table) {
+    uint i;
+
+    for (i = 0; i < (1U << table->table_bits); i++) {
+        chained_entry_t *e = table->table[i], *next;
+
+        for (; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+    }
+    free(table->table);
+}
+
+/**** benchmark ****/
+
+static uint64
+now_nanos() {
+#ifdef WINDOWS
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64) ((count.QuadPart * 1000000000.0) / frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (((uint64) now.tv_sec) * 1000000000ULL) + now.tv_nsec;
+#endif
+}
+
+static size_t
+heap_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+
+    return info.uordblks + info.hblkhd; // large arrays are mapped outside the arena
+#else
+    return 0;
+#endif
+}
+
+static long
+peak_rss_kb() {
+#ifdef WINDOWS
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#endif
+}
+
+static inline uint64
+next_random(uint64 *state) {
+    uint64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/* Blocks are discovered roughly in address order within each module, a few bytes apart. */
+static app_pc *
+generate_tags(uint entry_count) {
+    app_pc *tags = (app_pc *) malloc(entry_count * sizeof(app_pc));
+    ptr_uint_t cursors[MODULE_COUNT];
+    uint64 random_state = 0x2545f4914f6cdd1dULL;
+    uint i;
+
+    for (i = 0; i < MODULE_COUNT; i++)
+        cursors[i] = (ptr_uint_t) 0x70000000 + ((ptr_uint_t) i * 0x01000000);
+    for (i = 0; i < entry_count; i++) {
+        uint64 r = next_random(&random_state);
+        uint module = (uint) (r % MODULE_COUNT);
+
+        cursors[module] += 1 + ((r >> 8) & 0x3f);
+        tags[i] = (app_pc) cursors[module];
+    }
+    return tags;
+}
+
+static app_pc *
+generate_probes(app_pc *tags, uint entry_count, uint lookup_count) {
+    app_pc *probes = (app_pc *) malloc(lookup_count * sizeof(app_pc));
+    uint64 random_state = 0x9e3779b97f4a7c15ULL;
+    uint i;
+
+    for (i = 0; i < lookup_count; i++) {
+        uint64 r = next_random(&random_state);
+
+        probes[i] = tags[r % entry_count];
+        if ((r >> 40) % 100 < MISS_PERCENT)
+            probes[i] = (app_pc) ((ptr_uint_t) probes[i] + 0x80000000U); // outside every module
+    }
+    return probes;
+}
+
+static void
+report(const char *name, uint entry_count, uint lookup_count, uint64 insert_nanos,
+       uint64 lookup_nanos, size_t heap_bytes, long rss_growth_kb, uint hits)
+{
+    printf("%-8s %8.1f %12.1f %10.2f %12.1f %10ld %8u\n", name,
+           ((double) insert_nanos) / entry_count,
+           lookup_count / (lookup_nanos / 1e9) / 1e6,
+           ((double) lookup_nanos) / lookup_count,
+           ((double) heap_bytes) / entry_count, rss_growth_kb, hits);
+}
+
+static void
+run_open(app_pc *tags, app_pc *probes, uint entry_count, uint lookup_count) {
+    bb_state_table_t table;
+    bb_state_t state;
+    size_t heap_before = heap_in_use(), heap_bytes;
+    long rss_before = peak_rss_kb(), rss_growth_kb;
+    uint64 start, insert_nanos, lookup_nanos;
+    uint i, hits = 0;
+
+    memset(&state, 0, sizeof(state));
+    start = now_nanos();
+    bb_state_table_init(&table, INITIAL_TABLE_BITS);
+    for (i = 0; i < entry_count; i++) {
+        state.hash = (uint64) (ptr_uint_t) tags[i];
+        bb_state_table_insert(&table, tags[i], state);
+    }
+    insert_nanos = now_nanos() - start;
+    rss_growth_kb = peak_rss_kb() - rss_before;
+    heap_bytes = (heap_before == 0 && heap_in_use() == 0) ? bb_state_table_footprint(&table) :
+        heap_in_use() - heap_before;
+
+    start = now_nanos();
+    for (i = 0; i < lookup_count; i++) {
+        if (bb_state_table_lookup(&table, probes[i]) != NULL)
+            hits++;
+    }
+    lookup_nanos = now_nanos() - start;
+
+    report("open", entry_count, lookup_count, insert_nanos, lookup_nanos, heap_bytes,
+           rss_growth_kb, hits);
+    bb_state_table_delete(&table);
+}
+
+static void
+run_chained(app_pc *tags, app_pc *probes, uint entry_count, uint lookup_count) {
+    chained_table_t table;
+    bb_state_t state;
+    size_t heap_before = heap_in_use(), heap_bytes;
+    long rss_before = peak_rss_kb(), rss_growth_kb;
+    uint64 start, insert_nanos, lookup_nanos;
+    uint i, hits = 0;
+
+    memset(&state, 0, sizeof(state));
+    start = now_nanos();
+    chained_init(&table, INITIAL_TABLE_BITS);
+    for (i = 0; i < entry_count; i++) {
+        state.hash = (uint64) (ptr_uint_t) tags[i];
+        chained_add(&table, tags[i], state);
+    }
+    insert_nanos = now_nanos() - start;
+    rss_growth_kb = peak_rss_kb() - rss_before;
+    heap_bytes = (heap_before == 0 && heap_in_use() == 0) ?
+        (table.entries * sizeof(chained_entry_t)) + ((1U << table.table_bits) * sizeof(void *)) :
+        heap_in_use() - heap_before;
+
+    start = now_nanos();
+    for (i = 0; i < lookup_count; i++) {
+        if (chained_lookup(&table, probes[i]) != NULL)
+            hits++;
+    }
+    lookup_nanos = now_nanos() - start;
+
+    report("chained", entry_count, lookup_count, insert_nanos, lookup_nanos, heap_bytes,
+           rss_growth_kb, hits);
+    chained_delete(&table);
+}
+
+static int
+usage(const char *msg) {
+    if (msg != NULL && msg[0] != '\0')
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "usage: bb_state_table_bench [-entries <count>] [-lookups <count>] "
+            "[-table open|chained]\n");
+    return 1;
+}
+
+int
+main(int argc, char **argv) {
+    uint entry_count = DEFAULT_ENTRY_COUNT, lookup_count = DEFAULT_LOOKUP_COUNT;
+    bool run_open_table = true, run_chained_table = true;
+    app_pc *tags, *probes;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-entries") == 0 && i + 1 < argc)
+            entry_count = (uint) strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-lookups") == 0 && i + 1 < argc)
+            lookup_count = (uint) strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-table") == 0 && i + 1 < argc) {
+            i++;
+            run_open_table = (strcmp(argv[i], "open") == 0);
+            run_chained_table = (strcmp(argv[i], "chained") == 0);
+            if (!run_open_table && !run_chained_table)
+                return usage("unknown table");
+        } else
+            return usage("unknown option");
+    }
+    if (entry_count == 0 || lookup_count == 0)
+        return usage("counts must be positive");
+
+    tags = generate_tags(entry_count);
+    probes = generate_probes(tags, entry_count, lookup_count);
+
+    printf("%u entries, %u lookups (%d%% misses)\n", entry_count, lookup_count, MISS_PERCENT);
+    printf("%-8s %8s %12s %10s %12s %10s %8s\n", "table", "ns/ins", "Mlookups/s", "ns/lookup",
+           "heap B/entry", "RSS +KB", "hits");
+    if (run_chained_table)
+        run_chained(tags, probes, entry_count, lookup_count);
+    if (run_open_table)
+        run_open(tags, probes, entry_count, lookup_count);
+
+    free(probes);
+    free(tags);
+    return 0;
+}
@@ -13,6 +13,8 @@
 #include "execution_monitor.h"
 #include "crowd_safe_gencode.h"
 #include "crowd_safe_util.h"
+#include "crowd_safe_block_hash.h"
+#include "crowd_safe_probes.h"
 
 static void
 audit_dispatch(dcontext_t *dcontext)
@@ -360,6 +362,12 @@ event_exit(void)
     drsym_exit();
 }
 
+static void
+event_nudge(void *dcontext, uint64 argument)
+{
+    nudge_crowd_safe_probes(argument);
+}
+
 static audit_callbacks_t callbacks = {
     &cs_log_file,
     CROWD_SAFE_LOG_LEVEL,
@@ -407,6 +415,11 @@ static audit_callbacks_t callbacks = {
 
 uint crowd_safe_options = 0;
 uint bb_analysis_level;
+uint trace_buffer_kb = 0;     // initial buffer size of the non-graph trace files (0: default)
+uint graph_buffer_kb = 0;     // initial buffer size of the graph trace files (0: default)
+uint trace_buffer_max_kb = 0; // ceiling for adaptive buffer growth (0: default)
+uint metrics_ms = 0;          // sampling interval of the metrics ring file (0: no ring file)
+uint block_hash_version = BLOCK_HASH_LEGACY;
 static char monitor_dataset_buf[MAX_MONITOR_DATASET_DIR_LEN] = {0};
 char *monitor_dataset_dir = monitor_dataset_buf;
 uint64 process_start_time;
@@ -467,8 +480,22 @@ parse_options(client_id_t id)
         crowd_safe_options |= CROWD_SAFE_META_ON_CLOCK_OPTION;
     if (has_option("wdb_script"))
         crowd_safe_options |= CROWD_SAFE_DEBUG_SCRIPT_OPTION;
+    if (has_option("graph_map"))
+        crowd_safe_options |= CROWD_SAFE_MAP_GRAPH_OPTION;
+    if (has_option("graph_compact"))
+        crowd_safe_options |= CROWD_SAFE_COMPACT_GRAPH_OPTION;
+    if (has_option("uibp_exact"))
+        crowd_safe_options |= CROWD_SAFE_UIBP_EXACT_OPTION;
     if (get_uint_option("analysis", &bb_analysis_level))
         crowd_safe_options |= CROWD_SAFE_BB_ANALYSIS_OPTION;
+    get_uint_option("trace_buffer_kb", &trace_buffer_kb);
+    get_uint_option("graph_buffer_kb", &graph_buffer_kb);
+    get_uint_option("trace_buffer_max_kb", &trace_buffer_max_kb);
+    get_uint_option("metrics_ms", &metrics_ms);
+    if (get_uint_option("hash_version", &block_hash_version) && (block_hash_version > BLOCK_HASH_LATEST)) {
+        dr_printf("Unknown -hash_version %d, using the legacy hash\n", block_hash_version);
+        block_hash_version = BLOCK_HASH_LEGACY;
+    }
 }
 
 DR_EXPORT void
@@ -483,6 +510,7 @@ dr_init(client_id_t id)
     init_module_observer(false/*not fork*/);
 
     dr_register_exit_event(event_exit);
+    dr_register_nudge_event(event_nudge, id);
     dr_register_audit_callbacks(&callbacks);
 
     /*
@@ -4,6 +4,7 @@
 #include "module_observer.h"
 #include "execution_monitor.h"
 #include "blacklist.h"
+#include "blacklist_filter.h"
 
 /*
  *             <action> ::= <action-type> <action-type-filter>
@@ -111,6 +112,7 @@ bool blacklist_enabled = false;
 
 static hashtable_t *pending_blacklist_edge_table;
 static hashtable_t *blacklist_edge_table;
+static blacklist_filter_t blacklist_filter; // of every key in blacklist_edge_table
 
 static drvector_t *blacklist_module_load_list;
 static bool blacklist_module_load_any = false;
@@ -135,6 +137,10 @@ static void free_module_load_entry(void *e);
 
 static void free_blacklist_node_type(void *e);
 
+static void add_blacklist_entry(blacklist_entry_t *entry, module_location_t *module);
+
+static uint count_blacklist_lines(const char *buffer);
+
 /****** public functions *******/
 
 static bool
@@ -301,7 +307,7 @@ load_edge_entry(char **word_mark) {
             }
         }
 
-        hashtable_add(blacklist_edge_table, wildcards, wildcards);
+        add_blacklist_entry(wildcards, NULL);
         return true;
     }
 
@@ -411,7 +417,7 @@ load_node_entry(char **word_mark) {
             dr_global_free(wildcard, sizeof(blacklist_entry_t));
             return false;
         }
-        hashtable_add(blacklist_edge_table, wildcard, wildcard);
+        add_blacklist_entry(wildcard, NULL);
         return true;
     }
 
@@ -525,6 +531,7 @@ init_blacklist() {
     }
     buffer[size] = '\0';
 
+    blacklist_filter_init(&blacklist_filter, count_blacklist_lines(buffer));
     blacklist_enabled = load_blacklist(buffer);
 
 close_blacklist_file:
@@ -538,6 +545,7 @@ delete_blacklist() {
     // todo...
     drvector_delete(blacklist_module_load_list);
     drvector_delete(blacklist_node_type_list);
+    blacklist_filter_free(&blacklist_filter);
 }
 
 static void
@@ -610,7 +618,7 @@ blacklist_bind_module(module_location_t *module) {
             }
         }
 
-        hashtable_add(blacklist_edge_table, entry, entry);
+        add_blacklist_entry(entry, module);
         CS_LOG("BL| Bound blacklist entry [0x%x] "PX" -> "PX" (0x%llx) in module %s\n",
                entry->flags, entry->from, entry->to, entry->edge_hash, module_short_name);
     }
@@ -675,6 +683,9 @@ check_blacklist_node(module_location_t *module, app_pc tag) {
     blacklist_entry_t lookup = {0};
     lookup.from = tag;
 
+    if (!blacklist_filter_may_contain(&blacklist_filter, p2int(MODULAR_PC(module, tag))))
+        return;
+
     if (hashtable_lookup(blacklist_edge_table, &lookup) != NULL) {
         dr_snprintf(entry_text, 256, "%s "PX,
                     module->module_name, MODULAR_PC(module, tag));
@@ -774,8 +785,11 @@ check_blacklist_edge(module_location_t *from_module, module_location_t *to_modul
 {
     char entry_text[256];
     blacklist_entry_t lookup = {0};
+    uint64 filter_key = (edge_hash == 0ULL) ? p2int(MODULAR_PC(from_module, from)) : edge_hash;
 
-    if (edge_hash == 0ULL) {
+    if (!blacklist_filter_may_contain(&blacklist_filter, filter_key)) {
+        /* no entry can match, skip to the node types */
+    } else if (edge_hash == 0ULL) {
         lookup.from = from;
         lookup.to = to;
         if (hashtable_lookup(blacklist_edge_table, &lookup) != NULL) {
@@ -922,6 +936,35 @@ compare_blacklist_entry(void *a, void *b) {
            first->edge_hash == second->edge_hash;
 }
 
+/* Adds the entry to the table and its key to the filter: the edge hash when one side is an
+ * export, otherwise the offset of the `from` node in `module` (NULL for wildcard modules). */
+static void
+add_blacklist_entry(blacklist_entry_t *entry, module_location_t *module) {
+    uint64 filter_key;
+
+    if (TESTANY(BLACKLIST_FLAG_FROM_HASH | BLACKLIST_FLAG_TO_HASH, entry->flags))
+        filter_key = entry->edge_hash;
+    else if (module == NULL || TEST(BLACKLIST_FLAG_FROM_MODULE_WILDCARD, entry->flags))
+        filter_key = p2int(entry->from);
+    else
+        filter_key = p2int(MODULAR_PC(module, entry->from));
+
+    blacklist_filter_add(&blacklist_filter, filter_key);
+    hashtable_add(blacklist_edge_table, entry, entry);
+}
+
+/* Each line holds at most one entry, which is bound under the same key in every module. */
+static uint
+count_blacklist_lines(const char *buffer) {
+    uint count = 1;
+
+    for (; *buffer != '\0'; buffer++) {
+        if (*buffer == '\n')
+            count++;
+    }
+    return count;
+}
+
 static void
 free_pending_blacklist_module_entries(void *e) {
     drvector_t *entries = (drvector_t *) e;
@@ -0,0 +1,41 @@
+#include "blacklist_filter.h"
+
+/**** public functions ****/
+
+void
+blacklist_filter_init(blacklist_filter_t *filter, uint key_count) {
+    uint64 block_count = ((((uint64) key_count) * BLACKLIST_FILTER_BITS_PER_KEY) +
+                          (BLACKLIST_FILTER_BLOCK_BYTES * 8) - 1) /
+                         (BLACKLIST_FILTER_BLOCK_BYTES * 8);
+    size_t size;
+
+    filter->block_bits = 1; // (the block shift is undefined for 0 bits)
+    while ((1ULL << filter->block_bits) < block_count)
+        filter->block_bits++;
+
+    size = ((size_t) 1 << filter->block_bits) * BLACKLIST_FILTER_BLOCK_BYTES;
+    filter->allocation_size = size + BLACKLIST_FILTER_BLOCK_BYTES;
+    filter->allocation = CS_ALLOC(filter->allocation_size);
+    filter->blocks = (uint64 *) (((ptr_uint_t) filter->allocation +
+                                  BLACKLIST_FILTER_BLOCK_BYTES - 1) &
+                                 ~((ptr_uint_t) BLACKLIST_FILTER_BLOCK_BYTES - 1));
+    memset(filter->blocks, 0, size);
+}
+
+void
+blacklist_filter_add(blacklist_filter_t *filter, uint64 key) {
+    uint64 hash = blacklist_filter_hash(key);
+    uint64 *block = BLACKLIST_FILTER_BLOCK(filter, hash);
+    uint shift;
+
+    for (shift = 0; shift < 27; shift += 9)
+        block[(hash >> (shift + 6)) & 7] |= (1ULL << ((hash >> shift) & 63));
+}
+
+void
+blacklist_filter_free(blacklist_filter_t *filter) {
+    if (filter->allocation != NULL)
+        dr_global_free(filter->allocation, filter->allocation_size);
+    filter->allocation = NULL;
+    filter->blocks = NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef BLACKLIST_FILTER_H
+#define BLACKLIST_FILTER_H 1
+
+/* Blocked Bloom filter in front of the blacklist entry table (blacklist.c). Each key sets 3
+ * bits within one 64-byte block, so a query touches a single cache line, and a miss proves
+ * that no entry has the key. Bits are never cleared: a module unload leaves its keys behind,
+ * and binding the module again sets the same bits. Portable under CROWD_SAFE_PORTABLE.
+ *
+ * The blacklist keys every entry by the module-relative offset of its `from` node, or by the
+ * edge hash when one side is an export, since every probe of check_blacklist_edge() for a
+ * given edge shares that key. */
+
+#include "crowd_safe_portable.h"
+
+#define BLACKLIST_FILTER_BLOCK_BYTES 0x40
+#define BLACKLIST_FILTER_BLOCK_WORDS (BLACKLIST_FILTER_BLOCK_BYTES / sizeof(uint64))
+#define BLACKLIST_FILTER_BITS_PER_KEY 16
+
+typedef struct blacklist_filter_t blacklist_filter_t;
+struct blacklist_filter_t {
+    uint64 *blocks;  // aligned to BLACKLIST_FILTER_BLOCK_BYTES within `allocation`
+    uint block_bits; // 2^block_bits blocks
+    void *allocation;
+    size_t allocation_size;
+};
+
+/**** public functions ****/
+
+/* Sizes the filter for `key_count` keys, at BLACKLIST_FILTER_BITS_PER_KEY. */
+void
+blacklist_filter_init(blacklist_filter_t *filter, uint key_count);
+
+void
+blacklist_filter_add(blacklist_filter_t *filter, uint64 key);
+
+void
+blacklist_filter_free(blacklist_filter_t *filter);
+
+static inline uint64
+blacklist_filter_hash(uint64 key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+/* The block is chosen by the top bits of the hash, and the 3 bits by its low 27 bits. */
+#define BLACKLIST_FILTER_BLOCK(filter, hash) \
+    ((filter)->blocks + (((hash) >> (64 - (filter)->block_bits)) * BLACKLIST_FILTER_BLOCK_WORDS))
+#define BLACKLIST_FILTER_BIT(block, hash, shift) \
+    ((block)[((hash) >> ((shift) + 6)) & 7] & (1ULL << (((hash) >> (shift)) & 63)))
+
+/* A filter that was never initialized (no blacklist file, or an unreadable one) contains nothing. */
+static inline bool
+blacklist_filter_may_contain(blacklist_filter_t *filter, uint64 key) {
+    uint64 hash, *block;
+
+    if (filter->blocks == NULL)
+        return false;
+
+    hash = blacklist_filter_hash(key);
+    block = BLACKLIST_FILTER_BLOCK(filter, hash);
+    return (BLACKLIST_FILTER_BIT(block, hash, 0) != 0ULL) &&
+           (BLACKLIST_FILTER_BIT(block, hash, 9) != 0ULL) &&
+           (BLACKLIST_FILTER_BIT(block, hash, 18) != 0ULL);
+}
+
+#endif
@@ -0,0 +1,335 @@
+/* Blackbox blacklist filter benchmarking standalone app. */
+
+/* This is a standalone app that times check_blacklist_edge() over a large synthetic blacklist,
+ * with and without the blocked Bloom filter in front of the entry table. The entry table is
+ * reproduced here with the layout of the client's blacklist_edge_table: a drhashtablex.h
+ * chained table with the blacklist.c struct hash and comparator, starting at 2^7 buckets and
+ * doubling above 75% load. Entries are exact edges, `*` -> module edges and `*` -> `*` edges in
+ * a few modules, and each program edge takes the 4 probes of a non-export edge unless the
+ * filter rejects it first. Reports ns/edge, the hits (which must agree), and the share of
+ * non-matching edges that the filter lets through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WINDOWS
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "blacklist_filter.h"
+
+#define DEFAULT_ENTRY_COUNT 1000000
+#define DEFAULT_EDGE_COUNT 20000000
+#define HIT_PER_MILLION 100
+#define MODULE_COUNT 16
+#define MODULE_BASE(i) ((ptr_uint_t) 0x10000000 + ((ptr_uint_t) (i) * MODULE_SIZE))
+#define MODULE_SIZE 0x04000000
+#define INITIAL_TABLE_BITS 7 // BLACKLIST_TABLE_KEY_SIZE
+
+/* as in blacklist.c */
+#define EDGE_HASH_FROM_WILDCARD 0x9999999999999999ULL
+#define EDGE_HASH_TO_WILDCARD 0xaaaaaaaaaaaaaaaaULL
+#define EDGE_HASH_BOTH_WILDCARD 0xccccccccccccccccULL
+
+typedef struct entry_t entry_t;
+struct entry_t {
+    app_pc from;
+    app_pc to;
+    uint64 edge_hash;
+};
+
+typedef struct program_edge_t program_edge_t;
+struct program_edge_t {
+    uint from_module;
+    uint to_module;
+    app_pc from;
+    app_pc to;
+};
+
+/**** chained table, as instantiated from drhashtablex.h ****/
+
+typedef struct chained_entry_t chained_entry_t;
+struct chained_entry_t {
+    entry_t *key;
+    entry_t *payload;
+    chained_entry_t *next;
+};
+
+typedef struct chained_table_t chained_table_t;
+struct chained_table_t {
+    chained_entry_t **table;
+    uint table_bits;
+    uint entries;
+};
+
+/* hash_blacklist_entry() */
+static inline uint
+entry_hash(entry_t *entry, uint table_bits) {
+    uint hash = (uint) (ptr_uint_t) entry->from;
+
+    if (entry->to != NULL)
+        hash = hash ^ (hash << 5) ^ (uint) (ptr_uint_t) entry->to;
+    if (entry->edge_hash > 0ULL) {
+        hash = hash ^ (hash << 5) ^ (uint) entry->edge_hash;
+        hash = hash ^ (hash << 5) ^ (uint) (entry->edge_hash >> 8);
+    }
+    return hash & ((~0U) >> (32 - table_bits));
+}
+
+/* compare_blacklist_entry() */
+static inline bool
+entry_equals(entry_t *first, entry_t *second) {
+    return first->from == second->from && first->to == second->to &&
+           first->edge_hash == second->edge_hash;
+}
+
+static void
+chained_init(chained_table_t *table, uint table_bits) {
+    table->table_bits = table_bits;
+    table->entries = 0;
+    table->table = (chained_entry_t **) calloc(1U << table_bits, sizeof(chained_entry_t *));
+}
+
+static void
+chained_resize(chained_table_t *table) {
+    uint old_bits = table->table_bits, i;
+    chained_entry_t **old_table = table->table;
+
+    chained_init(table, old_bits + 1);
+    for (i = 0; i < (1U << old_bits); i++) {
+        chained_entry_t *e = old_table[i], *next;
+
+        for (; e != NULL; e = next) {
+            uint index = entry_hash(e->key, table->table_bits);
+
+            next = e->next;
+            e->next = table->table[index];
+            table->table[index] = e;
+        }
+    }
+    free(old_table);
+}
+
+static void
+chained_add(chained_table_t *table, entry_t *entry) {
+    chained_entry_t *e = (chained_entry_t *) malloc(sizeof(chained_entry_t));
+    uint index = entry_hash(entry, table->table_bits);
+
+    e->key = entry;
+    e->payload = entry;
+    e->next = table->table[index];
+    table->table[index] = e;
+    table->entries++;
+    if (table->entries * 100 > 75 * (1U << table->table_bits))
+        chained_resize(table);
+}
+
+static entry_t *
+chained_lookup(chained_table_t *table, entry_t *key) {
+    chained_entry_t *e;
+
+    for (e = table->table[entry_hash(key, table->table_bits)]; e != NULL; e = e->next) {
+        if (entry_equals(e->key, key))
+            return e->payload;
+    }
+    return NULL;
+}
+
+static void
+chained_delete(chained_table_t *table) {
+    uint i;
+
+    for (i = 0; i < (1U << table->table_bits); i++) {
+        chained_entry_t *e = table->table[i], *next;
+
+        for (; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+    }
+    free(table->table);
+}
+
+/**** benchmark ****/
+
+static uint64
+now_nanos() {
+#ifdef WINDOWS
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64) ((count.QuadPart * 1000000000.0) / frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (((uint64) now.tv_sec) * 1000000000ULL) + now.tv_nsec;
+#endif
+}
+
+static inline uint64
+next_random(uint64 *state) {
+    uint64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static inline uint
+random_offset(uint64 *state) {
+    return (uint) next_random(state) % MODULE_SIZE;
+}
+
+/* 70% exact edges within a module, 20% `*` -> module edges and 10% `*` -> `*` edges, bound the
+ * way blacklist_bind_module() and load_edge_entry() bind them. */
+static entry_t *
+generate_entries(uint entry_count, blacklist_filter_t *filter) {
+    entry_t *entries = (entry_t *) calloc(entry_count, sizeof(entry_t));
+    uint64 random_state = 0x2545f4914f6cdd1dULL;
+    uint i;
+
+    for (i = 0; i < entry_count; i++) {
+        uint module = (uint) (next_random(&random_state) % MODULE_COUNT), kind = i % 10;
+        uint from = random_offset(&random_state), to = random_offset(&random_state);
+
+        if (kind < 7) {
+            entries[i].from = (app_pc) (MODULE_BASE(module) + from);
+            entries[i].to = (app_pc) (MODULE_BASE(module) + to);
+        } else if (kind < 9) {
+            entries[i].edge_hash = EDGE_HASH_FROM_WILDCARD;
+            entries[i].from = (app_pc) (ptr_uint_t) from;
+            entries[i].to = (app_pc) (MODULE_BASE(module) + to);
+        } else {
+            entries[i].edge_hash = EDGE_HASH_BOTH_WILDCARD;
+            entries[i].from = (app_pc) (ptr_uint_t) from;
+            entries[i].to = (app_pc) (ptr_uint_t) to;
+        }
+        blacklist_filter_add(filter, from); // add_blacklist_entry()
+    }
+    return entries;
+}
+
+/* Mostly random edges, with HIT_PER_MILLION of them taken from the exact entries. */
+static program_edge_t *
+generate_edges(entry_t *entries, uint entry_count, uint edge_count) {
+    program_edge_t *edges = (program_edge_t *) malloc(edge_count * sizeof(program_edge_t));
+    uint64 random_state = 0x9e3779b97f4a7c15ULL;
+    uint i;
+
+    for (i = 0; i < edge_count; i++) {
+        program_edge_t *edge = &edges[i];
+
+        if ((next_random(&random_state) % 1000000) < HIT_PER_MILLION) {
+            uint exact = (uint) next_random(&random_state) % (entry_count / 10);
+            entry_t *entry = &entries[exact * 10]; // (every tenth entry is exact)
+
+            edge->from = entry->from;
+            edge->to = entry->to;
+            edge->from_module = edge->to_module =
+                (uint) (((ptr_uint_t) entry->from - MODULE_BASE(0)) / MODULE_SIZE);
+        } else {
+            edge->from_module = (uint) (next_random(&random_state) % MODULE_COUNT);
+            edge->to_module = (uint) (next_random(&random_state) % MODULE_COUNT);
+            edge->from = (app_pc) (MODULE_BASE(edge->from_module) + random_offset(&random_state));
+            edge->to = (app_pc) (MODULE_BASE(edge->to_module) + random_offset(&random_state));
+        }
+    }
+    return edges;
+}
+
+#define MODULAR_PC(module, pc) ((app_pc) ((ptr_uint_t) (pc) - MODULE_BASE(module)))
+
+/* the probes of check_blacklist_edge() for an edge without an export hash */
+static inline uint
+probe_edge(chained_table_t *table, program_edge_t *edge) {
+    entry_t lookup = { 0 };
+    uint hits = 0;
+
+    lookup.from = edge->from;
+    lookup.to = edge->to;
+    hits += (chained_lookup(table, &lookup) != NULL);
+    lookup.edge_hash = EDGE_HASH_FROM_WILDCARD;
+    lookup.from = MODULAR_PC(edge->from_module, edge->from);
+    hits += (chained_lookup(table, &lookup) != NULL);
+    lookup.edge_hash = EDGE_HASH_BOTH_WILDCARD;
+    lookup.to = MODULAR_PC(edge->to_module, edge->to);
+    hits += (chained_lookup(table, &lookup) != NULL);
+    lookup.edge_hash = EDGE_HASH_TO_WILDCARD;
+    lookup.from = edge->from;
+    hits += (chained_lookup(table, &lookup) != NULL);
+    return hits;
+}
+
+static int
+usage(const char *message) {
+    fprintf(stderr, "Error: %s\n", message);
+    fprintf(stderr, "Usage: blacklist_filter_bench [-entries <count>] [-edges <count>]\n");
+    return 1;
+}
+
+int
+main(int argc, char **argv) {
+    uint entry_count = DEFAULT_ENTRY_COUNT, edge_count = DEFAULT_EDGE_COUNT, i;
+    uint table_hits = 0, filtered_hits = 0, passed = 0;
+    blacklist_filter_t filter;
+    chained_table_t table;
+    program_edge_t *edges;
+    entry_t *entries;
+    uint64 start, table_nanos, filtered_nanos;
+    int arg;
+
+    for (arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-entries") == 0 && arg + 1 < argc)
+            entry_count = (uint) strtoul(argv[++arg], NULL, 0);
+        else if (strcmp(argv[arg], "-edges") == 0 && arg + 1 < argc)
+            edge_count = (uint) strtoul(argv[++arg], NULL, 0);
+        else
+            return usage("unknown option");
+    }
+    if (entry_count < 10 || edge_count == 0)
+        return usage("there must be at least 10 entries and 1 edge");
+
+    blacklist_filter_init(&filter, entry_count);
+    entries = generate_entries(entry_count, &filter);
+    edges = generate_edges(entries, entry_count, edge_count);
+    chained_init(&table, INITIAL_TABLE_BITS);
+    for (i = 0; i < entry_count; i++)
+        chained_add(&table, &entries[i]);
+
+    start = now_nanos();
+    for (i = 0; i < edge_count; i++)
+        table_hits += probe_edge(&table, &edges[i]);
+    table_nanos = now_nanos() - start;
+
+    start = now_nanos();
+    for (i = 0; i < edge_count; i++) {
+        program_edge_t *edge = &edges[i];
+
+        if (blacklist_filter_may_contain(&filter,
+                                         (ptr_uint_t) MODULAR_PC(edge->from_module, edge->from))) {
+            passed++;
+            filtered_hits += probe_edge(&table, edge);
+        }
+    }
+    filtered_nanos = now_nanos() - start;
+
+    printf("%u entries, %u edges, filter %u bytes\n", entry_count, edge_count,
+           (uint) (((size_t) 1 << filter.block_bits) * BLACKLIST_FILTER_BLOCK_BYTES));
+    printf("%-10s %10s %8s %12s\n", "check", "ns/edge", "hits", "passed");
+    printf("%-10s %10.1f %8u %12u\n", "table", (double) table_nanos / edge_count, table_hits,
+           edge_count);
+    printf("%-10s %10.1f %8u %12u (%.2f%% of misses)\n", "filtered",
+           (double) filtered_nanos / edge_count, filtered_hits, passed,
+           (100.0 * (passed - filtered_hits)) / (edge_count - filtered_hits));
+
+    chained_delete(&table);
+    blacklist_filter_free(&filter);
+    free(edges);
+    free(entries);
+    return (table_hits == filtered_hits) ? 0 : 1;
+}
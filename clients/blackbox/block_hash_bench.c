@@ -0,0 +1,243 @@
+/* Blackbox block hash benchmarking standalone app. */
+
+/* This is a standalone app that times each block hash version the way the client applies it:
+ * one call per instruction, over blocks whose instruction lengths and counts follow typical
+ * x86 code (1 to 15 bytes per instruction, about 3.5 on average, and a geometric number of
+ * instructions per block ending at a branch). The stripe hash is also timed over whole blocks.
+ * Blocks are drawn from -code_kb of random code (16MB by default, so most blocks miss in the
+ * cache as they do on first translation). Reports ns/block and MB/s, and the avalanche of each
+ * version: the mean and minimum number of output bits that change when one input bit of a
+ * 16-byte block flips (ideally 32).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WINDOWS
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "crowd_safe_block_hash.h"
+
+#define DEFAULT_BLOCK_COUNT 1000000
+#define DEFAULT_CODE_KB 0x4000
+#define MAX_BLOCK_INSTRUCTIONS 64
+#define MEAN_BLOCK_INSTRUCTIONS 5
+#define AVALANCHE_BYTES 16
+#define AVALANCHE_SAMPLES 1000
+
+/* cumulative percentage of instructions with length 1, 2, ... */
+static const uint length_percentiles[] = { 12, 34, 56, 64, 81, 91, 97, 98, 99, 100 };
+
+typedef struct block_t block_t;
+struct block_t {
+    uint offset;
+    byte instruction_count;
+    byte lengths[MAX_BLOCK_INSTRUCTIONS];
+    ushort size;
+};
+
+static byte *code;
+static uint code_bytes = DEFAULT_CODE_KB * 1024;
+static block_t *blocks;
+
+static uint64
+now_nanos() {
+#ifdef WINDOWS
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64) ((count.QuadPart * 1000000000.0) / frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (((uint64) now.tv_sec) * 1000000000ULL) + now.tv_nsec;
+#endif
+}
+
+static inline uint64
+next_random(uint64 *state) {
+    uint64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static uint
+bit_count(uint64 value) {
+    uint count = 0;
+
+    for (; value != 0ULL; value &= (value - 1))
+        count++;
+    return count;
+}
+
+static void
+generate_blocks(uint block_count) {
+    uint64 random_state = 0x2545f4914f6cdd1dULL;
+    uint i, j, total_instructions = 0, total_bytes = 0;
+
+    code = (byte *) malloc(code_bytes);
+    for (i = 0; i < code_bytes; i++)
+        code[i] = (byte) next_random(&random_state);
+
+    blocks = (block_t *) malloc(block_count * sizeof(block_t));
+    for (i = 0; i < block_count; i++) {
+        block_t *block = &blocks[i];
+
+        block->instruction_count = 1;
+        while ((block->instruction_count < MAX_BLOCK_INSTRUCTIONS) &&
+               ((next_random(&random_state) % MEAN_BLOCK_INSTRUCTIONS) != 0))
+            block->instruction_count++;
+
+        block->size = 0;
+        for (j = 0; j < block->instruction_count; j++) {
+            uint percentile = (uint) (next_random(&random_state) % 100), length = 0;
+
+            while (percentile >= length_percentiles[length])
+                length++;
+            length++;
+            if (length == (sizeof(length_percentiles) / sizeof(uint)))
+                length += (uint) (next_random(&random_state) % 6); // 10 to 15
+            block->lengths[j] = (byte) length;
+            block->size += (ushort) length;
+        }
+        block->offset = (uint) (next_random(&random_state) % (code_bytes - block->size));
+        total_instructions += block->instruction_count;
+        total_bytes += block->size;
+    }
+
+    printf("%u blocks, %.2f instructions and %.1f bytes per block\n", block_count,
+           ((double) total_instructions) / block_count, ((double) total_bytes) / block_count);
+}
+
+static void
+report(const char *name, uint block_count, uint64 bytes, uint64 nanos, uint64 checksum) {
+    printf("%-16s %10.1f %10.1f   (checksum %016llx)\n", name, ((double) nanos) / block_count,
+           (bytes / (nanos / 1e9)) / (1024 * 1024), (unsigned long long) checksum);
+}
+
+static void
+time_versions(uint block_count) {
+    uint64 start, checksum, bytes = 0;
+    uint i, j;
+
+    for (i = 0; i < block_count; i++)
+        bytes += blocks[i].size;
+
+    printf("%-16s %10s %10s\n", "hash", "ns/block", "MB/s");
+
+    checksum = 0ULL;
+    start = now_nanos();
+    for (i = 0; i < block_count; i++) {
+        const byte *bits = code + blocks[i].offset;
+        uint64 hash = 0ULL;
+
+        for (j = 0; j < blocks[i].instruction_count; j++) {
+            hash = block_hash_fold(hash, blocks[i].lengths[j], bits);
+            bits += blocks[i].lengths[j];
+        }
+        checksum += hash;
+    }
+    report("legacy", block_count, bytes, now_nanos() - start, checksum);
+
+    checksum = 0ULL;
+    start = now_nanos();
+    for (i = 0; i < block_count; i++) {
+        const byte *bits = code + blocks[i].offset;
+        block_hash_stream_t stream;
+
+        block_hash_stream_init(&stream);
+        for (j = 0; j < blocks[i].instruction_count; j++) {
+            block_hash_stream_append_stable(&stream, bits, blocks[i].lengths[j]);
+            bits += blocks[i].lengths[j];
+        }
+        checksum += block_hash_stream_finish(&stream);
+    }
+    report("stripe (stream)", block_count, bytes, now_nanos() - start, checksum);
+
+    checksum = 0ULL;
+    start = now_nanos();
+    for (i = 0; i < block_count; i++)
+        checksum += block_hash_stripe(code + blocks[i].offset, blocks[i].size, 0ULL);
+    report("stripe (block)", block_count, bytes, now_nanos() - start, checksum);
+
+    checksum = 0ULL;
+    start = now_nanos();
+    for (i = 0; i < block_count; i++)
+        checksum += block_hash_stripe_scalar(code + blocks[i].offset, blocks[i].size, 0ULL);
+    report("stripe (scalar)", block_count, bytes, now_nanos() - start, checksum);
+}
+
+static void
+measure_avalanche(const char *name, uint version) {
+    uint64 random_state = 0x9e3779b97f4a7c15ULL, flipped = 0ULL;
+    uint sample, bit, minimum = 64;
+
+    for (sample = 0; sample < AVALANCHE_SAMPLES; sample++) {
+        byte block[AVALANCHE_BYTES];
+        uint64 base, changed;
+        uint i;
+
+        for (i = 0; i < AVALANCHE_BYTES; i++)
+            block[i] = (byte) next_random(&random_state);
+        for (bit = 0; bit < (AVALANCHE_BYTES * 8); bit++) {
+            uint count;
+
+            base = (version == BLOCK_HASH_LEGACY) ? block_hash_fold(0ULL, AVALANCHE_BYTES, block) :
+                block_hash_stripe(block, AVALANCHE_BYTES, 0ULL);
+            block[bit / 8] ^= (byte) (1 << (bit % 8));
+            changed = (version == BLOCK_HASH_LEGACY) ? block_hash_fold(0ULL, AVALANCHE_BYTES, block) :
+                block_hash_stripe(block, AVALANCHE_BYTES, 0ULL);
+            block[bit / 8] ^= (byte) (1 << (bit % 8));
+
+            count = bit_count(base ^ changed);
+            flipped += count;
+            if (count < minimum)
+                minimum = count;
+        }
+    }
+    printf("%-16s %10.2f %10u\n", name,
+           ((double) flipped) / (AVALANCHE_SAMPLES * AVALANCHE_BYTES * 8), minimum);
+}
+
+static int
+usage(const char *msg) {
+    if (msg != NULL && msg[0] != '\0')
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "usage: block_hash_bench [-blocks <count>] [-code_kb <size>]\n");
+    return 1;
+}
+
+int
+main(int argc, char **argv) {
+    uint block_count = DEFAULT_BLOCK_COUNT;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-blocks") == 0 && i + 1 < argc)
+            block_count = (uint) strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-code_kb") == 0 && i + 1 < argc)
+            code_bytes = (uint) strtoul(argv[++i], NULL, 0) * 1024;
+        else
+            return usage("unknown option");
+    }
+    if ((block_count == 0) || (code_bytes < 0x1000))
+        return usage("need at least one block and 4KB of code");
+
+    generate_blocks(block_count);
+    time_versions(block_count);
+
+    printf("\n%-16s %10s %10s\n", "avalanche", "mean bits", "min bits");
+    measure_avalanche("legacy", BLOCK_HASH_LEGACY);
+    measure_avalanche("stripe", BLOCK_HASH_STRIPE);
+
+    free(blocks);
+    free(code);
+    return 0;
+}
@@ -0,0 +1,162 @@
+/* Blackbox block hash reference test. */
+
+/* Pins the output of every block hash version, since datasets recorded with one version are
+ * only comparable with hashes computed by exactly the same function. Also checks that the
+ * legacy fold matches the original hash_bits(), that the vector and scalar stripe paths agree,
+ * and that the stream result does not depend on how a block is split into instructions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crowd_safe_block_hash.h"
+
+#define INPUT_BYTES 0x400
+
+typedef struct reference_t reference_t;
+struct reference_t {
+    uint length;
+    uint64 legacy;
+    uint64 stripe;
+};
+
+static const reference_t references[] = {
+    { 0, 0x0000000000ffffffULL, 0xa75fbbd5683f2531ULL },
+    { 1, 0x0000000000000001ULL, 0xa2346efc53e9a707ULL },
+    { 2, 0x0000000000000801ULL, 0xd02c5085bbc2237fULL },
+    { 3, 0x00000000000f0801ULL, 0xd77a9cbe0d8204cbULL },
+    { 4, 0x00000000160f0801ULL, 0x341cccbcdc7bf1e8ULL },
+    { 5, 0x00000002d7ee083cULL, 0x743f3b5b6b3ee983ULL },
+    { 7, 0x00000002d7c52c3cULL, 0xaa5589ed6ead6f1dULL },
+    { 8, 0x00000002e5c52c3cULL, 0x6620cee67e6230d3ULL },
+    { 9, 0x0000005e5d60ab85ULL, 0x61511259c525beceULL },
+    { 15, 0x00000b9c77b9c770ULL, 0x408368f138043d30ULL },
+    { 16, 0x00000b9c1db9c770ULL, 0x1beb46cf520dfbbcULL },
+    { 17, 0x0001781faa812901ULL, 0x2b69042e115d748eULL },
+    { 24, 0x002e7bfa11afe5acULL, 0xbb82a2a35ef69543ULL },
+    { 31, 0xb9c193abc6ab3ce0ULL, 0xf993613cc8508400ULL },
+    { 32, 0xb9c193ab1cab3ce0ULL, 0xe214364c25fe0837ULL },
+    { 33, 0x81f3e6c889cca001ULL, 0x43f9111a315707c5ULL },
+    { 48, 0x837021e72cf223d0ULL, 0xc92da038ebbd1b85ULL },
+    { 64, 0x9d02de65f47358c0ULL, 0xe93864e547e1f5fcULL },
+    { 100, 0x430dd918c77b4801ULL, 0x3ede62a1852e3069ULL },
+    { 255, 0x00000000fa000000ULL, 0x71d8a3dd44ba1e92ULL },
+    { 256, 0x0000000000ffffffULL, 0x7eea28d327e631cdULL },
+    { 257, 0x0000000000000001ULL, 0x8e2daa970e7de50fULL },
+    { 1000, 0x8297bf68a8c90c1cULL, 0x2c801aea6371eaadULL },
+};
+
+static const uint64 reference_chunk = 0x85f99874cbaeeee0ULL;
+
+static byte input[INPUT_BYTES];
+static int failures = 0;
+
+#define SHIFT_IN_EMPTY_BYTES(data, bytes_to_keep) \
+    (data << ((4 - bytes_to_keep)*8)) >> ((4 - bytes_to_keep)*8)
+
+/* hash_bits() as it was in basic_block_observer.c before the hash was versioned, except for
+ * the unaligned word load */
+static uint64
+original_hash_bits(uint64 hash, uint length, byte *bits) {
+    unsigned short b;
+
+    while (length > 3) {
+        uint word;
+        memcpy(&word, bits, sizeof(uint));
+        hash = hash ^ (hash << 5) ^ word;
+        length -= 4;
+        bits += 4;
+    }
+    if (length != 0) {
+        uint tail = 0UL;
+        for (b = 0; b < length; b++)
+            tail |= ((uint)(*(bits + b)) << (b * 8));
+        tail = SHIFT_IN_EMPTY_BYTES(tail, length);
+        hash = hash ^ (hash << 5) ^ tail;
+    }
+
+    if (hash == 0ULL)
+        return 0xffffffULL;
+    else
+        return hash;
+}
+
+static void
+check(const char *what, uint length, uint64 actual, uint64 expected) {
+    if (actual != expected) {
+        printf("FAIL %s(%u): 0x%016llx, expected 0x%016llx\n", what, length,
+               (unsigned long long) actual, (unsigned long long) expected);
+        failures++;
+    }
+}
+
+/* Hashes the input as a block of instructions of 1 to `max_instruction` bytes, with the stream,
+ * the legacy fold and the original hash_bits(). Most instructions are appended in place. */
+static uint64
+hash_as_instructions(uint length, uint max_instruction, uint64 *legacy, uint64 *original) {
+    block_hash_stream_t stream;
+    byte scratch[16];
+    uint offset = 0, random = length;
+
+    block_hash_stream_init(&stream);
+    *legacy = *original = 0ULL;
+    while (offset < length) {
+        uint instruction;
+
+        random = (random * 1103515245U) + 12345U;
+        instruction = 1 + ((random >> 16) % max_instruction);
+        if (instruction > (length - offset))
+            instruction = length - offset;
+        if (((random >> 8) & 3) != 0) {
+            block_hash_stream_append_stable(&stream, input + offset, instruction);
+        } else { // like a normalized instruction, whose buffer is reused
+            memcpy(scratch, input + offset, instruction);
+            block_hash_stream_append(&stream, scratch, instruction);
+            memset(scratch, 0xcc, sizeof(scratch));
+        }
+        *legacy = block_hash_fold(*legacy, instruction, input + offset);
+        *original = original_hash_bits(*original, instruction, input + offset);
+        offset += instruction;
+    }
+    return block_hash_stream_finish(&stream);
+}
+
+int
+main(int argc, char **argv) {
+    uint64 chunk[4];
+    uint i, length;
+
+    for (i = 0; i < INPUT_BYTES; i++)
+        input[i] = (byte) ((i * 7) + 1);
+
+    for (i = 0; i < (sizeof(references) / sizeof(references[0])); i++) {
+        const reference_t *reference = &references[i];
+
+        check("legacy", reference->length, block_hash_fold(0ULL, reference->length, input),
+              reference->legacy);
+        check("stripe", reference->length, block_hash_stripe(input, reference->length, 0ULL),
+              reference->stripe);
+    }
+    memcpy(chunk, input, sizeof(chunk));
+    check("chunk", 4, block_hash_fold_words(chunk, 4), reference_chunk);
+
+    for (length = 0; length <= INPUT_BYTES; length++) {
+        uint64 streamed, split, legacy, original, split_legacy, split_original;
+
+        check("scalar", length, block_hash_stripe_scalar(input, length, length),
+              block_hash_stripe(input, length, length));
+
+        streamed = hash_as_instructions(length, 15, &legacy, &original);
+        check("original", length, legacy, original);
+        split = hash_as_instructions(length, 3, &split_legacy, &split_original);
+        check("split", length, split, streamed);
+        check("split original", length, split_legacy, split_original);
+        if (length <= BLOCK_HASH_STREAM_BYTES)
+            check("stream", length, streamed, block_hash_stripe(input, length, 0ULL));
+    }
+
+    if (failures == 0)
+        printf("block hash: all references match\n");
+    return (failures == 0) ? 0 : 1;
+}
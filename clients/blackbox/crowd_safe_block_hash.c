@@ -0,0 +1,288 @@
+#include "crowd_safe_block_hash.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+# define BLOCK_HASH_SSE2 1
+# include <emmintrin.h>
+#endif
+
+/**** private fields ****/
+
+#define PRIME_1 0x9e3779b185ebca87ULL
+#define PRIME_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME_3 0x165667b19e3779f9ULL
+#define PRIME_4 0x85ebca77c2b2ae63ULL
+#define PRIME_5 0x27d4eb2f165667c5ULL
+
+#define STRIPE_BYTES 32
+#define STRIPE_LANES 4
+#define SHORT_BYTES 16
+
+/* lane keys, then merge keys */
+static const uint64 stripe_keys[STRIPE_LANES * 2] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+/**** private prototypes ****/
+
+static inline uint64
+read64(const byte *bits);
+
+static inline uint
+read32(const byte *bits);
+
+static inline uint64
+rotate_left(uint64 value, uint bits);
+
+static inline uint64
+avalanche(uint64 hash);
+
+static uint64
+hash_short(const byte *bits, size_t length, uint64 seed);
+
+static uint64
+hash_medium(const byte *bits, size_t length, uint64 seed);
+
+static void
+init_lanes(uint64 *lanes, uint64 seed);
+
+static uint64
+merge_lanes(const uint64 *lanes, size_t length);
+
+static void
+accumulate_scalar(uint64 *lanes, const byte *stripe);
+
+#ifdef BLOCK_HASH_SSE2
+static void
+accumulate_sse2(__m128i *lanes, const byte *stripe);
+#endif
+
+/**** public functions ****/
+
+uint64
+block_hash_fold(uint64 hash, uint length, const byte *bits) {
+    uint b;
+
+    while (length > 3) {
+        hash = hash ^ (hash << 5) ^ read32(bits);
+        length -= 4;
+        bits += 4;
+    }
+    if (length != 0) {
+        uint tail = 0U;
+        for (b = 0; b < length; b++)
+            tail |= ((uint) bits[b]) << (b * 8);
+        hash = hash ^ (hash << 5) ^ tail;
+    }
+
+    if (hash == 0ULL)
+        return 0xffffffULL; // cannot use a zero hash, so substitute with a very unlikely hash
+    else
+        return hash;
+}
+
+uint64
+block_hash_fold_words(const uint64 *words, uint count) {
+    uint64 hash = 0ULL;
+    uint i;
+
+    for (i = 0; i < count; i++)
+        hash = hash ^ (hash << 5) ^ words[i];
+    return hash;
+}
+
+uint64
+block_hash_stripe(const byte *bits, size_t length, uint64 seed) {
+#ifdef BLOCK_HASH_SSE2
+    uint64 lanes[STRIPE_LANES];
+    __m128i vector_lanes[2];
+    size_t offset;
+
+    if (length <= STRIPE_BYTES)
+        return (length <= SHORT_BYTES) ? hash_short(bits, length, seed) :
+                                         hash_medium(bits, length, seed);
+
+    init_lanes(lanes, seed);
+    vector_lanes[0] = _mm_loadu_si128((const __m128i *) &lanes[0]);
+    vector_lanes[1] = _mm_loadu_si128((const __m128i *) &lanes[2]);
+    for (offset = 0; (offset + STRIPE_BYTES) < length; offset += STRIPE_BYTES)
+        accumulate_sse2(vector_lanes, bits + offset);
+    accumulate_sse2(vector_lanes, bits + length - STRIPE_BYTES); // last stripe may overlap
+    _mm_storeu_si128((__m128i *) &lanes[0], vector_lanes[0]);
+    _mm_storeu_si128((__m128i *) &lanes[2], vector_lanes[1]);
+    return merge_lanes(lanes, length);
+#else
+    return block_hash_stripe_scalar(bits, length, seed);
+#endif
+}
+
+uint64
+block_hash_stripe_scalar(const byte *bits, size_t length, uint64 seed) {
+    uint64 lanes[STRIPE_LANES];
+    size_t offset;
+
+    if (length <= STRIPE_BYTES)
+        return (length <= SHORT_BYTES) ? hash_short(bits, length, seed) :
+                                         hash_medium(bits, length, seed);
+
+    init_lanes(lanes, seed);
+    for (offset = 0; (offset + STRIPE_BYTES) < length; offset += STRIPE_BYTES)
+        accumulate_scalar(lanes, bits + offset);
+    accumulate_scalar(lanes, bits + length - STRIPE_BYTES); // last stripe may overlap
+    return merge_lanes(lanes, length);
+}
+
+void
+block_hash_stream_init(block_hash_stream_t *stream) {
+    stream->hash = 0ULL;
+    stream->folded = false;
+    stream->fill = 0U;
+    stream->span = NULL;
+    stream->span_length = 0U;
+}
+
+void
+block_hash_stream_spill(block_hash_stream_t *stream, const byte *bits, uint length) {
+    while (length > 0) {
+        uint available, count;
+
+        if (stream->fill == BLOCK_HASH_STREAM_BYTES) { // fold only once more bytes arrive
+            stream->hash = block_hash_stripe(stream->buffer, stream->fill, stream->hash);
+            stream->folded = true;
+            stream->fill = 0U;
+        }
+        available = BLOCK_HASH_STREAM_BYTES - stream->fill;
+        count = (length < available) ? length : available;
+        memcpy(stream->buffer + stream->fill, bits, count);
+        stream->fill += count;
+        bits += count;
+        length -= count;
+    }
+}
+
+uint64
+block_hash_stream_finish(block_hash_stream_t *stream) {
+    if (!stream->folded && (stream->fill == 0) && (stream->span_length <= BLOCK_HASH_STREAM_BYTES))
+        return block_hash_stripe(stream->span, stream->span_length, 0ULL); // all in place
+    if (stream->span_length > 0)
+        block_hash_stream_append(stream, NULL, 0); // copies the span
+    return block_hash_stripe(stream->buffer, stream->fill, stream->hash);
+}
+
+/**** private functions ****/
+
+/* Words are little-endian, as in the legacy hash. */
+static inline uint64
+read64(const byte *bits) {
+    uint64 value;
+    memcpy(&value, bits, sizeof(uint64));
+    return value;
+}
+
+static inline uint
+read32(const byte *bits) {
+    uint value;
+    memcpy(&value, bits, sizeof(uint));
+    return value;
+}
+
+static inline uint64
+rotate_left(uint64 value, uint bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64
+avalanche(uint64 hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* Two loads cover 4 to 16 bytes, overlapping in the middle; the length disambiguates. */
+static uint64
+hash_short(const byte *bits, size_t length, uint64 seed) {
+    uint64 low, high, hash;
+
+    if (length >= 8) {
+        low = read64(bits);
+        high = read64(bits + length - 8);
+    } else if (length >= 4) {
+        low = read32(bits);
+        high = read32(bits + length - 4);
+    } else if (length > 0) {
+        low = ((uint64) bits[0]) | (((uint64) bits[length >> 1]) << 8) |
+              (((uint64) bits[length - 1]) << 16);
+        high = 0ULL;
+    } else {
+        low = high = 0ULL;
+    }
+
+    hash = seed ^ (((uint64) length) * PRIME_5);
+    hash ^= (low ^ stripe_keys[0]) * PRIME_1;
+    hash = rotate_left(hash, 31) * PRIME_2;
+    hash ^= (high ^ stripe_keys[1]) * PRIME_3;
+    return avalanche(hash);
+}
+
+/* 17 to 32 bytes: the first and last 16, overlapping in the middle. */
+static uint64
+hash_medium(const byte *bits, size_t length, uint64 seed) {
+    uint64 first = hash_short(bits, SHORT_BYTES, seed);
+    uint64 last = hash_short(bits + length - SHORT_BYTES, SHORT_BYTES, seed ^ PRIME_4);
+
+    return avalanche(first ^ rotate_left(last, 29) ^ (((uint64) length) * PRIME_1));
+}
+
+static void
+init_lanes(uint64 *lanes, uint64 seed) {
+    lanes[0] = seed + PRIME_1;
+    lanes[1] = seed ^ PRIME_2;
+    lanes[2] = seed + PRIME_3;
+    lanes[3] = seed ^ PRIME_4;
+}
+
+static uint64
+merge_lanes(const uint64 *lanes, size_t length) {
+    uint64 hash = ((uint64) length) * PRIME_1;
+    uint i;
+
+    for (i = 0; i < STRIPE_LANES; i++)
+        hash = (hash ^ avalanche(lanes[i] ^ stripe_keys[STRIPE_LANES + i])) * PRIME_2;
+    return avalanche(hash);
+}
+
+/* Each lane adds its neighbor's word and the product of the low and high halves of its own
+ * keyed word. */
+static void
+accumulate_scalar(uint64 *lanes, const byte *stripe) {
+    uint64 words[STRIPE_LANES];
+    uint i;
+
+    for (i = 0; i < STRIPE_LANES; i++)
+        words[i] = read64(stripe + (i * sizeof(uint64)));
+    for (i = 0; i < STRIPE_LANES; i++) {
+        uint64 keyed = words[i] ^ stripe_keys[i];
+
+        lanes[i] += words[i ^ 1] + ((keyed & 0xffffffffULL) * (keyed >> 32));
+    }
+}
+
+#ifdef BLOCK_HASH_SSE2
+static void
+accumulate_sse2(__m128i *lanes, const byte *stripe) {
+    uint i;
+
+    for (i = 0; i < 2; i++) {
+        __m128i words = _mm_loadu_si128((const __m128i *) (stripe + (i * 16)));
+        __m128i keyed = _mm_xor_si128(words, _mm_loadu_si128((const __m128i *) &stripe_keys[i * 2]));
+        __m128i keyed_high = _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1));
+        __m128i product = _mm_mul_epu32(keyed, keyed_high);
+        __m128i swapped = _mm_shuffle_epi32(words, _MM_SHUFFLE(1, 0, 3, 2));
+
+        lanes[i] = _mm_add_epi64(lanes[i], _mm_add_epi64(product, swapped));
+    }
+}
+#endif
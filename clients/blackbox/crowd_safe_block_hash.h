@@ -0,0 +1,102 @@
+#ifndef CROWD_SAFE_BLOCK_HASH_H
+#define CROWD_SAFE_BLOCK_HASH_H 1
+
+/* Versioned hash functions for basic blocks and shadow page chunks. The version is selected
+ * at init (-hash_version) and recorded in the top byte of the meta header, so that offline tools
+ * can tell which function produced the hashes in a dataset. Files written before the version
+ * was recorded have 0 there, which is the legacy hash. Portable under CROWD_SAFE_PORTABLE.
+ *
+ *   BLOCK_HASH_LEGACY: hash = hash ^ (hash << 5) ^ word over 4-byte words of each instruction
+ *     (8-byte words for chunks). Linear over GF(2), so related blocks collide easily.
+ *
+ *   BLOCK_HASH_STRIPE: multiply-fold over 32-byte stripes of the whole block, as four 64-bit
+ *     lanes (two SSE2 registers where available, with an identical scalar fallback), finished
+ *     with a full avalanche. Inputs of 16 bytes or less take a scalar short path. */
+
+#include "crowd_safe_portable.h"
+
+#define BLOCK_HASH_LEGACY 0
+#define BLOCK_HASH_STRIPE 1
+#define BLOCK_HASH_LATEST BLOCK_HASH_STRIPE
+
+#define BLOCK_HASH_STREAM_BYTES 0x100
+
+/* Collects the bytes of a block for BLOCK_HASH_STRIPE, which hashes the block as a whole.
+ * A block that fits the buffer hashes as block_hash_stripe(bytes, length, 0); in longer ones,
+ * every full buffer is folded into `hash`, which seeds the next one. Bytes that stay in place
+ * until the hash is finished (such as the app's instruction bytes) are only referenced while
+ * they are contiguous, so an unmodified block is hashed in place without copying. */
+typedef struct block_hash_stream_t block_hash_stream_t;
+struct block_hash_stream_t {
+    uint64 hash;
+    bool folded;
+    uint fill;
+    const byte *span; // stable bytes not yet copied into `buffer`
+    uint span_length;
+    byte buffer[BLOCK_HASH_STREAM_BYTES];
+};
+
+/**** public functions ****/
+
+/* One step of the legacy hash over `length` bytes, including its substitution of zero. */
+uint64
+block_hash_fold(uint64 hash, uint length, const byte *bits);
+
+/* The legacy hash of `count` 8-byte words. */
+uint64
+block_hash_fold_words(const uint64 *words, uint count);
+
+uint64
+block_hash_stripe(const byte *bits, size_t length, uint64 seed);
+
+/* Reference implementation of block_hash_stripe() without vector instructions. */
+uint64
+block_hash_stripe_scalar(const byte *bits, size_t length, uint64 seed);
+
+void
+block_hash_stream_init(block_hash_stream_t *stream);
+
+/* Appends bytes that do not fit the buffer, folding full buffers. */
+void
+block_hash_stream_spill(block_hash_stream_t *stream, const byte *bits, uint length);
+
+/* Appends bytes that may change before the hash is finished. Called once per instruction, so
+ * the common case is inline. */
+static inline void
+block_hash_stream_append(block_hash_stream_t *stream, const byte *bits, uint length) {
+    if (stream->span_length > 0) {
+        const byte *span = stream->span;
+        uint span_length = stream->span_length;
+
+        stream->span_length = 0U;
+        block_hash_stream_append(stream, span, span_length);
+    }
+    if (length <= (BLOCK_HASH_STREAM_BYTES - stream->fill)) {
+        byte *next = stream->buffer + stream->fill;
+        uint i;
+
+        for (i = 0; i < length; i++) // instructions are short, so avoid a call to memcpy
+            next[i] = bits[i];
+        stream->fill += length;
+    } else {
+        block_hash_stream_spill(stream, bits, length);
+    }
+}
+
+/* Appends bytes that stay in place until block_hash_stream_finish(). */
+static inline void
+block_hash_stream_append_stable(block_hash_stream_t *stream, const byte *bits, uint length) {
+    if ((stream->span_length > 0) && ((stream->span + stream->span_length) == bits)) {
+        stream->span_length += length;
+    } else {
+        if (stream->span_length > 0)
+            block_hash_stream_append(stream, NULL, 0); // copies the span
+        stream->span = bits;
+        stream->span_length = length;
+    }
+}
+
+uint64
+block_hash_stream_finish(block_hash_stream_t *stream);
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef CROWD_SAFE_DATASET_H
+#define CROWD_SAFE_DATASET_H 1
+
+/* Layout of the monitor dataset (image_execution_monitor.c) and of the search index that the
+ * dataset_compile tool appends to it. Portable under CROWD_SAFE_PORTABLE.
+
+   The original layout begins at offset 0, and the compiled file keeps it byte for byte, so
+   every offset in it stays valid and older monitors can still read the compiled file:
+
+     module_dataset_t[module_count]   sorted by name; the first name follows the last entry
+     module names
+     for each module, in directory order: uint count, monitor_bb_index_t[count] sorted by
+       relative tag (a tag may repeat, once for each hash seen at it)
+     the anonymous module data and alarm limits (after the last module's index)
+     monitor_bb_t records, at the data_offset of their index entries
+
+   The compiled index follows, in 64-byte aligned sections:
+
+     for each module: dataset_tree_node_t[tree_count + 1], the distinct relative tags of the
+       module in Eytzinger (breadth-first) order from position 1, each with the position of
+       its first entry in the sorted index. The top levels of the tree share a few cache
+       lines, and the children of a node are adjacent, so a lookup prefetches its descendants
+       a few levels ahead instead of taking one dependent miss per level.
+     dataset_directory_t, then dataset_name_slot_t[slot_count], an open-addressed table of
+       the modules by the FNV-1a hash of their name, then dataset_indexed_module_t[module_count]
+     dataset_footer_t, the last 16 bytes of the file
+*/
+
+#include "crowd_safe_portable.h"
+
+#ifdef _MSC_VER
+# include <xmmintrin.h>
+# define DATASET_PREFETCH(address) _mm_prefetch((const char *) (address), _MM_HINT_T0)
+#else
+# define DATASET_PREFETCH(address) __builtin_prefetch(address)
+#endif
+
+#define DATASET_INDEX_MAGIC 0x58444942U // "BIDX"
+#define DATASET_INDEX_VERSION 1
+#define DATASET_SECTION_ALIGNMENT 0x40
+#define DATASET_NOT_FOUND 0xffffffffU
+
+/* one entry of the original module directory */
+typedef struct module_dataset_t module_dataset_t;
+struct module_dataset_t {
+    uint name_offset;
+    uint index_offset;
+};
+
+/* one entry of a module's original sorted index */
+typedef struct monitor_bb_index_t monitor_bb_index_t;
+struct monitor_bb_index_t {
+    uint relative_tag;
+    uint data_offset;
+};
+
+typedef struct dataset_tree_node_t dataset_tree_node_t;
+struct dataset_tree_node_t {
+    uint relative_tag;
+    uint first_position; // in the module's sorted index
+};
+
+typedef struct dataset_indexed_module_t dataset_indexed_module_t;
+struct dataset_indexed_module_t {
+    uint name_offset;
+    uint index_offset;
+    uint tree_offset;
+    uint tree_count;
+};
+
+typedef struct dataset_name_slot_t dataset_name_slot_t;
+struct dataset_name_slot_t {
+    uint name_hash;   // 0 when the slot is empty
+    uint module;      // position in the dataset_indexed_module_t array
+};
+
+typedef struct dataset_directory_t dataset_directory_t;
+struct dataset_directory_t {
+    uint slot_count;  // a power of 2
+    uint module_count;
+};
+
+typedef struct dataset_footer_t dataset_footer_t;
+struct dataset_footer_t {
+    uint magic;
+    uint version;
+    uint directory_offset;
+    uint original_size; // size of the original layout at offset 0
+};
+
+#define DATASET_NAME_SLOTS(directory) ((dataset_name_slot_t *) ((directory) + 1))
+#define DATASET_INDEXED_MODULES(directory) \
+    ((dataset_indexed_module_t *) (DATASET_NAME_SLOTS(directory) + (directory)->slot_count))
+
+/**** public functions ****/
+
+static inline uint
+dataset_name_hash(const char *name) {
+    uint hash = 0x811c9dc5U;
+
+    for (; *name != '\0'; name++)
+        hash = (hash ^ (byte) *name) * 0x01000193U;
+    return (hash == 0U) ? 1U : hash;
+}
+
+/* Returns the footer of the compiled index in the `size` bytes at `dataset`, or NULL if the
+ * file has only the original layout. */
+static inline dataset_footer_t *
+dataset_find_footer(byte *dataset, size_t size) {
+    dataset_footer_t *footer;
+    dataset_directory_t *directory;
+    size_t end;
+
+    if (size < sizeof(dataset_footer_t))
+        return NULL;
+    end = size - sizeof(dataset_footer_t);
+    footer = (dataset_footer_t *) (dataset + end);
+    if ((footer->magic != DATASET_INDEX_MAGIC) || (footer->version != DATASET_INDEX_VERSION) ||
+        (footer->original_size > footer->directory_offset) ||
+        ((footer->directory_offset + sizeof(dataset_directory_t)) > end))
+        return NULL;
+
+    directory = (dataset_directory_t *) (dataset + footer->directory_offset);
+    if ((directory->slot_count == 0) ||
+        ((directory->slot_count & (directory->slot_count - 1)) != 0) ||
+        (directory->module_count >= directory->slot_count) ||
+        ((byte *) (DATASET_INDEXED_MODULES(directory) + directory->module_count) >
+         (dataset + end)))
+        return NULL;
+    return footer;
+}
+
+/* Returns the position in the module directory of the module named `name`, or
+ * DATASET_NOT_FOUND. */
+static inline uint
+dataset_find_module(byte *dataset, dataset_directory_t *directory, const char *name) {
+    dataset_name_slot_t *slots = DATASET_NAME_SLOTS(directory);
+    dataset_indexed_module_t *modules = DATASET_INDEXED_MODULES(directory);
+    uint hash = dataset_name_hash(name), mask = directory->slot_count - 1, i;
+
+    for (i = hash & mask; slots[i].name_hash != 0U; i = (i + 1) & mask) {
+        if ((slots[i].name_hash == hash) &&
+            (strcmp((char *) (dataset + modules[slots[i].module].name_offset), name) == 0))
+            return slots[i].module;
+    }
+    return DATASET_NOT_FOUND;
+}
+
+/* Returns the position of the first sorted index entry for `relative_tag` in the Eytzinger
+ * tree of `count` nodes, or DATASET_NOT_FOUND. Branch-free descent to the lower bound; the
+ * 8 nodes of each cache line are the descendants 3 levels below some node, so prefetching
+ * at 8 * k requests the line that the lookup reaches 3 levels later. */
+static inline uint
+dataset_tree_search(const dataset_tree_node_t *tree, uint count, uint relative_tag) {
+    uint k = 1;
+
+    while (k <= count) {
+        DATASET_PREFETCH(tree + (k * 8));
+        k = (2 * k) + (tree[k].relative_tag < relative_tag);
+    }
+    while ((k & 1) != 0) // climb back over the right turns to the last left turn,
+        k >>= 1;
+    k >>= 1;             // which was taken at the lower bound (0 if every turn went right)
+
+    if ((k == 0) || (tree[k].relative_tag != relative_tag))
+        return DATASET_NOT_FOUND;
+    return tree[k].first_position;
+}
+
+#endif
@@ -0,0 +1,249 @@
+#include "crowd_safe_metrics.h"
+#include <intrin.h>
+
+/**** private fields ****/
+
+#define METRICS_DEFAULT_INTERVAL_MS 1000 // without a ring, fold the counters before they can wrap
+
+#ifdef SYSTEM_TIME_RDTSC
+# define METRICS_CLOCK_INTERVAL(ms) (((clock_type_t) (ms)) << 0x15) // approximate: about 2 GHz
+#else
+# define METRICS_CLOCK_INTERVAL(ms) ((((clock_type_t) (ms)) * 10000U) >> 0x10) // KUSER time
+#endif
+
+typedef struct crowd_safe_metrics_t crowd_safe_metrics_t;
+struct crowd_safe_metrics_t {
+    void *mutex;               // guards the block list, the totals and the ring file
+    thread_metrics_t *threads;
+    uint thread_count;
+    uint64 totals[_metric_count];
+    clock_type_t clock_interval;
+    volatile clock_type_t last_sample;
+    uint interval_ms;
+    file_t ring_file;          // INVALID_FILE without -metrics_ms
+    uint64 start_time_ms;
+    uint64 sequence;
+};
+
+static crowd_safe_metrics_t *metrics;
+
+/* Counts of threads without a cstl (early init, the trace writer and the xhash worker). It is
+ * static so that lock waits can be counted before the metrics are initialized. */
+static thread_metrics_t shared_metrics;
+
+static const char *metric_names[_metric_count] = METRIC_NAMES;
+
+/**** private prototypes ****/
+
+static void
+open_metrics_ring();
+
+static void
+take_sample();
+
+static void
+fold_counters(thread_metrics_t *block);
+
+static void
+write_ring_record();
+
+/**** public functions ****/
+
+void
+init_crowd_safe_metrics(bool is_fork) {
+    extern uint metrics_ms;
+
+    if (is_fork) { // the parent's totals stay in its own ring
+        if (metrics->ring_file != INVALID_FILE)
+            dr_close_file(metrics->ring_file);
+        memset(metrics->totals, 0, sizeof(metrics->totals));
+    } else {
+        metrics = (crowd_safe_metrics_t *) CS_ALLOC(sizeof(crowd_safe_metrics_t));
+        memset(metrics, 0, sizeof(crowd_safe_metrics_t));
+    }
+
+    metrics->mutex = dr_mutex_create();
+    CS_TRACK(metrics->mutex, sizeof(mutex_t));
+    metrics->interval_ms = (metrics_ms > 0) ? metrics_ms : METRICS_DEFAULT_INTERVAL_MS;
+    metrics->clock_interval = METRICS_CLOCK_INTERVAL(metrics->interval_ms);
+    if (metrics->clock_interval == 0)
+        metrics->clock_interval = 1;
+    metrics->last_sample = quick_system_time_millis();
+    metrics->start_time_ms = dr_get_milliseconds();
+    metrics->sequence = 0ULL;
+    metrics->ring_file = INVALID_FILE;
+    if (metrics_ms > 0)
+        open_metrics_ring();
+}
+
+void
+crowd_safe_metrics_thread_init(crowd_safe_thread_local_t *cstl) {
+    thread_metrics_t *block = (thread_metrics_t *) CS_ALLOC(sizeof(thread_metrics_t));
+    memset(block, 0, sizeof(thread_metrics_t));
+
+    dr_mutex_lock(metrics->mutex);
+    block->next = metrics->threads;
+    metrics->threads = block;
+    metrics->thread_count++;
+    dr_mutex_unlock(metrics->mutex);
+
+    cstl->metrics = block;
+}
+
+void
+crowd_safe_metrics_thread_exit(crowd_safe_thread_local_t *cstl) {
+    thread_metrics_t *block = cstl->metrics, **link;
+
+    if (block == NULL)
+        return;
+
+    cstl->metrics = NULL; // any later counts of this thread go to the shared block
+    dr_mutex_lock(metrics->mutex);
+    fold_counters(block);
+    for (link = &metrics->threads; *link != NULL; link = &(*link)->next) {
+        if (*link == block) {
+            *link = block->next;
+            metrics->thread_count--;
+            break;
+        }
+    }
+    dr_mutex_unlock(metrics->mutex);
+    dr_global_free(block, sizeof(thread_metrics_t));
+}
+
+void
+add_shared_metric(metric_id id, uint value) {
+    dr_atomic_add32_return_sum((volatile int *) &shared_metrics.counters[id], (int) value);
+}
+
+void
+add_metric(metric_id id, uint value) {
+    crowd_safe_thread_local_t *cstl = NULL;
+    dcontext_t *dcontext = dr_get_current_drcontext();
+
+    if ((dcontext != NULL) && (dcontext != GLOBAL_DCONTEXT))
+        cstl = GET_CSTL(dcontext);
+    add_thread_metric(cstl, id, value);
+}
+
+void
+wait_for_mutex(void *mutex) {
+    uint64 start = __rdtsc();
+
+    dr_mutex_lock(mutex);
+    add_metric(metric_lock_wait_kcycles, (uint) ((__rdtsc() - start) >> 10));
+}
+
+void
+sample_crowd_safe_metrics(clock_type_t now) {
+    if ((metrics == NULL) || ((now - metrics->last_sample) < metrics->clock_interval))
+        return; // note: allowing an unsafe read here
+    if (!dr_mutex_trylock(metrics->mutex))
+        return; // another thread is taking the sample
+
+    if ((now - metrics->last_sample) >= metrics->clock_interval) {
+        metrics->last_sample = now;
+        take_sample();
+    }
+    dr_mutex_unlock(metrics->mutex);
+}
+
+void
+close_crowd_safe_metrics() {
+    uint i;
+
+    dr_mutex_lock(metrics->mutex);
+    take_sample();
+    if (metrics->ring_file != INVALID_FILE) {
+        dr_close_file(metrics->ring_file);
+        metrics->ring_file = INVALID_FILE;
+    }
+    CS_LOG("Metrics after %lld ms and %lld ring samples:\n",
+           dr_get_milliseconds() - metrics->start_time_ms, metrics->sequence);
+    for (i = 0; i < _metric_count; i++)
+        CS_LOG("\t%s: %lld\n", metric_names[i], metrics->totals[i]);
+    dr_mutex_unlock(metrics->mutex);
+    // the mutex stays, since exiting threads still fold their counters
+}
+
+/**** private functions ****/
+
+static void
+open_metrics_ring() {
+    char filename[256];
+    metrics_ring_header_t header;
+
+    generate_filename(filename, "metrics", "ring");
+    metrics->ring_file = create_output_file(filename);
+    if (metrics->ring_file == INVALID_FILE) {
+        CS_ERR("Failed to create the metrics ring %s\n", filename);
+        return;
+    }
+
+    header.magic = METRICS_RING_MAGIC;
+    header.version = METRICS_RING_VERSION;
+    header.record_size = sizeof(metrics_ring_record_t);
+    header.slot_count = METRICS_RING_SLOT_COUNT;
+    header.metric_count = _metric_count;
+    header.interval_ms = metrics->interval_ms;
+    header.start_time_ms = metrics->start_time_ms;
+    header.sequence = 0ULL;
+    if (dr_write_file(metrics->ring_file, &header, sizeof(header)) != sizeof(header)) {
+        CS_ERR("Failed to write the header of the metrics ring %s\n", filename);
+        dr_close_file(metrics->ring_file);
+        metrics->ring_file = INVALID_FILE;
+    }
+}
+
+/* Caller holds the metrics mutex. */
+static void
+take_sample() {
+    thread_metrics_t *block;
+
+    fold_counters(&shared_metrics);
+    for (block = metrics->threads; block != NULL; block = block->next)
+        fold_counters(block);
+
+    if (metrics->ring_file != INVALID_FILE)
+        write_ring_record();
+}
+
+/* The owner may be counting while this runs, so each counter is read once. A count that lands
+ * after the read simply goes to the next sample. */
+static void
+fold_counters(thread_metrics_t *block) {
+    uint i, count;
+
+    for (i = 0; i < _metric_count; i++) {
+        count = *(volatile uint *) &block->counters[i];
+        metrics->totals[i] += (uint) (count - block->sampled[i]);
+        block->sampled[i] = count;
+    }
+}
+
+/* The record goes first, so a reader never finds the header ahead of the ring. */
+static void
+write_ring_record() {
+    metrics_ring_record_t record;
+    file_t ring = metrics->ring_file;
+
+    record.sequence = metrics->sequence;
+    record.time_ms = dr_get_milliseconds() - metrics->start_time_ms;
+    record.thread_count = metrics->thread_count;
+    record.reserved = 0U;
+    memcpy(record.totals, metrics->totals, sizeof(record.totals));
+    record.sequence_check = metrics->sequence;
+
+    dr_file_seek(ring, (int64) METRICS_RING_SLOT_OFFSET(metrics->sequence), DR_SEEK_SET);
+    if (dr_write_file(ring, &record, sizeof(record)) != sizeof(record)) {
+        CS_ERR("Failed to write metrics sample %lld; closing the ring\n", metrics->sequence);
+        dr_close_file(ring);
+        metrics->ring_file = INVALID_FILE;
+        return;
+    }
+
+    metrics->sequence++;
+    // the sequence is the last field of the header
+    dr_file_seek(ring, (int64) (sizeof(metrics_ring_header_t) - sizeof(uint64)), DR_SEEK_SET);
+    dr_write_file(ring, &metrics->sequence, sizeof(uint64));
+}
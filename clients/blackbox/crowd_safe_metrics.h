@@ -0,0 +1,112 @@
+#ifndef CROWD_SAFE_METRICS_H
+#define CROWD_SAFE_METRICS_H 1
+
+/* Running totals of the trace work, for finding the phases of an application that make
+ * Blackbox slow. Each thread counts into its own block without any lock or atomic, and the
+ * heartbeat folds the blocks into 64-bit totals every sampling interval. With -metrics_ms, each
+ * sample is also written to the metrics.ring file, which can be tailed while the process runs
+ * (see metrics_tail). The ring layout is portable when built with CROWD_SAFE_PORTABLE.
+
+   The ring file is a header followed by `slot_count` fixed-size records, all little-endian.
+   Sample n (from 0) goes to slot n % slot_count, and the header `sequence` is then set to n + 1.
+   A record is written in one piece, and it is only valid while its `sequence` and
+   `sequence_check` both equal the sample number that the reader expects in that slot.
+*/
+
+#include "crowd_safe_portable.h"
+
+#define METRICS_RING_MAGIC 0x4d534242U // "BBSM"
+#define METRICS_RING_VERSION 1
+#define METRICS_RING_SLOT_COUNT 0x1000
+
+typedef enum metric_id metric_id;
+enum metric_id {
+    metric_nodes_committed,
+    metric_edges_written,    // intra- and cross-module
+    metric_ibp_adds,
+    metric_uib_reports,
+    metric_output_bytes,
+    metric_lock_wait_kcycles, // waiting for the hashcode and output locks, in units of 1024 cycles
+    metric_flush_kcycles,     // writing trace buffers to their files
+    metric_flush_count,
+    _metric_count
+};
+
+#define METRIC_NAMES { \
+    "nodes", "edges", "ibp-adds", "uib-reports", "output-bytes", "lock-wait-kcycles", \
+    "flush-kcycles", "flushes" }
+
+typedef struct metrics_ring_header_t metrics_ring_header_t;
+struct metrics_ring_header_t {
+    uint magic;
+    uint version;
+    uint record_size;
+    uint slot_count;
+    uint metric_count;
+    uint interval_ms;
+    uint64 start_time_ms; // dr_get_milliseconds() when the ring was created
+    uint64 sequence;      // samples written so far
+};
+
+typedef struct metrics_ring_record_t metrics_ring_record_t;
+struct metrics_ring_record_t {
+    uint64 sequence;
+    uint64 time_ms;       // since start_time_ms
+    uint thread_count;    // threads with a live counter block
+    uint reserved;
+    uint64 totals[_metric_count];
+    uint64 sequence_check;
+};
+
+#define METRICS_RING_SLOT_OFFSET(sequence) \
+    (sizeof(metrics_ring_header_t) + \
+     (((sequence) % METRICS_RING_SLOT_COUNT) * sizeof(metrics_ring_record_t)))
+
+#ifndef CROWD_SAFE_PORTABLE
+# include "crowd_safe_util.h"
+
+struct thread_metrics_t {
+    uint counters[_metric_count]; // written only by the owning thread, so they may wrap
+    uint sampled[_metric_count];  // counters at the last sample
+    thread_metrics_t *next;
+};
+
+/**** public functions ****/
+
+void
+init_crowd_safe_metrics(bool is_fork);
+
+void
+crowd_safe_metrics_thread_init(crowd_safe_thread_local_t *cstl);
+
+/* Folds the thread's last counts into the totals before releasing its block. */
+void
+crowd_safe_metrics_thread_exit(crowd_safe_thread_local_t *cstl);
+
+/* For threads without a counter block; adds atomically to a shared block. */
+void
+add_shared_metric(metric_id id, uint value);
+
+/* Adds to the counter block of the calling thread, which may be slower to find. */
+void
+add_metric(metric_id id, uint value);
+
+/* Called on the heartbeat; takes a sample when the interval has passed and no other thread
+ * is already taking one. */
+void
+sample_crowd_safe_metrics(clock_type_t now);
+
+/* Writes the final sample and logs the totals. */
+void
+close_crowd_safe_metrics();
+
+inline void
+add_thread_metric(crowd_safe_thread_local_t *cstl, metric_id id, uint value) {
+    if ((cstl != NULL) && (cstl->metrics != NULL))
+        cstl->metrics->counters[id] += value;
+    else
+        add_shared_metric(id, value);
+}
+#endif
+
+#endif
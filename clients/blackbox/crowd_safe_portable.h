@@ -0,0 +1,37 @@
+#ifndef CROWD_SAFE_PORTABLE_H
+#define CROWD_SAFE_PORTABLE_H 1
+
+/* Modules that are also built outside the client (benchmarks and offline tools) include this
+ * header instead of dr_api.h. When CROWD_SAFE_PORTABLE is defined, it supplies the DR types
+ * and the few allocation and ordering primitives those modules use. */
+
+#ifdef CROWD_SAFE_PORTABLE
+# include <stddef.h>
+# include <stdint.h>
+# include <stdlib.h>
+# include <string.h>
+typedef uint64_t uint64;
+typedef int64_t int64;
+typedef unsigned int uint;
+typedef unsigned short ushort;
+typedef unsigned char byte;
+typedef uintptr_t ptr_uint_t;
+typedef intptr_t ptr_int_t;
+typedef byte *app_pc;
+# ifndef __cplusplus
+typedef _Bool bool;
+#  define true (1)
+#  define false (0)
+# endif
+# define CS_ALLOC(size) malloc(size)
+# define dr_global_free(ptr, size) free(ptr)
+# ifdef _MSC_VER
+#  include <intrin.h>
+# else
+#  define _ReadWriteBarrier() __asm__ __volatile__("" ::: "memory")
+# endif
+#else
+# include "dr_api.h"
+#endif
+
+#endif
@@ -0,0 +1,244 @@
+#include "crowd_safe_probes.h"
+
+/**** private fields ****/
+
+volatile uint probe_mask;
+
+static void *probe_mutex; // guards the block list, the retired block and the log
+
+static thread_probes_t *probe_threads;
+
+/* Histograms of exited threads, and of threads without a block (such as the trace writer). */
+static thread_probes_t retired_probes;
+
+static file_t probe_log = INVALID_FILE;
+
+static uint64 probe_start_time;
+
+static const char *probe_names[_probe_count] = PROBE_NAMES;
+
+/**** private prototypes ****/
+
+static inline void
+add_probe_latency(thread_probes_t *block, probe_id id, uint64 cycles);
+
+static void
+reset_probes(uint mask);
+
+static void
+dump_probes(uint mask);
+
+static uint64
+probe_percentile(uint64 *histogram, uint64 count, uint percent);
+
+/**** public functions ****/
+
+void
+init_crowd_safe_probes(bool is_fork) {
+    probe_mask = 0; // a forked child starts without probes, since nudges go to one process
+    if (is_fork && (probe_log != INVALID_FILE)) {
+        dr_close_file(probe_log);
+        probe_log = INVALID_FILE;
+    }
+
+    probe_mutex = dr_mutex_create();
+    CS_TRACK(probe_mutex, sizeof(mutex_t));
+    probe_start_time = dr_get_milliseconds();
+}
+
+void
+crowd_safe_probes_thread_init(crowd_safe_thread_local_t *cstl) {
+    thread_probes_t *block = (thread_probes_t *) CS_ALLOC(sizeof(thread_probes_t));
+    memset(block, 0, sizeof(thread_probes_t));
+
+    dr_mutex_lock(probe_mutex);
+    block->next = probe_threads;
+    probe_threads = block;
+    dr_mutex_unlock(probe_mutex);
+
+    cstl->probes = block;
+}
+
+void
+crowd_safe_probes_thread_exit(crowd_safe_thread_local_t *cstl) {
+    thread_probes_t *block = cstl->probes, **link;
+    uint p, b;
+
+    if (block == NULL)
+        return;
+
+    cstl->probes = NULL; // any later latencies of this thread go to the retired block
+    dr_mutex_lock(probe_mutex);
+    for (p = 0; p < _probe_count; p++) {
+        for (b = 0; b <= PROBE_BUCKET_COUNT; b++) {
+            retired_probes.histograms[p][b] += block->histograms[p][b];
+            retired_probes.baseline[p][b] += block->baseline[p][b];
+        }
+    }
+    for (link = &probe_threads; *link != NULL; link = &(*link)->next) {
+        if (*link == block) {
+            *link = block->next;
+            break;
+        }
+    }
+    dr_mutex_unlock(probe_mutex);
+    dr_global_free(block, sizeof(thread_probes_t));
+}
+
+void
+record_probe(crowd_safe_thread_local_t *cstl, probe_id id, uint64 cycles) {
+    if (cstl == NULL) {
+        dcontext_t *dcontext = dr_get_current_drcontext();
+
+        if ((dcontext != NULL) && (dcontext != GLOBAL_DCONTEXT))
+            cstl = GET_CSTL(dcontext);
+    }
+
+    if ((cstl != NULL) && (cstl->probes != NULL)) {
+        add_probe_latency(cstl->probes, id, cycles);
+    } else {
+        dr_mutex_lock(probe_mutex);
+        add_probe_latency(&retired_probes, id, cycles);
+        dr_mutex_unlock(probe_mutex);
+    }
+}
+
+void
+nudge_crowd_safe_probes(uint64 argument) {
+    uint mask = PROBE_NUDGE_MASK(argument);
+
+    mask &= (1U << _probe_count) - 1;
+    if (mask == 0)
+        mask = (1U << _probe_count) - 1;
+
+    dr_mutex_lock(probe_mutex);
+    switch (PROBE_NUDGE_COMMAND(argument)) {
+        case PROBE_NUDGE_ENABLE:
+            reset_probes(mask); // before the probes start, so the baseline is exact
+            probe_mask |= mask;
+            CS_LOG("Probes enabled: 0x%x\n", probe_mask);
+            break;
+        case PROBE_NUDGE_DUMP:
+            dump_probes(mask & probe_mask);
+            break;
+        case PROBE_NUDGE_DISABLE:
+            dump_probes(mask & probe_mask);
+            probe_mask &= ~mask;
+            CS_LOG("Probes enabled: 0x%x\n", probe_mask);
+            break;
+        default:
+            CS_WARN("Unknown nudge 0x%llx\n", argument);
+    }
+    dr_mutex_unlock(probe_mutex);
+}
+
+void
+close_crowd_safe_probes() {
+    dr_mutex_lock(probe_mutex);
+    if (probe_mask != 0) {
+        dump_probes(probe_mask);
+        probe_mask = 0;
+    }
+    if (probe_log != INVALID_FILE) {
+        dr_close_file(probe_log);
+        probe_log = INVALID_FILE;
+    }
+    dr_mutex_unlock(probe_mutex);
+    // the mutex stays, since exiting threads still retire their histograms
+}
+
+/**** private functions ****/
+
+static inline void
+add_probe_latency(thread_probes_t *block, probe_id id, uint64 cycles) {
+    uint64 *histogram = block->histograms[id];
+    uint bucket = 0;
+
+    while (((cycles >> bucket) > 1ULL) && (bucket < (PROBE_BUCKET_COUNT - 1)))
+        bucket++;
+    histogram[bucket]++;
+    histogram[PROBE_CYCLES] += cycles;
+}
+
+/* The owners may be recording while this runs, so a latency that lands during the copy may be
+ * left out of the next dump, or counted once too many. Caller holds the probe mutex. */
+static void
+reset_probes(uint mask) {
+    thread_probes_t *block = &retired_probes;
+    uint p;
+
+    while (block != NULL) {
+        for (p = 0; p < _probe_count; p++) {
+            if ((mask & (1U << p)) != 0)
+                memcpy(block->baseline[p], block->histograms[p], sizeof(block->histograms[p]));
+        }
+        block = (block == &retired_probes) ? probe_threads : block->next;
+    }
+}
+
+/* Caller holds the probe mutex. */
+static void
+dump_probes(uint mask) {
+    uint64 histogram[PROBE_BUCKET_COUNT + 1], count;
+    thread_probes_t *block;
+    uint p, b;
+
+    if (mask == 0)
+        return;
+    if (probe_log == INVALID_FILE) {
+        char filename[256];
+
+        generate_filename(filename, "probes", "log");
+        probe_log = create_output_file(filename);
+        if (probe_log == INVALID_FILE) {
+            CS_ERR("Failed to create the probe log %s\n", filename);
+            return;
+        }
+    }
+
+    dr_fprintf(probe_log, "Probe latencies in cycles at %lld ms:\n",
+               dr_get_milliseconds() - probe_start_time);
+    for (p = 0; p < _probe_count; p++) {
+        if ((mask & (1U << p)) == 0)
+            continue;
+
+        memset(histogram, 0, sizeof(histogram));
+        block = &retired_probes;
+        while (block != NULL) {
+            for (b = 0; b <= PROBE_BUCKET_COUNT; b++)
+                histogram[b] += block->histograms[p][b] - block->baseline[p][b];
+            block = (block == &retired_probes) ? probe_threads : block->next;
+        }
+
+        for (count = 0, b = 0; b < PROBE_BUCKET_COUNT; b++)
+            count += histogram[b];
+        if (count == 0ULL) {
+            dr_fprintf(probe_log, "\t%s: no events\n", probe_names[p]);
+            continue;
+        }
+        dr_fprintf(probe_log, "\t%s: %lld events, mean %lld, p50 < %lld, p90 < %lld, p99 < %lld\n",
+                   probe_names[p], count, histogram[PROBE_CYCLES] / count,
+                   probe_percentile(histogram, count, 50), probe_percentile(histogram, count, 90),
+                   probe_percentile(histogram, count, 99));
+        for (b = 0; b < PROBE_BUCKET_COUNT; b++) {
+            if (histogram[b] > 0ULL) {
+                dr_fprintf(probe_log, "\t\t%12lld - %12lld: %lld\n", (b == 0) ? 0ULL : (1ULL << b),
+                           (1ULL << (b + 1)) - 1, histogram[b]);
+            }
+        }
+    }
+}
+
+/* Returns the upper bound of the bucket that holds the percentile. */
+static uint64
+probe_percentile(uint64 *histogram, uint64 count, uint percent) {
+    uint64 rank = ((count * percent) + 99) / 100, seen = 0ULL;
+    uint b;
+
+    for (b = 0; b < PROBE_BUCKET_COUNT; b++) {
+        seen += histogram[b];
+        if (seen >= rank)
+            break;
+    }
+    return 1ULL << (b + 1);
+}
@@ -0,0 +1,91 @@
+#ifndef CROWD_SAFE_PROBES_H
+#define CROWD_SAFE_PROBES_H 1
+
+/* Latency probes on the hot paths of the trace, for finding what makes a release build slow
+ * without any logging. All probes start disabled, and a disabled probe costs one load of
+ * `probe_mask` and an untaken branch. An enabled probe reads the cycle counter on entry and exit,
+ * and adds the latency to a histogram of the calling thread by powers of two, without any lock.
+ * Probes are inclusive: commit_basic_block includes commit_incoming_edges, which includes
+ * write_graph_edge, which includes install_ibp.
+
+   Probes are driven by nudges (see dr_nudge_client_ex(); `drconfig -nudge` sends one from the
+   command line). The low byte of the argument is a PROBE_NUDGE_* command, and the high 32 bits
+   are a mask of probes (1 << probe_id), where 0 selects all of them. For example, 0x300000001
+   starts commit_basic_block and commit_incoming_edges, and 2 appends the histograms of every
+   enabled probe to probes.log.
+*/
+
+#include "crowd_safe_util.h"
+#include <intrin.h>
+
+#define PROBE_NUDGE_ENABLE 1  // starts the probes of the mask from empty histograms
+#define PROBE_NUDGE_DUMP 2    // appends the histograms of the probes of the mask to probes.log
+#define PROBE_NUDGE_DISABLE 3 // dumps the probes of the mask, then stops them
+
+#define PROBE_NUDGE_COMMAND(argument) ((uint) ((argument) & 0xff))
+#define PROBE_NUDGE_MASK(argument) ((uint) ((argument) >> 0x20))
+
+#define PROBE_BUCKET_COUNT 0x20 // bucket b counts latencies in [2^b, 2^(b+1)) cycles
+#define PROBE_CYCLES PROBE_BUCKET_COUNT // the slot after the buckets holds the total cycles
+
+typedef enum probe_id probe_id;
+enum probe_id {
+    probe_commit_basic_block,
+    probe_commit_incoming_edges,
+    probe_write_graph_edge,
+    probe_install_ibp,
+    probe_flush_trace_buffer,
+    probe_notify_module_loaded,
+    _probe_count
+};
+
+#define PROBE_NAMES { \
+    "commit_basic_block", "commit_incoming_edges", "write_graph_edge", "install_ibp", \
+    "flush_trace_buffer", "notify_module_loaded" }
+
+struct thread_probes_t {
+    uint64 histograms[_probe_count][PROBE_BUCKET_COUNT + 1]; // written only by the owning thread
+    uint64 baseline[_probe_count][PROBE_BUCKET_COUNT + 1];   // histograms when last enabled
+    thread_probes_t *next;
+};
+
+extern volatile uint probe_mask;
+
+/**** public functions ****/
+
+void
+init_crowd_safe_probes(bool is_fork);
+
+void
+crowd_safe_probes_thread_init(crowd_safe_thread_local_t *cstl);
+
+/* Moves the thread's histograms to the retired block before releasing its block. */
+void
+crowd_safe_probes_thread_exit(crowd_safe_thread_local_t *cstl);
+
+/* Adds one latency to the histograms of `cstl`, or of the calling thread if it is NULL. */
+void
+record_probe(crowd_safe_thread_local_t *cstl, probe_id id, uint64 cycles);
+
+void
+nudge_crowd_safe_probes(uint64 argument);
+
+/* Dumps the probes that are still enabled. */
+void
+close_crowd_safe_probes();
+
+/* Returns the entry stamp of an enabled probe, or 0. */
+inline uint64
+probe_start(probe_id id) {
+    if ((probe_mask & (1U << id)) == 0)
+        return 0ULL;
+    return __rdtsc();
+}
+
+inline void
+probe_end(crowd_safe_thread_local_t *cstl, probe_id id, uint64 start) {
+    if (start != 0ULL)
+        record_probe(cstl, id, __rdtsc() - start);
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "crowd_safe_trace.h"
+#include "crowd_safe_trace_buffer.h"
 #include "link_observer.h"
 #include "indirect_link_observer.h"
 #include "crowd_safe_util.h"
@@ -6,6 +7,10 @@
 #include "indirect_link_hashtable.h"
 #include "execution_monitor.h"
 #include "blacklist.h"
+#include "pending_edge_table.h"
+#include "xhash_worker.h"
+#include "crowd_safe_metrics.h"
+#include "crowd_safe_probes.h"
 #include "drvector.h"
 #include "drhashtable.h"
 #include <intrin.h>
@@ -22,14 +27,72 @@ typedef struct trace_file_t trace_file_t;
 struct trace_file_t {
     bool active;
     bool buffered;
-    uint buffer_position; // step of 1 per sizeof(uint64)
-    uint buffer_size;
-    uint entry_count;
+    bool threaded; // entries arrive through per-thread rings and are written by the trace writer
+    volatile uint entry_count; // for threaded files, also the sequence number of the next entry
+    uint next_sequence; // threaded files only: next entry the trace writer may write
     clock_type_t last_buffer_flush;
     file_t file;
-    uint64* buffer;
+    trace_buffer_t buffer;
+    const char *basename;
+    uint min_buffer_size; // buffer adapts to the write rate within [min, max]
+    uint max_buffer_size;
+    uint sparse_flushes;  // consecutive flushes of less than 1/8 of the buffer
+    bool mapped;          // `buffer` is a writable view of the file at `map_offset`
+    uint64 map_offset;
 };
 
+/* A single-producer, single-consumer ring of graph entries for one trace file. The owning
+ * thread fills records at `tail` without any lock, and the trace writer drains at `head`. */
+#define TRACE_RING_RECORD_COUNT 0x200 // must be a power of 2
+#define TRACE_RING_INDEX(position) ((position) & (TRACE_RING_RECORD_COUNT - 1))
+#define TRACE_RECORD_MAX_WORDS 3
+
+typedef struct trace_ring_record_t trace_ring_record_t;
+struct trace_ring_record_t {
+    uint sequence;
+    uint word_count;
+    uint64 words[TRACE_RECORD_MAX_WORDS];
+};
+
+typedef struct trace_ring_t trace_ring_t;
+struct trace_ring_t {
+    volatile uint head;
+    volatile uint tail;
+    volatile bool retired; // owner thread has exited; free the ring when it is empty
+    trace_ring_t *next;    // registry of all rings for the file, guarded by `trace_ring_mutex`
+    trace_ring_record_t records[TRACE_RING_RECORD_COUNT];
+};
+
+struct trace_thread_buffers_t {
+    trace_ring_t *rings[_trace_file_id_count]; // non-null for threaded files only
+};
+
+typedef struct trace_writer_t trace_writer_t;
+struct trace_writer_t {
+    trace_ring_t *rings[_trace_file_id_count];        // registry heads
+    trace_ring_t *orphan_rings[_trace_file_id_count]; // for threads without a cstl, under the output lock
+    volatile bool flush_requested;
+    volatile bool exiting;
+    volatile bool running; // cleared only by the writer thread on exit (or by the forked child)
+};
+
+static trace_writer_t *trace_writer;
+
+static void *trace_ring_mutex;
+
+#define IS_THREADED_TRACE_FILE(id) \
+    (((id) == graph_node_file) || ((id) == graph_edge_file) || ((id) == graph_cross_module_file))
+
+#define TRACE_WRITER_INTERVAL_MS 10
+#define TRACE_WRITER_EXIT_WAIT_MS 1000
+
+/* Publish ring records to the trace writer: all record stores must be visible before `tail` moves. */
+#define TRACE_RING_PUBLISH(ring, position) \
+do { \
+    _ReadWriteBarrier(); \
+    (ring)->tail = (position); \
+} while (0)
+
 static trace_file_t *trace_files;
 
 static hashtable_t *call_continuations;
@@ -43,27 +106,24 @@ static bool *output_files_closed = NULL;
 #define PERMANENT_MODULE_INSTANCE_HASH ((ushort)0xffff)
 
 #define GRAPH_BUFFER_LONG_COUNT 512
+#define GRAPH_WRITER_BUFFER_LONG_COUNT 0x4000
+#define TRACE_BUFFER_MAX_LONG_COUNT 0x20000 // default ceiling for adaptive growth (1 MB)
+#define TRACE_BUFFER_KB_TO_LONG_COUNT(kb) (((kb) * 0x400) / sizeof(uint64))
+#define TRACE_BUFFER_GROW_INTERVAL (BUFFER_FLUSH_INTERVAL >> 4) // double a buffer that fills faster
+#define TRACE_BUFFER_SHRINK_FLUSH_COUNT 0x10 // halve after this many consecutive sparse flushes
+#define TRACE_MAP_WINDOW_SIZE 0x400000 // multiple of the 64KB allocation granularity
 #define CALL_CONTINUATION_KEY_SIZE 10
+#define PENDING_EDGE_TABLE_BITS 12
 
-typedef struct incoming_edge_t incoming_edge_t;
-struct incoming_edge_t {
-    app_pc from;
-    byte exit_ordinal;
-    graph_edge_type type;
-    ushort module_instance_hash; // from_module->image_instance_id + to_module->image_instance_id
-};
-
-#define MULTIMAP_NAME_KEY incoming_edge_multimap
-#define MULTIMAP_KEY_TYPE app_pc
-#define MULTIMAP_VALUE_TYPE incoming_edge_t*
-#include "../drcontainers/drmultimap.h"
+static pending_edge_table_t *pending_incoming_edges;
+static report_mask_t pending_edge_report_mask; // logs the pending edge population as it grows
 
-#define MULTIMAP_NAME_KEY incoming_edge_multimap
-#define MULTIMAP_KEY_TYPE app_pc
-#define MULTIMAP_VALUE_TYPE incoming_edge_t*
-#include "../drcontainers/drmultimapx.h"
+/* The xhash file is text, so it has its own buffer, under the output lock. */
+#define XHASH_TEXT_BUFFER_SIZE 0x10000
+#define XHASH_LINE_MAX_LENGTH 0x200
 
-static incoming_edge_multimap_t *pending_incoming_edges;
+static char *xhash_text_buffer;
+static uint xhash_text_position;
 
 typedef enum meta_entry_type meta_entry_type;
 enum meta_entry_type {
@@ -86,6 +146,11 @@ static app_pc
 write_graph_edge(dcontext_t *dcontext, app_pc from, app_pc to, bb_state_t *from_state, bb_state_t *to_state,
     module_location_t *from_module, module_location_t *to_module, byte exit_ordinal, graph_edge_type edge_type);
 
+static app_pc
+write_unprobed_graph_edge(dcontext_t *dcontext, app_pc from, app_pc to, bb_state_t *from_state,
+    bb_state_t *to_state, module_location_t *from_module, module_location_t *to_module, byte exit_ordinal,
+    graph_edge_type edge_type);
+
 static app_pc
 write_cross_module_edge(dcontext_t *dcontext, crowd_safe_thread_local_t *cstl, app_pc from,
     app_pc to, bb_state_t *from_state, bb_state_t *to_state, module_location_t *from_module,
@@ -99,9 +164,36 @@ static void
 activate_trace_file(trace_file_id id, bool active, bool buffered,
                     uint buffer_size, const char *basename, const char *extension);
 
+static trace_frame_format_t
+get_graph_frame_format(trace_file_id id);
+
+static uint
+get_trace_buffer_size(uint option_kb, uint default_long_count);
+
+static void
+adapt_trace_buffer(trace_file_t *trace_file, uint fill, clock_type_t now);
+
+static void
+map_trace_file(trace_file_t *trace_file);
+
+static void
+truncate_trace_file(trace_file_t *trace_file, uint64 end);
+
+static bool
+map_trace_window(trace_file_t *trace_file, uint64 offset);
+
+static uint64
+unmap_trace_window(trace_file_t *trace_file);
+
+static void
+advance_trace_window(trace_file_t *trace_file);
+
 static inline void
 write_byte_aligned_file_entry(trace_file_id id, uint64 data);
 
+static ptr_int_t
+write_trace_sink(void *sink, const void *data, size_t size);
+
 static inline void
 flush_trace_buffer(trace_file_t *trace_file);
 
@@ -111,6 +203,36 @@ close_active_trace_files();
 static void
 close_active_trace_file(trace_file_t *trace_file);
 
+static void
+flush_xhash_text();
+
+static void
+append_trace_record(trace_file_id id, uint64 *words, uint word_count);
+
+static trace_ring_t *
+create_trace_ring();
+
+static void
+start_trace_writer();
+
+static bool
+stop_trace_writer();
+
+static void
+trace_writer_thread(void *arg);
+
+static bool
+drain_trace_rings(trace_file_id id);
+
+static bool
+merge_trace_rings(trace_file_id id);
+
+static void
+discard_trace_rings();
+
+static inline void
+request_trace_flush();
+
 static bool
 find_in_exports(IMAGE_EXPORT_DIRECTORY *exports, size_t exports_size, app_pc from, app_pc to,
     module_location_t *from_module, module_location_t *to_module, char *function_id);
@@ -127,56 +249,122 @@ get_cross_module_name(module_location_t *module);
 static byte
 get_black_box_callout_ordinal(graph_edge_type edge_type);
 
-static incoming_edge_t*
-create_pending_edge(app_pc from, byte exit_ordinal, graph_edge_type type, ushort module_instance_hash);
+static void
+add_pending_incoming_edge(app_pc from, app_pc to, byte exit_ordinal, graph_edge_type type,
+    ushort module_instance_hash);
 
 static void
-free_incoming_edge(void *cc);
+log_pending_edge_counters(const char *when);
 
 /**** public functions ****/
 
 void
 init_crowd_safe_trace(bool isFork) {
     byte *RtlUserThreadStart = dr_get_ntdll_proc_address("RtlUserThreadStart");
+    extern uint trace_buffer_kb, graph_buffer_kb;
+    uint buffer_size, graph_buffer_size;
+    const char *graph_extension = CROWD_SAFE_COMPACT_GRAPH() ? "cdat" : "dat";
     CROWD_SAFE_DEBUG_HOOK_VOID(__FUNCTION__);
 
     output_mutex = dr_mutex_create();
     CS_TRACK(output_mutex, sizeof(mutex_t));
+    trace_ring_mutex = dr_mutex_create();
+    CS_TRACK(trace_ring_mutex, sizeof(mutex_t));
+    init_crowd_safe_metrics(isFork);
+    init_crowd_safe_probes(isFork);
 
     if (isFork) {
+        trace_writer->running = false; // the writer thread does not survive the fork
+        discard_trace_rings();
         close_active_trace_files();
     } else {
+        trace_file_id id;
+
         trace_files = (trace_file_t*)CS_ALLOC(_trace_file_id_count * sizeof(trace_file_t));
 
-        pending_incoming_edges = (incoming_edge_multimap_t *)CS_ALLOC(sizeof(incoming_edge_multimap_t));
-        incoming_edge_multimap_init(pending_incoming_edges, free_incoming_edge, "pending incoming edges");
+        trace_writer = (trace_writer_t*)CS_ALLOC(sizeof(trace_writer_t));
+        memset(trace_writer, 0, sizeof(trace_writer_t));
+        for (id = 0; id < _trace_file_id_count; id++) {
+            if (IS_THREADED_TRACE_FILE(id)) {
+                trace_writer->orphan_rings[id] = create_trace_ring();
+                trace_writer->rings[id] = trace_writer->orphan_rings[id];
+            }
+        }
+
+        pending_incoming_edges = (pending_edge_table_t *)CS_ALLOC(sizeof(pending_edge_table_t));
+        pending_edge_table_init(pending_incoming_edges, PENDING_EDGE_TABLE_BITS);
+        init_report_mask(&pending_edge_report_mask, 0xfff, 0xffffffff);
     }
 
     output_files_closed = CS_ALLOC(sizeof(bool));
     *output_files_closed = false;
 
+    graph_buffer_size = get_trace_buffer_size(graph_buffer_kb, GRAPH_WRITER_BUFFER_LONG_COUNT);
+    buffer_size = get_trace_buffer_size(trace_buffer_kb, GRAPH_BUFFER_LONG_COUNT);
+    if (CROWD_SAFE_COMPACT_GRAPH() && CROWD_SAFE_MAP_GRAPH())
+        CS_WARN("Option -graph_map is ignored because -graph_compact is enabled\n");
+
     activate_trace_file(module_file, true, false, 0U, "module", "log");
     activate_trace_file(graph_node_file, true, true,
-                        GRAPH_BUFFER_LONG_COUNT, "graph-node", "dat");
+                        graph_buffer_size, "graph-node", graph_extension);
     activate_trace_file(graph_edge_file, true, true,
-                        GRAPH_BUFFER_LONG_COUNT, "graph-edge", "dat");
+                        graph_buffer_size, "graph-edge", graph_extension);
     activate_trace_file(graph_cross_module_file, true, true,
-                        GRAPH_BUFFER_LONG_COUNT, "cross-module", "dat");
+                        graph_buffer_size, "cross-module", graph_extension);
     activate_trace_file(network_monitor_file, CROWD_SAFE_NETWORK_MONITOR(), true,
-                        GRAPH_BUFFER_LONG_COUNT, "network-monitor", "dat");
+                        buffer_size, "network-monitor", "dat");
     activate_trace_file(call_stack_file, CROWD_SAFE_NETWORK_MONITOR(), true,
-                        GRAPH_BUFFER_LONG_COUNT, "call-stack", "dat");
+                        buffer_size, "call-stack", "dat");
     activate_trace_file(meta_file, true, true,
-                        GRAPH_BUFFER_LONG_COUNT, "meta", "dat");
+                        buffer_size, "meta", "dat");
     activate_trace_file(cross_module_hash_file, false/*activate on demand*/, false,
                         0, "xhash", "tab");
     activate_trace_file(disassembly_file, is_bb_analysis_level_active(BB_ANALYSIS_ASSEMBLY),
                         false, 0, "disassembly", "log");
 
+    start_trace_writer();
+
     add_pending_edge(PROCESS_ENTRY_POINT, RtlUserThreadStart, 0, direct_edge,
                      internal_fake_module, internal_fake_module, false);
 }
 
+void
+crowd_safe_trace_thread_init(crowd_safe_thread_local_t *cstl) {
+    trace_file_id id;
+    trace_thread_buffers_t *buffers = CS_ALLOC(sizeof(trace_thread_buffers_t));
+
+    dr_mutex_lock(trace_ring_mutex);
+    for (id = 0; id < _trace_file_id_count; id++) {
+        if (IS_THREADED_TRACE_FILE(id)) {
+            buffers->rings[id] = create_trace_ring();
+            buffers->rings[id]->next = trace_writer->rings[id];
+            trace_writer->rings[id] = buffers->rings[id];
+        } else {
+            buffers->rings[id] = NULL;
+        }
+    }
+    dr_mutex_unlock(trace_ring_mutex);
+
+    cstl->trace_buffers = buffers;
+}
+
+void
+crowd_safe_trace_thread_exit(crowd_safe_thread_local_t *cstl) {
+    trace_file_id id;
+    trace_thread_buffers_t *buffers = cstl->trace_buffers;
+
+    if (buffers == NULL)
+        return;
+
+    cstl->trace_buffers = NULL;
+    for (id = 0; id < _trace_file_id_count; id++) {
+        if (buffers->rings[id] != NULL)
+            buffers->rings[id]->retired = true; // the writer frees it after the last record is drained
+    }
+    request_trace_flush();
+    dr_global_free(buffers, sizeof(trace_thread_buffers_t));
+}
+
 void
 write_hash(bb_hash_t hash, trace_file_id file_id) {
     assert_output_lock();
@@ -197,7 +385,7 @@ write_link(dcontext_t *dcontext, app_pc from, app_pc to, bb_state_t *from_state,
 
 void
 write_network_event(network_event_type_t type, network_event_status_t status, network_address_t *address,
-    network_protocol_t protocol, uint payload_length, ushort call_stack_id, ushort socket_id, uint thread_id,
+    network_protocol_t protocol, uint payload_length, uint call_stack_id, ushort socket_id, uint thread_id,
     uint64 timestamp)
 {
     uint64 entry;
@@ -210,11 +398,12 @@ write_network_event(network_event_type_t type, network_event_status_t status, ne
     write_byte_aligned_file_entry(network_monitor_file, timestamp);
 
     entry = call_stack_id;
-    entry |= (((uint64) socket_id) << 0x10);
     entry |= (((uint64) thread_id) << 0x20);
     write_byte_aligned_file_entry(network_monitor_file, entry);
 
-    write_byte_aligned_file_entry(network_monitor_file, payload_length);
+    entry = payload_length;
+    entry |= (((uint64) socket_id) << 0x20);
+    write_byte_aligned_file_entry(network_monitor_file, entry);
 
     entry = type;
     entry |= (((uint64) status) << 4);
@@ -227,34 +416,32 @@ write_network_event(network_event_type_t type, network_event_status_t status, ne
     output_lock_release();
 }
 
-ushort
+uint
 write_call_stack(stack_frame_t *frames, uint frame_count) {
     uint i;
     uint64 entry;
 
     output_lock_acquire();
 
-    for (i = 0; i < (frame_count - 1); i += 2) {
-        entry = p2int(frames[i | 1].return_address);
-        entry |= (((uint64) frames[i].return_address) << 0x20);
+    write_byte_aligned_file_entry(call_stack_file, frame_count);
+    for (i = 0; i < frame_count; i += 2) {
+        entry = p2int(frames[i].return_address);
+        if ((i + 1) < frame_count)
+            entry |= (((uint64) p2int(frames[i + 1].return_address)) << 0x20);
         write_byte_aligned_file_entry(call_stack_file, entry);
     }
 
-    if ((frame_count & 1) == 0)
-        entry = (((uint64) frames[frame_count - 1].return_address) << 0x20);
-    else
-        entry = 0ULL;
-    write_byte_aligned_file_entry(call_stack_file, entry);
-
     i = trace_files[call_stack_file].entry_count++;
     output_lock_release();
-    return (ushort) i;
+    return i;
 }
 
 void
 write_meta_header() {
+    extern uint block_hash_version;
     module_data_t *main = dr_get_main_module();
-    uint64 header = (uint64)main->start;
+    uint64 header = (uint64)main->start | (((uint64)block_hash_version) << 0x38) |
+        (((uint64)NETWORK_TRACE_VERSION) << 0x30);
 
     output_lock_acquire();
     write_byte_aligned_file_entry(meta_file, header);
@@ -288,6 +475,7 @@ write_meta_uib(app_pc from, app_pc to, uint edge_index, bool is_cross_module,
         entry |= 0x4000000000000000ULL;
 
     write_byte_aligned_file_entry(meta_file, entry);
+    add_metric(metric_uib_reports, 1);
 
     CS_DET("Writing UIB for edge #%d: %d traversals\n", edge_index, traversal_count);
 
@@ -355,6 +543,7 @@ finalize_metadata() {
 
 void
 write_cross_module_hash(uint relative_address, function_export_t export) {
+    int length;
     ASSERT(CROWD_SAFE_RECORD_XHASH());
 
     output_lock_acquire();
@@ -363,8 +552,21 @@ write_cross_module_hash(uint relative_address, function_export_t export) {
                             0, "xhash", "tab");
     }
 
-    dr_fprintf(trace_files[cross_module_hash_file].file,
-               "0x%llx %s "PX"\n", export.hash, export.function_id, (app_pc) relative_address);
+    if (xhash_text_buffer == NULL) {
+        xhash_text_buffer = CS_ALLOC(XHASH_TEXT_BUFFER_SIZE);
+        xhash_text_position = 0;
+    } else if ((XHASH_TEXT_BUFFER_SIZE - xhash_text_position) < XHASH_LINE_MAX_LENGTH) {
+        flush_xhash_text();
+    }
+
+    length = dr_snprintf(xhash_text_buffer + xhash_text_position, XHASH_LINE_MAX_LENGTH,
+                         "0x%llx %s "PX"\n", export.hash, export.function_id,
+                         (app_pc) relative_address);
+    if (length < 0) { // truncated: keep the line
+        length = XHASH_LINE_MAX_LENGTH;
+        xhash_text_buffer[xhash_text_position + length - 1] = '\n';
+    }
+    xhash_text_position += length;
     output_lock_release();
 }
 
@@ -399,9 +601,8 @@ notify_code_modification(dcontext_t *dcontext, dr_fragment_t *exception_f, app_p
                 CS_DET("Exception continuation edge %s("PX") - "PX" directly written for target "PX"\n",
                     module->module_name, MODULAR_PC(module, exception_f->tag), resume_tag, target);
             } else {
-                incoming_edge_multimap_add(pending_incoming_edges, resume_tag,
-                    create_pending_edge(exception_f->tag, exit_ordinal, exception_continuation_edge,
-                        2 * module->image_instance_id));
+                add_pending_incoming_edge(exception_f->tag, resume_tag, exit_ordinal,
+                    exception_continuation_edge, 2 * module->image_instance_id);
 
                 CS_DET("Exception continuation edge %s("PX") - "PX" pending for target "PX"\n",
                     module->module_name, MODULAR_PC(module, exception_f->tag), resume_tag, target);
@@ -455,30 +656,8 @@ add_pending_edge(app_pc from, app_pc to, byte exit_ordinal, graph_edge_type type
     if (!holds_lock_already)
         hashcode_lock_acquire();
 
-    {
-        incoming_edge_t *edge;
-        bool duplicate = false;
-
-        // todo: hottest spot in Chrome (~15%) during page load
-        // this will also be an issue with the full JIT optimization
-        // maybe replace with a 4-way hash key, similar to blacklist?
-        incoming_edge_multimap_entry_t *pending_edges = incoming_edge_multimap_lookup(pending_incoming_edges, to);
-        uint i, pending_edge_count = incoming_edge_multimap_item_count(pending_edges);
-        for (i = 0; i < pending_edge_count; i++) {
-            edge = incoming_edge_multimap_entry_get_item(pending_edges, i);
-            if ((edge->from == from) && (edge->module_instance_hash == module_instance_hash)) {
-                duplicate = true;
-                break;
-            }
-        }
-
-        if (!duplicate) {
-            incoming_edge_multimap_add(pending_incoming_edges, to,
-                create_pending_edge(from, exit_ordinal, type, module_instance_hash));
-        }
-
-        // CS_LOG("Pend edge type %d "PX"-"PX" at ordinal %d\n", type, from, to, exit_ordinal);
-    }
+    add_pending_incoming_edge(from, to, exit_ordinal, type, module_instance_hash);
+    // CS_LOG("Pend edge type %d "PX"-"PX" at ordinal %d\n", type, from, to, exit_ordinal);
 
     if (!holds_lock_already)
         hashcode_lock_release();
@@ -489,24 +668,26 @@ commit_incoming_edges(dcontext_t *dcontext, crowd_safe_thread_local_t *cstl, app
     bb_state_t *state, graph_meta_type meta_type, module_location_t *module)
 {
     bool edges_reach_building_tag = false;
-    incoming_edge_multimap_entry_t *pending_edges;
+    pending_edge_set_t *pending_edges;
     uint pending_edge_count = 9999999;
+    uint64 probe = probe_start(probe_commit_incoming_edges);
 
     assert_hashcode_lock();
     ASSERT(tag == GET_BUILDING_TAG(cstl));
 
-    pending_edges = incoming_edge_multimap_lookup(pending_incoming_edges, tag);
+    pending_edges = pending_edge_table_lookup(pending_incoming_edges, tag);
     if (pending_edges != NULL) {
         uint i;
-        incoming_edge_t *edge;
+        incoming_edge_t *edge, pending_edge;
         bb_state_t *from_state;
         module_location_t *from_module;
         app_pc committed_edge_target;
         ushort module_instance_hash;
 
-        pending_edge_count = incoming_edge_multimap_item_count(pending_edges);
+        pending_edge_count = pending_edges->count;
         for (i = 0; i < pending_edge_count; i++) {
-            edge = incoming_edge_multimap_entry_get_item(pending_edges, i);
+            pending_edge = PENDING_EDGES(pending_edges)[i]; // the array moves if writing adds edges
+            edge = &pending_edge;
             from_state = get_bb_state(edge->from);
             from_module = get_module_for_address(edge->from);
             committed_edge_target = NULL;
@@ -567,8 +748,9 @@ commit_incoming_edges(dcontext_t *dcontext, crowd_safe_thread_local_t *cstl, app
 
             edges_reach_building_tag |= (committed_edge_target == tag);
         }
-        incoming_edge_multimap_remove_entry(pending_incoming_edges, tag);
+        pending_edge_table_remove(pending_incoming_edges, tag);
     }
+    probe_end(cstl, probe_commit_incoming_edges, probe);
 
     /* if (edges_reach_building_tag)
         approve_linkage(cstl, "edge");
@@ -783,10 +965,12 @@ crowd_safe_heartbeat(dcontext_t *dcontext) {
 #ifdef MONITOR_UNEXPECTED_IBP
     write_stale_uibp_reports(dcontext, now);
 #endif
+    sample_crowd_safe_metrics(now);
 
     for (id = 0; id < _trace_file_id_count; id++) {
         file = &trace_files[id]; // note: allowing an unsafe read here
-        if (file->active && file->buffered && ((now - file->last_buffer_flush) > BUFFER_FLUSH_INTERVAL)) {
+        if (file->active && file->buffered && !file->threaded &&
+            ((now - file->last_buffer_flush) > BUFFER_FLUSH_INTERVAL)) {
             flush_now = true;
             break;
         }
@@ -797,9 +981,11 @@ crowd_safe_heartbeat(dcontext_t *dcontext) {
         output_lock_acquire();
         for (id = 0; id < _trace_file_id_count; id++) {
             file = &trace_files[id];
-            if (file->active && file->buffered)
+            if (file->active && file->buffered && !file->threaded)
                 flush_trace_buffer(file);
         }
+        if (xhash_text_buffer != NULL)
+            flush_xhash_text();
         output_lock_release();
     }
 }
@@ -807,11 +993,16 @@ crowd_safe_heartbeat(dcontext_t *dcontext) {
 void
 close_crowd_safe_trace() {
     if (output_files_closed != NULL && !*output_files_closed) {
+        if (CROWD_SAFE_RECORD_XHASH())
+            stop_xhash_worker(); // before the xhash file closes
         close_active_trace_files();
+        close_crowd_safe_metrics(); // after the last flush
+        close_crowd_safe_probes();
+        log_pending_edge_counters("at exit");
         /*
 
-        incoming_edge_multimap_delete(pending_incoming_edges);
-        dr_global_free(pending_incoming_edges, sizeof(incoming_edge_multimap_t));
+        pending_edge_table_delete(pending_incoming_edges);
+        dr_global_free(pending_incoming_edges, sizeof(pending_edge_table_t));
 
         if (CROWD_SAFE_MONITOR()) {
             close_execution_monitor();
@@ -820,6 +1011,7 @@ close_crowd_safe_trace() {
 
         */
         dr_mutex_destroy(output_mutex);
+        dr_mutex_destroy(trace_ring_mutex);
         *output_files_closed = true;
     }
 }
@@ -845,23 +1037,33 @@ write_basic_block(dcontext_t *dcontext, crowd_safe_thread_local_t *cstl, module_
 
 static inline void
 write_committed_basic_block(app_pc tag, bb_state_t *state) {
-    uint64 compound_tag = p2int(tag);
+    uint64 entry[2];
 
     ASSERT(IS_BB_COMMITTED(state));
 
-    output_lock_acquire();
-    *(((byte*)&compound_tag)+0x6) = state->meta_type;
-    *(((byte*)&compound_tag)+0x7) = state->tag_version;
-    write_byte_aligned_file_entry(graph_node_file, compound_tag);
-    write_byte_aligned_file_entry(graph_node_file, state->hash);
-    trace_files[graph_node_file].entry_count++;
-    output_lock_release();
+    entry[0] = trace_encode_node_tag(p2int(tag), state->meta_type, state->tag_version);
+    entry[1] = state->hash;
+    append_trace_record(graph_node_file, entry, 2);
 }
 
-// cs-todo: for trampoline patches, make sure the pair hash gets written also
+/* The probe covers every path out of write_unprobed_graph_edge(). */
 static app_pc
 write_graph_edge(dcontext_t *dcontext, app_pc from, app_pc to, bb_state_t *from_state, bb_state_t *to_state,
     module_location_t *from_module, module_location_t *to_module, byte exit_ordinal, graph_edge_type edge_type)
+{
+    uint64 probe = probe_start(probe_write_graph_edge);
+    app_pc target = write_unprobed_graph_edge(dcontext, from, to, from_state, to_state, from_module, to_module,
+                                              exit_ordinal, edge_type);
+
+    probe_end(GET_CSTL(dcontext), probe_write_graph_edge, probe);
+    return target;
+}
+
+// cs-todo: for trampoline patches, make sure the pair hash gets written also
+static app_pc
+write_unprobed_graph_edge(dcontext_t *dcontext, app_pc from, app_pc to, bb_state_t *from_state,
+    bb_state_t *to_state, module_location_t *from_module, module_location_t *to_module, byte exit_ordinal,
+    graph_edge_type edge_type)
 {
     crowd_safe_thread_local_t *cstl = GET_CSTL(dcontext);
     bool verified, write_edge, skip_edge = false;
@@ -975,8 +1177,6 @@ write_graph_edge(dcontext_t *dcontext, app_pc from, app_pc to, bb_state_t *from_
         SET_BB_LINKED(to_state);
     } else {
         bool committed_bb = false;
-        uint64 compoundFromTag = p2int(from);
-        uint64 compoundToTag = p2int(to);
 
         DODEBUG({
             CS_DET("Intra-module edge %s from "PX" to "PX"\n", from_module->module_name,
@@ -1023,21 +1223,16 @@ write_graph_edge(dcontext_t *dcontext, app_pc from, app_pc to, bb_state_t *from_
             CS_DET("DMP| Buffering edge %s("PX") -%d-> %s("PX") to disk.\n", from_module->module_name,
                 MODULAR_PC(from_module, from), exit_ordinal, to_module->module_name, MODULAR_PC(to_module, to));
 
-        output_lock_acquire();
-        *(((byte*)&compoundFromTag)+0x5) = exit_ordinal;
-        *(((byte*)&compoundFromTag)+0x6) = edge_type;
-        *(((byte*)&compoundFromTag)+0x7) = from_state->tag_version;
-        *(((byte*)&compoundToTag)+0x7) = to_state->tag_version;
-        write_byte_aligned_file_entry(graph_edge_file, compoundFromTag);
-        write_byte_aligned_file_entry(graph_edge_file, compoundToTag);
-        trace_files[graph_edge_file].entry_count++;
+        {
+            uint64 entry[2];
+            entry[0] = trace_encode_edge_from_tag(p2int(from), exit_ordinal, (byte) edge_type,
+                                                  from_state->tag_version);
+            entry[1] = trace_encode_edge_to_tag(p2int(to), to_state->tag_version);
+            append_trace_record(graph_edge_file, entry, 2);
+        }
 
-        if (!verified) {
-            flush_trace_buffer(&trace_files[graph_edge_file]);
-            if (committed_bb)
-                flush_trace_buffer(&trace_files[graph_node_file]);
-            }
-        output_lock_release();
+        if (!verified)
+            request_trace_flush(); // the edge and any committed nodes go to disk on the next writer pass
     }
 
     return to;
@@ -1080,6 +1275,9 @@ write_cross_module_edge(dcontext_t *dcontext, crowd_safe_thread_local_t *cstl, a
         }
     }
 
+    if ((edge_hash == 0ULL) && (to_module->type == module_type_image) && CROWD_SAFE_RECORD_XHASH())
+        xhash_await_module(to_module->start_pc); // the target may be a symbol not yet published
+
     if (edge_hash == 0ULL) {
         if (from == *dll_entry_callback_block) {
             CS_DET("Cross-module edge from "PX" to a dll init function at "PX"\n", from, to);
@@ -1257,8 +1455,6 @@ write_cross_module_edge(dcontext_t *dcontext, crowd_safe_thread_local_t *cstl, a
         SET_BB_LINKED(to_state);
     } else {
         bool committed_bb = false;
-        uint64 compoundFromTag = p2int(from);
-        uint64 compoundToTag = p2int(to);
 
         DODEBUG({
             CS_DET("Cross-module edge %s from %s("PX") to %s("PX")\n", function_id, from_module->module_name,
@@ -1329,31 +1525,26 @@ write_cross_module_edge(dcontext_t *dcontext, crowd_safe_thread_local_t *cstl, a
             SET_BB_LINKED(to_state);
         }
 
-        output_lock_acquire();
-
 #ifdef MONITOR_UNEXPECTED_IBP
         if ((from_module->type != module_type_anonymous) &&
             (to_module->type == module_type_anonymous) && (cstl->csd->stack_spy_mark != 0)) {
+            output_lock_acquire();
             write_meta_suspicious_gencode_entry(cstl->stack_suspicion.uib_count, cstl->stack_suspicion.suib_count);
+            output_lock_release();
         }
 #endif
 
-        *(((byte*)&compoundFromTag)+0x5) = exit_ordinal;
-        *(((byte*)&compoundFromTag)+0x6) = edge_type;
-        *(((byte*)&compoundFromTag)+0x7) = from_tag_version;
-        *(((byte*)&compoundToTag)+0x7) = to_tag_version;
-        write_byte_aligned_file_entry(graph_cross_module_file, compoundFromTag);
-        write_byte_aligned_file_entry(graph_cross_module_file, compoundToTag);
-        write_byte_aligned_file_entry(graph_cross_module_file, edge_hash);
-        trace_files[graph_cross_module_file].entry_count++;
-
-        if (!verified) {
-            flush_trace_buffer(&trace_files[graph_cross_module_file]);
-            if (committed_bb)
-                flush_trace_buffer(&trace_files[graph_node_file]);
+        {
+            uint64 entry[3];
+            entry[0] = trace_encode_edge_from_tag(p2int(from), exit_ordinal, (byte) edge_type,
+                                                  from_tag_version);
+            entry[1] = trace_encode_edge_to_tag(p2int(to), to_tag_version);
+            entry[2] = edge_hash;
+            append_trace_record(graph_cross_module_file, entry, 3);
         }
 
-        output_lock_release();
+        if (!verified)
+            request_trace_flush();
     }
     return to;
 }
@@ -1370,6 +1561,7 @@ static void
 install_ibp(dcontext_t *dcontext, app_pc from, app_pc to, module_location_t *from_module,
     module_location_t *to_module, bb_state_t *from_state, bb_state_t *to_state, bool verified, bool is_return)
 {
+    uint64 probe = probe_start(probe_install_ibp);
 #ifdef MONITOR_UNEXPECTED_IBP
 # ifdef MONITOR_ALL_IBP
     bool unexpected = true;
@@ -1431,6 +1623,8 @@ install_ibp(dcontext_t *dcontext, app_pc from, app_pc to, module_location_t *fro
     } else
 #endif
         ibp_hash_add(dcontext, from, to); // cs-todo: could skip the extra lookup by making a separate add()
+
+    probe_end(NULL, probe_install_ibp, probe);
 }
 
 static void
@@ -1442,20 +1636,109 @@ activate_trace_file(trace_file_id id, bool active, bool buffered, uint buffer_si
     // buffered = false; // not yet...
 
     trace_file->entry_count = 0U;
+    trace_file->next_sequence = 0U;
+    trace_file->threaded = IS_THREADED_TRACE_FILE(id);
     trace_file->last_buffer_flush = quick_system_time_millis();
+    trace_file->basename = basename;
     trace_file->active = active;
     if (active) {
+        bool mapped = buffered && trace_file->threaded && CROWD_SAFE_MAP_GRAPH() && !CROWD_SAFE_COMPACT_GRAPH();
+
         generate_filename(filename, basename, extension);
-        trace_file->file = create_output_file(filename);
+        if (mapped)
+            trace_file->file = create_mappable_output_file(filename);
+        else
+            trace_file->file = create_output_file(filename);
 
         CS_DET("Attempting to open filename %s: 0x%x\n", filename, trace_file->file);
 
         trace_file->buffered = buffered;
         if (buffered) {
-            trace_file->buffer_position = 0U;
-            trace_file->buffer_size = buffer_size;
-            trace_file->buffer = (uint64*)CS_ALLOC(buffer_size * sizeof(uint64));
+            extern uint trace_buffer_max_kb;
+            bool compact = trace_file->threaded && CROWD_SAFE_COMPACT_GRAPH();
+            trace_frame_format_t frame_format;
+
+            if (compact) { // the buffer must hold a whole frame
+                frame_format = get_graph_frame_format(id);
+                if (buffer_size < TRACE_FRAME_WORDS(frame_format))
+                    buffer_size = TRACE_FRAME_WORDS(frame_format);
+            }
+            trace_file->min_buffer_size = buffer_size;
+            trace_file->max_buffer_size = get_trace_buffer_size(trace_buffer_max_kb,
+                                                                TRACE_BUFFER_MAX_LONG_COUNT);
+            if (trace_file->max_buffer_size < buffer_size)
+                trace_file->max_buffer_size = buffer_size;
+            trace_file->sparse_flushes = 0U;
+            trace_file->mapped = false;
+            trace_buffer_init(&trace_file->buffer, (uint64*)CS_ALLOC(buffer_size * sizeof(uint64)),
+                              buffer_size, write_trace_sink, trace_file);
+            if (compact) {
+                trace_buffer_set_frame(&trace_file->buffer, frame_format,
+                                       (byte*)CS_ALLOC(TRACE_FRAME_MAX_BYTES(TRACE_FRAME_WORDS(frame_format))));
+            } else if (mapped) {
+                map_trace_file(trace_file);
+            }
+        }
+    }
+}
+
+/* Tags are delta-encoded against the previous entry; block and edge hashes are stored as-is. */
+static trace_frame_format_t
+get_graph_frame_format(trace_file_id id) {
+    trace_frame_format_t format;
+
+    switch (id) {
+        case graph_node_file: // { tag, hash }
+            format.entry_words = 2;
+            format.delta_mask = 0x1;
+            break;
+        case graph_edge_file: // { from, to }
+            format.entry_words = 2;
+            format.delta_mask = 0x3;
+            break;
+        default: // graph_cross_module_file: { from, to, edge hash }
+            format.entry_words = 3;
+            format.delta_mask = 0x3;
+    }
+    return format;
+}
+
+static uint
+get_trace_buffer_size(uint option_kb, uint default_long_count) {
+    if (option_kb == 0)
+        return default_long_count;
+    return (uint) TRACE_BUFFER_KB_TO_LONG_COUNT(option_kb);
+}
+
+/* Double the buffer when it fills within TRACE_BUFFER_GROW_INTERVAL of the previous flush, and
+ * halve it after a run of sparse flushes. Called after a flush, which leaves less than a frame
+ * pending in a compact buffer. */
+static void
+adapt_trace_buffer(trace_file_t *trace_file, uint fill, clock_type_t now) {
+    trace_buffer_t *buffer = &trace_file->buffer;
+    uint size = buffer->size;
+
+    if ((fill == size) && ((now - trace_file->last_buffer_flush) < TRACE_BUFFER_GROW_INTERVAL)) {
+        trace_file->sparse_flushes = 0U;
+        if (size < trace_file->max_buffer_size)
+            size = min(size << 1, trace_file->max_buffer_size);
+    } else if (fill < (size >> 3)) {
+        if (++trace_file->sparse_flushes == TRACE_BUFFER_SHRINK_FLUSH_COUNT) {
+            trace_file->sparse_flushes = 0U;
+            if (size > trace_file->min_buffer_size)
+                size = max(size >> 1, trace_file->min_buffer_size);
         }
+    } else {
+        trace_file->sparse_flushes = 0U;
+    }
+
+    if (size != buffer->size) {
+        uint64 *old_entries = buffer->entries;
+        uint old_size = buffer->size;
+
+        CS_DET("Resizing the %s buffer from %d to %d entries\n", trace_file->basename, buffer->size, size);
+        trace_buffer_resize(buffer, (uint64*)CS_ALLOC(size * sizeof(uint64)), size);
+        dr_global_free(old_entries, old_size * sizeof(uint64));
     }
 }
 
@@ -1465,59 +1748,413 @@ write_byte_aligned_file_entry(trace_file_id id, uint64 data) {
 
     assert_output_lock();
     if (output->buffered) {
-        ASSERT(output->buffer_position < output->buffer_size);
+        ASSERT(output->buffer.position < output->buffer.size);
 
-        *(output->buffer + output->buffer_position) = data;
-        output->buffer_position++;
-
-        if (output->buffer_position == output->buffer_size)
+        if (trace_buffer_append(&output->buffer, data))
             flush_trace_buffer(output);
     } else {
         dr_write_file(output->file, &data, sizeof(uint64));
     }
 }
 
+static ptr_int_t
+write_trace_sink(void *sink, const void *data, size_t size) {
+    return (ptr_int_t) dr_write_file(((trace_file_t *) sink)->file, data, size);
+}
+
+/* Replace the heap buffer with a view of the file. On failure the file stays buffered. */
+static void
+map_trace_file(trace_file_t *trace_file) {
+    uint64 *heap_entries = trace_file->buffer.entries;
+    uint heap_size = trace_file->buffer.size;
+
+    if (map_trace_window(trace_file, 0ULL)) {
+        trace_file->mapped = true;
+        dr_global_free(heap_entries, heap_size * sizeof(uint64));
+    } else {
+        CS_ERR("Failed to map the %s file; falling back to buffered writes\n", trace_file->basename);
+        truncate_trace_file(trace_file, 0ULL);
+        trace_buffer_attach(&trace_file->buffer, heap_entries, heap_size);
+    }
+}
+
+/* Cut the file back to `end` after a mapped window, which is 0 when nothing was written. */
+static void
+truncate_trace_file(trace_file_t *trace_file, uint64 end) {
+    if (!dr_file_set_size(trace_file->file, end))
+        CS_ERR("Failed to truncate the %s file to 0x%llx bytes\n", trace_file->basename, end);
+}
+
+/* Extend the file to cover the window at `offset`, and point the buffer at its view. */
+static bool
+map_trace_window(trace_file_t *trace_file, uint64 offset) {
+    size_t size = TRACE_MAP_WINDOW_SIZE;
+    void *window;
+
+    if (!dr_file_set_size(trace_file->file, offset + size)) {
+        CS_ERR("Failed to extend the %s file to 0x%llx bytes\n", trace_file->basename, offset + size);
+        return false;
+    }
+    window = dr_map_file(trace_file->file, &size, offset, NULL, DR_MEMPROT_READ | DR_MEMPROT_WRITE, 0);
+    if (window == NULL) {
+        CS_ERR("Failed to map the %s file at offset 0x%llx\n", trace_file->basename, offset);
+        return false;
+    }
+
+    trace_file->map_offset = offset;
+    trace_buffer_attach(&trace_file->buffer, (uint64*)window, (uint)(size / sizeof(uint64)));
+    return true;
+}
+
+/* Release the current window and cut the file back to the end of the written entries,
+ * which is returned. The file position is left at that end for buffered writes. */
+static uint64
+unmap_trace_window(trace_file_t *trace_file) {
+    trace_buffer_t *buffer = &trace_file->buffer;
+    uint64 end = trace_file->map_offset + trace_buffer_pending_bytes(buffer);
+
+    add_metric(metric_output_bytes, (uint) (end - trace_file->map_offset));
+    trace_buffer_commit(buffer);
+    dr_unmap_file(buffer->entries, buffer->size * sizeof(uint64));
+    trace_buffer_attach(buffer, NULL, 0U);
+    truncate_trace_file(trace_file, end);
+    dr_file_seek(trace_file->file, end, DR_SEEK_SET);
+    return end;
+}
+
+static void
+advance_trace_window(trace_file_t *trace_file) {
+    uint64 end = unmap_trace_window(trace_file);
+
+    if (!map_trace_window(trace_file, end)) {
+        uint size = trace_file->min_buffer_size;
+
+        CS_ERR("Falling back to buffered writes for the %s file at offset 0x%llx\n",
+               trace_file->basename, end);
+        truncate_trace_file(trace_file, end);
+        trace_file->mapped = false;
+        trace_buffer_attach(&trace_file->buffer, (uint64*)CS_ALLOC(size * sizeof(uint64)), size);
+    }
+}
+
 static inline void
 flush_trace_buffer(trace_file_t *trace_file) {
-    assert_output_lock();
+    clock_type_t now = quick_system_time_millis();
 
-    if (trace_file->buffer_position > 0) {
-        ssize_t output_bytes = dr_write_file(trace_file->file, trace_file->buffer,
-                                            trace_file->buffer_position * sizeof(uint64));
+    DODEBUG({
+        if (!trace_file->threaded) // threaded files belong to the trace writer
+            assert_output_lock();
+    });
+
+    if (trace_file->mapped) { // entries are already in the file; only move to the next window when full
+        if (trace_file->buffer.position == trace_file->buffer.size)
+            advance_trace_window(trace_file);
+        trace_file->last_buffer_flush = now;
+        return;
+    }
+
+    if (trace_buffer_flushable_words(&trace_file->buffer) > 0) { // a compact buffer keeps its partial frame
+        uint fill = trace_file->buffer.position;
+        uint kept = fill - trace_buffer_flushable_words(&trace_file->buffer);
+        uint64 start = __rdtsc(), probe = probe_start(probe_flush_trace_buffer);
+        ssize_t output_bytes = (ssize_t) trace_buffer_flush(&trace_file->buffer);
+
+        probe_end(NULL, probe_flush_trace_buffer, probe);
+        add_metric(metric_flush_kcycles, (uint) ((__rdtsc() - start) >> 10));
+        add_metric(metric_flush_count, 1);
         if (output_bytes < 0) {
             CS_ERR("Failed to write to an output file; errno %d\n", -(int)output_bytes);
             return;
-        } else if (output_bytes < (ssize_t) (trace_file->buffer_position * sizeof(uint64))) {
+        } else if (trace_file->buffer.position > kept) { // entries only leave the buffer on a full write
             CS_ERR("Failed to fully write an 8-byte value to an output file; "
                    "only %d bytes were written (errno not available)\n", // %d\n",
                    output_bytes); //, errno);
             return;
         }
-        trace_file->buffer_position = 0;
+        add_metric(metric_output_bytes, (uint) output_bytes);
+        adapt_trace_buffer(trace_file, fill, now);
     }
-    trace_file->last_buffer_flush = quick_system_time_millis();
+    trace_file->last_buffer_flush = now;
 }
 
 static void
 close_active_trace_files() {
     uint i;
+    bool writer_stopped = stop_trace_writer();
 
 	output_lock_acquire();
     for (i = 0; i < _trace_file_id_count; i++) {
         trace_file_t *trace_file = &trace_files[i];
-        if (trace_file->active)
-            close_active_trace_file(trace_file);
+        if (!trace_file->active)
+            continue;
+        if (trace_file->threaded && !writer_stopped) { // the writer still owns the rings and file
+            CS_WARN("Trace file %s is left to the trace writer; entries after exit may be lost\n",
+                    trace_file->basename);
+            continue;
+        }
+        close_active_trace_file(trace_file);
     }
 	output_lock_release();
 }
 
 static void
 close_active_trace_file(trace_file_t *trace_file) {
+    if (trace_file->threaded) { // app threads with a full ring may drain until the file is inactive
+        dr_mutex_lock(trace_ring_mutex);
+        merge_trace_rings((trace_file_id)(trace_file - trace_files));
+    }
     if (trace_file->buffered) {
-        flush_trace_buffer(trace_file);
-        dr_global_free(trace_file->buffer, trace_file->buffer_size * sizeof(uint64));
+        trace_buffer_stats_t *stats = &trace_file->buffer.stats;
+
+        if (trace_file->mapped) {
+            unmap_trace_window(trace_file);
+        } else {
+            flush_trace_buffer(trace_file);
+            if (trace_file->buffer.frame != NULL) {
+                ssize_t output_bytes = (ssize_t) trace_buffer_finish(&trace_file->buffer); // the last, short frame
+
+                if ((output_bytes < 0) || (trace_file->buffer.position > 0))
+                    CS_ERR("Failed to write the last frame of %s\n", trace_file->basename);
+                dr_global_free(trace_file->buffer.frame,
+                               TRACE_FRAME_MAX_BYTES(TRACE_FRAME_WORDS(trace_file->buffer.frame_format)));
+            }
+            dr_global_free(trace_file->buffer.entries, trace_file->buffer.size * sizeof(uint64));
+        }
+        CS_LOG("Trace file %s: %d flushes, %lld bytes, peak fill %d entries, %d resizes%s\n",
+               trace_file->basename, stats->flush_count, stats->bytes_written, stats->peak_fill,
+               stats->resize_count, trace_file->mapped ? " (mapped)" : "");
+    }
+    if ((trace_file == &trace_files[cross_module_hash_file]) && (xhash_text_buffer != NULL)) {
+        flush_xhash_text();
+        dr_global_free(xhash_text_buffer, XHASH_TEXT_BUFFER_SIZE);
+        xhash_text_buffer = NULL;
     }
     dr_close_file(trace_file->file);
+    if (trace_file->threaded) {
+        trace_file->active = false;
+        dr_mutex_unlock(trace_ring_mutex);
+    }
+}
+
+/* Caller holds the output lock. */
+static void
+flush_xhash_text() {
+    ssize_t output_bytes;
+
+    if (xhash_text_position == 0)
+        return;
+
+    output_bytes = dr_write_file(trace_files[cross_module_hash_file].file, xhash_text_buffer,
+                                 xhash_text_position);
+    if (output_bytes > 0)
+        add_metric(metric_output_bytes, (uint) output_bytes);
+    if (output_bytes < (ssize_t) xhash_text_position) {
+        CS_ERR("Failed to write the xhash buffer; only %d of %d bytes were written\n",
+               output_bytes, xhash_text_position);
+    }
+    xhash_text_position = 0;
+}
+
+/* Append one graph entry to the calling thread's ring for `id`. The entry index in the file
+ * is taken from an atomic counter, so the trace writer can restore the global order. */
+static void
+append_trace_record(trace_file_id id, uint64 *words, uint word_count) {
+    uint i, position;
+    trace_ring_t *ring = NULL;
+    trace_ring_record_t *record;
+    crowd_safe_thread_local_t *cstl = NULL;
+    dcontext_t *dcontext = dr_get_current_drcontext();
+    bool orphan;
+
+    ASSERT(IS_THREADED_TRACE_FILE(id) && (word_count <= TRACE_RECORD_MAX_WORDS));
+
+    if ((dcontext != NULL) && (dcontext != GLOBAL_DCONTEXT)) {
+        cstl = GET_CSTL(dcontext);
+        if ((cstl != NULL) && (cstl->trace_buffers != NULL))
+            ring = cstl->trace_buffers->rings[id];
+    }
+    orphan = (ring == NULL);
+    if (orphan) { // early init or a DR-internal thread: share one ring under the output lock
+        output_lock_acquire();
+        ring = trace_writer->orphan_rings[id];
+    }
+
+    position = ring->tail;
+    while ((position - ring->head) >= TRACE_RING_RECORD_COUNT) {
+        if (!trace_writer->running) {
+            drain_trace_rings(id); // writer is gone (exit or fork): write synchronously
+        } else {
+            request_trace_flush();
+            dr_thread_yield();
+        }
+    }
+
+    record = &ring->records[TRACE_RING_INDEX(position)];
+    record->sequence = (uint)dr_atomic_add32_return_sum((volatile int *)&trace_files[id].entry_count, 1) - 1;
+    record->word_count = word_count;
+    for (i = 0; i < word_count; i++)
+        record->words[i] = words[i];
+    TRACE_RING_PUBLISH(ring, position + 1);
+
+    if (orphan)
+        output_lock_release();
+    add_thread_metric(cstl, (id == graph_node_file) ? metric_nodes_committed : metric_edges_written,
+                      1);
+}
+
+static trace_ring_t *
+create_trace_ring() {
+    trace_ring_t *ring = (trace_ring_t *)CS_ALLOC(sizeof(trace_ring_t));
+    ring->head = 0U;
+    ring->tail = 0U;
+    ring->retired = false;
+    ring->next = NULL;
+    return ring;
+}
+
+static void
+start_trace_writer() {
+    trace_writer->exiting = false;
+    trace_writer->flush_requested = false;
+    trace_writer->running = dr_create_client_thread(trace_writer_thread, NULL);
+    if (!trace_writer->running)
+        CS_ERR("Failed to start the trace writer thread. Graph entries will be written at exit.\n");
+}
+
+/* Returns true once the writer thread has acknowledged its exit (or was never running). On
+ * timeout the writer is left running, since it may still be draining into the trace files. */
+static bool
+stop_trace_writer() {
+    uint waited = 0;
+
+    if (!trace_writer->running)
+        return true;
+
+    trace_writer->exiting = true;
+    while (trace_writer->running && (waited < TRACE_WRITER_EXIT_WAIT_MS)) {
+        dr_sleep(1);
+        waited++;
+    }
+    if (trace_writer->running) {
+        CS_WARN("Trace writer did not stop within %d ms; leaving the graph files open\n",
+                TRACE_WRITER_EXIT_WAIT_MS);
+        return false;
+    }
+    return true;
+}
+
+static void
+trace_writer_thread(void *arg) {
+    trace_file_id id;
+    bool drained;
+
+    while (!trace_writer->exiting) {
+        drained = false;
+        trace_writer->flush_requested = false;
+        for (id = 0; id < _trace_file_id_count; id++) {
+            if (trace_files[id].active && trace_files[id].threaded)
+                drained |= drain_trace_rings(id);
+        }
+        if (!drained && !trace_writer->flush_requested)
+            dr_sleep(TRACE_WRITER_INTERVAL_MS);
+    }
+    trace_writer->running = false;
+}
+
+static inline void
+write_drained_entry(trace_file_t *trace_file, uint64 data) {
+    if (trace_buffer_append(&trace_file->buffer, data))
+        flush_trace_buffer(trace_file);
+}
+
+/* Called from the trace writer, or from any thread once the writer has exited; the callers
+ * are serialized by `trace_ring_mutex`, which also covers the buffer flush. */
+static bool
+drain_trace_rings(trace_file_id id) {
+    bool drained;
+
+    dr_mutex_lock(trace_ring_mutex);
+    drained = merge_trace_rings(id);
+    dr_mutex_unlock(trace_ring_mutex);
+    return drained;
+}
+
+/* Merge the rings for `id` into the file in sequence order, stopping at the first sequence
+ * number that has been claimed but not yet published. Frees retired rings once empty. Once
+ * the file is closed, records are discarded so that appending threads are not stalled.
+ * Caller holds `trace_ring_mutex`. */
+static bool
+merge_trace_rings(trace_file_id id) {
+    trace_file_t *trace_file = &trace_files[id];
+    trace_ring_t *ring, **link;
+    trace_ring_record_t *record;
+    uint j, position, drained_count = 0;
+    bool progress = trace_file->active;
+
+    if (!progress) {
+        for (ring = trace_writer->rings[id]; ring != NULL; ring = ring->next)
+            ring->head = ring->tail;
+    }
+    while (progress) {
+        progress = false;
+        for (ring = trace_writer->rings[id]; ring != NULL; ring = ring->next) {
+            for (position = ring->head; position != ring->tail; position++) {
+                _ReadWriteBarrier();
+                record = &ring->records[TRACE_RING_INDEX(position)];
+                if (record->sequence != trace_file->next_sequence)
+                    break;
+                for (j = 0; j < record->word_count; j++)
+                    write_drained_entry(trace_file, record->words[j]);
+                trace_file->next_sequence++;
+                drained_count++;
+                progress = true;
+            }
+            ring->head = position;
+        }
+    }
+
+    link = &trace_writer->rings[id];
+    while (*link != NULL) {
+        ring = *link;
+        if (ring->retired && (ring->head == ring->tail)) {
+            *link = ring->next;
+            dr_global_free(ring, sizeof(trace_ring_t));
+        } else {
+            link = &ring->next;
+        }
+    }
+
+    if (drained_count > 0)
+        flush_trace_buffer(trace_file);
+
+    return drained_count > 0;
+}
+
+/* In a forked child, drop every record inherited from the parent (the parent writes them, along
+ * with the entries pending in its buffers) and restart the sequence, so a claimed but unpublished
+ * entry cannot stall the merge. */
+static void
+discard_trace_rings() {
+    trace_file_id id;
+    trace_ring_t *ring;
+
+    dr_mutex_lock(trace_ring_mutex);
+    for (id = 0; id < _trace_file_id_count; id++) {
+        if (!IS_THREADED_TRACE_FILE(id))
+            continue;
+        for (ring = trace_writer->rings[id]; ring != NULL; ring = ring->next)
+            ring->head = ring->tail;
+        if (trace_files[id].active && trace_files[id].buffered && !trace_files[id].mapped)
+            trace_files[id].buffer.position = 0U;
+        trace_files[id].entry_count = 0U;
+        trace_files[id].next_sequence = 0U;
+    }
+    dr_mutex_unlock(trace_ring_mutex);
+}
+
+static inline void
+request_trace_flush() {
+    trace_writer->flush_requested = true;
 }
 
 static inline bool
@@ -1665,17 +2302,31 @@ get_black_box_callout_ordinal(graph_edge_type edge_type) {
     }
 }
 
-static inline incoming_edge_t*
-create_pending_edge(app_pc from, byte exit_ordinal, graph_edge_type type, ushort module_instance_hash) {
-    incoming_edge_t *edge = (incoming_edge_t *)CS_ALLOC(sizeof(incoming_edge_t));
-    edge->from = from;
-    edge->exit_ordinal = exit_ordinal;
-    edge->type = type;
-    edge->module_instance_hash = module_instance_hash;
-    return edge;
+/* Called with the hashcode lock. Duplicates of a pending edge are dropped. */
+static void
+add_pending_incoming_edge(app_pc from, app_pc to, byte exit_ordinal, graph_edge_type type,
+    ushort module_instance_hash)
+{
+    incoming_edge_t edge;
+
+    edge.from = from;
+    edge.exit_ordinal = exit_ordinal;
+    edge.type = type;
+    edge.module_instance_hash = module_instance_hash;
+    if (pending_edge_table_add(pending_incoming_edges, to, &edge) &&
+        is_report_threshold(&pending_edge_report_mask, pending_incoming_edges->edges))
+        log_pending_edge_counters("growing");
 }
 
 static void
-free_incoming_edge(void *edge) {
-    dr_global_free(edge, sizeof(incoming_edge_t));
+log_pending_edge_counters(const char *when) {
+    pending_edge_table_t *table = pending_incoming_edges;
+
+    if (table == NULL)
+        return;
+
+    CS_LOG("Pending edges %s: %d edges to %d tags (peak %d edges); %lld added, %lld tags "
+           "committed, %d slab and %lld spill allocations\n", when, table->edges, table->sets,
+           table->peak_edges, table->added_edges, table->committed_sets, table->chunk_allocations,
+           table->spill_allocations);
 }
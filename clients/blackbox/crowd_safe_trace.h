@@ -25,11 +25,32 @@ enum trace_file_id {
      -block_hash:            { block_hash_file }
      -pair_hash:             { pair_hash_file }
      -bb_graph:              { module_file, graph_node_file, graph_edge_file, graph_cross_module_file }
+     -graph_map:             graph_node_file, graph_edge_file and graph_cross_module_file are written
+                             directly into a mapped view of the file (a crash may leave zero padding
+                             after the last entry, up to the end of the 4MB window)
+     -graph_compact:         the same three files are written as compact frames (crowd_safe_trace_frame.h)
+                             with extension .cdat, and -graph_map is ignored
      -netmon:                { module_file, network_monitor_file, call_stack_file }
      -xhash:                 { cross_module_hash_file }
      -bb_analysis_level > 0  { disassembly_file }
+
+   Buffered files start at -graph_buffer_kb (graph files) or -trace_buffer_kb (others), then grow
+   under a high write rate up to -trace_buffer_max_kb and shrink back when idle.
+
+   The meta header is the base of the main module, with the -hash_version of the block and chunk
+   hashes in its top byte (crowd_safe_block_hash.h), and NETWORK_TRACE_VERSION in the byte below.
+
+   Network trace version 2 (version 0 had 16-bit call stack ids, and stacks ended with a word
+   whose low half was 0):
+     network-monitor.dat  4 words per event: timestamp; call stack id | thread id << 32;
+                          payload length | socket id << 32; type, status, protocol, port and ip
+     call-stack.dat       one record per distinct stack, where the id is the record index:
+                          the frame count, then the 32-bit return addresses two per word
+                          (first in the low half, 0 in the high half of an odd last word)
 */
 
+#define NETWORK_TRACE_VERSION 2
+
 typedef struct instruction_trace_t instruction_trace_t;
 struct instruction_trace_t {
     app_pc tag;
@@ -42,6 +63,16 @@ struct instruction_trace_t {
 void
 init_crowd_safe_trace(bool isFork);
 
+/* Allocate the calling thread's private rings for the graph files. Entries appended
+ * to these rings are drained to disk by the trace writer thread, in order of their
+ * sequence number (which is also the entry index within the file). */
+void
+crowd_safe_trace_thread_init(crowd_safe_thread_local_t *cstl);
+
+/* Retire the calling thread's rings. The trace writer frees them once drained. */
+void
+crowd_safe_trace_thread_exit(crowd_safe_thread_local_t *cstl);
+
 void
 write_hash(bb_hash_t hash, trace_file_id file);
 
@@ -51,10 +82,11 @@ write_link(dcontext_t *dcontext, app_pc from, app_pc to, bb_state_t *from_state,
 
 void
 write_network_event(network_event_type_t type, network_event_status_t status, network_address_t *address,
-    network_protocol_t protocol, uint payload_length, ushort call_stack_id, ushort socket_id, uint thread_id,
+    network_protocol_t protocol, uint payload_length, uint call_stack_id, ushort socket_id, uint thread_id,
     uint64/*not a clock_type_t*/ timestamp);
 
-ushort
+/* Appends a new stack to call-stack.dat and returns its id. */
+uint
 write_call_stack(stack_frame_t *frames, uint frame_count);
 
 void
@@ -131,7 +163,8 @@ close_crowd_safe_trace();
 inline void
 output_lock_acquire() {
     extern void *output_mutex;
-    dr_mutex_lock(output_mutex);
+    if (!dr_mutex_trylock(output_mutex))
+        wait_for_mutex(output_mutex);
 }
 
 inline void
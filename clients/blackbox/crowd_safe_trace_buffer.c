@@ -0,0 +1,127 @@
+#include "crowd_safe_trace_buffer.h"
+
+/**** private prototypes ****/
+
+static ptr_int_t
+write_leading_words(trace_buffer_t *buffer, uint word_count);
+
+/**** public functions ****/
+
+void
+trace_buffer_init(trace_buffer_t *buffer, uint64 *entries, uint size, trace_sink_write_t write,
+                  void *sink)
+{
+    buffer->entries = entries;
+    buffer->position = 0U;
+    buffer->size = size;
+    buffer->write = write;
+    buffer->sink = sink;
+    buffer->stats.flush_count = 0U;
+    buffer->stats.resize_count = 0U;
+    buffer->stats.peak_fill = 0U;
+    buffer->stats.bytes_written = 0ULL;
+    buffer->frame_format.entry_words = 1;
+    buffer->frame_format.delta_mask = 0;
+    buffer->frame_column = 0;
+    buffer->frame = NULL;
+}
+
+void
+trace_buffer_set_frame(trace_buffer_t *buffer, trace_frame_format_t format, byte *frame) {
+    buffer->frame_format = format;
+    buffer->frame = frame;
+}
+
+void
+trace_buffer_resize(trace_buffer_t *buffer, uint64 *entries, uint size) {
+    if (buffer->position > 0)
+        memcpy(entries, buffer->entries, buffer->position * sizeof(uint64));
+    buffer->entries = entries;
+    buffer->size = size;
+    buffer->stats.resize_count++;
+}
+
+void
+trace_buffer_attach(trace_buffer_t *buffer, uint64 *entries, uint size) {
+    buffer->entries = entries;
+    buffer->position = 0U;
+    buffer->size = size;
+}
+
+void
+trace_buffer_commit(trace_buffer_t *buffer) {
+    if (buffer->position == 0)
+        return;
+
+    if (buffer->position > buffer->stats.peak_fill)
+        buffer->stats.peak_fill = buffer->position;
+    buffer->stats.flush_count++;
+    buffer->stats.bytes_written += trace_buffer_pending_bytes(buffer);
+    buffer->position = 0U;
+}
+
+ptr_int_t
+trace_buffer_flush(trace_buffer_t *buffer) {
+    return write_leading_words(buffer, trace_buffer_flushable_words(buffer));
+}
+
+ptr_int_t
+trace_buffer_finish(trace_buffer_t *buffer) {
+    return write_leading_words(buffer, buffer->position);
+}
+
+/**** private functions ****/
+
+/* Writes the first `word_count` pending words, one frame at a time if the buffer is compact,
+ * and moves the remaining words to the front. Stops at the first frame the sink does not take
+ * completely, which stays pending with everything after it. */
+static ptr_int_t
+write_leading_words(trace_buffer_t *buffer, uint word_count) {
+    uint written = 0U, chunk;
+    size_t chunk_bytes;
+    const void *output;
+    ptr_int_t output_bytes, total_bytes = 0;
+
+    if (word_count == 0)
+        return 0;
+
+    if (buffer->position > buffer->stats.peak_fill)
+        buffer->stats.peak_fill = buffer->position;
+
+    while (written < word_count) {
+        if (buffer->frame == NULL) {
+            chunk = word_count;
+            chunk_bytes = chunk * sizeof(uint64);
+            output = buffer->entries;
+        } else {
+            chunk = word_count - written;
+            if (chunk > TRACE_FRAME_WORDS(buffer->frame_format))
+                chunk = TRACE_FRAME_WORDS(buffer->frame_format);
+            chunk_bytes = trace_frame_encode(buffer->frame_format, buffer->frame_column,
+                                             buffer->entries + written, chunk, buffer->frame);
+            output = buffer->frame;
+        }
+
+        output_bytes = buffer->write(buffer->sink, output, chunk_bytes);
+        if (output_bytes < 0) {
+            total_bytes = output_bytes;
+            break;
+        }
+        buffer->stats.bytes_written += (uint64) output_bytes;
+        total_bytes += output_bytes;
+        if (output_bytes != (ptr_int_t) chunk_bytes)
+            break;
+
+        buffer->frame_column = (byte) ((buffer->frame_column + chunk) %
+                                       buffer->frame_format.entry_words);
+        written += chunk;
+    }
+    buffer->stats.flush_count++;
+
+    if (written > 0) {
+        buffer->position -= written;
+        if (buffer->position > 0)
+            memmove(buffer->entries, buffer->entries + written, buffer->position * sizeof(uint64));
+    }
+    return total_bytes;
+}
@@ -0,0 +1,120 @@
+#ifndef CROWD_SAFE_TRACE_BUFFER_H
+#define CROWD_SAFE_TRACE_BUFFER_H 1
+
+/* Buffering and entry encoding for the trace files. This module depends on neither DR nor
+ * Win32, so it can be built and benchmarked on any host by defining CROWD_SAFE_PORTABLE.
+ * Buffers with a frame format write compact frames (see crowd_safe_trace_frame.h). */
+
+#include "crowd_safe_trace_frame.h"
+
+/* Writes `size` bytes to the sink. Returns the number of bytes written, or a negative error
+ * code (same convention as dr_write_file). */
+typedef ptr_int_t (*trace_sink_write_t)(void *sink, const void *data, size_t size);
+
+typedef struct trace_buffer_stats_t trace_buffer_stats_t;
+struct trace_buffer_stats_t {
+    uint flush_count;
+    uint resize_count;
+    uint peak_fill;     // most entries pending at any flush
+    uint64 bytes_written;
+};
+
+typedef struct trace_buffer_t trace_buffer_t;
+struct trace_buffer_t {
+    uint64 *entries;
+    uint position; // step of 1 per sizeof(uint64)
+    uint size;
+    trace_sink_write_t write;
+    void *sink;
+    trace_buffer_stats_t stats;
+    trace_frame_format_t frame_format;
+    byte frame_column; // column of entries[0] within its entry
+    byte *frame;       // NULL for raw output, else encoding space for one frame
+};
+
+/**** public functions ****/
+
+void
+trace_buffer_init(trace_buffer_t *buffer, uint64 *entries, uint size, trace_sink_write_t write,
+                  void *sink);
+
+/* Writes the pending entries to the sink and returns the sink result. A compact buffer only
+ * writes whole frames of TRACE_FRAME_WORDS() and keeps the rest pending for a later frame (see
+ * trace_buffer_flushable_words()). Entries leave the buffer only when the sink took all of
+ * their bytes. */
+ptr_int_t
+trace_buffer_flush(trace_buffer_t *buffer);
+
+/* Like trace_buffer_flush(), but also writes the entries short of a whole frame as a last,
+ * shorter frame. For closing the file. */
+ptr_int_t
+trace_buffer_finish(trace_buffer_t *buffer);
+
+/* Replaces the entry storage, moving the pending entries (at most `size`) to the new storage;
+ * the caller frees the old storage. */
+void
+trace_buffer_resize(trace_buffer_t *buffer, uint64 *entries, uint size);
+
+/* Switches the buffer to compact frames. `frame` must hold
+ * TRACE_FRAME_MAX_BYTES(TRACE_FRAME_WORDS(format)), and the buffer must hold at least
+ * TRACE_FRAME_WORDS(format) entries through every resize. */
+void
+trace_buffer_set_frame(trace_buffer_t *buffer, trace_frame_format_t format, byte *frame);
+
+/* Points the buffer at entry storage owned by the caller, such as a file mapping, without
+ * counting a resize. Any pending entries are dropped. */
+void
+trace_buffer_attach(trace_buffer_t *buffer, uint64 *entries, uint size);
+
+/* Counts the pending entries as written without passing them to the sink, for storage that
+ * is already part of the file. Empties the buffer. */
+void
+trace_buffer_commit(trace_buffer_t *buffer);
+
+static inline size_t
+trace_buffer_pending_bytes(trace_buffer_t *buffer) {
+    return buffer->position * sizeof(uint64);
+}
+
+/* Returns the number of pending entries that trace_buffer_flush() would write. */
+static inline uint
+trace_buffer_flushable_words(trace_buffer_t *buffer) {
+    uint frame_words;
+
+    if (buffer->frame == NULL)
+        return buffer->position;
+    frame_words = TRACE_FRAME_WORDS(buffer->frame_format);
+    return buffer->position - (buffer->position % frame_words);
+}
+
+/* Returns true when the buffer is full and must be flushed before the next append. */
+static inline bool
+trace_buffer_append(trace_buffer_t *buffer, uint64 data) {
+    buffer->entries[buffer->position++] = data;
+    return buffer->position == buffer->size;
+}
+
+/**** entry encoding ****/
+
+/* Node tag: bytes 0-5 are the block tag, byte 6 is the meta type and byte 7 the tag version. */
+static inline uint64
+trace_encode_node_tag(ptr_uint_t tag, byte meta_type, byte tag_version) {
+    return (((uint64) tag) & 0xffffffffffffULL) | (((uint64) meta_type) << 0x30) |
+        (((uint64) tag_version) << 0x38);
+}
+
+/* Edge source: bytes 0-4 are the block tag, byte 5 is the exit ordinal, byte 6 the edge type
+ * and byte 7 the tag version. */
+static inline uint64
+trace_encode_edge_from_tag(ptr_uint_t from, byte exit_ordinal, byte edge_type, byte tag_version) {
+    return (((uint64) from) & 0xffffffffffULL) | (((uint64) exit_ordinal) << 0x28) |
+        (((uint64) edge_type) << 0x30) | (((uint64) tag_version) << 0x38);
+}
+
+/* Edge target: bytes 0-6 are the block tag and byte 7 is the tag version. */
+static inline uint64
+trace_encode_edge_to_tag(ptr_uint_t to, byte tag_version) {
+    return (((uint64) to) & 0xffffffffffffffULL) | (((uint64) tag_version) << 0x38);
+}
+
+#endif
@@ -0,0 +1,135 @@
+#include "crowd_safe_trace_frame.h"
+
+#define ZIGZAG_ENCODE(delta) ((((uint64) (delta)) << 1) ^ ((uint64) ((delta) >> 63)))
+#define ZIGZAG_DECODE(value) ((uint64) (((value) >> 1) ^ (~((value) & 1) + 1)))
+
+/**** private prototypes ****/
+
+static inline void
+write_uint32(byte *out, uint value);
+
+static inline uint
+read_uint32(const byte *in);
+
+/**** public functions ****/
+
+size_t
+trace_frame_encode(trace_frame_format_t format, byte first_column, const uint64 *words,
+                   uint word_count, byte *frame)
+{
+    uint64 previous[TRACE_FRAME_MAX_COLUMNS] = {0};
+    byte *out = frame + TRACE_FRAME_HEADER_SIZE;
+    byte column = first_column;
+    uint i, j;
+
+    for (i = 0; i < word_count; i++) {
+        uint64 word = words[i];
+
+        if (format.delta_mask & (1 << column)) {
+            uint64 value = ZIGZAG_ENCODE((int64) (word - previous[column]));
+
+            previous[column] = word;
+            while (value >= 0x80) {
+                *out++ = (byte) (value | 0x80);
+                value >>= 7;
+            }
+            *out++ = (byte) value;
+        } else {
+            for (j = 0; j < 8; j++)
+                *out++ = (byte) (word >> (j * 8));
+        }
+
+        if (++column == format.entry_words)
+            column = 0;
+    }
+
+    write_uint32(frame, TRACE_FRAME_MAGIC);
+    frame[4] = TRACE_FRAME_VERSION;
+    frame[5] = format.entry_words;
+    frame[6] = format.delta_mask;
+    frame[7] = first_column;
+    write_uint32(frame + 8, word_count);
+    write_uint32(frame + 12, (uint) (out - (frame + TRACE_FRAME_HEADER_SIZE)));
+    return out - frame;
+}
+
+size_t
+trace_frame_size(const byte *header) {
+    if ((read_uint32(header) != TRACE_FRAME_MAGIC) || (header[4] != TRACE_FRAME_VERSION))
+        return 0;
+    return TRACE_FRAME_HEADER_SIZE + read_uint32(header + 12);
+}
+
+uint
+trace_frame_word_count(const byte *header) {
+    return read_uint32(header + 8);
+}
+
+size_t
+trace_frame_decode(const byte *frame, size_t available, uint64 *words) {
+    uint64 previous[TRACE_FRAME_MAX_COLUMNS] = {0};
+    trace_frame_format_t format;
+    const byte *in, *end;
+    size_t frame_size;
+    uint i, j, word_count;
+    byte column;
+
+    if (available < TRACE_FRAME_HEADER_SIZE)
+        return 0;
+    frame_size = trace_frame_size(frame);
+    if ((frame_size == 0) || (frame_size > available))
+        return 0;
+
+    format.entry_words = frame[5];
+    format.delta_mask = frame[6];
+    column = frame[7];
+    word_count = trace_frame_word_count(frame);
+    if ((format.entry_words == 0) || (format.entry_words > TRACE_FRAME_MAX_COLUMNS) ||
+        (column >= format.entry_words))
+        return 0;
+
+    in = frame + TRACE_FRAME_HEADER_SIZE;
+    end = frame + frame_size;
+    for (i = 0; i < word_count; i++) {
+        uint64 word = 0;
+
+        if (format.delta_mask & (1 << column)) {
+            uint shift = 0;
+            uint64 value = 0;
+
+            do {
+                if ((in == end) || (shift > 63))
+                    return 0;
+                value |= ((uint64) (*in & 0x7f)) << shift;
+                shift += 7;
+            } while (*in++ & 0x80);
+            word = previous[column] + ZIGZAG_DECODE(value);
+            previous[column] = word;
+        } else {
+            if ((end - in) < 8)
+                return 0;
+            for (j = 0; j < 8; j++)
+                word |= ((uint64) *in++) << (j * 8);
+        }
+        words[i] = word;
+
+        if (++column == format.entry_words)
+            column = 0;
+    }
+    return (in == end) ? frame_size : 0;
+}
+
+/**** private functions ****/
+
+static inline void
+write_uint32(byte *out, uint value) {
+    out[0] = (byte) value;
+    out[1] = (byte) (value >> 8);
+    out[2] = (byte) (value >> 0x10);
+    out[3] = (byte) (value >> 0x18);
+}
+
+static inline uint
+read_uint32(const byte *in) {
+    return ((uint) in[0]) | (((uint) in[1]) << 8) | (((uint) in[2]) << 0x10) | (((uint) in[3]) << 0x18);
+}
@@ -0,0 +1,62 @@
+#ifndef CROWD_SAFE_TRACE_FRAME_H
+#define CROWD_SAFE_TRACE_FRAME_H 1
+
+/* Compact frame format for the graph files, and its reference decoder. Like the trace buffer,
+ * this module is portable when built with CROWD_SAFE_PORTABLE.
+
+   A compact file is a sequence of independent frames, each holding TRACE_FRAME_ENTRY_COUNT
+   entries, except the last frame of a file which may be shorter. Frames are cut by entry count
+   rather than at buffer flushes, so the framing does not depend on flush timing. Entries are `entry_words` wide, and each word sits in a column. Columns
+   selected by `delta_mask` are stored as the zigzag varint of the difference from the same
+   column of the previous entry in the frame; the others are stored as 8 little-endian bytes.
+   Delta state starts from zero in every frame. The header is 16 bytes, little-endian:
+
+     uint32 magic ("BBGF")
+     byte   version
+     byte   entry_words
+     byte   delta_mask
+     byte   first_column  (column of the first word, since frames may split an entry)
+     uint32 word_count
+     uint32 payload_bytes
+*/
+
+#include "crowd_safe_portable.h"
+
+#define TRACE_FRAME_MAGIC 0x46474242U // "BBGF"
+#define TRACE_FRAME_VERSION 1
+#define TRACE_FRAME_HEADER_SIZE 16
+#define TRACE_FRAME_MAX_COLUMNS 8
+#define TRACE_FRAME_MAX_BYTES(word_count) (TRACE_FRAME_HEADER_SIZE + ((word_count) * 10))
+#define TRACE_FRAME_ENTRY_COUNT 0x400
+#define TRACE_FRAME_WORDS(format) (((uint) (format).entry_words) * TRACE_FRAME_ENTRY_COUNT)
+
+typedef struct trace_frame_format_t trace_frame_format_t;
+struct trace_frame_format_t {
+    byte entry_words; // 2 for nodes and edges, 3 for cross-module edges
+    byte delta_mask;  // bit n: column n is delta-encoded
+};
+
+/**** public functions ****/
+
+/* Encodes `word_count` words into `frame`, which must hold TRACE_FRAME_MAX_BYTES(word_count).
+ * Returns the frame size in bytes. */
+size_t
+trace_frame_encode(trace_frame_format_t format, byte first_column, const uint64 *words,
+                   uint word_count, byte *frame);
+
+/* Returns the total size of the frame starting with `header` (TRACE_FRAME_HEADER_SIZE bytes),
+ * or 0 if the header is not a frame of a supported version. */
+size_t
+trace_frame_size(const byte *header);
+
+/* Returns the number of words in the frame starting with `header`. */
+uint
+trace_frame_word_count(const byte *header);
+
+/* Decodes the frame at `frame` (at most `available` bytes) into `words`, which must hold
+ * trace_frame_word_count() words. Returns the frame size, or 0 if the frame is malformed
+ * or truncated. */
+size_t
+trace_frame_decode(const byte *frame, size_t available, uint64 *words);
+
+#endif
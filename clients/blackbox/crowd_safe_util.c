@@ -27,16 +27,19 @@ extern const char *monitor_dataset_dir;
 
 static const char *CROWD_SAFE_HASHLOG_DIR = "CROWD_SAFE_HASHLOG_DIR";
 static const char *CROWD_SAFE_DATASET_DIR = "CROWD_SAFE_DATASET_DIR";
+static const char *CROWD_SAFE_XHASH_CACHE_DIR = "CROWD_SAFE_XHASH_CACHE_DIR";
 #ifdef UNIX
 static const char FILE_SEPARATOR_CHAR = '/';
 static const char *FILE_SEPARATOR_STRING = "/";
 static const char *DEFAULT_HASHLOG_DIRECTORY = "./";
 static const char *DEFAULT_DATASET_DIRECTORY = "./";
+static const char *DEFAULT_XHASH_CACHE_DIRECTORY = "./xhash-cache";
 #elif defined WINDOWS
 static const char FILE_SEPARATOR_CHAR = '\\';
 static const char *FILE_SEPARATOR_STRING = "\\";
 static const char *DEFAULT_HASHLOG_DIRECTORY = "c:\\Users\\b\\AppData\\LocalLow\\hashlog";
 static const char *DEFAULT_DATASET_DIRECTORY = "c:\\Users\\b\\AppData\\LocalLow\\hashlog\\monitor";
+static const char *DEFAULT_XHASH_CACHE_DIRECTORY = "c:\\Users\\b\\AppData\\LocalLow\\hashlog\\xhash-cache";
 #endif
 
 #define ENV_DYNAMORIO_HOME "DYNAMORIO_HOME"
@@ -48,6 +51,8 @@ static size_t application_short_name_length;
 
 static char hashlog_dir[64] = {0};
 
+static char xhash_cache_dir[256] = {0};
+
 /* tweaked for traces?
 static const uint stack_spy_sysnums_x86[] = // { [0x1F..0]U, [0x3F..0x20]U, [0x5F..0x40]U, etc. }
     { 0xffffbfffU, 0xfffbffcfU, 0xffffffffU, 0xff6ffffbU, 0xfffe56ffU, 0xffffffffU, 0xcbffffffU, 0xb948d564U,
@@ -149,13 +154,15 @@ static memory_tracker_t *memory_tracker;
 #include "../drcontainers/drvectorx.h"
 
 #define CALL_STACK_NEW_BYTE_SIZE(frame_count) \
-    (sizeof(stack_frame_t) + ((frame_count - 1) * sizeof(app_pc)))
+    (sizeof(call_stack_t) + ((frame_count) * sizeof(app_pc))) // (one spare, for frame_count == 0)
 #define CALL_STACK_BYTE_SIZE(stack) CALL_STACK_NEW_BYTE_SIZE(stack->frame_count)
 
+/* An interned call stack, keyed in the call_stack_table by the hash of its return addresses.
+ * Stacks whose hashes collide are keyed at the next free hash value. */
 typedef struct _call_stack_t {
-    ushort id;
+    uint id; // index of the stack in call-stack.dat
     uint64 hash;
-    ushort frame_count;
+    uint frame_count;
     app_pc frames[1];
 } call_stack_t;
 
@@ -254,6 +261,12 @@ init_application_short_name();
 static void
 call_stack_delete(call_stack_t *call_stack);
 
+static inline uint64
+hash_call_stack(stack_frame_t *frames, uint frame_count);
+
+static inline bool
+is_same_call_stack(call_stack_t *stack, stack_frame_t *frames, uint frame_count);
+
 /**** Public Functions ****/
 
 void
@@ -270,6 +283,8 @@ init_crowd_safe_log(bool is_fork, bool is_wow64_process) {
 #endif
     } else {
         load_environment_dir((char*)&hashlog_dir, CROWD_SAFE_HASHLOG_DIR, DEFAULT_HASHLOG_DIRECTORY);
+        load_environment_dir((char*)&xhash_cache_dir, CROWD_SAFE_XHASH_CACHE_DIR,
+                             DEFAULT_XHASH_CACHE_DIRECTORY);
 
         parent_process_id = (int)dr_get_process_id();
     }
@@ -639,36 +654,41 @@ get_app_stacktrace(dcontext_t *dcontext, uint max_frames, stack_frame_t *frames)
     return f;
 }
 
-ushort
+uint
 observe_call_stack(dcontext_t *dcontext)
 {
-    uint64 hash = 0ULL;
+    uint id;
     call_stack_t *matching_stack;
     stack_frame_t appstack[MAX_APP_STACK_FRAMES];
     uint f, frame_count = get_app_stacktrace(dcontext, MAX_APP_STACK_FRAMES, appstack);
+    uint64 hash = hash_call_stack(appstack, frame_count);
 
     CALL_STACK_LOCK;
-    for (f = 0; f < frame_count; f++)
-        hash = hash ^ (hash << 5) ^ (uint) appstack[f].return_address;
+    while (true) {
+        matching_stack = (call_stack_t *) call_stack_table_lookup(call_stack_table, hash);
+        if (matching_stack == NULL || is_same_call_stack(matching_stack, appstack, frame_count))
+            break;
+        CS_DET("Call stack hash collision at 0x%llx\n", hash);
+        hash++;
+    }
 
-    matching_stack = (call_stack_t *) call_stack_table_lookup(call_stack_table, hash);
     if (matching_stack == NULL) {
-        ushort id = write_call_stack(appstack, frame_count);
-
         CS_DET("Created new call stack for hash 0x%llx\n", hash);
 
         matching_stack = CS_ALLOC(CALL_STACK_NEW_BYTE_SIZE(frame_count));
-        matching_stack->id = id;
+        matching_stack->id = write_call_stack(appstack, frame_count);
         matching_stack->hash = hash;
-        matching_stack->frame_count = (ushort) frame_count;
-        memcpy(matching_stack->frames, appstack, sizeof(app_pc) * frame_count);
+        matching_stack->frame_count = frame_count;
+        for (f = 0; f < frame_count; f++)
+            matching_stack->frames[f] = appstack[f].return_address;
         call_stack_table_add(call_stack_table, hash, matching_stack);
     } else {
         CS_DET("Found call stack for hash 0x%llx\n", hash);
     }
+    id = matching_stack->id;
     CALL_STACK_UNLOCK;
 
-    return matching_stack->id;
+    return id;
 }
 
 /*
@@ -729,23 +749,40 @@ generate_filename(char *buffer, const char *basename, const char *suffix) {
         parent_process_id, dr_get_process_id(), suffix);
 }
 
-file_t
-create_output_file(const char *filename) {
-    file_t result;
-    CROWD_SAFE_DEBUG_HOOK(__FUNCTION__, (file_t)0x0);
+const char *
+get_xhash_cache_dir() {
+    return xhash_cache_dir;
+}
+
+static file_t
+open_output_file(const char *filename, uint mode_flags) {
+    file_t result = dr_open_file(filename, mode_flags);
 
-    result = dr_open_file(filename, DR_FILE_WRITE_REQUIRE_NEW);
     if (result == INVALID_FILE) {
         if (dr_file_exists(filename))
-            dr_fprintf(STDERR, "Error: unable to create file %s because it already exists!\n");
+            dr_fprintf(STDERR, "Error: unable to create file %s because it already exists!\n", filename);
         else
-            dr_fprintf(STDERR, "Error: unable to create file %s!\n");
+            dr_fprintf(STDERR, "Error: unable to create file %s!\n", filename);
     }
 
     CS_LOG("Created Crowd-Safe output file %s\n", filename);
     return result;
 }
 
+file_t
+create_output_file(const char *filename) {
+    CROWD_SAFE_DEBUG_HOOK(__FUNCTION__, (file_t)0x0);
+
+    return open_output_file(filename, DR_FILE_WRITE_REQUIRE_NEW);
+}
+
+file_t
+create_mappable_output_file(const char *filename) {
+    CROWD_SAFE_DEBUG_HOOK(__FUNCTION__, (file_t)0x0);
+
+    return open_output_file(filename, DR_FILE_READ | DR_FILE_WRITE_REQUIRE_NEW);
+}
+
 static void
 print_shadow_stack_internal(const char *tag, int frame_number, shadow_stack_frame_t *top) {
     int i;
@@ -1267,3 +1304,33 @@ call_stack_delete(call_stack_t *call_stack)
 {
     dr_global_free(call_stack, CALL_STACK_BYTE_SIZE(call_stack));
 }
+
+/* Rolling FNV-1a over the return addresses. The low bits select the table bucket, so every
+ * address has to reach them. */
+static inline uint64
+hash_call_stack(stack_frame_t *frames, uint frame_count)
+{
+    uint64 hash = 0xcbf29ce484222325ULL ^ frame_count;
+    uint f;
+
+    for (f = 0; f < frame_count; f++) {
+        hash ^= (uint64) p2int(frames[f].return_address);
+        hash *= 0x100000001b3ULL;
+        hash ^= (hash >> 0x20);
+    }
+    return hash;
+}
+
+static inline bool
+is_same_call_stack(call_stack_t *stack, stack_frame_t *frames, uint frame_count)
+{
+    uint f;
+
+    if (stack->frame_count != frame_count)
+        return false;
+    for (f = 0; f < frame_count; f++) {
+        if (stack->frames[f] != frames[f].return_address)
+            return false;
+    }
+    return true;
+}
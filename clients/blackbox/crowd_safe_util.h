@@ -144,6 +144,9 @@ typedef uint clock_type_t;
 #define CROWD_SAFE_RECORD_XHASH_OPTION 0x10
 #define CROWD_SAFE_DEBUG_SCRIPT_OPTION 0x20
 #define CROWD_SAFE_BB_ANALYSIS_OPTION 0x40
+#define CROWD_SAFE_MAP_GRAPH_OPTION 0x80
+#define CROWD_SAFE_COMPACT_GRAPH_OPTION 0x100
+#define CROWD_SAFE_UIBP_EXACT_OPTION 0x200
 #define CROWD_SAFE_MONITOR() is_crowd_safe_option_active(CROWD_SAFE_MONITOR_OPTION)
 #define CROWD_SAFE_ALARM() is_crowd_safe_option_active(CROWD_SAFE_ALARM_OPTION)
 #define CROWD_SAFE_NETWORK_MONITOR() is_crowd_safe_option_active(CROWD_SAFE_NETWORK_MONITOR_OPTION)
@@ -151,6 +154,9 @@ typedef uint clock_type_t;
 #define CROWD_SAFE_RECORD_XHASH() is_crowd_safe_option_active(CROWD_SAFE_RECORD_XHASH_OPTION)
 #define CROWD_SAFE_DEBUG_SCRIPT() is_crowd_safe_option_active(CROWD_SAFE_DEBUG_SCRIPT_OPTION)
 #define CROWD_SAFE_BB_ANALYSIS() is_crowd_safe_option_active(CROWD_SAFE_BB_ANALYSIS_OPTION)
+#define CROWD_SAFE_MAP_GRAPH() is_crowd_safe_option_active(CROWD_SAFE_MAP_GRAPH_OPTION)
+#define CROWD_SAFE_COMPACT_GRAPH() is_crowd_safe_option_active(CROWD_SAFE_COMPACT_GRAPH_OPTION)
+#define CROWD_SAFE_UIBP_EXACT() is_crowd_safe_option_active(CROWD_SAFE_UIBP_EXACT_OPTION)
 
 // CS-TODO: verify correctness of big/little endianness
 #ifndef __BYTE_ORDER
@@ -630,6 +636,15 @@ typedef struct _return_address_iterator_t {
     bool is_complete;
 } return_address_iterator_t;
 
+/* Per-thread trace output rings, owned by crowd_safe_trace.c */
+typedef struct trace_thread_buffers_t trace_thread_buffers_t;
+
+/* Per-thread metric counters, owned by crowd_safe_metrics.c */
+typedef struct thread_metrics_t thread_metrics_t;
+
+/* Per-thread probe histograms, owned by crowd_safe_probes.c */
+typedef struct thread_probes_t thread_probes_t;
+
 typedef struct crowd_safe_thread_local_t crowd_safe_thread_local_t;
 struct crowd_safe_thread_local_t {
     local_security_audit_state_t *csd;
@@ -647,6 +662,9 @@ struct crowd_safe_thread_local_t {
     stack_suspicion_t stack_suspicion;
 #endif
     return_address_iterator_t *stack_walk;
+    trace_thread_buffers_t *trace_buffers;
+    thread_metrics_t *metrics;
+    thread_probes_t *probes;
 };
 
 typedef struct anonymous_black_box_t anonymous_black_box_t;
@@ -734,7 +752,8 @@ current_thread_id();
 uint
 get_app_stacktrace(dcontext_t *dcontext, uint max_frames, stack_frame_t *frames);
 
-ushort
+/* Returns the id of the current app call stack, writing it to call-stack.dat if it is new. */
+uint
 observe_call_stack(dcontext_t *dcontext);
 
 void
@@ -761,6 +780,14 @@ generate_filename(char *buffer, const char *basename, const char *suffix);
 file_t
 create_output_file(const char *filename);
 
+/* Also opens the file for reading, which a writable view (dr_map_file) requires on Windows. */
+file_t
+create_mappable_output_file(const char *filename);
+
+/* Directory of the xhash cache, from $CROWD_SAFE_XHASH_CACHE_DIR, ending in a separator. */
+const char *
+get_xhash_cache_dir();
+
 void
 print_shadow_stack(dcontext_t *dcontext);
 
@@ -774,6 +801,11 @@ close_crowd_safe_util();
 void
 close_crowd_safe_log();
 
+/* Locks a mutex that another thread holds, counting the wait as metric_lock_wait_kcycles
+ * (defined in crowd_safe_metrics.c). */
+void
+wait_for_mutex(void *mutex);
+
 /******** inline definitions **********/
 
 inline void
@@ -803,7 +835,8 @@ hashcode_lock_acquire() {
     extern void *output_mutex;
     CROWD_SAFE_DEBUG_HOOK_VOID(__FUNCTION__);
 
-    dr_mutex_lock(hashcode_mutex);
+    if (!dr_mutex_trylock(hashcode_mutex))
+        wait_for_mutex(hashcode_mutex);
     ASSERT(!dr_mutex_self_owns(output_mutex));
 }
 
@@ -971,9 +1004,15 @@ wstring_hash(const wchar_t *string) {
     return hash;
 }
 
+inline void
+print_callback_function_id_by_name(char *buffer, size_t length, const char *module_name,
+                                   size_t offset) {
+    dr_snprintf(buffer, length, "%s!@%x", module_name, offset);
+}
+
 inline void
 print_callback_function_id(char *buffer, size_t length, module_location_t *module, size_t offset) {
-    dr_snprintf(buffer, length, "%s!@%x", module->module_name, offset);
+    print_callback_function_id_by_name(buffer, length, module->module_name, offset);
 }
 
 inline void
@@ -0,0 +1,516 @@
+/* Blackbox monitor dataset compiler standalone app. */
+
+/* Appends the search index described in crowd_safe_dataset.h to a monitor dataset: an
+ * Eytzinger tree over the relative tags of each module, and a hashed directory of module
+ * names. The original layout is copied unchanged (a dataset that was already compiled is
+ * recompiled from its original part), and every lookup of the new index is checked against
+ * the sorted index before the output is written.
+ *
+ *   dataset_compile <dataset> <output>
+ *   dataset_compile -bench <dataset>             time both lookups over a (compiled) dataset
+ *   dataset_compile -synthetic <modules> <blocks> [-bench | <output>]
+ *                                                compile and check a generated dataset of
+ *                                                this shape, then time it or write it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WINDOWS
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "crowd_safe_dataset.h"
+
+#define BENCH_LOOKUPS 4000000
+#define SYNTHETIC_DUPLICATE_PERCENT 10
+#define SYNTHETIC_BB_SIZE 0x10
+
+typedef struct buffer_t buffer_t;
+struct buffer_t {
+    byte *bytes;
+    size_t size;
+    size_t capacity;
+};
+
+/**** private prototypes ****/
+
+static int
+usage(const char *msg);
+
+static uint64
+now_nanos();
+
+static void
+append(buffer_t *buffer, const void *bytes, size_t size);
+
+static uint
+align(buffer_t *buffer);
+
+static bool
+read_dataset(const char *path, buffer_t *dataset);
+
+static bool
+write_dataset(const char *path, buffer_t *dataset);
+
+static void
+generate_dataset(buffer_t *dataset, uint module_count, uint block_count);
+
+static bool
+check_original(buffer_t *dataset, uint *module_count);
+
+static bool
+compile_dataset(buffer_t *dataset);
+
+static uint
+verify_dataset(buffer_t *dataset);
+
+static void
+bench_dataset(buffer_t *dataset);
+
+/**** public functions ****/
+
+int
+main(int argc, char **argv) {
+    buffer_t dataset = { NULL, 0, 0 };
+    const char *output = NULL;
+    bool bench = false;
+    uint failures;
+
+    if (argc >= 4 && strcmp(argv[1], "-synthetic") == 0) {
+        uint module_count = (uint) strtoul(argv[2], NULL, 0);
+        uint block_count = (uint) strtoul(argv[3], NULL, 0);
+
+        if (module_count == 0 || block_count == 0)
+            return usage("need at least one module and one block");
+        if (argc > 4 && strcmp(argv[4], "-bench") == 0)
+            bench = true;
+        else if (argc > 4)
+            output = argv[4];
+        generate_dataset(&dataset, module_count, block_count);
+        if (!compile_dataset(&dataset))
+            return 1;
+    } else if (argc == 3 && strcmp(argv[1], "-bench") == 0) {
+        bench = true;
+        if (!read_dataset(argv[2], &dataset) || !compile_dataset(&dataset))
+            return 1;
+    } else if (argc == 3 && argv[1][0] != '-') {
+        output = argv[2];
+        if (!read_dataset(argv[1], &dataset) || !compile_dataset(&dataset))
+            return 1;
+    } else {
+        return usage("");
+    }
+
+    failures = verify_dataset(&dataset);
+    if (failures > 0) {
+        fprintf(stderr, "The compiled index disagrees with the sorted index in %u lookups\n",
+                failures);
+        return 1;
+    }
+    if (bench)
+        bench_dataset(&dataset);
+    else if (output != NULL && !write_dataset(output, &dataset))
+        return 1;
+
+    free(dataset.bytes);
+    return 0;
+}
+
+/**** private functions ****/
+
+static int
+usage(const char *msg) {
+    if (msg != NULL && msg[0] != '\0')
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "usage: dataset_compile <dataset> <output>\n"
+            "       dataset_compile -bench <dataset>\n"
+            "       dataset_compile -synthetic <modules> <blocks> [-bench | <output>]\n");
+    return 1;
+}
+
+static uint64
+now_nanos() {
+#ifdef WINDOWS
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64) ((count.QuadPart * 1000000000.0) / frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (((uint64) now.tv_sec) * 1000000000ULL) + now.tv_nsec;
+#endif
+}
+
+static inline uint64
+next_random(uint64 *state) {
+    uint64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void
+append(buffer_t *buffer, const void *bytes, size_t size) {
+    if ((buffer->size + size) > buffer->capacity) {
+        while ((buffer->size + size) > buffer->capacity)
+            buffer->capacity = (buffer->capacity == 0) ? 0x10000 : buffer->capacity * 2;
+        buffer->bytes = (byte *) realloc(buffer->bytes, buffer->capacity);
+        if (buffer->bytes == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    if (bytes == NULL)
+        memset(buffer->bytes + buffer->size, 0, size);
+    else
+        memcpy(buffer->bytes + buffer->size, bytes, size);
+    buffer->size += size;
+}
+
+/* Pads the buffer to the section alignment and returns the offset of the next section. */
+static uint
+align(buffer_t *buffer) {
+    size_t padding = (DATASET_SECTION_ALIGNMENT - (buffer->size % DATASET_SECTION_ALIGNMENT)) %
+        DATASET_SECTION_ALIGNMENT;
+
+    append(buffer, NULL, padding);
+    return (uint) buffer->size;
+}
+
+static bool
+read_dataset(const char *path, buffer_t *dataset) {
+    FILE *file = fopen(path, "rb");
+    byte chunk[0x10000];
+    size_t count;
+
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return false;
+    }
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        append(dataset, chunk, count);
+    fclose(file);
+    return true;
+}
+
+static bool
+write_dataset(const char *path, buffer_t *dataset) {
+    FILE *file = fopen(path, "wb");
+    bool success;
+
+    if (file == NULL) {
+        fprintf(stderr, "Failed to create %s\n", path);
+        return false;
+    }
+    success = (fwrite(dataset->bytes, 1, dataset->size, file) == dataset->size);
+    success = (fclose(file) == 0) && success;
+    if (!success)
+        fprintf(stderr, "Failed to write %s\n", path);
+    return success;
+}
+
+/* Lays out the directory, names and sorted indexes of the original format. Every index entry
+ * points at the same placeholder block, since only the lookups are checked. */
+static void
+generate_dataset(buffer_t *dataset, uint module_count, uint block_count) {
+    uint64 random_state = 0x2545f4914f6cdd1dULL;
+    module_dataset_t *directory;
+    char name[64];
+    uint i, j, names_offset = module_count * sizeof(module_dataset_t);
+
+    append(dataset, NULL, names_offset);
+    for (i = 0; i < module_count; i++) { // zero-padded, so the names are already sorted
+        uint name_offset = (uint) dataset->size;
+
+        sprintf(name, "synthetic-%06u.dll-%08x", i, (uint) next_random(&random_state));
+        append(dataset, name, strlen(name) + 1);
+        ((module_dataset_t *) dataset->bytes)[i].name_offset = name_offset;
+    }
+    for (i = 0; i < module_count; i++) {
+        uint relative_tag = 0x1000, index_offset = align(dataset);
+        monitor_bb_index_t entry;
+
+        ((module_dataset_t *) dataset->bytes)[i].index_offset = index_offset;
+        append(dataset, &block_count, sizeof(uint));
+        for (j = 0; j < block_count; j++) {
+            if ((j == 0) || ((next_random(&random_state) % 100) >= SYNTHETIC_DUPLICATE_PERCENT))
+                relative_tag += 1 + (uint) (next_random(&random_state) % 0x40);
+            entry.relative_tag = relative_tag;
+            entry.data_offset = 0; // patched below
+            append(dataset, &entry, sizeof(entry));
+        }
+    }
+    align(dataset);
+    append(dataset, NULL, SYNTHETIC_BB_SIZE);
+
+    directory = (module_dataset_t *) dataset->bytes;
+    for (i = 0; i < module_count; i++) {
+        monitor_bb_index_t *index = (monitor_bb_index_t *)
+            (dataset->bytes + directory[i].index_offset + sizeof(uint));
+
+        for (j = 0; j < block_count; j++)
+            index[j].data_offset = (uint) (dataset->size - SYNTHETIC_BB_SIZE);
+    }
+    printf("Generated %u modules of %u blocks (%u bytes)\n", module_count, block_count,
+           (uint) dataset->size);
+}
+
+static bool
+check_original(buffer_t *dataset, uint *module_count) {
+    module_dataset_t *directory = (module_dataset_t *) dataset->bytes;
+    uint i, j;
+
+    if ((dataset->size < sizeof(module_dataset_t)) ||
+        (directory[0].name_offset % sizeof(module_dataset_t)) != 0 ||
+        directory[0].name_offset > dataset->size) {
+        fprintf(stderr, "The module directory is malformed\n");
+        return false;
+    }
+    *module_count = directory[0].name_offset / sizeof(module_dataset_t);
+
+    for (i = 0; i < *module_count; i++) {
+        uint name_offset = directory[i].name_offset, index_offset = directory[i].index_offset;
+        monitor_bb_index_t *index;
+        uint count;
+
+        if ((name_offset >= dataset->size) ||
+            (memchr(dataset->bytes + name_offset, 0, dataset->size - name_offset) == NULL) ||
+            ((index_offset + sizeof(uint)) > dataset->size)) {
+            fprintf(stderr, "Module #%u is out of bounds\n", i);
+            return false;
+        }
+        if ((i > 0) && (strcmp((char *) (dataset->bytes + directory[i - 1].name_offset),
+                               (char *) (dataset->bytes + name_offset)) >= 0)) {
+            fprintf(stderr, "The module directory is not sorted at %s\n",
+                    (char *) (dataset->bytes + name_offset));
+            return false;
+        }
+
+        count = *(uint *) (dataset->bytes + index_offset);
+        index = (monitor_bb_index_t *) (dataset->bytes + index_offset + sizeof(uint));
+        if (((uint64) index_offset + sizeof(uint) + ((uint64) count * sizeof(monitor_bb_index_t))) >
+            dataset->size) {
+            fprintf(stderr, "The index of %s is out of bounds\n",
+                    (char *) (dataset->bytes + name_offset));
+            return false;
+        }
+        for (j = 1; j < count; j++) {
+            if (index[j - 1].relative_tag > index[j].relative_tag) {
+                fprintf(stderr, "The index of %s is not sorted at entry %u\n",
+                        (char *) (dataset->bytes + name_offset), j);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Places the sorted `nodes` in Eytzinger order: an in-order walk of the implicit tree rooted
+ * at 1 visits them in sorted order. */
+static uint
+place_tree(dataset_tree_node_t *tree, uint count, const dataset_tree_node_t *nodes, uint next,
+           uint k) {
+    if (k <= count) {
+        next = place_tree(tree, count, nodes, next, 2 * k);
+        tree[k] = nodes[next++];
+        next = place_tree(tree, count, nodes, next, (2 * k) + 1);
+    }
+    return next;
+}
+
+/* Fills the hashed directory of the module names at `directory_offset`. */
+static void
+place_directory(buffer_t *dataset, uint directory_offset, dataset_indexed_module_t *modules,
+                uint module_count) {
+    dataset_directory_t *directory = (dataset_directory_t *) (dataset->bytes + directory_offset);
+    dataset_name_slot_t *slots = DATASET_NAME_SLOTS(directory);
+    uint mask = directory->slot_count - 1, i, j;
+
+    for (i = 0; i < module_count; i++) {
+        uint hash = dataset_name_hash((char *) (dataset->bytes + modules[i].name_offset));
+
+        for (j = hash & mask; slots[j].name_hash != 0U; j = (j + 1) & mask)
+            ;
+        slots[j].name_hash = hash;
+        slots[j].module = i;
+    }
+}
+
+static bool
+compile_dataset(buffer_t *dataset) {
+    dataset_footer_t *footer = dataset_find_footer(dataset->bytes, dataset->size);
+    dataset_indexed_module_t *modules;
+    dataset_directory_t directory;
+    dataset_footer_t new_footer;
+    uint module_count, i, j;
+
+    if (footer != NULL) {
+        printf("Replacing the compiled index of the dataset\n");
+        dataset->size = footer->original_size;
+    }
+    if (!check_original(dataset, &module_count))
+        return false;
+    new_footer.magic = DATASET_INDEX_MAGIC;
+    new_footer.version = DATASET_INDEX_VERSION;
+    new_footer.original_size = (uint) dataset->size;
+
+    modules = (dataset_indexed_module_t *) CS_ALLOC(module_count *
+                                                    sizeof(dataset_indexed_module_t));
+    for (i = 0; i < module_count; i++) {
+        module_dataset_t module = ((module_dataset_t *) dataset->bytes)[i];
+        uint count = *(uint *) (dataset->bytes + module.index_offset), tree_count = 0;
+        monitor_bb_index_t *index;
+        dataset_tree_node_t *nodes;
+
+        nodes = (dataset_tree_node_t *) CS_ALLOC((count + 1) * sizeof(dataset_tree_node_t));
+        index = (monitor_bb_index_t *) (dataset->bytes + module.index_offset + sizeof(uint));
+        for (j = 0; j < count; j++) {
+            if ((j == 0) || (index[j].relative_tag != index[j - 1].relative_tag)) {
+                nodes[tree_count].relative_tag = index[j].relative_tag;
+                nodes[tree_count].first_position = j;
+                tree_count++;
+            }
+        }
+
+        modules[i].name_offset = module.name_offset;
+        modules[i].index_offset = module.index_offset;
+        modules[i].tree_count = tree_count;
+        modules[i].tree_offset = align(dataset);
+        append(dataset, NULL, (tree_count + 1) * sizeof(dataset_tree_node_t));
+        place_tree((dataset_tree_node_t *) (dataset->bytes + modules[i].tree_offset),
+                   tree_count, nodes, 0, 1);
+        dr_global_free(nodes, (count + 1) * sizeof(dataset_tree_node_t));
+    }
+
+    directory.module_count = module_count;
+    directory.slot_count = 4;
+    while (directory.slot_count < (module_count * 2))
+        directory.slot_count <<= 1;
+    new_footer.directory_offset = align(dataset);
+    append(dataset, &directory, sizeof(directory));
+    append(dataset, NULL, directory.slot_count * sizeof(dataset_name_slot_t));
+    append(dataset, modules, module_count * sizeof(dataset_indexed_module_t));
+    place_directory(dataset, new_footer.directory_offset, modules, module_count);
+    append(dataset, &new_footer, sizeof(new_footer));
+
+    printf("Indexed %u modules: %u bytes of dataset, %u of index\n", module_count,
+           new_footer.original_size, (uint) (dataset->size - new_footer.original_size));
+    dr_global_free(modules, module_count * sizeof(dataset_indexed_module_t));
+    return true;
+}
+
+/* The lookup of the original layout (drvector's search): the first entry for the tag. */
+static uint
+sorted_search(const monitor_bb_index_t *index, uint count, uint relative_tag) {
+    uint low = 0, high = count;
+
+    while (low < high) {
+        uint middle = (low + high) / 2;
+
+        if (index[middle].relative_tag < relative_tag)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if ((low < count) && (index[low].relative_tag == relative_tag))
+        return low;
+    return DATASET_NOT_FOUND;
+}
+
+/* Checks each module name and each tag, and the tag after each one, against the original
+ * layout. Returns the number of lookups that disagree. */
+static uint
+verify_dataset(buffer_t *dataset) {
+    dataset_footer_t *footer = dataset_find_footer(dataset->bytes, dataset->size);
+    dataset_directory_t *directory;
+    dataset_indexed_module_t *modules;
+    uint i, j, failures = 0;
+    uint64 lookups = 0;
+
+    if (footer == NULL)
+        return 1;
+    directory = (dataset_directory_t *) (dataset->bytes + footer->directory_offset);
+    modules = DATASET_INDEXED_MODULES(directory);
+
+    for (i = 0; i < directory->module_count; i++) {
+        char *name = (char *) (dataset->bytes + modules[i].name_offset);
+        dataset_tree_node_t *tree;
+        uint count = *(uint *) (dataset->bytes + modules[i].index_offset);
+        monitor_bb_index_t *index = (monitor_bb_index_t *)
+            (dataset->bytes + modules[i].index_offset + sizeof(uint));
+
+        tree = (dataset_tree_node_t *) (dataset->bytes + modules[i].tree_offset);
+        if (dataset_find_module(dataset->bytes, directory, name) != i)
+            failures++;
+        for (j = 0; j < count; j++) {
+            uint tag = index[j].relative_tag;
+
+            failures += (dataset_tree_search(tree, modules[i].tree_count, tag) !=
+                         sorted_search(index, count, tag));
+            failures += (dataset_tree_search(tree, modules[i].tree_count, tag + 1) !=
+                         sorted_search(index, count, tag + 1));
+            lookups += 2;
+        }
+        failures += (dataset_tree_search(tree, modules[i].tree_count, 0) !=
+                     sorted_search(index, count, 0));
+    }
+    if (dataset_find_module(dataset->bytes, directory, "no-such-module.dll") != DATASET_NOT_FOUND)
+        failures++;
+
+    if (failures == 0)
+        printf("Verified %u module names and %llu tag lookups\n", directory->module_count,
+               (unsigned long long) lookups);
+    return failures;
+}
+
+/* Times random lookups of tags present in the largest module, as the monitor does them. */
+static void
+bench_dataset(buffer_t *dataset) {
+    dataset_footer_t *footer = dataset_find_footer(dataset->bytes, dataset->size);
+    dataset_directory_t *directory = (dataset_directory_t *) (dataset->bytes +
+                                                              footer->directory_offset);
+    dataset_indexed_module_t *modules = DATASET_INDEXED_MODULES(directory), *module = modules;
+    uint64 random_state = 0x9e3779b97f4a7c15ULL, start, checksum;
+    monitor_bb_index_t *index;
+    dataset_tree_node_t *tree;
+    uint *tags, i, count;
+
+    for (i = 1; i < directory->module_count; i++) {
+        if (modules[i].tree_count > module->tree_count)
+            module = &modules[i];
+    }
+    count = *(uint *) (dataset->bytes + module->index_offset);
+    index = (monitor_bb_index_t *) (dataset->bytes + module->index_offset + sizeof(uint));
+    tree = (dataset_tree_node_t *) (dataset->bytes + module->tree_offset);
+
+    tags = (uint *) CS_ALLOC(BENCH_LOOKUPS * sizeof(uint));
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        tags[i] = index[next_random(&random_state) % count].relative_tag;
+
+    printf("%u lookups in %s (%u blocks, %u distinct tags)\n", BENCH_LOOKUPS,
+           (char *) (dataset->bytes + module->name_offset), count, module->tree_count);
+    printf("%-16s %10s\n", "lookup", "ns/lookup");
+
+    checksum = 0ULL;
+    start = now_nanos();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        checksum += sorted_search(index, count, tags[i]);
+    printf("%-16s %10.1f   (checksum %llx)\n", "sorted", ((double) (now_nanos() - start)) /
+           BENCH_LOOKUPS, (unsigned long long) checksum);
+
+    checksum = 0ULL;
+    start = now_nanos();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        checksum += dataset_tree_search(tree, module->tree_count, tags[i]);
+    printf("%-16s %10.1f   (checksum %llx)\n", "eytzinger", ((double) (now_nanos() - start)) /
+           BENCH_LOOKUPS, (unsigned long long) checksum);
+
+    dr_global_free(tags, BENCH_LOOKUPS * sizeof(uint));
+}
@@ -0,0 +1,758 @@
+/* Blackbox offline graph analyzer standalone app. */
+
+/* Loads the graph of every process in a run directory: graph-node, graph-edge and cross-module
+ * (raw .dat, memory-mapped and read in place, or compact .cdat), meta.dat and module.log. Nodes
+ * are indexed by tag and tag version, and edges are resolved into a compressed (CSR) adjacency
+ * index of each node's outgoing intra-module and cross-module edges.
+ *
+ * Reports (in addition to entry counts, the meta header and edges whose nodes are missing):
+ *   -modules        nodes, edges and cross-module edges per module, by the module.log ranges
+ *   -histogram      edge types, exit ordinals, node meta types, meta entries and out-degrees
+ *   -baseline <dir> edges that appear in no process of the baseline run. Tags vary between
+ *                   runs, so edges are compared by the block hashes of their nodes.
+ *   -list <n>       print up to n of the new edges (default 20)
+ *   -node <tag>     the outgoing edges of each node with this tag
+ *
+ * Edge sources are recorded with only 5 bytes of their tag (crowd_safe_trace_buffer.h), so an
+ * edge goes out of the first node whose tag matches in the low 40 bits (which is exact for 32-bit
+ * processes). Up to 4G nodes and 4G edges per process; the node index, the CSR and the edge
+ * keys of a baseline take about 40 bytes per node and 24 per edge.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "graph_files.h"
+
+#define PREFETCH_DISTANCE 16
+
+#define EDGE_TYPE_COUNT 8
+#define META_TYPE_COUNT 6
+#define META_ENTRY_TYPE_COUNT 5
+#define DEGREE_BUCKETS 12
+
+static const char *edge_type_names[EDGE_TYPE_COUNT] = {
+    "indirect", "direct", "call-continuation", "exception-continuation", "unexpected-return",
+    "gencode-perm", "gencode-write", "fork"
+};
+
+static const char *meta_type_names[META_TYPE_COUNT] = {
+    "normal", "singleton", "trampoline", "return", "signal-handler", "sigreturn"
+};
+
+static const char *meta_entry_names[META_ENTRY_TYPE_COUNT] = {
+    "timepoint", "uib", "uib-interval", "suspicious-syscall", "suspicious-gencode"
+};
+
+typedef struct module_t module_t;
+struct module_t {
+    char *id;
+    uint64 nodes;
+    uint64 edges;
+    uint64 cross_out;
+    uint64 cross_in;
+    uint64 new_edges;
+};
+
+typedef struct csr_edge_t csr_edge_t;
+struct csr_edge_t {
+    uint target;
+    uint record;
+};
+
+/* The outgoing edges of node n are edges[offsets[n]] up to edges[offsets[n + 1]]. */
+typedef struct csr_t csr_t;
+struct csr_t {
+    uint *offsets;
+    csr_edge_t *edges;
+    uint64 edge_count;
+    uint64 dangling;
+};
+
+typedef struct graph_t graph_t;
+struct graph_t {
+    char name[MAX_PATH];
+    word_file_t nodes;
+    word_file_t edges;
+    word_file_t cross;
+    word_file_t meta;
+    node_index_t node_index;
+    uint *node_modules;
+    uint *in_degrees;
+    csr_t intra;
+    csr_t cross_index;
+    module_windows_t module_windows;
+};
+
+typedef struct key_set_t key_set_t;
+struct key_set_t {
+    uint64 *keys;
+    uint64 mask;
+    uint64 count;
+};
+
+static module_t *modules;
+static uint module_count, module_capacity;
+static bool report_modules, report_histogram;
+static uint list_limit = 20;
+
+/**** private prototypes ****/
+
+static int
+usage(const char *msg);
+
+static double
+elapsed_seconds(struct timespec *start);
+
+static bool
+load_graph(const char *dir, const char *process, graph_t *graph);
+
+static void
+free_graph(graph_t *graph);
+
+static void
+build_csr(graph_t *graph, word_file_t *file, uint entry_words, csr_t *csr);
+
+static uint
+intern_module(const char *id);
+
+static void
+attribute_modules(graph_t *graph);
+
+static void
+count_modules(graph_t *graph);
+
+static uint64
+edge_key(graph_t *graph, csr_edge_t *edge, uint from, bool is_cross);
+
+static uint64 *
+edge_keys(graph_t *graph, uint64 *count);
+
+static void
+key_set_init(key_set_t *set, uint64 capacity);
+
+static void
+key_set_reserve(key_set_t *set, uint64 additional);
+
+static bool
+key_set_add(key_set_t *set, uint64 key);
+
+static bool
+key_set_contains(key_set_t *set, uint64 key);
+
+static void
+key_set_add_all(key_set_t *set, const uint64 *keys, uint64 count);
+
+static void
+key_set_remove_known(key_set_t *set, uint64 *keys, uint64 count);
+
+static void
+print_summary(graph_t *graph);
+
+static void
+print_histograms(graph_t *graph);
+
+static void
+print_node(graph_t *graph, uint64 tag);
+
+static void
+print_new_edges(graph_t *graph, key_set_t *baseline, uint *listed);
+
+static void
+print_modules();
+
+/**** public functions ****/
+
+int
+main(int argc, char **argv) {
+    static char processes[MAX_PROCESSES][MAX_PATH];
+    const char *dir = NULL, *baseline_dir = NULL;
+    uint64 node_tag = 0ULL;
+    bool query_node = false;
+    key_set_t baseline = { NULL, 0, 0 };
+    struct timespec start;
+    uint process_count, i, listed = 0;
+    int arg;
+
+    for (arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-modules") == 0)
+            report_modules = true;
+        else if (strcmp(argv[arg], "-histogram") == 0)
+            report_histogram = true;
+        else if (strcmp(argv[arg], "-baseline") == 0 && arg + 1 < argc)
+            baseline_dir = argv[++arg];
+        else if (strcmp(argv[arg], "-list") == 0 && arg + 1 < argc)
+            list_limit = (uint) strtoul(argv[++arg], NULL, 0);
+        else if (strcmp(argv[arg], "-node") == 0 && arg + 1 < argc) {
+            node_tag = strtoull(argv[++arg], NULL, 16);
+            query_node = true;
+        } else if (argv[arg][0] == '-' || dir != NULL)
+            return usage("unknown option");
+        else
+            dir = argv[arg];
+    }
+    if (dir == NULL)
+        return usage("");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (baseline_dir != NULL) {
+        static char baseline_processes[MAX_PROCESSES][MAX_PATH];
+        uint baseline_count = find_processes(baseline_dir, baseline_processes);
+
+        if (baseline_count == 0)
+            return usage("no graph files in the baseline directory");
+        key_set_init(&baseline, 1 << 20);
+        for (i = 0; i < baseline_count; i++) {
+            uint64 *keys, key_count;
+            graph_t graph;
+
+            if (!load_graph(baseline_dir, baseline_processes[i], &graph))
+                return 1;
+            keys = edge_keys(&graph, &key_count);
+            free_graph(&graph);
+            key_set_add_all(&baseline, keys, key_count);
+            free(keys);
+        }
+        printf("Baseline %s: %u processes, %llu distinct edges\n", baseline_dir, baseline_count,
+               (unsigned long long) baseline.count);
+    }
+
+    process_count = find_processes(dir, processes);
+    if (process_count == 0)
+        return usage("no graph files in the run directory");
+
+    for (i = 0; i < process_count; i++) {
+        graph_t graph;
+
+        if (!load_graph(dir, processes[i], &graph))
+            return 1;
+        print_summary(&graph);
+        if (report_modules)
+            count_modules(&graph);
+        if (report_histogram)
+            print_histograms(&graph);
+        if (query_node)
+            print_node(&graph, node_tag);
+        if (baseline.keys != NULL)
+            print_new_edges(&graph, &baseline, &listed);
+        free_graph(&graph);
+    }
+    if (report_modules)
+        print_modules();
+
+    printf("\nAnalyzed %u processes in %.2f s\n", process_count, elapsed_seconds(&start));
+    free(baseline.keys);
+    return 0;
+}
+
+/**** private functions ****/
+
+static int
+usage(const char *msg) {
+    if (msg != NULL && msg[0] != '\0')
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "usage: graph_analyze [-modules] [-histogram] [-baseline <run-dir>] "
+            "[-list <n>] [-node <hex-tag>] <run-dir>\n");
+    return 1;
+}
+
+static double
+elapsed_seconds(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + ((now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+static bool
+load_graph(const char *dir, const char *process, graph_t *graph) {
+    memset(graph, 0, sizeof(graph_t));
+    strncpy(graph->name, process, MAX_PATH - 1);
+
+    if (!open_word_file(dir, process, "graph-node", NODE_WORDS, &graph->nodes) ||
+        !open_word_file(dir, process, "graph-edge", EDGE_WORDS, &graph->edges) ||
+        !open_word_file(dir, process, "cross-module", CROSS_WORDS, &graph->cross) ||
+        !open_word_file(dir, process, "meta", 1, &graph->meta)) {
+        free_graph(graph);
+        return false;
+    }
+    if ((graph->nodes.entry_count >= NO_NODE) || (graph->edges.entry_count >= NO_NODE) ||
+        (graph->cross.entry_count >= NO_NODE)) {
+        fprintf(stderr, "Too many nodes or edges in %s\n", process);
+        free_graph(graph);
+        return false;
+    }
+
+    index_nodes(&graph->node_index, &graph->nodes);
+    build_csr(graph, &graph->edges, EDGE_WORDS, &graph->intra);
+    build_csr(graph, &graph->cross, CROSS_WORDS, &graph->cross_index);
+    load_module_windows(dir, process, &graph->module_windows, intern_module);
+    attribute_modules(graph);
+    return true;
+}
+
+static void
+free_graph(graph_t *graph) {
+    close_word_file(&graph->nodes);
+    close_word_file(&graph->edges);
+    close_word_file(&graph->cross);
+    close_word_file(&graph->meta);
+    free_node_index(&graph->node_index);
+    free(graph->node_modules);
+    free(graph->in_degrees);
+    free(graph->intra.offsets);
+    free(graph->intra.edges);
+    free(graph->cross_index.offsets);
+    free(graph->cross_index.edges);
+    free_module_windows(&graph->module_windows);
+}
+
+/* The arrays of a large graph take GB, so running out of memory is reported and fatal. */
+static inline uint64
+mix64(uint64 value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+/* Two passes over the edge file: count the out-degree of each source, then place each edge
+ * at its source's next free position. */
+static void
+build_csr(graph_t *graph, word_file_t *file, uint entry_words, csr_t *csr) {
+    uint node_count = (uint) graph->nodes.entry_count;
+    uint *sources = (uint *) allocate(file->entry_count + 1, sizeof(uint), false);
+    uint *targets = (uint *) allocate(file->entry_count + 1, sizeof(uint), false);
+    node_index_t *index = &graph->node_index;
+    uint64 i;
+    uint n, total = 0;
+
+    if (graph->in_degrees == NULL)
+        graph->in_degrees = (uint *) allocate(node_count + 1, sizeof(uint), true);
+    csr->offsets = (uint *) allocate(node_count + 2, sizeof(uint), true);
+    csr->dangling = 0;
+
+    for (i = 0; i < file->entry_count; i++) {
+        const uint64 *entry = file->words + (i * entry_words);
+
+        if ((i + PREFETCH_DISTANCE) < file->entry_count) { // lookups are random, so start early
+            const uint64 *ahead = entry + (PREFETCH_DISTANCE * entry_words);
+
+            __builtin_prefetch(&index->slots[node_home_slot(index, EDGE_FROM_KEY(ahead[0]))]);
+            __builtin_prefetch(&index->slots[node_home_slot(index, EDGE_TO_KEY(ahead[1]))]);
+        }
+        sources[i] = lookup_node(index, EDGE_FROM_KEY(entry[0]), NODE_MATCH_MASK);
+        targets[i] = lookup_node(index, EDGE_TO_KEY(entry[1]), FULL_MATCH_MASK);
+        if ((sources[i] == NO_NODE) || (targets[i] == NO_NODE)) {
+            csr->dangling++;
+            sources[i] = NO_NODE;
+        } else {
+            csr->offsets[sources[i] + 1]++;
+            graph->in_degrees[targets[i]]++;
+        }
+    }
+
+    for (n = 0; n < node_count; n++) {
+        uint degree = csr->offsets[n + 1];
+
+        csr->offsets[n + 1] = total; // becomes the fill position of node n
+        total += degree;
+    }
+    csr->offsets[0] = 0;
+    csr->edge_count = total;
+    csr->edges = (csr_edge_t *) allocate(total + 1, sizeof(csr_edge_t), false);
+
+    for (i = 0; i < file->entry_count; i++) {
+        if (sources[i] != NO_NODE) {
+            uint position = csr->offsets[sources[i] + 1]++;
+
+            csr->edges[position].target = targets[i];
+            csr->edges[position].record = (uint) i;
+        }
+    }
+    // after placement, offsets[n + 1] is the end of node n, which is the start of node n + 1
+    free(sources);
+    free(targets);
+}
+
+static uint
+intern_module(const char *id) {
+    uint i;
+
+    for (i = module_count; i > 0; i--) { // reloads are usually recent
+        if (strcmp(modules[i - 1].id, id) == 0)
+            return i - 1;
+    }
+    if (module_count == module_capacity) {
+        module_capacity = (module_capacity == 0) ? 64 : module_capacity * 2;
+        modules = (module_t *) realloc(modules, module_capacity * sizeof(module_t));
+    }
+    memset(&modules[module_count], 0, sizeof(module_t));
+    modules[module_count].id = strdup(id);
+    return module_count++;
+}
+
+/* Nodes outside of every module are counted under "<unknown>". */
+static uint
+known_module(uint module) {
+    return (module == NO_MODULE) ? intern_module("<unknown>") : module;
+}
+
+static void
+attribute_modules(graph_t *graph) {
+    uint node_count = (uint) graph->nodes.entry_count, n;
+    module_window_t *cached = NULL;
+
+    graph->node_modules = (uint *) allocate(node_count + 1, sizeof(uint), false);
+    for (n = 0; n < node_count; n++) {
+        uint64 tag = NODE_TAG(graph->nodes.words[n * NODE_WORDS]);
+        uint window;
+
+        if (cached != NULL && tag >= cached->start && tag < cached->end) {
+            graph->node_modules[n] = cached->module; // consecutive nodes share a module
+            continue;
+        }
+        window = find_window(&graph->module_windows, tag, n);
+        if (window == NO_MODULE) {
+            graph->node_modules[n] = NO_MODULE;
+        } else {
+            graph->node_modules[n] = graph->module_windows.windows[window].module;
+            if (graph->module_windows.windows[window].is_alone) // no other load can claim its range
+                cached = &graph->module_windows.windows[window];
+        }
+    }
+}
+
+static void
+count_modules(graph_t *graph) {
+    uint node_count = (uint) graph->nodes.entry_count, n;
+
+    for (n = 0; n < node_count; n++) {
+        uint module = known_module(graph->node_modules[n]), e;
+
+        modules[module].nodes++;
+        modules[module].edges += graph->intra.offsets[n + 1] - graph->intra.offsets[n];
+        for (e = graph->cross_index.offsets[n]; e < graph->cross_index.offsets[n + 1]; e++) {
+            uint target = graph->cross_index.edges[e].target;
+
+            modules[module].cross_out++;
+            modules[known_module(graph->node_modules[target])].cross_in++;
+        }
+    }
+}
+
+/* Edges are identified across runs by the hashes of their nodes, type and exit ordinal, and
+ * for cross-module edges also by the edge hash (the export or callback). */
+static uint64
+edge_key(graph_t *graph, csr_edge_t *edge, uint from, bool is_cross) {
+    const uint64 *entry = is_cross ? graph->cross.words + (edge->record * CROSS_WORDS) :
+                                     graph->edges.words + (edge->record * EDGE_WORDS);
+    uint64 from_hash = graph->nodes.words[(from * NODE_WORDS) + 1];
+    uint64 to_hash = graph->nodes.words[(edge->target * NODE_WORDS) + 1];
+    uint64 key = mix64(from_hash) ^ (mix64(to_hash + 0x9e3779b97f4a7c15ULL) * 3);
+
+    key ^= (((uint64) EDGE_TYPE(entry[0])) << 8) | EDGE_ORDINAL(entry[0]);
+    if (is_cross)
+        key = mix64(key ^ mix64(entry[2] ^ 0xc2b2ae3d27d4eb4fULL));
+    key = mix64(key);
+    return (key == 0ULL) ? 1ULL : key;
+}
+
+static void
+key_set_init(key_set_t *set, uint64 capacity) {
+    set->keys = (uint64 *) allocate_huge(capacity * sizeof(uint64));
+    memset(set->keys, 0, capacity * sizeof(uint64));
+    set->mask = capacity - 1;
+    set->count = 0;
+}
+
+/* Grows the set to hold `additional` more keys at no more than half full. */
+static void
+key_set_reserve(key_set_t *set, uint64 additional) {
+    uint64 capacity = set->mask + 1, i;
+    key_set_t larger;
+
+    while (((set->count + additional) * 2) > capacity)
+        capacity <<= 1;
+    if (capacity == (set->mask + 1))
+        return;
+
+    key_set_init(&larger, capacity);
+    for (i = 0; i <= set->mask; i++) {
+        if (set->keys[i] != 0ULL)
+            key_set_add(&larger, set->keys[i]);
+    }
+    free(set->keys);
+    *set = larger;
+}
+
+static bool
+key_set_add(key_set_t *set, uint64 key) {
+    uint64 slot;
+
+    key_set_reserve(set, 1);
+    for (slot = key & set->mask; set->keys[slot] != 0ULL; slot = (slot + 1) & set->mask) {
+        if (set->keys[slot] == key)
+            return false;
+    }
+    set->keys[slot] = key;
+    set->count++;
+    return true;
+}
+
+static bool
+key_set_contains(key_set_t *set, uint64 key) {
+    uint64 slot;
+
+    for (slot = key & set->mask; set->keys[slot] != 0ULL; slot = (slot + 1) & set->mask) {
+        if (set->keys[slot] == key)
+            return true;
+    }
+    return false;
+}
+
+/* Returns the key of every edge in CSR order: for each node, its intra-module edges and then
+ * its cross-module edges. Computed in one pass, so that set operations on them can prefetch. */
+static uint64 *
+edge_keys(graph_t *graph, uint64 *count) {
+    uint64 *keys, k = 0;
+    uint n, e;
+
+    *count = graph->intra.edge_count + graph->cross_index.edge_count;
+    keys = (uint64 *) allocate(*count + 1, sizeof(uint64), false);
+    for (n = 0; n < graph->nodes.entry_count; n++) {
+        for (e = graph->intra.offsets[n]; e < graph->intra.offsets[n + 1]; e++)
+            keys[k++] = edge_key(graph, &graph->intra.edges[e], n, false);
+        for (e = graph->cross_index.offsets[n]; e < graph->cross_index.offsets[n + 1]; e++)
+            keys[k++] = edge_key(graph, &graph->cross_index.edges[e], n, true);
+    }
+    return keys;
+}
+
+static void
+key_set_add_all(key_set_t *set, const uint64 *keys, uint64 count) {
+    uint64 i;
+
+    key_set_reserve(set, count);
+    for (i = 0; i < count; i++) {
+        if ((i + PREFETCH_DISTANCE) < count)
+            __builtin_prefetch(&set->keys[keys[i + PREFETCH_DISTANCE] & set->mask]);
+        key_set_add(set, keys[i]);
+    }
+}
+
+/* Replaces each of the `keys` that is in the set with 0. */
+static void
+key_set_remove_known(key_set_t *set, uint64 *keys, uint64 count) {
+    uint64 i;
+
+    for (i = 0; i < count; i++) {
+        if ((i + PREFETCH_DISTANCE) < count)
+            __builtin_prefetch(&set->keys[keys[i + PREFETCH_DISTANCE] & set->mask]);
+        if (key_set_contains(set, keys[i]))
+            keys[i] = 0ULL;
+    }
+}
+
+static void
+print_summary(graph_t *graph) {
+    printf("\nProcess %s\n", graph->name);
+    printf("  nodes: %llu (%llu duplicates)\n", (unsigned long long) graph->nodes.entry_count,
+           (unsigned long long) graph->node_index.duplicates);
+    printf("  edges: %llu (%llu with a missing node)\n",
+           (unsigned long long) graph->edges.entry_count,
+           (unsigned long long) graph->intra.dangling);
+    printf("  cross-module edges: %llu (%llu with a missing node)\n",
+           (unsigned long long) graph->cross.entry_count,
+           (unsigned long long) graph->cross_index.dangling);
+    if (graph->meta.entry_count > 0) {
+        uint64 header = graph->meta.words[0];
+
+        printf("  main module base: 0x%llx, block hash version %u\n",
+               (unsigned long long) (header & 0xffffffffffffffULL), (uint) (header >> 0x38));
+    }
+    printf("  module loads: %u\n", graph->module_windows.count);
+}
+
+static void
+print_degree_buckets(const char *label, uint *offsets, uint node_count) {
+    uint64 buckets[DEGREE_BUCKETS] = {0};
+    uint n, b;
+
+    for (n = 0; n < node_count; n++) {
+        uint degree = offsets[n + 1] - offsets[n];
+
+        for (b = 0; degree > 0 && b < (DEGREE_BUCKETS - 1); b++)
+            degree >>= 1;
+        buckets[b]++;
+    }
+    printf("  %s:", label);
+    for (b = 0; b < DEGREE_BUCKETS; b++) {
+        if (buckets[b] > 0)
+            printf(" %s%u:%llu", (b == DEGREE_BUCKETS - 1) ? ">=" : (b == 0 ? "" : "<"),
+                   (b == 0) ? 0 : (b == DEGREE_BUCKETS - 1) ? (1U << (b - 1)) : (1U << b),
+                   (unsigned long long) buckets[b]);
+    }
+    printf("\n");
+}
+
+static void
+print_histograms(graph_t *graph) {
+    uint64 intra_types[EDGE_TYPE_COUNT + 1] = {0}, cross_types[EDGE_TYPE_COUNT + 1] = {0};
+    uint64 meta_types[META_TYPE_COUNT + 1] = {0}, meta_entries[META_ENTRY_TYPE_COUNT + 1] = {0};
+    uint64 ordinals[4] = {0}, i;
+    uint t;
+
+    for (i = 0; i < graph->edges.entry_count; i++) {
+        uint64 word = graph->edges.words[i * EDGE_WORDS];
+        byte ordinal = EDGE_ORDINAL(word);
+
+        intra_types[(EDGE_TYPE(word) < EDGE_TYPE_COUNT) ? EDGE_TYPE(word) : EDGE_TYPE_COUNT]++;
+        ordinals[(ordinal < 3) ? ordinal : 3]++;
+    }
+    for (i = 0; i < graph->cross.entry_count; i++) {
+        byte type = EDGE_TYPE(graph->cross.words[i * CROSS_WORDS]);
+
+        cross_types[(type < EDGE_TYPE_COUNT) ? type : EDGE_TYPE_COUNT]++;
+    }
+    for (i = 0; i < graph->nodes.entry_count; i++) {
+        byte meta = NODE_META(graph->nodes.words[i * NODE_WORDS]);
+
+        meta_types[(meta < META_TYPE_COUNT) ? meta : META_TYPE_COUNT]++;
+    }
+    for (i = 1; i < graph->meta.entry_count; i++) { // the first entry is the header
+        byte type = (byte) graph->meta.words[i];
+
+        meta_entries[(type < META_ENTRY_TYPE_COUNT) ? type : META_ENTRY_TYPE_COUNT]++;
+    }
+
+    printf("  %-24s %14s %14s\n", "edge type", "intra", "cross");
+    for (t = 0; t <= EDGE_TYPE_COUNT; t++) {
+        if (intra_types[t] > 0 || cross_types[t] > 0)
+            printf("  %-24s %14llu %14llu\n",
+                   (t < EDGE_TYPE_COUNT) ? edge_type_names[t] : "<other>",
+                   (unsigned long long) intra_types[t], (unsigned long long) cross_types[t]);
+    }
+    printf("  exit ordinals: 0:%llu 1:%llu 2:%llu >2:%llu\n", (unsigned long long) ordinals[0],
+           (unsigned long long) ordinals[1], (unsigned long long) ordinals[2],
+           (unsigned long long) ordinals[3]);
+    printf("  node meta types:");
+    for (t = 0; t <= META_TYPE_COUNT; t++) {
+        if (meta_types[t] > 0)
+            printf(" %s:%llu", (t < META_TYPE_COUNT) ? meta_type_names[t] : "<other>",
+                   (unsigned long long) meta_types[t]);
+    }
+    printf("\n  meta entries:");
+    for (t = 0; t <= META_ENTRY_TYPE_COUNT; t++) {
+        if (meta_entries[t] > 0)
+            printf(" %s:%llu", (t < META_ENTRY_TYPE_COUNT) ? meta_entry_names[t] : "<other>",
+                   (unsigned long long) meta_entries[t]);
+    }
+    printf("\n");
+    print_degree_buckets("intra out-degrees", graph->intra.offsets,
+                         (uint) graph->nodes.entry_count);
+    print_degree_buckets("cross out-degrees", graph->cross_index.offsets,
+                         (uint) graph->nodes.entry_count);
+}
+
+static const char *
+module_name(uint module) {
+    return (module == NO_MODULE) ? "<unknown>" : modules[module].id;
+}
+
+static void
+print_edge(graph_t *graph, uint from, csr_edge_t *edge, bool is_cross) {
+    const uint64 *entry = is_cross ? graph->cross.words + (edge->record * CROSS_WORDS) :
+                                     graph->edges.words + (edge->record * EDGE_WORDS);
+    byte type = EDGE_TYPE(entry[0]);
+
+    printf("    %s 0x%llx -%s/%u-> %s 0x%llx", module_name(graph->node_modules[from]),
+           (unsigned long long) NODE_TAG(graph->nodes.words[from * NODE_WORDS]),
+           (type < EDGE_TYPE_COUNT) ? edge_type_names[type] : "?", EDGE_ORDINAL(entry[0]),
+           module_name(graph->node_modules[edge->target]),
+           (unsigned long long) NODE_TAG(graph->nodes.words[edge->target * NODE_WORDS]));
+    if (is_cross)
+        printf(" (hash 0x%llx)", (unsigned long long) entry[2]);
+    printf("\n");
+}
+
+static void
+print_node(graph_t *graph, uint64 tag) {
+    uint version, e;
+
+    for (version = 0; version < 0x100; version++) {
+        uint node = lookup_node(&graph->node_index, NODE_KEY(tag, version), FULL_MATCH_MASK);
+
+        if (node == NO_NODE)
+            continue;
+        printf("  node 0x%llx v%u in %s: hash 0x%llx, %u incoming\n", (unsigned long long) tag,
+               version, module_name(graph->node_modules[node]),
+               (unsigned long long) graph->nodes.words[(node * NODE_WORDS) + 1],
+               graph->in_degrees[node]);
+        for (e = graph->intra.offsets[node]; e < graph->intra.offsets[node + 1]; e++)
+            print_edge(graph, node, &graph->intra.edges[e], false);
+        for (e = graph->cross_index.offsets[node]; e < graph->cross_index.offsets[node + 1]; e++)
+            print_edge(graph, node, &graph->cross_index.edges[e], true);
+    }
+}
+
+static void
+print_new_edges(graph_t *graph, key_set_t *baseline, uint *listed) {
+    uint64 new_intra = 0, new_cross = 0, edge_count, k = 0;
+    uint64 *keys = edge_keys(graph, &edge_count);
+    key_set_t seen;
+    uint n, e;
+
+    key_set_remove_known(baseline, keys, edge_count);
+    key_set_init(&seen, 1 << 12);
+    for (n = 0; n < graph->nodes.entry_count; n++) {
+        uint module = graph->node_modules[n];
+
+        for (e = graph->intra.offsets[n]; e < graph->intra.offsets[n + 1]; e++, k++) {
+            if (keys[k] != 0ULL && key_set_add(&seen, keys[k])) {
+                new_intra++;
+                if (report_modules)
+                    modules[known_module(module)].new_edges++;
+                if ((*listed)++ < list_limit)
+                    print_edge(graph, n, &graph->intra.edges[e], false);
+            }
+        }
+        for (e = graph->cross_index.offsets[n]; e < graph->cross_index.offsets[n + 1]; e++, k++) {
+            if (keys[k] != 0ULL && key_set_add(&seen, keys[k])) {
+                new_cross++;
+                if (report_modules)
+                    modules[known_module(module)].new_edges++;
+                if ((*listed)++ < list_limit)
+                    print_edge(graph, n, &graph->cross_index.edges[e], true);
+            }
+        }
+    }
+    free(seen.keys);
+    free(keys);
+    printf("  new vs baseline: %llu edges, %llu cross-module edges\n",
+           (unsigned long long) new_intra, (unsigned long long) new_cross);
+}
+
+static void
+print_modules() {
+    uint i;
+
+    printf("\n%-48s %12s %12s %12s %12s %12s\n", "module", "nodes", "edges", "cross out",
+           "cross in", "new edges");
+    for (i = 0; i < module_count; i++) {
+        module_t *module = &modules[i];
+
+        if (module->nodes == 0 && module->cross_in == 0 && module->new_edges == 0)
+            continue;
+        printf("%-48s %12llu %12llu %12llu %12llu %12llu\n", module->id,
+               (unsigned long long) module->nodes, (unsigned long long) module->edges,
+               (unsigned long long) module->cross_out, (unsigned long long) module->cross_in,
+               (unsigned long long) module->new_edges);
+    }
+}
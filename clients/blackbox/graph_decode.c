@@ -0,0 +1,96 @@
+/* Blackbox compact graph decoder standalone app. */
+
+/* Converts a compact graph file (graph-node.cdat, graph-edge.cdat or cross-module.cdat) back
+ * into the raw uint64 entry stream of the corresponding .dat file, one frame at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crowd_safe_trace_frame.h"
+
+static int
+usage(const char *msg) {
+    if (msg != NULL && msg[0] != '\0')
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "usage: graph_decode <compact-file> <raw-file>\n");
+    return 1;
+}
+
+int
+main(int argc, char **argv) {
+    byte header[TRACE_FRAME_HEADER_SIZE];
+    byte *frame = NULL;
+    uint64 *words = NULL;
+    size_t frame_capacity = 0, word_capacity = 0;
+    uint64 frame_count = 0, word_total = 0;
+    FILE *in, *out;
+    int result = 0;
+
+    if (argc != 3)
+        return usage("");
+
+    in = fopen(argv[1], "rb");
+    if (in == NULL)
+        return usage("cannot open the compact file");
+    out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        fclose(in);
+        return usage("cannot create the raw file");
+    }
+
+    while (fread(header, 1, TRACE_FRAME_HEADER_SIZE, in) == TRACE_FRAME_HEADER_SIZE) {
+        size_t frame_size = trace_frame_size(header);
+        uint word_count = trace_frame_word_count(header);
+
+        if (frame_size == 0) {
+            fprintf(stderr, "Frame %llu: bad magic or unsupported version\n",
+                    (unsigned long long) frame_count);
+            result = 1;
+            break;
+        }
+        if (frame_size > frame_capacity) {
+            free(frame);
+            frame_capacity = frame_size;
+            frame = (byte *) malloc(frame_capacity);
+        }
+        if (word_count > word_capacity) {
+            free(words);
+            word_capacity = word_count;
+            words = (uint64 *) malloc(word_capacity * sizeof(uint64));
+        }
+        if (frame == NULL || (word_count > 0 && words == NULL)) {
+            fprintf(stderr, "Out of memory for a frame of %llu bytes\n",
+                    (unsigned long long) frame_size);
+            result = 1;
+            break;
+        }
+
+        memcpy(frame, header, TRACE_FRAME_HEADER_SIZE);
+        if ((fread(frame + TRACE_FRAME_HEADER_SIZE, 1, frame_size - TRACE_FRAME_HEADER_SIZE, in) !=
+             frame_size - TRACE_FRAME_HEADER_SIZE) ||
+            (trace_frame_decode(frame, frame_size, words) != frame_size)) {
+            fprintf(stderr, "Frame %llu: truncated or malformed\n", (unsigned long long) frame_count);
+            result = 1;
+            break;
+        }
+        if (fwrite(words, sizeof(uint64), word_count, out) != word_count) {
+            fprintf(stderr, "Failed to write the raw file\n");
+            result = 1;
+            break;
+        }
+        frame_count++;
+        word_total += word_count;
+    }
+
+    if (result == 0) {
+        printf("Decoded %llu frames into %llu words\n", (unsigned long long) frame_count,
+               (unsigned long long) word_total);
+    }
+    free(frame);
+    free(words);
+    fclose(in);
+    fclose(out);
+    return result;
+}
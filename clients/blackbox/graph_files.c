@@ -0,0 +1,335 @@
+#include "graph_files.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**** private prototypes ****/
+
+static bool
+decode_compact(const byte *data, size_t size, word_file_t *file);
+
+static int
+compare_windows(const void *left, const void *right);
+
+/**** public functions ****/
+
+/* Files are named <app>.<basename>.<timestamp>.<pids>.<ext>, and the process name used here is
+ * everything but the basename and extension: "<app>.|<timestamp>.<pids>". */
+uint
+find_processes(const char *dir, char names[][MAX_PATH]) {
+    DIR *listing = opendir(dir);
+    struct dirent *entry;
+    uint count = 0, i;
+
+    if (listing == NULL)
+        return 0;
+    while ((entry = readdir(listing)) != NULL && count < MAX_PROCESSES) {
+        char *marker = strstr(entry->d_name, ".graph-node."), *extension;
+        size_t app_length;
+
+        if (marker == NULL)
+            continue;
+        extension = strrchr(entry->d_name, '.');
+        app_length = (marker - entry->d_name) + 1;
+        if ((app_length + (extension - (marker + 12)) + 2) >= MAX_PATH)
+            continue;
+        memcpy(names[count], entry->d_name, app_length);
+        names[count][app_length] = '|';
+        memcpy(names[count] + app_length + 1, marker + 12, extension - (marker + 12));
+        names[count][app_length + 1 + (extension - (marker + 12))] = '\0';
+        for (i = 0; i < count; i++) { // a process may have both .dat and .cdat files
+            if (strcmp(names[i], names[count]) == 0)
+                break;
+        }
+        if (i == count)
+            count++;
+    }
+    closedir(listing);
+    return count;
+}
+
+void
+process_file_path(char *path, const char *dir, const char *process, const char *basename,
+                  const char *extension) {
+    const char *split = strchr(process, '|');
+
+    snprintf(path, MAX_PATH, "%s/%.*s%s.%s.%s", dir, (int) (split - process), process, basename,
+             split + 1, extension);
+}
+
+bool
+open_word_file(const char *dir, const char *process, const char *basename, uint entry_words,
+               word_file_t *file) {
+    char path[MAX_PATH];
+    struct stat status;
+    bool compact = false;
+    int fd;
+
+    memset(file, 0, sizeof(word_file_t));
+    process_file_path(path, dir, process, basename, "dat");
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        process_file_path(path, dir, process, basename, "cdat");
+        fd = open(path, O_RDONLY);
+        compact = true;
+    }
+    if (fd < 0)
+        return true;
+
+    if (fstat(fd, &status) != 0) {
+        close(fd);
+        return false;
+    }
+    if (status.st_size > 0) {
+        file->mapping_size = (size_t) status.st_size;
+        file->mapping = mmap(NULL, file->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->mapping == MAP_FAILED) {
+            fprintf(stderr, "Failed to map %s\n", path);
+            close(fd);
+            return false;
+        }
+        madvise(file->mapping, file->mapping_size, MADV_SEQUENTIAL); // advice values are not flags
+        madvise(file->mapping, file->mapping_size, MADV_WILLNEED);
+        if (compact) {
+            if (!decode_compact((const byte *) file->mapping, file->mapping_size, file)) {
+                fprintf(stderr, "Malformed compact file %s\n", path);
+                close(fd);
+                return false;
+            }
+            munmap(file->mapping, file->mapping_size);
+            file->mapping = NULL;
+        } else {
+            file->words = (const uint64 *) file->mapping;
+            file->entry_count = file->mapping_size / sizeof(uint64);
+        }
+    }
+    close(fd);
+
+    file->entry_count /= entry_words;
+    while (file->entry_count > 0) { // -graph_map may leave zero padding after a crash
+        const uint64 *last = file->words + ((file->entry_count - 1) * entry_words);
+        uint i;
+
+        for (i = 0; i < entry_words; i++) {
+            if (last[i] != 0ULL)
+                break;
+        }
+        if (i < entry_words)
+            break;
+        file->entry_count--;
+    }
+    return true;
+}
+
+void
+close_word_file(word_file_t *file) {
+    if (file->mapping != NULL)
+        munmap(file->mapping, file->mapping_size);
+    free(file->decoded);
+    memset(file, 0, sizeof(word_file_t));
+}
+
+/* module.log lines: "(<nodes>,<edges>,<cross>,<net>) Loaded module <id>: <start> - <end>" */
+void
+load_module_windows(const char *dir, const char *process, module_windows_t *windows,
+                    uint (*intern_module)(const char *id)) {
+    char path[MAX_PATH], line[1024];
+    uint capacity = 0, i;
+    FILE *log;
+
+    process_file_path(path, dir, process, "module", "log");
+    log = fopen(path, "r");
+    if (log == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), log) != NULL) {
+        unsigned long long node_count, edge_count, cross_count, network_count, start, end;
+        char action[16], *id, *range;
+        int consumed = 0;
+
+        if (sscanf(line, "(%llu,%llu,%llu,%llu) %15s module %n", &node_count, &edge_count,
+                   &cross_count, &network_count, action, &consumed) != 5 || consumed == 0)
+            continue;
+        id = line + consumed;
+        range = strrchr(id, ':'); // the id itself may contain a colon
+        if (range == NULL || sscanf(range + 1, " %llx - %llx", &start, &end) != 2)
+            continue;
+        *range = '\0';
+
+        if (strcmp(action, "Loaded") == 0) {
+            module_window_t *window;
+
+            if (windows->count == capacity) {
+                capacity = (capacity == 0) ? 64 : capacity * 2;
+                windows->windows = (module_window_t *) realloc(windows->windows,
+                                                               capacity * sizeof(module_window_t));
+            }
+            window = &windows->windows[windows->count++];
+            window->start = start;
+            window->end = end;
+            window->first_node = node_count;
+            window->last_node = ~0ULL;
+            window->module = intern_module(id);
+        } else if (strcmp(action, "Unloaded") == 0) {
+            for (i = windows->count; i > 0; i--) {
+                module_window_t *window = &windows->windows[i - 1];
+
+                if (window->start == start && window->end == end && window->last_node == ~0ULL) {
+                    window->last_node = node_count;
+                    break;
+                }
+            }
+        }
+    }
+    fclose(log);
+
+    qsort(windows->windows, windows->count, sizeof(module_window_t), compare_windows);
+    windows->max_end = (uint64 *) allocate(windows->count + 1, sizeof(uint64), false);
+    for (i = 0; i < windows->count; i++) {
+        module_window_t *window = &windows->windows[i];
+
+        windows->max_end[i] = window->end;
+        window->is_alone = true;
+        if (i > 0) {
+            if (windows->max_end[i - 1] > window->start)
+                window->is_alone = windows->windows[i - 1].is_alone = false;
+            if (windows->max_end[i - 1] > window->end)
+                windows->max_end[i] = windows->max_end[i - 1];
+        }
+    }
+}
+
+uint
+find_window(module_windows_t *windows, uint64 tag, uint64 node_index) {
+    uint low = 0, high = windows->count, fallback = NO_MODULE;
+
+    while (low < high) { // first window starting past the tag
+        uint middle = (low + high) / 2;
+
+        if (windows->windows[middle].start <= tag)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    while (low > 0 && windows->max_end[low - 1] > tag) {
+        module_window_t *window = &windows->windows[--low];
+
+        if (tag < window->end) {
+            if (node_index >= window->first_node && node_index <= window->last_node)
+                return low;
+            if (fallback == NO_MODULE)
+                fallback = low;
+        }
+    }
+    return fallback;
+}
+
+void
+free_module_windows(module_windows_t *windows) {
+    free(windows->windows);
+    free(windows->max_end);
+    memset(windows, 0, sizeof(module_windows_t));
+}
+
+void
+index_nodes(node_index_t *index, word_file_t *nodes) {
+    uint64 capacity = 16, i;
+    uint bits = 4;
+
+    while (capacity < (nodes->entry_count + (nodes->entry_count / 2))) {
+        capacity <<= 1;
+        bits++;
+    }
+    index->mask = capacity - 1;
+    index->shift = 64 - bits;
+    index->duplicates = 0;
+    index->slots = (node_slot_t *) allocate_huge(capacity * sizeof(node_slot_t));
+    memset(index->slots, 0xff, capacity * sizeof(node_slot_t));
+
+    for (i = 0; i < nodes->entry_count; i++) {
+        uint64 word = nodes->words[i * NODE_WORDS];
+        uint64 key = NODE_KEY(NODE_TAG(word), TAG_VERSION(word)), slot = node_home_slot(index, key);
+
+        while (index->slots[slot].record != NO_NODE) {
+            if (index->slots[slot].key == key)
+                break;
+            slot = (slot + 1) & index->mask;
+        }
+        if (index->slots[slot].record != NO_NODE) {
+            index->duplicates++;
+        } else {
+            index->slots[slot].key = key;
+            index->slots[slot].record = (uint) i;
+        }
+    }
+}
+
+void
+free_node_index(node_index_t *index) {
+    free(index->slots);
+    memset(index, 0, sizeof(node_index_t));
+}
+
+void *
+allocate(uint64 count, size_t size, bool zero) {
+    void *block = zero ? calloc(count, size) : malloc(count * size);
+
+    if (block == NULL) {
+        fprintf(stderr, "Out of memory allocating %llu bytes\n",
+                (unsigned long long) (count * size));
+        exit(1);
+    }
+    return block;
+}
+
+void *
+allocate_huge(size_t size) {
+    void *block;
+
+    if (posix_memalign(&block, HUGE_PAGE_SIZE, size) != 0) {
+        fprintf(stderr, "Out of memory allocating %llu bytes\n", (unsigned long long) size);
+        exit(1);
+    }
+    madvise(block, size, MADV_HUGEPAGE);
+    return block;
+}
+
+/**** private functions ****/
+
+static bool
+decode_compact(const byte *data, size_t size, word_file_t *file) {
+    uint64 word_total = 0, decoded = 0;
+    size_t offset = 0, frame_size;
+
+    while ((offset + TRACE_FRAME_HEADER_SIZE) <= size) { // count first, to decode in place
+        frame_size = trace_frame_size(data + offset);
+        if (frame_size == 0 || (offset + frame_size) > size)
+            break; // a crash may leave a partial frame
+        word_total += trace_frame_word_count(data + offset);
+        offset += frame_size;
+    }
+
+    file->decoded = (uint64 *) malloc((word_total + 1) * sizeof(uint64));
+    if (file->decoded == NULL)
+        return false;
+    for (offset = 0; decoded < word_total; offset += frame_size) {
+        frame_size = trace_frame_decode(data + offset, size - offset, file->decoded + decoded);
+        if (frame_size == 0)
+            return false;
+        decoded += trace_frame_word_count(data + offset);
+    }
+    file->words = file->decoded;
+    file->entry_count = word_total;
+    return true;
+}
+
+static int
+compare_windows(const void *left, const void *right) {
+    const module_window_t *a = (const module_window_t *) left, *b = (const module_window_t *) right;
+
+    if (a->start != b->start)
+        return (a->start < b->start) ? -1 : 1;
+    return (a->first_node < b->first_node) ? -1 : (a->first_node > b->first_node);
+}
@@ -0,0 +1,149 @@
+#ifndef GRAPH_FILES_H
+#define GRAPH_FILES_H 1
+
+/* Readers for the graph files of a run directory, shared by the offline tools (graph_analyze and
+ * graph_merge): the process names of a run, the word files of a process (raw .dat, mapped and
+ * read in place, or compact .cdat), the module loads of module.log, and an open-addressed index
+ * of the nodes of a process. UNIX only. Out of memory is reported and fatal. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crowd_safe_trace_frame.h"
+
+#define NODE_WORDS 2
+#define EDGE_WORDS 2
+#define CROSS_WORDS 3
+#define MAX_PROCESSES 256
+#define MAX_PATH 1024
+#define NO_NODE 0xffffffffU
+#define NO_MODULE 0xffffffffU
+#define HUGE_PAGE_SIZE 0x200000
+#define FULL_MATCH_MASK 0xffffffffffffffffULL
+#define NODE_MATCH_MASK 0xffffffffffffULL /* the low 40 bits of the tag and the version */
+
+#define NODE_KEY(tag, version) (((tag) << 8) | (version))
+#define NODE_TAG(word) ((word) & 0xffffffffffffULL)
+#define NODE_META(word) ((byte) ((word) >> 0x30))
+#define EDGE_FROM_TAG(word) ((word) & 0xffffffffffULL)
+#define EDGE_ORDINAL(word) ((byte) ((word) >> 0x28))
+#define EDGE_TYPE(word) ((byte) ((word) >> 0x30))
+#define EDGE_TO_TAG(word) ((word) & 0xffffffffffffULL) /* nodes record 6 bytes of the tag */
+#define TAG_VERSION(word) ((byte) ((word) >> 0x38))
+#define EDGE_FROM_KEY(word) NODE_KEY(EDGE_FROM_TAG(word), TAG_VERSION(word))
+#define EDGE_TO_KEY(word) NODE_KEY(EDGE_TO_TAG(word), TAG_VERSION(word))
+
+/* The words of one graph file, either mapped in place or decoded from compact frames. */
+typedef struct word_file_t word_file_t;
+struct word_file_t {
+    const uint64 *words;
+    uint64 entry_count;
+    void *mapping;
+    size_t mapping_size;
+    uint64 *decoded;
+};
+
+/* One load of a module, active for the nodes written between its load and unload. */
+typedef struct module_window_t module_window_t;
+struct module_window_t {
+    uint64 start;
+    uint64 end;
+    uint64 first_node;
+    uint64 last_node;
+    uint module;
+    bool is_alone; // overlaps no other window
+};
+
+/* The module loads of one process, sorted by start. */
+typedef struct module_windows_t module_windows_t;
+struct module_windows_t {
+    module_window_t *windows;
+    uint count;
+    uint64 *max_end; // running maximum of `end` over the windows
+};
+
+typedef struct node_slot_t node_slot_t;
+struct node_slot_t {
+    uint64 key;
+    uint record; // NO_NODE when the slot is empty
+};
+
+/* Open-addressed index of the node records of one process, homed by NODE_MATCH_MASK. */
+typedef struct node_index_t node_index_t;
+struct node_index_t {
+    node_slot_t *slots;
+    uint64 mask;
+    uint shift;
+    uint64 duplicates; // later records of a tag and version that is already indexed
+};
+
+/**** public functions ****/
+
+/* Fills `names` with the processes of a run directory, and returns how many there are. */
+uint
+find_processes(const char *dir, char names[][MAX_PATH]);
+
+void
+process_file_path(char *path, const char *dir, const char *process, const char *basename,
+                  const char *extension);
+
+/* Opens <process>.<basename> as .dat (mapped) or .cdat (decoded). A missing file is empty. */
+bool
+open_word_file(const char *dir, const char *process, const char *basename, uint entry_words,
+               word_file_t *file);
+
+void
+close_word_file(word_file_t *file);
+
+/* Reads the module loads of a process; `intern_module` maps each module id to its index. A
+ * missing module.log leaves no windows. */
+void
+load_module_windows(const char *dir, const char *process, module_windows_t *windows,
+                    uint (*intern_module)(const char *id));
+
+/* Finds the load of a module covering `tag` that was active when the node was written, or
+ * else any load covering it (the counts in module.log are approximate across threads).
+ * Returns the index of the window, or NO_MODULE. */
+uint
+find_window(module_windows_t *windows, uint64 tag, uint64 node_index);
+
+void
+free_module_windows(module_windows_t *windows);
+
+/* Indexes each node by its first record; later records of the same tag and version are
+ * counted as duplicates. */
+void
+index_nodes(node_index_t *index, word_file_t *nodes);
+
+void
+free_node_index(node_index_t *index);
+
+void *
+allocate(uint64 count, size_t size, bool zero);
+
+/* Randomly accessed arrays of many MB take a TLB miss on nearly every access with small pages. */
+void *
+allocate_huge(size_t size);
+
+/* Fibonacci hashing: cheaper than a full mix on this hot path, and spreads runs of tags evenly. */
+static inline uint64
+node_home_slot(node_index_t *index, uint64 key) {
+    return ((key & NODE_MATCH_MASK) * 0x9e3779b97f4a7c15ULL) >> index->shift;
+}
+
+/* Finds the node whose key matches `key` in the bits of `match_mask`. The key is kept in the
+ * slot, so a lookup misses the cache only once. */
+static inline uint
+lookup_node(node_index_t *index, uint64 key, uint64 match_mask) {
+    uint64 slot;
+
+    for (slot = node_home_slot(index, key); index->slots[slot].record != NO_NODE;
+         slot = (slot + 1) & index->mask) {
+        if ((index->slots[slot].key & match_mask) == key)
+            return index->slots[slot].record;
+    }
+    return NO_NODE;
+}
+
+#endif
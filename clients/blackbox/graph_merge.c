@@ -0,0 +1,1092 @@
+/* Blackbox offline graph merge standalone app. */
+
+/* Merges the graphs of every process in N run directories into one graph. Tags vary between runs,
+ * so a node is identified by its module (by the module.log ranges), its offset in the module and
+ * its block hash, and an edge by the identities of its two nodes, its type, its exit ordinal and
+ * (cross-module) its edge hash. Each merged node and edge counts the runs and the processes in
+ * which it appears.
+ *
+ * The merge is an external sort, so the merged graph may be far larger than RAM. A pool of worker
+ * threads reads the processes, each into a buffer of merge records (-memory is split among the
+ * workers). A full buffer is sorted, stripped of duplicates and spilled to the temp directory.
+ * Records are sorted by the hash of their source node first, so every spill splits at the same
+ * points into hash partitions. When there are more than MERGE_FAN_IN spills, groups of them are
+ * merged into larger spills; then each partition is merged by one worker, counting the runs and
+ * processes of each key, and the partition outputs are concatenated. Besides the buffers, each
+ * worker holds only the node index of the process it is reading (about 40 bytes per node).
+ *
+ * Output files in the -out directory, each a flat array of records sorted by source node hash:
+ *   merged.modules.txt       module ids, one per line: line n is module n (sorted by id)
+ *   merged.nodes.dat         merged_node_t
+ *   merged.edges.dat         merged_edge_t, with an edge_hash of 0
+ *   merged.cross-module.dat  merged_edge_t
+ * Nodes outside of every module are assigned to "<unknown>", at the low 32 bits of their tag.
+ * Up to 64K runs, and up to 4G nodes and 4G edges per process.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "graph_files.h"
+
+#define MAX_RUNS 0x10000
+#define MAX_PARTITIONS 0x100
+#define MERGE_FAN_IN 0x40
+#define MIN_READ_RECORDS 0x1000
+#define OUTPUT_BUFFER_SIZE 0x100000
+#define COPY_BUFFER_SIZE 0x100000
+#define TEMP_NAME_MAX 0x40 // room for the longest name under temp_dir, "/<partition>.merged.cross-module.dat"
+
+#define PARTITION(hash) ((uint) ((hash) >> partition_shift))
+
+typedef enum record_kind record_kind;
+enum record_kind {
+    record_node,
+    record_edge,
+    record_cross,
+    _record_kind_count
+};
+
+static const char *output_names[_record_kind_count] = {
+    "merged.nodes.dat", "merged.edges.dat", "merged.cross-module.dat"
+};
+
+typedef struct node_id_t node_id_t;
+struct node_id_t {
+    uint64 hash;
+    uint module;
+    uint offset; // from the start of the module
+};
+
+/* One node or edge of one process. A node has an empty `to`. */
+typedef struct merge_record_t merge_record_t;
+struct merge_record_t {
+    node_id_t from;
+    node_id_t to;
+    uint64 edge_hash;
+    byte kind;
+    byte type; // of the edge, or the meta type of the node (which is not part of the key)
+    byte ordinal;
+    byte unused;
+    ushort run;
+    ushort process;
+};
+
+typedef struct merged_node_t merged_node_t;
+struct merged_node_t {
+    node_id_t id;
+    uint run_count;
+    uint process_count;
+    byte meta; // in the first process
+    byte unused[7];
+};
+
+typedef struct merged_edge_t merged_edge_t;
+struct merged_edge_t {
+    node_id_t from;
+    node_id_t to;
+    uint64 edge_hash;
+    uint run_count;
+    uint process_count;
+    byte type;
+    byte ordinal;
+    byte unused[6];
+};
+
+typedef struct job_t job_t;
+struct job_t {
+    const char *dir;
+    char process[MAX_PATH];
+    ushort run;
+    ushort index;
+    module_windows_t windows;
+};
+
+/* A sorted run of records in the temp directory, split into the hash partitions. */
+typedef struct spill_t spill_t;
+struct spill_t {
+    char path[MAX_PATH];
+    uint64 partition_starts[MAX_PARTITIONS + 1]; // in records; the last is the record count
+};
+
+typedef struct spill_reader_t spill_reader_t;
+struct spill_reader_t {
+    int fd;
+    uint64 next; // the next record to read from the file
+    uint64 end;
+    merge_record_t *buffer;
+    uint buffered;
+    uint position;
+};
+
+/* A k-way merge of ranges of spills, by a min-heap of readers on their current record. */
+typedef struct merger_t merger_t;
+struct merger_t {
+    spill_reader_t *readers;
+    uint *heap;
+    uint heap_count;
+    uint reader_count;
+};
+
+typedef struct spill_writer_t spill_writer_t;
+struct spill_writer_t {
+    spill_t *spill;
+    FILE *file;
+    uint64 count;
+    uint partition;
+};
+
+typedef struct merge_counts_t merge_counts_t;
+struct merge_counts_t {
+    uint64 entries[_record_kind_count];
+    uint64 in_every_run[_record_kind_count];
+    uint64 in_one_run[_record_kind_count];
+};
+
+typedef struct worker_t worker_t;
+struct worker_t {
+    pthread_t thread;
+    merge_record_t *buffer;
+    uint64 buffered;
+    uint64 inputs[_record_kind_count];
+    uint64 dangling;
+    uint64 duplicate_nodes;
+    merge_counts_t counts;
+    bool failed;
+};
+
+static job_t *jobs;
+static uint job_count, run_count;
+static volatile uint next_task;
+static uint task_count;
+
+static char **module_ids;
+static uint module_count, module_capacity, unknown_module;
+
+static spill_t **spills;
+static uint spill_count, spill_capacity, spill_sequence;
+static spill_t **merged_spills; // the output of a merge pass
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char temp_dir[MAX_PATH];
+static const char *out_dir;
+static uint thread_count, partition_count, partition_shift;
+static uint64 buffer_records, read_records;
+
+/**** private prototypes ****/
+
+static int
+usage(const char *msg);
+
+static double
+elapsed_seconds(struct timespec *start);
+
+static uint
+intern_module(const char *id);
+
+static int
+compare_module_ids(const void *left, const void *right);
+
+static void
+prepare_modules();
+
+static void
+run_workers(worker_t *workers, void *(*work)(void *), uint tasks);
+
+static void *
+read_processes(void *arg);
+
+static bool
+read_process(worker_t *worker, job_t *job);
+
+static inline void
+add_record(worker_t *worker, merge_record_t *record);
+
+static void
+spill_buffer(worker_t *worker);
+
+static void *
+merge_spill_groups(void *arg);
+
+static void *
+merge_partitions(void *arg);
+
+static bool
+merge_partition(worker_t *worker, uint partition);
+
+static void
+emit_entry(merge_record_t *key, uint runs, uint processes, FILE **outputs,
+           merge_counts_t *counts);
+
+static int
+compare_keys(const merge_record_t *a, const merge_record_t *b);
+
+static int
+compare_records(const void *left, const void *right);
+
+static spill_t *
+new_spill();
+
+static void
+add_spill(spill_t *spill);
+
+static bool
+open_spill_writer(spill_writer_t *writer);
+
+static bool
+write_spill_record(spill_writer_t *writer, merge_record_t *record);
+
+static bool
+close_spill_writer(spill_writer_t *writer);
+
+static bool
+merger_init(merger_t *merger, spill_t **sources, uint count, uint first_partition,
+            uint end_partition);
+
+static bool
+merger_next(merger_t *merger, merge_record_t *record);
+
+static void
+merger_free(merger_t *merger);
+
+static void
+refill_reader(spill_reader_t *reader);
+
+static inline merge_record_t *
+heap_record(merger_t *merger, uint index);
+
+static void
+sift_down(merger_t *merger, uint index);
+
+static bool
+partition_path(char *path, uint partition, record_kind kind);
+
+static bool
+concatenate_outputs(uint64 *sizes);
+
+/**** public functions ****/
+
+int
+main(int argc, char **argv) {
+    static char processes[MAX_PROCESSES][MAX_PATH];
+    const char *temp_parent = NULL;
+    uint64 memory_mb = 1024, inputs[_record_kind_count] = { 0 }, sizes[_record_kind_count];
+    uint64 dangling = 0, duplicate_nodes = 0, pass_count = 0;
+    merge_counts_t counts;
+    struct timespec start, phase;
+    double read_seconds, merge_seconds;
+    worker_t *workers;
+    FILE *module_file;
+    char path[MAX_PATH];
+    uint i, k, run, process_count;
+    int arg;
+
+    thread_count = (uint) sysconf(_SC_NPROCESSORS_ONLN);
+    for (arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-threads") == 0 && arg + 1 < argc)
+            thread_count = (uint) strtoul(argv[++arg], NULL, 0);
+        else if (strcmp(argv[arg], "-memory") == 0 && arg + 1 < argc)
+            memory_mb = strtoull(argv[++arg], NULL, 0);
+        else if (strcmp(argv[arg], "-temp") == 0 && arg + 1 < argc)
+            temp_parent = argv[++arg];
+        else if (strcmp(argv[arg], "-out") == 0 && arg + 1 < argc)
+            out_dir = argv[++arg];
+        else if (argv[arg][0] == '-')
+            return usage("unknown option");
+        else
+            break;
+    }
+    if (out_dir == NULL || arg == argc)
+        return usage("");
+    if (argc - arg > MAX_RUNS)
+        return usage("too many run directories");
+    if (thread_count == 0)
+        thread_count = 1;
+    if (memory_mb == 0)
+        memory_mb = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (run = 0; arg < argc; arg++, run++) {
+        process_count = find_processes(argv[arg], processes);
+        if (process_count == 0) {
+            fprintf(stderr, "No graph files in %s\n", argv[arg]);
+            return 1;
+        }
+        jobs = (job_t *) realloc(jobs, (job_count + process_count) * sizeof(job_t));
+        for (i = 0; i < process_count; i++) {
+            job_t *job = &jobs[job_count++];
+
+            memset(job, 0, sizeof(job_t));
+            job->dir = argv[arg];
+            strcpy(job->process, processes[i]);
+            job->run = (ushort) run;
+            job->index = (ushort) i;
+        }
+    }
+    run_count = run;
+    prepare_modules();
+
+    if (mkdir(out_dir, 0755) != 0 && errno != EEXIST)
+        return usage("cannot create the output directory");
+    if (snprintf(temp_dir, MAX_PATH - TEMP_NAME_MAX, "%s/graph_merge.%d",
+                 (temp_parent == NULL) ? out_dir : temp_parent, (int) getpid()) >= MAX_PATH - TEMP_NAME_MAX)
+        return usage("the temp directory path is too long");
+    if (mkdir(temp_dir, 0700) != 0)
+        return usage("cannot create the temp directory");
+
+    snprintf(path, MAX_PATH, "%s/merged.modules.txt", out_dir);
+    module_file = fopen(path, "w");
+    if (module_file == NULL)
+        return usage("cannot write to the output directory");
+    for (i = 0; i < module_count; i++)
+        fprintf(module_file, "%s\n", module_ids[i]);
+    fclose(module_file);
+
+    for (partition_count = 2, partition_shift = 63;
+         partition_count < (thread_count * 4) && partition_count < MAX_PARTITIONS;
+         partition_count <<= 1, partition_shift--)
+        ;
+    buffer_records = ((memory_mb << 20) / thread_count) / sizeof(merge_record_t);
+    if (buffer_records < MIN_READ_RECORDS)
+        buffer_records = MIN_READ_RECORDS;
+    read_records = buffer_records / MERGE_FAN_IN;
+    if (read_records < MIN_READ_RECORDS)
+        read_records = MIN_READ_RECORDS;
+    workers = (worker_t *) allocate(thread_count, sizeof(worker_t), true);
+
+    /* read every process into sorted spills */
+    run_workers(workers, read_processes, job_count);
+    read_seconds = elapsed_seconds(&start);
+    for (i = 0; i < thread_count; i++) {
+        if (workers[i].failed)
+            return 1;
+        for (k = 0; k < _record_kind_count; k++)
+            inputs[k] += workers[i].inputs[k];
+        dangling += workers[i].dangling;
+        duplicate_nodes += workers[i].duplicate_nodes;
+        free(workers[i].buffer);
+        workers[i].buffer = NULL;
+    }
+
+    /* merge groups of spills until the final merge can read them all at once */
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    printf("Read %u processes of %u runs into %u spills in %.2f s\n", job_count, run_count,
+           spill_count, read_seconds);
+    while (spill_count > MERGE_FAN_IN) {
+        uint group_count = (spill_count + MERGE_FAN_IN - 1) / MERGE_FAN_IN;
+
+        merged_spills = (spill_t **) allocate(group_count, sizeof(spill_t *), true);
+        run_workers(workers, merge_spill_groups, group_count);
+        for (i = 0; i < thread_count; i++) {
+            if (workers[i].failed)
+                return 1;
+        }
+        free(spills);
+        spills = merged_spills;
+        spill_count = spill_capacity = group_count;
+        pass_count++;
+    }
+
+    run_workers(workers, merge_partitions, partition_count);
+    memset(&counts, 0, sizeof(merge_counts_t));
+    for (i = 0; i < thread_count; i++) {
+        if (workers[i].failed)
+            return 1;
+        for (k = 0; k < _record_kind_count; k++) {
+            counts.entries[k] += workers[i].counts.entries[k];
+            counts.in_every_run[k] += workers[i].counts.in_every_run[k];
+            counts.in_one_run[k] += workers[i].counts.in_one_run[k];
+        }
+    }
+    for (i = 0; i < spill_count; i++) {
+        unlink(spills[i]->path);
+        free(spills[i]);
+    }
+    if (!concatenate_outputs(sizes))
+        return 1;
+    rmdir(temp_dir);
+    merge_seconds = elapsed_seconds(&phase);
+
+    printf("  input: %llu nodes (%llu duplicates), %llu edges, %llu cross-module edges "
+           "(%llu with a missing node)\n", (unsigned long long) inputs[record_node],
+           (unsigned long long) duplicate_nodes, (unsigned long long) inputs[record_edge],
+           (unsigned long long) inputs[record_cross], (unsigned long long) dangling);
+    printf("  %u modules, %u threads, %u partitions, %llu merge passes\n", module_count,
+           thread_count, partition_count, (unsigned long long) (pass_count + 1));
+    printf("  %-20s %14s %14s %14s %14s\n", "merged", "entries", "in every run", "in one run",
+           "bytes");
+    for (k = 0; k < _record_kind_count; k++) {
+        printf("  %-20s %14llu %14llu %14llu %14llu\n", output_names[k] + 7,
+               (unsigned long long) counts.entries[k], (unsigned long long) counts.in_every_run[k],
+               (unsigned long long) counts.in_one_run[k], (unsigned long long) sizes[k]);
+    }
+    printf("\nMerged in %.2f s (%.2f s reading, %.2f s merging)\n", elapsed_seconds(&start),
+           read_seconds, merge_seconds);
+
+    for (i = 0; i < job_count; i++)
+        free_module_windows(&jobs[i].windows);
+    free(jobs);
+    free(spills);
+    free(workers);
+    return 0;
+}
+
+/**** private functions ****/
+
+static int
+usage(const char *msg) {
+    if (msg != NULL && msg[0] != '\0')
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "usage: graph_merge [-threads <n>] [-memory <mb>] [-temp <dir>] -out <dir> "
+            "<run-dir>...\n");
+    return 1;
+}
+
+static double
+elapsed_seconds(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + ((now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+static uint
+intern_module(const char *id) {
+    uint i;
+
+    for (i = module_count; i > 0; i--) { // reloads are usually recent
+        if (strcmp(module_ids[i - 1], id) == 0)
+            return i - 1;
+    }
+    if (module_count == module_capacity) {
+        module_capacity = (module_capacity == 0) ? 64 : module_capacity * 2;
+        module_ids = (char **) realloc(module_ids, module_capacity * sizeof(char *));
+    }
+    module_ids[module_count] = strdup(id);
+    return module_count++;
+}
+
+static int
+compare_module_ids(const void *left, const void *right) {
+    return strcmp(*(char *const *) left, *(char *const *) right);
+}
+
+/* Loads the module windows of every process, and numbers the modules in the order of their ids,
+ * so that the merged graph does not depend on the order of the runs. */
+static void
+prepare_modules() {
+    char **unsorted;
+    uint *numbers, i, w;
+
+    for (i = 0; i < job_count; i++)
+        load_module_windows(jobs[i].dir, jobs[i].process, &jobs[i].windows, intern_module);
+    intern_module("<unknown>");
+
+    unsorted = (char **) allocate(module_count, sizeof(char *), false);
+    memcpy(unsorted, module_ids, module_count * sizeof(char *));
+    qsort(module_ids, module_count, sizeof(char *), compare_module_ids);
+    numbers = (uint *) allocate(module_count, sizeof(uint), false);
+    for (i = 0; i < module_count; i++) {
+        char **sorted = (char **) bsearch(&unsorted[i], module_ids, module_count, sizeof(char *),
+                                          compare_module_ids);
+
+        numbers[i] = (uint) (sorted - module_ids);
+    }
+    for (i = 0; i < job_count; i++) {
+        for (w = 0; w < jobs[i].windows.count; w++)
+            jobs[i].windows.windows[w].module = numbers[jobs[i].windows.windows[w].module];
+    }
+    unknown_module = numbers[module_count - 1]; // interned last
+    free(unsorted);
+    free(numbers);
+}
+
+/* Runs `work` on every worker, which takes tasks from `next_task` until all `tasks` are taken. */
+static void
+run_workers(worker_t *workers, void *(*work)(void *), uint tasks) {
+    uint i;
+
+    next_task = 0;
+    task_count = tasks;
+    for (i = 0; i < thread_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start worker %u\n", i);
+            exit(1);
+        }
+    }
+    for (i = 0; i < thread_count; i++)
+        pthread_join(workers[i].thread, NULL);
+}
+
+static void *
+read_processes(void *arg) {
+    worker_t *worker = (worker_t *) arg;
+    uint task;
+
+    worker->buffer = (merge_record_t *) allocate(buffer_records, sizeof(merge_record_t), false);
+    while (!worker->failed && (task = __sync_fetch_and_add(&next_task, 1)) < task_count) {
+        if (!read_process(worker, &jobs[task]))
+            worker->failed = true;
+    }
+    if (worker->buffered > 0)
+        spill_buffer(worker);
+    return NULL;
+}
+
+/* Nodes are attributed to modules as in graph_analyze; an edge goes out of the first node whose
+ * tag matches in the low 40 bits. */
+static bool
+read_process(worker_t *worker, job_t *job) {
+    word_file_t nodes, edges, cross;
+    node_index_t index;
+    node_id_t *ids;
+    module_window_t *cached = NULL;
+    merge_record_t record;
+    uint64 i;
+
+    memset(&edges, 0, sizeof(word_file_t));
+    memset(&cross, 0, sizeof(word_file_t));
+    if (!open_word_file(job->dir, job->process, "graph-node", NODE_WORDS, &nodes) ||
+        !open_word_file(job->dir, job->process, "graph-edge", EDGE_WORDS, &edges) ||
+        !open_word_file(job->dir, job->process, "cross-module", CROSS_WORDS, &cross)) {
+        fprintf(stderr, "Failed to read %s in %s\n", job->process, job->dir);
+        close_word_file(&nodes);
+        close_word_file(&edges);
+        return false;
+    }
+    if ((nodes.entry_count >= NO_NODE) || (edges.entry_count >= NO_NODE) ||
+        (cross.entry_count >= NO_NODE)) {
+        fprintf(stderr, "Too many nodes or edges in %s\n", job->process);
+        close_word_file(&nodes);
+        close_word_file(&edges);
+        close_word_file(&cross);
+        return false;
+    }
+
+    index_nodes(&index, &nodes);
+    worker->duplicate_nodes += index.duplicates;
+    ids = (node_id_t *) allocate(nodes.entry_count + 1, sizeof(node_id_t), false);
+    memset(&record, 0, sizeof(merge_record_t));
+    record.run = job->run;
+    record.process = job->index;
+
+    record.kind = record_node;
+    for (i = 0; i < nodes.entry_count; i++) {
+        uint64 word = nodes.words[i * NODE_WORDS], tag = NODE_TAG(word);
+        node_id_t *id = &ids[i];
+        uint window;
+
+        id->hash = nodes.words[(i * NODE_WORDS) + 1];
+        if (cached == NULL || tag < cached->start || tag >= cached->end) {
+            window = find_window(&job->windows, tag, i);
+            cached = NULL;
+            if (window != NO_MODULE && job->windows.windows[window].is_alone)
+                cached = &job->windows.windows[window];
+            if (window == NO_MODULE) {
+                id->module = unknown_module;
+                id->offset = (uint) tag;
+            } else {
+                id->module = job->windows.windows[window].module;
+                id->offset = (uint) (tag - job->windows.windows[window].start);
+            }
+        } else { // consecutive nodes share a module
+            id->module = cached->module;
+            id->offset = (uint) (tag - cached->start);
+        }
+        record.from = *id;
+        record.type = NODE_META(word);
+        add_record(worker, &record);
+    }
+    worker->inputs[record_node] += nodes.entry_count;
+
+    for (i = 0; i < edges.entry_count + cross.entry_count; i++) {
+        bool is_cross = (i >= edges.entry_count);
+        const uint64 *entry = is_cross ? cross.words + ((i - edges.entry_count) * CROSS_WORDS) :
+                                         edges.words + (i * EDGE_WORDS);
+        uint from = lookup_node(&index, EDGE_FROM_KEY(entry[0]), NODE_MATCH_MASK);
+        uint to = lookup_node(&index, EDGE_TO_KEY(entry[1]), FULL_MATCH_MASK);
+
+        if (from == NO_NODE || to == NO_NODE) {
+            worker->dangling++;
+            continue;
+        }
+        record.kind = is_cross ? record_cross : record_edge;
+        record.from = ids[from];
+        record.to = ids[to];
+        record.type = EDGE_TYPE(entry[0]);
+        record.ordinal = EDGE_ORDINAL(entry[0]);
+        record.edge_hash = is_cross ? entry[2] : 0ULL;
+        add_record(worker, &record);
+    }
+    worker->inputs[record_edge] += edges.entry_count;
+    worker->inputs[record_cross] += cross.entry_count;
+
+    free(ids);
+    free_node_index(&index);
+    close_word_file(&nodes);
+    close_word_file(&edges);
+    close_word_file(&cross);
+    return true;
+}
+
+static inline void
+add_record(worker_t *worker, merge_record_t *record) {
+    worker->buffer[worker->buffered++] = *record;
+    if (worker->buffered == buffer_records)
+        spill_buffer(worker);
+}
+
+/* Sorts the buffer, drops records repeated within a process, and writes it out as a spill. */
+static void
+spill_buffer(worker_t *worker) {
+    spill_writer_t writer;
+    uint64 i;
+
+    qsort(worker->buffer, worker->buffered, sizeof(merge_record_t), compare_records);
+    writer.spill = new_spill();
+    if (writer.spill == NULL || !open_spill_writer(&writer)) {
+        free(writer.spill);
+        worker->failed = true;
+        return;
+    }
+    for (i = 0; i < worker->buffered; i++) {
+        if (i > 0 && compare_records(&worker->buffer[i - 1], &worker->buffer[i]) == 0)
+            continue;
+        if (!write_spill_record(&writer, &worker->buffer[i]))
+            worker->failed = true;
+    }
+    if (!close_spill_writer(&writer))
+        worker->failed = true;
+    worker->buffered = 0;
+    add_spill(writer.spill);
+}
+
+/* Merges each group of MERGE_FAN_IN spills into one spill of `merged_spills`. */
+static void *
+merge_spill_groups(void *arg) {
+    worker_t *worker = (worker_t *) arg;
+    merge_record_t record, last;
+    spill_writer_t writer;
+    merger_t merger;
+    uint task, first, count, i;
+    bool has_last;
+
+    while (!worker->failed && (task = __sync_fetch_and_add(&next_task, 1)) < task_count) {
+        first = task * MERGE_FAN_IN;
+        count = (spill_count - first < MERGE_FAN_IN) ? (spill_count - first) : MERGE_FAN_IN;
+        writer.spill = new_spill();
+        if (writer.spill == NULL ||
+            !merger_init(&merger, spills + first, count, 0, partition_count) ||
+            !open_spill_writer(&writer)) {
+            worker->failed = true;
+            break;
+        }
+        for (has_last = false; merger_next(&merger, &record); has_last = true) {
+            if (has_last && compare_records(&last, &record) == 0)
+                continue;
+            if (!write_spill_record(&writer, &record))
+                worker->failed = true;
+            last = record;
+        }
+        merger_free(&merger);
+        if (!close_spill_writer(&writer))
+            worker->failed = true;
+        merged_spills[task] = writer.spill;
+        for (i = first; i < first + count; i++) {
+            unlink(spills[i]->path);
+            free(spills[i]);
+        }
+    }
+    return NULL;
+}
+
+static void *
+merge_partitions(void *arg) {
+    worker_t *worker = (worker_t *) arg;
+    uint task;
+
+    while (!worker->failed && (task = __sync_fetch_and_add(&next_task, 1)) < task_count) {
+        if (!merge_partition(worker, task))
+            worker->failed = true;
+    }
+    return NULL;
+}
+
+/* Records of one key arrive in order of run and process, so each new run or process is a change
+ * from the previous record. */
+static bool
+merge_partition(worker_t *worker, uint partition) {
+    FILE *outputs[_record_kind_count];
+    merge_record_t record, key;
+    merger_t merger;
+    char path[MAX_PATH];
+    uint runs = 0, processes = 0, k;
+    bool ok = true;
+
+    if (!merger_init(&merger, spills, spill_count, partition, partition + 1))
+        return false;
+    for (k = 0; k < _record_kind_count; k++) {
+        outputs[k] = partition_path(path, partition, (record_kind) k) ? fopen(path, "wb") : NULL;
+        if (outputs[k] == NULL) {
+            fprintf(stderr, "Failed to create %s\n", path);
+            while (k > 0)
+                fclose(outputs[--k]);
+            merger_free(&merger);
+            return false;
+        }
+        setvbuf(outputs[k], NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+
+    while (merger_next(&merger, &record)) {
+        if (processes > 0 && compare_keys(&key, &record) == 0) {
+            if (record.run != key.run) {
+                runs++;
+                processes++;
+            } else if (record.process != key.process) {
+                processes++;
+            }
+            key.run = record.run;
+            key.process = record.process;
+            continue;
+        }
+        if (processes > 0)
+            emit_entry(&key, runs, processes, outputs, &worker->counts);
+        key = record;
+        runs = processes = 1;
+    }
+    if (processes > 0)
+        emit_entry(&key, runs, processes, outputs, &worker->counts);
+
+    merger_free(&merger);
+    for (k = 0; k < _record_kind_count; k++) {
+        if (ferror(outputs[k]))
+            ok = false;
+        if (fclose(outputs[k]) != 0)
+            ok = false;
+    }
+    if (!ok)
+        fprintf(stderr, "Failed to write the output of partition %u\n", partition);
+    return ok;
+}
+
+static void
+emit_entry(merge_record_t *key, uint runs, uint processes, FILE **outputs,
+           merge_counts_t *counts) {
+    if (key->kind == record_node) {
+        merged_node_t node;
+
+        memset(&node, 0, sizeof(merged_node_t));
+        node.id = key->from;
+        node.run_count = runs;
+        node.process_count = processes;
+        node.meta = key->type;
+        fwrite(&node, sizeof(merged_node_t), 1, outputs[record_node]);
+    } else {
+        merged_edge_t edge;
+
+        memset(&edge, 0, sizeof(merged_edge_t));
+        edge.from = key->from;
+        edge.to = key->to;
+        edge.edge_hash = key->edge_hash;
+        edge.run_count = runs;
+        edge.process_count = processes;
+        edge.type = key->type;
+        edge.ordinal = key->ordinal;
+        fwrite(&edge, sizeof(merged_edge_t), 1, outputs[key->kind]);
+    }
+    counts->entries[key->kind]++;
+    if (runs == run_count)
+        counts->in_every_run[key->kind]++;
+    if (runs == 1)
+        counts->in_one_run[key->kind]++;
+}
+
+static inline int
+compare_ids(const node_id_t *a, const node_id_t *b) {
+    if (a->hash != b->hash)
+        return (a->hash < b->hash) ? -1 : 1;
+    if (a->module != b->module)
+        return (a->module < b->module) ? -1 : 1;
+    if (a->offset != b->offset)
+        return (a->offset < b->offset) ? -1 : 1;
+    return 0;
+}
+
+/* The source hash goes first, which keeps the partitions contiguous. */
+static int
+compare_keys(const merge_record_t *a, const merge_record_t *b) {
+    int order = compare_ids(&a->from, &b->from);
+
+    if (order != 0)
+        return order;
+    if (a->kind != b->kind)
+        return (a->kind < b->kind) ? -1 : 1;
+    if (a->kind == record_node)
+        return 0;
+    order = compare_ids(&a->to, &b->to);
+    if (order != 0)
+        return order;
+    if (a->type != b->type)
+        return (a->type < b->type) ? -1 : 1;
+    if (a->ordinal != b->ordinal)
+        return (a->ordinal < b->ordinal) ? -1 : 1;
+    if (a->edge_hash != b->edge_hash)
+        return (a->edge_hash < b->edge_hash) ? -1 : 1;
+    return 0;
+}
+
+static int
+compare_records(const void *left, const void *right) {
+    const merge_record_t *a = (const merge_record_t *) left, *b = (const merge_record_t *) right;
+    int order = compare_keys(a, b);
+
+    if (order != 0)
+        return order;
+    if (a->run != b->run)
+        return (a->run < b->run) ? -1 : 1;
+    return (a->process < b->process) ? -1 : (a->process > b->process);
+}
+
+/* Returns NULL if the path would not fit, which the length check on temp_dir rules out. */
+static spill_t *
+new_spill() {
+    spill_t *spill = (spill_t *) allocate(1, sizeof(spill_t), true);
+
+    if (snprintf(spill->path, MAX_PATH, "%s/%u.spill", temp_dir,
+                 __sync_fetch_and_add(&spill_sequence, 1)) >= MAX_PATH) {
+        fprintf(stderr, "Spill path too long under %s\n", temp_dir);
+        free(spill);
+        return NULL;
+    }
+    return spill;
+}
+
+static void
+add_spill(spill_t *spill) {
+    pthread_mutex_lock(&spill_lock);
+    if (spill_count == spill_capacity) {
+        spill_capacity = (spill_capacity == 0) ? 64 : spill_capacity * 2;
+        spills = (spill_t **) realloc(spills, spill_capacity * sizeof(spill_t *));
+    }
+    spills[spill_count++] = spill;
+    pthread_mutex_unlock(&spill_lock);
+}
+
+static bool
+open_spill_writer(spill_writer_t *writer) {
+    writer->file = fopen(writer->spill->path, "wb");
+    if (writer->file == NULL) {
+        fprintf(stderr, "Failed to create %s\n", writer->spill->path);
+        return false;
+    }
+    setvbuf(writer->file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    writer->count = 0;
+    writer->partition = 0;
+    return true;
+}
+
+/* Records arrive in order, so each partition starts where the first record past the previous
+ * one is written. */
+static bool
+write_spill_record(spill_writer_t *writer, merge_record_t *record) {
+    uint partition = PARTITION(record->from.hash);
+
+    while (writer->partition < partition)
+        writer->spill->partition_starts[++writer->partition] = writer->count;
+    writer->count++;
+    return fwrite(record, sizeof(merge_record_t), 1, writer->file) == 1;
+}
+
+static bool
+close_spill_writer(spill_writer_t *writer) {
+    bool ok = (ferror(writer->file) == 0);
+
+    while (writer->partition < partition_count)
+        writer->spill->partition_starts[++writer->partition] = writer->count;
+    if (fclose(writer->file) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "Failed to write %s\n", writer->spill->path);
+    return ok;
+}
+
+/* Merges the partitions [first_partition, end_partition) of the `sources`. */
+static bool
+merger_init(merger_t *merger, spill_t **sources, uint count, uint first_partition,
+            uint end_partition) {
+    uint i;
+
+    merger->readers = (spill_reader_t *) allocate(count + 1, sizeof(spill_reader_t), true);
+    merger->heap = (uint *) allocate(count + 1, sizeof(uint), false);
+    merger->heap_count = 0;
+    merger->reader_count = 0;
+    for (i = 0; i < count; i++) {
+        spill_reader_t *reader = &merger->readers[merger->reader_count];
+
+        reader->next = sources[i]->partition_starts[first_partition];
+        reader->end = sources[i]->partition_starts[end_partition];
+        if (reader->next == reader->end)
+            continue;
+        reader->fd = open(sources[i]->path, O_RDONLY);
+        if (reader->fd < 0) {
+            fprintf(stderr, "Failed to open %s\n", sources[i]->path);
+            merger_free(merger);
+            return false;
+        }
+        merger->reader_count++;
+        reader->buffer = (merge_record_t *) allocate(read_records, sizeof(merge_record_t), false);
+        refill_reader(reader);
+        merger->heap[merger->heap_count++] = merger->reader_count - 1;
+    }
+    for (i = merger->heap_count / 2; i > 0; i--)
+        sift_down(merger, i - 1);
+    return true;
+}
+
+static bool
+merger_next(merger_t *merger, merge_record_t *record) {
+    spill_reader_t *reader;
+
+    if (merger->heap_count == 0)
+        return false;
+
+    reader = &merger->readers[merger->heap[0]];
+    *record = reader->buffer[reader->position++];
+    if (reader->position == reader->buffered) {
+        if (reader->next == reader->end)
+            merger->heap[0] = merger->heap[--merger->heap_count];
+        else
+            refill_reader(reader);
+    }
+    if (merger->heap_count > 0)
+        sift_down(merger, 0);
+    return true;
+}
+
+static void
+merger_free(merger_t *merger) {
+    uint i;
+
+    for (i = 0; i < merger->reader_count; i++) {
+        close(merger->readers[i].fd);
+        free(merger->readers[i].buffer);
+    }
+    free(merger->readers);
+    free(merger->heap);
+    memset(merger, 0, sizeof(merger_t));
+}
+
+/* The spills are our own files, so a failed read is fatal. */
+static void
+refill_reader(spill_reader_t *reader) {
+    uint64 count = reader->end - reader->next;
+    size_t size, done = 0;
+
+    if (count > read_records)
+        count = read_records;
+    size = count * sizeof(merge_record_t);
+    while (done < size) {
+        ssize_t result = pread(reader->fd, ((byte *) reader->buffer) + done, size - done,
+                               (off_t) ((reader->next * sizeof(merge_record_t)) + done));
+
+        if (result <= 0) {
+            if (result < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to read a spill file\n");
+            exit(1);
+        }
+        done += (size_t) result;
+    }
+    reader->next += count;
+    reader->buffered = (uint) count;
+    reader->position = 0;
+}
+
+static inline merge_record_t *
+heap_record(merger_t *merger, uint index) {
+    spill_reader_t *reader = &merger->readers[merger->heap[index]];
+
+    return &reader->buffer[reader->position];
+}
+
+static void
+sift_down(merger_t *merger, uint index) {
+    while (true) {
+        uint child = (index * 2) + 1, smallest = index, swap;
+
+        if (child < merger->heap_count &&
+            compare_records(heap_record(merger, child), heap_record(merger, smallest)) < 0)
+            smallest = child;
+        child++;
+        if (child < merger->heap_count &&
+            compare_records(heap_record(merger, child), heap_record(merger, smallest)) < 0)
+            smallest = child;
+        if (smallest == index)
+            break;
+        swap = merger->heap[smallest];
+        merger->heap[smallest] = merger->heap[index];
+        merger->heap[index] = swap;
+        index = smallest;
+    }
+}
+
+static bool
+partition_path(char *path, uint partition, record_kind kind) {
+    if (snprintf(path, MAX_PATH, "%s/%u.%s", temp_dir, partition, output_names[kind]) >= MAX_PATH) {
+        fprintf(stderr, "Partition path too long under %s\n", temp_dir);
+        return false;
+    }
+    return true;
+}
+
+/* Appends the partition outputs of each kind, in partition order, to the merged file. */
+static bool
+concatenate_outputs(uint64 *sizes) {
+    char path[MAX_PATH];
+    byte *buffer = (byte *) allocate(COPY_BUFFER_SIZE, 1, false);
+    uint k, partition;
+    bool ok = true;
+
+    for (k = 0; k < _record_kind_count; k++) {
+        FILE *out;
+
+        sizes[k] = 0;
+        snprintf(path, MAX_PATH, "%s/%s", out_dir, output_names[k]);
+        out = fopen(path, "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Failed to create %s\n", path);
+            free(buffer);
+            return false;
+        }
+        for (partition = 0; partition < partition_count; partition++) {
+            FILE *in;
+            size_t size;
+
+            in = partition_path(path, partition, (record_kind) k) ? fopen(path, "rb") : NULL;
+            if (in == NULL) {
+                ok = false;
+                continue;
+            }
+            while ((size = fread(buffer, 1, COPY_BUFFER_SIZE, in)) > 0) {
+                if (fwrite(buffer, 1, size, out) != size)
+                    ok = false;
+                sizes[k] += size;
+            }
+            fclose(in);
+            unlink(path);
+        }
+        if (fclose(out) != 0)
+            ok = false;
+    }
+    free(buffer);
+    if (!ok)
+        fprintf(stderr, "Failed to write the merged files in %s\n", out_dir);
+    return ok;
+}
@@ -0,0 +1,321 @@
+/* Blackbox IBP table stress test. */
+
+/* Runs the lock-free insert and table retirement of the core IBP table (ibp_lockless.h) the
+ * way audit.c does, with many threads adding pairs while others probe their cached table
+ * pointer without a lock, as the in-cache lookup does. The table starts small so that it is
+ * resized many times during the run. Checks that every pair is added exactly once, that a
+ * lockless probe never sees anything but an empty slot or a whole pair, that a pair is found
+ * by its adder right away, and that retired tables are freed only after every thread has moved
+ * past them (freed tables are poisoned first, and ASan catches any later read).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crowd_safe_portable.h"
+
+typedef uint64 bb_tag_pairing_t;
+
+#define IBP_LOAD(slot) __atomic_load_n((slot), __ATOMIC_ACQUIRE)
+#define IBP_COMPARE_EXCHANGE(slot, compare, exchange) \
+    __sync_val_compare_and_swap((slot), (compare), (exchange))
+#define IBP_ATOMIC_ADD(var, value) __sync_add_and_fetch(&(var), (value))
+
+#include "../../core/x86/ibp_lockless.h"
+
+#define INSERTER_COUNT 8
+#define READER_COUNT 4
+#define PAIR_COUNT 200000
+#define READER_PROBES 2000000
+#define REFRESH_INTERVAL 64
+#define INITIAL_BITS 4
+#define LOAD_FACTOR_PERCENT 80
+#define SENTINEL ((bb_tag_pairing_t) 0x100000000ULL)
+#define POISON ((bb_tag_pairing_t) 0xdeadbeefdeadbeefULL)
+
+typedef struct table_t table_t;
+struct table_t {
+    bb_tag_pairing_t *slots; // 2^bits, then the sentinel
+    uint bits;
+    uint capacity;
+    int entries;
+    int resize_threshold;
+};
+
+/* the thread's view of the table, as kept in local_security_audit_state_t */
+typedef struct thread_state_t thread_state_t;
+struct thread_state_t {
+    table_t *table;
+    uint epoch;
+    uint index;
+};
+
+static table_t *volatile current;
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static ibp_epoch_t epoch; // under the write lock, as in audit.c
+static int added_counts[PAIR_COUNT];
+static int resize_count;
+static int failures;
+
+static void
+fail(const char *message, bb_tag_pairing_t value) {
+    if (__sync_add_and_fetch(&failures, 1) <= 10)
+        printf("FAIL %s: 0x%016llx\n", message, (unsigned long long) value);
+}
+
+static inline bb_tag_pairing_t
+pair_for(uint i) {
+    uint low = (i + 1) * 0x9e3779b1U;
+
+    return (((bb_tag_pairing_t) (i + 1)) << 32) | (low | 1U);
+}
+
+static inline bool
+is_pair(bb_tag_pairing_t value) {
+    uint i = (uint) (value >> 32);
+
+    return (i > 0) && (i <= PAIR_COUNT) && (value == pair_for(i - 1));
+}
+
+static inline uint
+index_mask(table_t *table) {
+    return (1U << table->bits) - 1;
+}
+
+static table_t *
+table_create(uint bits) {
+    table_t *table = (table_t *) malloc(sizeof(table_t));
+
+    table->bits = bits;
+    table->capacity = (1U << bits) + 1;
+    table->slots = (bb_tag_pairing_t *) calloc(table->capacity, sizeof(bb_tag_pairing_t));
+    table->slots[table->capacity - 1] = SENTINEL;
+    table->entries = 0;
+    table->resize_threshold = (int) (table->capacity * LOAD_FACTOR_PERCENT / 100);
+    return table;
+}
+
+static void
+free_retired(ibp_retired_t *retired) {
+    while (retired != NULL) {
+        ibp_retired_t *next = retired->next;
+        table_t *table = (table_t *) retired->table;
+        uint i;
+
+        for (i = 0; i < table->capacity; i++)
+            table->slots[i] = POISON;
+        free(table->slots);
+        free(table);
+        free(retired);
+        retired = next;
+    }
+}
+
+/* The in-cache lookup: no lock, through the thread's own table pointer. */
+static bool
+probe(table_t *table, bb_tag_pairing_t pair) {
+    uint mask = index_mask(table), index = ((uint) pair) & mask;
+
+    while (true) {
+        bb_tag_pairing_t e = IBP_LOAD(&table->slots[index]);
+
+        if (e == pair)
+            return true;
+        if (e == 0ULL)
+            return false;
+        if (!is_pair(e))
+            fail("probe saw a torn or stale entry", e);
+        index = (index + 1) & mask;
+    }
+}
+
+/* Called with the write lock, like hashtable_ibp_add() */
+static void
+add_locked(table_t *table, bb_tag_pairing_t pair) {
+    uint mask = index_mask(table), index = ((uint) pair) & mask;
+
+    while (table->slots[index] != 0ULL)
+        index = (index + 1) & mask;
+    __atomic_store_n(&table->slots[index], pair, __ATOMIC_RELEASE); // probes may be reading
+    table->entries++;
+}
+
+/* Called with the write lock, like check_size() and resized_custom() */
+static void
+resize_locked() {
+    table_t *old = current, *table = table_create(old->bits + 1);
+    ibp_retired_t *retired = (ibp_retired_t *) malloc(sizeof(ibp_retired_t));
+    uint i;
+
+    for (i = 0; i < old->capacity - 1; i++) {
+        if (old->slots[i] != 0ULL)
+            add_locked(table, old->slots[i]);
+    }
+    current = table;
+    resize_count++;
+
+    retired->table = old;
+    retired->capacity = old->capacity;
+    if (!ibp_epoch_retire(&epoch, retired)) {
+        retired->next = NULL;
+        free_retired(retired);
+    }
+}
+
+static bool
+lookup_locked(table_t *table, bb_tag_pairing_t pair) {
+    uint mask = index_mask(table), index = ((uint) pair) & mask;
+
+    for (; table->slots[index] != 0ULL; index = (index + 1) & mask) {
+        if (table->slots[index] == pair)
+            return true;
+    }
+    return false;
+}
+
+/* dr_ibp_add_new() */
+static bool
+add_new(bb_tag_pairing_t pair) {
+    ibp_insert_result_t result;
+    bool added = false;
+    table_t *table;
+
+    pthread_rwlock_rdlock(&table_lock);
+    table = current;
+    result = ibp_insert_lockless(table->slots, ((uint) pair) & index_mask(table),
+                                 index_mask(table), &table->entries, table->resize_threshold,
+                                 pair);
+    pthread_rwlock_unlock(&table_lock);
+    if (result != IBP_INSERT_FULL)
+        return (result == IBP_INSERT_ADDED);
+
+    pthread_rwlock_wrlock(&table_lock);
+    if (!lookup_locked(current, pair)) {
+        if ((current->entries + 1) > current->resize_threshold)
+            resize_locked();
+        add_locked(current, pair);
+        added = true;
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return added;
+}
+
+/* audit_thread_init(), refresh_ibp_table() */
+static void
+thread_enter(thread_state_t *state) {
+    pthread_rwlock_wrlock(&table_lock);
+    state->epoch = ibp_epoch_thread_init(&epoch);
+    state->table = current;
+    pthread_rwlock_unlock(&table_lock);
+}
+
+static void
+thread_refresh(thread_state_t *state, bool exiting) {
+    ibp_retired_t *reclaimed;
+
+    if (!exiting && (state->epoch == __atomic_load_n(&epoch.current, __ATOMIC_RELAXED)))
+        return;
+
+    pthread_rwlock_wrlock(&table_lock);
+    reclaimed = ibp_epoch_advance(&epoch, state->epoch, exiting);
+    state->epoch = epoch.current;
+    state->table = exiting ? NULL : current;
+    pthread_rwlock_unlock(&table_lock);
+
+    free_retired(reclaimed);
+}
+
+static void *
+inserter(void *arg) {
+    thread_state_t state;
+    uint i, start;
+
+    state.index = (uint) (size_t) arg;
+    thread_enter(&state);
+
+    /* each pair is offered by two neighboring inserters, which race to add it */
+    start = (state.index * (PAIR_COUNT / INSERTER_COUNT)) % PAIR_COUNT;
+    for (i = 0; i < (PAIR_COUNT / INSERTER_COUNT) * 2; i++) {
+        uint pair_index = (start + i) % PAIR_COUNT;
+        bb_tag_pairing_t pair = pair_for(pair_index);
+
+        if (!probe(state.table, pair) && add_new(pair)) {
+            __sync_add_and_fetch(&added_counts[pair_index], 1);
+            pthread_rwlock_rdlock(&table_lock);
+            if (!probe(current, pair))
+                fail("added pair is missing from the current table", pair);
+            pthread_rwlock_unlock(&table_lock);
+        }
+        if ((i % REFRESH_INTERVAL) == 0)
+            thread_refresh(&state, false);
+    }
+
+    thread_refresh(&state, true);
+    return NULL;
+}
+
+static void *
+reader(void *arg) {
+    thread_state_t state;
+    uint64 random = 0x2545f4914f6cdd1dULL + (size_t) arg;
+    uint i, hits = 0;
+
+    state.index = (uint) (size_t) arg;
+    thread_enter(&state);
+
+    for (i = 0; i < READER_PROBES; i++) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        hits += probe(state.table, pair_for((uint) (random % PAIR_COUNT)));
+        if ((i % REFRESH_INTERVAL) == 0)
+            thread_refresh(&state, false);
+    }
+
+    thread_refresh(&state, true);
+    return (void *) (size_t) hits;
+}
+
+int
+main(int argc, char **argv) {
+    pthread_t threads[INSERTER_COUNT + READER_COUNT];
+    uint i, found = 0;
+
+    ibp_epoch_init(&epoch);
+    current = table_create(INITIAL_BITS);
+
+    for (i = 0; i < INSERTER_COUNT; i++)
+        pthread_create(&threads[i], NULL, inserter, (void *) (size_t) i);
+    for (i = 0; i < READER_COUNT; i++)
+        pthread_create(&threads[INSERTER_COUNT + i], NULL, reader, (void *) (size_t) i);
+    for (i = 0; i < (INSERTER_COUNT + READER_COUNT); i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < PAIR_COUNT; i++) {
+        if (added_counts[i] != 1)
+            fail("pair was not added exactly once", pair_for(i));
+    }
+    for (i = 0; i < current->capacity - 1; i++) {
+        if (current->slots[i] != 0ULL) {
+            if (!is_pair(current->slots[i]))
+                fail("table holds a bogus entry", current->slots[i]);
+            found++;
+        }
+    }
+    if ((found != PAIR_COUNT) || (current->entries != PAIR_COUNT))
+        fail("table entry count is off", ((uint64) found << 32) | (uint) current->entries);
+    if (current->slots[current->capacity - 1] != SENTINEL)
+        fail("sentinel was overwritten", current->slots[current->capacity - 1]);
+    if ((epoch.retired != NULL) || (epoch.thread_count != 0))
+        fail("retired tables outlived every thread", (uint64) epoch.thread_count);
+
+    free(current->slots);
+    free(current);
+
+    if (failures == 0)
+        printf("ibp table: %d pairs from %d threads over %d resizes\n", PAIR_COUNT,
+               INSERTER_COUNT + READER_COUNT, resize_count);
+    return (failures == 0) ? 0 : 1;
+}
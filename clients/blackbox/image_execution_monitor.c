@@ -1,4 +1,5 @@
 #include "execution_monitor.h"
+#include "crowd_safe_dataset.h"
 //#include "../../core/options.h"
 //#include "../../core/x86/instrument.h"
 #include "indirect_link_hashtable.h"
@@ -18,12 +19,6 @@ struct monitor_bb_t {
     uint edges[1]; // fake array size: it's specified in `counts`
 }; // IMIBT = Intra Module Indirect Branch Target
 
-typedef struct monitor_bb_index_t monitor_bb_index_t;
-struct monitor_bb_index_t {
-    uint relative_tag;
-    uint data_offset;
-};
-
   /**** Vector Template  monitor_bb_index_vector_t ****/
 
 #define VECTOR_NAME_KEY monitor_bb_index_vector
@@ -42,12 +37,6 @@ struct monitor_bb_index_t {
 #define VECTOR_ENTRY_INLINE 1
 #include "../drcontainers/drvectorx.h"
 
-typedef struct module_dataset_t module_dataset_t;
-struct module_dataset_t {
-    uint name_offset;
-    uint index_offset;
-};
-
   /**** Vector Template  module_dataset_vector_t ****/
 
 #define VECTOR_NAME_KEY module_dataset_vector
@@ -64,6 +53,13 @@ struct module_dataset_t {
 #define VECTOR_ENTRY_INLINE 1
 #include "../drcontainers/drvectorx.h"
 
+/* The blocks of one module: its sorted index, and the compiled tree over it if there is one. */
+struct monitor_module_data_t {
+    monitor_bb_index_vector_t index; // first: IS_SAME_MODULE() in crowd_safe_trace.c reads it
+    dataset_tree_node_t *tree;       // NULL when the dataset has only the original layout
+    uint tree_count;
+};
+
 alarm_data_t *alarm_counters;
 alarm_data_t *alarm_limits;
 
@@ -72,6 +68,7 @@ static struct dataset_t {
     uint offset;
     size_t size;
     module_dataset_vector_t modules;
+    dataset_directory_t *directory; // of the compiled index, or NULL
 } dataset;
 
 #pragma pack(pop)
@@ -108,8 +105,7 @@ static struct dataset_t {
 
 #define MODULE_NAME(module) ((char*)int2p(dataset.offset + module.name_offset))
 #define BB_DATA(bb_index) ((monitor_bb_t*)int2p(dataset.offset + bb_index->data_offset))
-#define GET_BB_INDEX(module, relative_tag) \
-    monitor_bb_index_vector_search((monitor_bb_index_vector_t*)module->monitor_data, relative_tag)
+#define GET_BB_INDEX(module, relative_tag) find_bb_index(module->monitor_data, relative_tag)
 
 #define GET_RELATIVE_TAG(module, tag) (p2int(tag) - p2int(module->start_pc))
 #define GET_ABSOLUTE_TAG(module, relative_tag) int2p(p2int(module->start_pc) + p2int(relative_tag))
@@ -203,6 +199,9 @@ static bool *monitor_exited = NULL;
 static void
 init_dataset();
 
+static inline monitor_bb_index_t *
+find_bb_index(monitor_module_data_t *data, uint relative_tag);
+
 static bool
 verify_black_box_entry(module_location_t *from_module, module_location_t *to_module,
     app_pc from, app_pc to, bb_hash_t to_hash, bb_hash_t edge_hash);
@@ -302,7 +301,7 @@ is_monitor_active() {
 void
 get_monitor_module(module_location_t *module) {
     char module_id[256] = {0};
-    module_dataset_t *data;
+    uint index_offset = 0, tree_offset = 0, tree_count = 0;
 
     if (!dataset.active) {
         module->monitor_data = NULL;
@@ -314,21 +313,38 @@ get_monitor_module(module_location_t *module) {
     else
         print_module_id(module_id, 256, module);
 
-    data = module_dataset_vector_search(&dataset.modules, module_id);
-    if (data == NULL) {
+    if (dataset.directory != NULL) {
+        uint position = dataset_find_module((byte*)int2p(dataset.offset), dataset.directory, module_id);
+        if (position != DATASET_NOT_FOUND) {
+            dataset_indexed_module_t *indexed = &DATASET_INDEXED_MODULES(dataset.directory)[position];
+            index_offset = indexed->index_offset;
+            tree_offset = indexed->tree_offset;
+            tree_count = indexed->tree_count;
+        }
+    } else {
+        module_dataset_t *data = module_dataset_vector_search(&dataset.modules, module_id);
+        if (data != NULL)
+            index_offset = data->index_offset;
+    }
+
+    if (index_offset == 0) {
         CS_LOG("No monitor data for module %s\n", module_id);
 
         module->monitor_data = NULL;
     } else {
         // cs-todo: if the module has been loaded once already, copy from there
 
-        monitor_bb_index_vector_t *monitor_data = (monitor_bb_index_vector_t*)CS_ALLOC(sizeof(monitor_bb_index_vector_t));
-        memset(monitor_data, 0, sizeof(monitor_bb_index_vector_t));
-        monitor_data->entries = GET_MODULE_INDEX_SIZE(data->index_offset);
-        monitor_data->array = GET_MODULE_INDEX(data->index_offset);
-        monitor_data->comparator = relative_tag_comparator;
+        monitor_module_data_t *monitor_data = (monitor_module_data_t*)CS_ALLOC(sizeof(monitor_module_data_t));
+        memset(monitor_data, 0, sizeof(monitor_module_data_t));
+        monitor_data->index.entries = GET_MODULE_INDEX_SIZE(index_offset);
+        monitor_data->index.array = GET_MODULE_INDEX(index_offset);
+        monitor_data->index.comparator = relative_tag_comparator;
+        if (tree_offset != 0) {
+            monitor_data->tree = (dataset_tree_node_t*)int2p(dataset.offset + tree_offset);
+            monitor_data->tree_count = tree_count;
+        }
 
-        module->monitor_data = (monitor_module_data_t*)monitor_data;
+        module->monitor_data = monitor_data;
     }
 }
 
@@ -338,7 +354,7 @@ free_monitor_module(module_location_t *module) {
         return;
 
     if (module->monitor_data != NULL)
-        dr_global_free(module->monitor_data, sizeof(monitor_bb_index_vector_t));
+        dr_global_free(module->monitor_data, sizeof(monitor_module_data_t));
 }
 
 bool
@@ -731,11 +747,13 @@ close_execution_monitor() {
 static inline void
 init_dataset() {
     extern char *monitor_dataset_path;
+    dataset_footer_t *footer;
     uint64 file_size;
     file_t dataset_file;
 
     dataset.active = false; // toggle on success, below
     dataset.offset = dataset.size = 0;
+    dataset.directory = NULL;
 
     MON_DET("Opening monitor dataset file %s\n", monitor_dataset_path);
 
@@ -771,6 +789,12 @@ init_dataset() {
     dataset.modules.entries = (dataset.modules.array[0].name_offset / sizeof(module_dataset_t));
     dataset.modules.comparator = module_id_comparator;
 
+    footer = dataset_find_footer((byte*)int2p(dataset.offset), dataset.size);
+    if (footer != NULL) {
+        dataset.directory = (dataset_directory_t*)int2p(dataset.offset + footer->directory_offset);
+        CS_LOG("Monitor dataset has a compiled index of %d modules\n", dataset.directory->module_count);
+    }
+
     callout_multimap = (callout_multimap_t *)CS_ALLOC(sizeof(callout_multimap_t));
     callout_multimap_init(callout_multimap, NULL, "monitor callout map");
 
@@ -988,6 +1012,21 @@ relative_tag_comparator(monitor_bb_index_t index, uint relative_tag) {
     return index.relative_tag - relative_tag;
 }
 
+/* Finds the first index entry for `relative_tag`, which the callers iterate over the sorted
+ * index for every hash seen at that tag. */
+static inline monitor_bb_index_t *
+find_bb_index(monitor_module_data_t *data, uint relative_tag) {
+    uint position;
+
+    if (data->tree == NULL)
+        return monitor_bb_index_vector_search(&data->index, relative_tag);
+
+    position = dataset_tree_search(data->tree, data->tree_count, relative_tag);
+    if (position == DATASET_NOT_FOUND)
+        return NULL;
+    return &data->index.array[position];
+}
+
 #ifdef ANALYZE_UNEXPECTED_SUBGRAPHS
 static unrecognized_subgraph_t*
 create_unrecognized_subgraph(module_location_t *module) {
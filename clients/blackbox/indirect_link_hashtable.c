@@ -3,6 +3,8 @@
 #include "execution_monitor.h"
 #include "crowd_safe_trace.h"
 #include "crowd_safe_util.h"
+#include "crowd_safe_metrics.h"
+#include "uibp_sketch.h"
 
 /**** hashtablex.h interface elements ****/
 
@@ -29,6 +31,7 @@ static xref_multimap_t *xref_multimap; // synchronized under TAG_XREF_LOCK
 
 // Locking note: if necessary to hold the xref lock and the table lock at the same time,
 // acquire the xref lock first, then the table lock. This occurs in the xref removal callback.
+// The hashcode lock, when held with the xref lock, is always acquired first.
 #define TAG_XREF_LOCK dr_mutex_lock(tag_xref_mutex);
 #define TAG_XREF_UNLOCK dr_mutex_unlock(tag_xref_mutex);
 #define ASSERT_TAG_XREF_LOCK ASSERT(dr_mutex_self_owns(tag_xref_mutex));
@@ -92,6 +95,16 @@ struct global_uibp_t {
 
 static drvector_t *pending_uibp_list;
 
+/* Without -uibp_exact, UIBP executions are counted in this sketch instead of in each UIBP. A new
+ * UIBP is still reported once from the pending list, but after that only the pairs in the top
+ * heap of the sketch are reported again, and the final report skips all the others. When
+ * `uibp_table` reaches UIBP_SKETCH_TABLE_LIMIT pairs, every pair outside the top heap gets its
+ * final report and moves to the IBP table (see graduate_uibps()), so it is no longer counted. */
+static uibp_sketch_t *uibp_sketch;
+static bool is_final_uibp_clear; // the final report is freeing the UIBPs of the sketch mode
+
+# define UIBP_SKETCH_TABLE_LIMIT 0x1000
+
 # define MIN_UIBP_REPORT_MASK 0xff
 # define MAX_UIBP_REPORT_MASK 0xfffffff
 
@@ -117,6 +130,21 @@ write_pending_uibp_reports(dcontext_t *dcontext);
 
 static void
 uibp_removed(void *p);
+
+static inline uint
+count_uibp_execution(bb_tag_pairing_t key);
+
+static void
+write_top_uibp_reports();
+
+static void
+graduate_uibps(dcontext_t *dcontext);
+
+static inline uint
+uibp_execution_count(unexpected_ibp_t *uibp);
+
+static void
+remove_pending_uibp(unexpected_ibp_t *uibp);
 #endif
 
 static void
@@ -168,6 +196,11 @@ ibp_hash_global_init(dcontext_t *dcontext) {
         pending_uibp_list = CS_ALLOC(sizeof(drvector_t));
         drvector_init(pending_uibp_list, 0x40, false, NULL);
 
+        if (!CROWD_SAFE_UIBP_EXACT()) {
+            uibp_sketch = (uibp_sketch_t *)CS_ALLOC(sizeof(uibp_sketch_t));
+            uibp_sketch_init(uibp_sketch);
+        }
+
         final_uibp_report_written = CS_ALLOC(sizeof(bool));
         *final_uibp_report_written = false;
     }
@@ -200,6 +233,7 @@ ibp_hash_add(dcontext_t *dcontext, app_pc from, app_pc to) {
         xref_multimap_add(xref_multimap, to, key);
         TAG_XREF_UNLOCK
         added = true;
+        add_thread_metric(GET_CSTL(dcontext), metric_ibp_adds, 1);
     }
 
     DODEBUG({
@@ -325,9 +359,17 @@ install_unexpected_ibp(dcontext_t *dcontext, app_pc from, app_pc to, module_loca
             CS_ERR("Installing over the top of an existing UIBP!\n");
     }
 
+    if ((uibp_sketch != NULL) && (uibp_table->entries >= UIBP_SKETCH_TABLE_LIMIT))
+        graduate_uibps(dcontext);
+
     uibp_hashtable_add(uibp_table, key, uibp);
     xref_multimap_add(xref_multimap, from, key);
     xref_multimap_add(xref_multimap, to, key);
+    if (uibp_sketch != NULL) { // the pending list reports the first execution
+        uibp_sketch_add(uibp_sketch, (uint64) key);
+        uibp->flags |= UIBP_REPORT_PENDING;
+        drvector_append(pending_uibp_list, uibp);
+    }
     report_uibp(dcontext, cstl, is_admitted, from, to, from_module, to_module, edge_index);
     increment_pending_uib_count(dcontext);
     TAG_XREF_UNLOCK
@@ -340,6 +382,7 @@ notify_possibly_unexpected_ibp(dcontext_t *dcontext, crowd_safe_thread_local_t *
     bb_tag_pairing_t key;
     unexpected_ibp_t *uibp;
     module_location_t *from_module, *to_module;
+    uint execution_count;
 
     if (!CROWD_SAFE_MONITOR())
         return false;
@@ -368,10 +411,14 @@ notify_possibly_unexpected_ibp(dcontext_t *dcontext, crowd_safe_thread_local_t *
         from_module->module_name, MODULAR_PC(from_module, from),
         to_module->module_name, MODULAR_PC(to_module, to));
 
-    uibp->execution_count++;
-    if ((uibp->flags & UIBP_REPORT_PENDING) == 0) {
-        uibp->flags |= UIBP_REPORT_PENDING;
-        drvector_append(pending_uibp_list, uibp);
+    if (uibp_sketch != NULL) {
+        execution_count = count_uibp_execution(key);
+    } else {
+        execution_count = ++uibp->execution_count;
+        if ((uibp->flags & UIBP_REPORT_PENDING) == 0) {
+            uibp->flags |= UIBP_REPORT_PENDING;
+            drvector_append(pending_uibp_list, uibp);
+        }
     }
 
     report_uibp(dcontext, cstl, uibp->flags & UIBP_ADMITTED, from, to, from_module, to_module, uibp->edge_index);
@@ -403,13 +450,13 @@ notify_possibly_unexpected_ibp(dcontext_t *dcontext, crowd_safe_thread_local_t *
                 label = "E->E";
         }
 
-        if (is_report_threshold(&uibp->report_mask, uibp->execution_count))
+        if (is_report_threshold(&uibp->report_mask, execution_count))
             if (from_module == to_module)
-                CS_LOG("UIBP| %d executions of %s ibp %s("PX"->"PX")\n", uibp->execution_count, label,
+                CS_LOG("UIBP| %d executions of %s ibp %s("PX"->"PX")\n", execution_count, label,
                     from_module->module_name, MODULAR_PC(from_module, from), MODULAR_PC(to_module, to));
             else
                 CS_LOG("UIBP| %d executions of %s ibp %s("PX")->%s("PX")\n",
-                    uibp->execution_count, label, from_module->module_name, MODULAR_PC(from_module, from),
+                    execution_count, label, from_module->module_name, MODULAR_PC(from_module, from),
                     to_module->module_name, MODULAR_PC(to_module, to));
 
         if (is_report_threshold(&cstl->thread_uibp.report_mask, cstl->thread_uibp.total))
@@ -490,10 +537,11 @@ write_pending_uibp_reports(dcontext_t *dcontext) {
     for (i = 0; i < pending_uibp_list->entries; i++) {
         uibp = pending_uibp_list->array[i];
         write_meta_uib(uibp->from, uibp->to, uibp->edge_index, uibp->flags & UIBP_CROSS_MODULE,
-            uibp->flags & UIBP_ADMITTED, uibp->execution_count);
+            uibp->flags & UIBP_ADMITTED, uibp_execution_count(uibp));
         if (CROWD_SAFE_META_ON_CLOCK()) {
             bb_tag_pairing_t key = hash_ibp(uibp->from, uibp->to);
 
+            uibp->flags &= ~UIBP_REPORT_PENDING; // the list is cleared below
             uibp_hashtable_remove(uibp_table, key);
 
             dr_ibp_add(dcontext, key);
@@ -505,6 +553,8 @@ write_pending_uibp_reports(dcontext_t *dcontext) {
         }
     }
     drvector_clear(pending_uibp_list);
+    if (uibp_sketch != NULL)
+        write_top_uibp_reports();
     global_uibp->pending_report_count = 0;
     global_uibp->last_report = quick_system_time_millis();
 
@@ -531,8 +581,31 @@ write_final_uibp_report() {
 
     TAG_XREF_LOCK
     output_lock_acquire();
+    if (uibp_sketch != NULL) {
+        uint i;
+        unexpected_ibp_t *uibp;
+
+        for (i = 0; i < pending_uibp_list->entries; i++) {
+            uibp = pending_uibp_list->array[i];
+            write_meta_uib(uibp->from, uibp->to, uibp->edge_index, uibp->flags & UIBP_CROSS_MODULE,
+                uibp->flags & UIBP_ADMITTED, uibp_execution_count(uibp));
+            uibp->flags &= ~UIBP_REPORT_PENDING;
+        }
+        drvector_clear(pending_uibp_list);
+        write_top_uibp_reports();
+
+        CS_LOG("UIBP sketch: %lld executions of %d UIBPs; %d in the top heap after %lld evictions\n",
+            uibp_sketch->executions, uibp_table->entries, uibp_sketch->top_count, uibp_sketch->evictions);
+        for (i = 0; i < uibp_sketch->top_count; i++) {
+            uibp = uibp_hashtable_lookup(uibp_table, uibp_sketch->top[i].key);
+            if (uibp != NULL)
+                CS_LOG("UIBP sketch: ~%d executions of "PX" -> "PX"\n", uibp_sketch->top[i].count,
+                    uibp->from, uibp->to);
+        }
+        is_final_uibp_clear = true; // everything is reported, so the clear only frees
+    }
     write_uibp_interval_report();
-    uibp_hashtable_clear(uibp_table); // prompts an exit report per UIBP
+    uibp_hashtable_clear(uibp_table); // in exact mode, prompts an exit report per UIBP
     output_lock_release();
     *final_uibp_report_written = true;
     TAG_XREF_UNLOCK
@@ -566,6 +639,9 @@ ibp_hash_global_destroy() {
 
     dr_global_free(global_uibp, sizeof(global_uibp_t));
 
+    if (uibp_sketch != NULL)
+        dr_global_free(uibp_sketch, sizeof(uibp_sketch_t));
+
     dr_global_free(final_uibp_report_written, sizeof(bool));
 #endif
 }
@@ -650,8 +726,25 @@ uibp_removed(void *p) {
         return;
 
     if (uibp != NULL) {
+        uint execution_count = uibp->execution_count;
 # ifdef MONITOR_UIBP_ONLINE
         char *label;
+# endif
+
+        if (uibp->flags & UIBP_REPORT_PENDING)
+            remove_pending_uibp(uibp);
+        if (is_final_uibp_clear) {
+            dr_global_free(uibp, sizeof(unexpected_ibp_t));
+            return;
+        }
+        if (uibp_sketch != NULL) {
+            bb_tag_pairing_t key = hash_ibp(uibp->from, uibp->to);
+
+            uibp_top_remove(uibp_sketch, key);
+            execution_count = uibp_sketch_estimate(uibp_sketch, (uint64) key);
+        }
+
+# ifdef MONITOR_UIBP_ONLINE
         switch (uibp->flags & (UIBP_FROM_EXPECTED | UIBP_TO_EXPECTED)) {
             case 0:
                 label = "U->U";
@@ -666,14 +759,98 @@ uibp_removed(void *p) {
                 label = "E->E";
         }
         CS_LOG("UIBP| %d executions of %s ibp "PX" -> "PX" (final--removing ibp)\n",
-            uibp->execution_count, label, uibp->from, uibp->to);
+            execution_count, label, uibp->from, uibp->to);
 # endif
 
         write_meta_uib(uibp->from, uibp->to, uibp->edge_index, uibp->flags & UIBP_CROSS_MODULE,
-            uibp->flags & UIBP_ADMITTED, uibp->execution_count);
+            uibp->flags & UIBP_ADMITTED, execution_count);
         dr_global_free(uibp, sizeof(unexpected_ibp_t));
     }
 }
+
+static inline uint
+count_uibp_execution(bb_tag_pairing_t key) {
+    uint estimate = uibp_sketch_add(uibp_sketch, (uint64) key);
+
+    uibp_top_offer(uibp_sketch, (uint64) key, estimate);
+    return estimate;
+}
+
+static inline uint
+uibp_execution_count(unexpected_ibp_t *uibp) {
+    if (uibp_sketch == NULL)
+        return uibp->execution_count;
+    return uibp_sketch_estimate(uibp_sketch, (uint64) hash_ibp(uibp->from, uibp->to));
+}
+
+/* Bounds `uibp_table` in the sketch mode. After the pending reports are written, every pair
+ * outside the top heap gets its final report (in uibp_removed()) and moves to the IBP table,
+ * like the pairs of -meta_on_clock. Its later executions are not counted, which the sketch
+ * mode already accepts for reports outside the top heap. */
+static void
+graduate_uibps(dcontext_t *dcontext) {
+    uint i, graduated = 0;
+    uibp_hashtable_entry_t *e, *next_e;
+
+    ASSERT_TAG_XREF_LOCK
+
+    output_lock_acquire();
+    write_pending_uibp_reports(dcontext);
+    for (i = 0; i < HASHTABLE_SIZE(uibp_table->table_bits); i++) {
+        for (e = uibp_table->table[i]; e != NULL; e = next_e) {
+            next_e = e->next; // the removal frees `e`
+            if (uibp_top_find(uibp_sketch, (uint64) e->key) == NULL) {
+                bb_tag_pairing_t key = e->key;
+
+                uibp_hashtable_remove(uibp_table, key);
+                dr_ibp_add(dcontext, key);
+                graduated++;
+            }
+        }
+    }
+    output_lock_release();
+
+    CS_LOG("UIBP sketch: moved %d UIBPs to the IBP table; %d remain\n", graduated, uibp_table->entries);
+}
+
+/* Reports the pairs in the top heap whose estimate changed since their last report. */
+static void
+write_top_uibp_reports() {
+    uint i;
+    uibp_top_entry_t *entry;
+    unexpected_ibp_t *uibp;
+
+    ASSERT_TAG_XREF_LOCK
+    assert_output_lock();
+
+    for (i = 0; i < uibp_sketch->top_count; i++) {
+        entry = &uibp_sketch->top[i];
+        if (!entry->dirty)
+            continue;
+
+        entry->dirty = false;
+        uibp = uibp_hashtable_lookup(uibp_table, entry->key);
+        if (uibp != NULL) {
+            write_meta_uib(uibp->from, uibp->to, uibp->edge_index, uibp->flags & UIBP_CROSS_MODULE,
+                uibp->flags & UIBP_ADMITTED, entry->count);
+        }
+    }
+}
+
+/* The UIBP is being freed before its pending report was written. */
+static void
+remove_pending_uibp(unexpected_ibp_t *uibp) {
+    uint i;
+
+    for (i = 0; i < pending_uibp_list->entries; i++) {
+        if (pending_uibp_list->array[i] == uibp) {
+            pending_uibp_list->entries--;
+            pending_uibp_list->array[i] = pending_uibp_list->array[pending_uibp_list->entries];
+            break;
+        }
+    }
+    uibp->flags &= ~UIBP_REPORT_PENDING;
+}
 #endif
 
 #ifdef MONITOR_UNEXPECTED_IBP
@@ -24,7 +24,9 @@
  * from C code, except that no lock is required for the remove()
  * operation, and (as best I understand it) remove() can safely
  * run in parallel with the assembly routine (generated by
- * indirect_link_observer).
+ * indirect_link_observer). New entries are added with a CAS under
+ * the read lock, and a resize retires the old table until every
+ * thread has loaded the new one (see core/x86/ibp_lockless.h).
  */
 
 #include "crowd_safe_util.h"
@@ -39,8 +41,8 @@ ibp_hash_global_init(dcontext_t *dcontext);
 bb_tag_pairing_t
 ibp_hash_lookup(dcontext_t *dcontext, app_pc from, app_pc to);
 
-/* Add an entry to the hashtable; delegates to template code.
- * Acquires and releases the table's write lock. */
+/* Add an entry to the hashtable, if new; delegates to template code.
+ * Acquires and releases the table's read lock, or its write lock to resize. */
 bool
 ibp_hash_add(dcontext_t *dcontext, app_pc from, app_pc to);
 
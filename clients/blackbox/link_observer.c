@@ -11,6 +11,8 @@
 #include "crowd_safe_gencode.h"
 #include "execution_monitor.h"
 #include "blacklist.h"
+#include "crowd_safe_metrics.h"
+#include "crowd_safe_probes.h"
 
 #ifdef WINDOWS
 # include "winbase.h"
@@ -139,6 +141,12 @@ link_observer_thread_init(dcontext_t *dcontext) {
 #endif
     cstl->stack_walk = CS_ALLOC(sizeof(return_address_iterator_t));
     CS_TRACK(cstl->stack_walk, sizeof(return_address_iterator_t));
+    cstl->trace_buffers = NULL;
+    crowd_safe_trace_thread_init(cstl);
+    cstl->metrics = NULL;
+    crowd_safe_metrics_thread_init(cstl);
+    cstl->probes = NULL;
+    crowd_safe_probes_thread_init(cstl);
 
     SET_CSTL(dcontext, cstl);
 
@@ -554,6 +562,9 @@ link_observer_thread_exit(dcontext_t *dcontext) {
     indirect_link_observer_thread_exit(dcontext);
 
     cstl = GET_CSTL(dcontext);
+    crowd_safe_trace_thread_exit(cstl);
+    crowd_safe_metrics_thread_exit(cstl);
+    crowd_safe_probes_thread_exit(cstl);
     dr_global_free(cstl->stack_walk, sizeof(return_address_iterator_t));
     dr_global_free(cstl, sizeof(crowd_safe_thread_local_t));
 
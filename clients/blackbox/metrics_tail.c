@@ -0,0 +1,145 @@
+/* Blackbox metrics ring reader standalone app. */
+
+/* Prints the samples in a metrics.ring file (written with -metrics_ms) as one line per
+ * interval, showing how much each metric grew since the previous sample. With -f it keeps
+ * polling the ring for new samples, like `tail -f`, so it can watch a running process.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+# include <windows.h>
+# define sleep_ms(ms) Sleep(ms)
+#else
+# include <unistd.h>
+# define sleep_ms(ms) usleep((ms) * 1000)
+#endif
+
+#include "crowd_safe_metrics.h"
+
+static const char *metric_names[_metric_count] = METRIC_NAMES;
+
+static int
+usage(const char *msg) {
+    if (msg != NULL && msg[0] != '\0')
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "usage: metrics_tail [-f] <ring-file>\n");
+    return 1;
+}
+
+static bool
+read_at(FILE *in, uint64 offset, void *data, size_t size) {
+    if (fseek(in, (long) offset, SEEK_SET) != 0)
+        return false;
+    return fread(data, 1, size, in) == size;
+}
+
+static bool
+read_sequence(FILE *in, uint64 *sequence) {
+    return read_at(in, sizeof(metrics_ring_header_t) - sizeof(uint64), sequence, sizeof(uint64));
+}
+
+static int
+column_width(uint metric) {
+    int width = (int) strlen(metric_names[metric]);
+
+    return (width > 12) ? width : 12;
+}
+
+static void
+print_columns() {
+    uint i;
+
+    printf("%12s %7s", "time-ms", "threads");
+    for (i = 0; i < _metric_count; i++)
+        printf(" %*s", column_width(i), metric_names[i]);
+    printf("\n");
+}
+
+/* Prints the growth since `previous`, or the totals if there is none. */
+static void
+print_sample(metrics_ring_record_t *record, metrics_ring_record_t *previous) {
+    uint i;
+
+    printf("%12llu %7u", (unsigned long long) record->time_ms, record->thread_count);
+    for (i = 0; i < _metric_count; i++) {
+        uint64 value = record->totals[i];
+
+        if (previous != NULL)
+            value -= previous->totals[i];
+        printf(" %*llu", column_width(i), (unsigned long long) value);
+    }
+    printf("\n");
+}
+
+int
+main(int argc, char **argv) {
+    metrics_ring_header_t header;
+    metrics_ring_record_t record, previous;
+    uint64 sequence, next;
+    bool follow = false, has_previous = false;
+    const char *path;
+    FILE *in;
+
+    if ((argc == 3) && (strcmp(argv[1], "-f") == 0))
+        follow = true;
+    else if (argc != 2)
+        return usage("");
+    path = argv[argc - 1];
+
+    in = fopen(path, "rb");
+    if (in == NULL)
+        return usage("cannot open the ring file");
+    if (!read_at(in, 0, &header, sizeof(header)) || (header.magic != METRICS_RING_MAGIC)) {
+        fclose(in);
+        return usage("not a metrics ring file");
+    }
+    if ((header.version != METRICS_RING_VERSION) ||
+        (header.record_size != sizeof(metrics_ring_record_t)) ||
+        (header.slot_count != METRICS_RING_SLOT_COUNT) || (header.metric_count != _metric_count)) {
+        fprintf(stderr, "Unsupported ring: version %u, %u-byte records, %u slots, %u metrics\n",
+                header.version, header.record_size, header.slot_count, header.metric_count);
+        fclose(in);
+        return 1;
+    }
+
+    printf("# %s: sampled every %u ms\n", path, header.interval_ms);
+    print_columns();
+
+    sequence = header.sequence;
+    next = (sequence > METRICS_RING_SLOT_COUNT) ? (sequence - METRICS_RING_SLOT_COUNT) : 0;
+    while (true) {
+        for (; next < sequence; next++) {
+            if (!read_at(in, METRICS_RING_SLOT_OFFSET(next), &record, sizeof(record)) ||
+                (record.sequence != next) || (record.sequence_check != next)) {
+                /* overwritten by a later lap, or still being written */
+                if (sequence - next < METRICS_RING_SLOT_COUNT)
+                    break;
+                fprintf(stderr, "# sample %llu was overwritten\n", (unsigned long long) next);
+                has_previous = false;
+                continue;
+            }
+            print_sample(&record, has_previous ? &previous : NULL);
+            previous = record;
+            has_previous = true;
+        }
+        if (!follow)
+            break;
+
+        fflush(stdout);
+        sleep_ms(header.interval_ms);
+        clearerr(in);
+        if (!read_sequence(in, &sequence)) {
+            fprintf(stderr, "Failed to read the ring header\n");
+            break;
+        }
+        if (sequence - next > METRICS_RING_SLOT_COUNT) { // fell behind by more than a lap
+            next = sequence - METRICS_RING_SLOT_COUNT;
+            has_previous = false;
+        }
+    }
+
+    fclose(in);
+    return 0;
+}
@@ -12,6 +12,9 @@
 #include "crowd_safe_gencode.h"
 #include "execution_monitor.h"
 #include "blacklist.h"
+#include "crowd_safe_block_hash.h"
+#include "xhash_worker.h"
+#include "crowd_safe_probes.h"
 
 #ifdef UNIX
 # include "../../core/unix/module.h"
@@ -82,25 +85,22 @@ struct pending_gencode_edge_t {
     graph_edge_type edge_type;
 };
 
-/* Template instantiation: chunk_hash_vector_t */
-#define VECTOR_NAME_KEY chunk_hash_vector
-#define VECTOR_ENTRY_TYPE bb_hash_t
-#define VECTOR_COMPARISON_TYPE bb_hash_t
-#define VECTOR_ENTRY_INLINE 1
-#define VECTOR_SORTED 1
-#include "../drcontainers/drvector.h"
-
-/* Template instantiation: chunk_hash_vector_t */
-#define VECTOR_NAME_KEY chunk_hash_vector
-#define VECTOR_ENTRY_TYPE bb_hash_t
-#define VECTOR_COMPARISON_TYPE bb_hash_t
-#define VECTOR_ENTRY_INLINE 1
-#define VECTOR_SORTED 1
-#include "../drcontainers/drvectorx.h"
-
 #define CHUNK_WORDS 0x4
-#define CHUNKS_PER_PAGE 0x80
-#define CHUNK_INDEX(tag) (p2int(tag) >> 5) & 0x7f;
+#define CHUNK_BYTES (CHUNK_WORDS * sizeof(uint64))
+#define CHUNKS_PER_PAGE (0x1000 / CHUNK_BYTES)
+#define CHUNK_INDEX(tag) ((uint) ((p2int(tag) & 0xfff) / CHUNK_BYTES))
+#define DIRTY_CHUNK_WORDS ((CHUNKS_PER_PAGE + 63) / 64)
+
+/* The distinct hashes seen in one chunk, up to a fixed capacity. Once full, each new hash
+ * replaces the oldest one. */
+#define CHUNK_HASH_SET_CAPACITY 6
+
+typedef struct chunk_hash_set_t chunk_hash_set_t;
+struct chunk_hash_set_t {
+    bb_hash_t hashes[CHUNK_HASH_SET_CAPACITY];
+    byte count;
+    byte next; // slot to replace once the set is full
+};
 
 typedef struct shadow_page_t shadow_page_t;
 struct shadow_page_t {
@@ -108,8 +108,9 @@ struct shadow_page_t {
     drvector_t *pending_edges;
     bool executable;
 #ifdef GENCODE_CHUNK_STUDY
-    chunk_hash_vector_t chunks[CHUNKS_PER_PAGE];
+    chunk_hash_set_t chunks[CHUNKS_PER_PAGE];
     bb_hash_t last_chunk_hash[CHUNKS_PER_PAGE];
+    uint64 dirty_chunks[DIRTY_CHUNK_WORDS]; // written since the last flush
     bool chunk_flushed[CHUNKS_PER_PAGE];
     bool ever_visited_after_flush[CHUNKS_PER_PAGE];
     bool ever_flushed;
@@ -169,6 +170,16 @@ struct chunk_change_t {
 *valid_flush_report,
 *flush_report_counter,
 *rotation_report;
+
+/* Chunks rehashed after a flush vs. chunks skipped because no observed write touched them. */
+typedef struct chunk_rehash_report_t chunk_rehash_report_t;
+struct chunk_rehash_report_t {
+    uint64 rehashed;
+    uint64 skipped;
+    uint untracked_flushes; // flushes of a page with no observed writes, rehashing all chunks
+    report_mask_t mask;
+}
+*chunk_rehash_report;
 #endif
 
 typedef ushort relocation_entry_t;
@@ -213,11 +224,6 @@ struct relocation_table_page_t {
 
 #define MAX_MODULE_NAME_LENGTH 100
 
-typedef struct _xhash_module_t {
-    module_location_t *module;
-    bool write_xhash;
-} xhash_module_t;
-
 #define MODULE_LOCK dr_lock_modules();
 #define MODULE_UNLOCK dr_unlock_modules();
 
@@ -276,11 +282,17 @@ static void
 take_write_stack_snapshot(dcontext_t *dcontext, executable_write_t *write, app_pc writer_tag);
 
 #ifdef GENCODE_CHUNK_STUDY
+static void
+mark_dirty_chunks(app_pc start, app_pc end);
+
 static void
 update_shadow_page_chunks(shadow_page_t *page);
 
 static bb_hash_t
 hash_chunk(uint64 *code);
+
+static bool
+chunk_hash_set_add(chunk_hash_set_t *set, bb_hash_t hash);
 #endif
 
 #ifdef WINDOWS
@@ -290,6 +302,10 @@ load_relocations(module_location_t *location, const char *module_path);
 static void
 initialize_module_exports(module_location_t *module, const char *module_path);
 
+static inline void
+add_module_export(xhash_job_t *xhash_job, app_pc absolute_address, uint relative_address,
+                  function_export_t export);
+
 static void
 clear_module_exports(module_location_t *module);
 
@@ -320,9 +336,6 @@ print_module_load(module_location_t *module);
 static void
 print_module_unload(module_location_t *module);
 
-static int
-compare_hashes(bb_hash_t first, bb_hash_t second);
-
 static int
 compare_executable_write_with_pc(executable_write_t write, app_pc second);
 
@@ -467,6 +480,9 @@ init_module_observer(bool is_fork) {
         *image_instance_index = 1;
     }
 
+    if (CROWD_SAFE_RECORD_XHASH())
+        init_xhash_worker(is_fork);
+
 #ifdef GENCODE_CHUNK_STUDY
     redundant_flush_report_singleton = CS_ALLOC(sizeof(chunk_change_t));
     redundant_flush_report_singleton->count = 0;
@@ -487,6 +503,10 @@ init_module_observer(bool is_fork) {
     rotation_report = CS_ALLOC(sizeof(chunk_change_t));
     rotation_report->count = 0;
     init_report_mask(&rotation_report->mask, 0xf, 0xffffffffU);
+
+    chunk_rehash_report = CS_ALLOC(sizeof(chunk_rehash_report_t));
+    memset(chunk_rehash_report, 0, sizeof(chunk_rehash_report_t));
+    init_report_mask(&chunk_rehash_report->mask, 0xff, 0xffffffffU);
 #endif
 }
 
@@ -510,6 +530,7 @@ notify_module_loaded(void *dcontext, const module_data_t *data, bool loaded) {
     module_location_t *module;
     char *module_name = NULL;
     module_data_t *main;
+    uint64 probe = probe_start(probe_notify_module_loaded);
 
     module = (module_location_t *)CS_ALLOC(sizeof(module_location_t));
     module->start_pc = data->start;
@@ -585,6 +606,8 @@ notify_module_loaded(void *dcontext, const module_data_t *data, bool loaded) {
         }
         MODULE_UNLOCK
     }
+
+    probe_end(NULL, probe_notify_module_loaded, probe);
 }
 
 static void /* callback */
@@ -596,6 +619,8 @@ notify_module_unloaded(void *dcontext, const module_data_t *data) {
     if (module != NULL) {
         hashcode_lock_acquire();
         clear_module_exports(module);
+        if (CROWD_SAFE_RECORD_XHASH())
+            xhash_module_unloaded(module->start_pc);
         blacklist_unbind_module(module);
         hashcode_lock_release();
 
@@ -853,6 +878,9 @@ observe_shadow_page_write(dcontext_t *dcontext, module_location_t *writing_modul
     }
     take_write_stack_snapshot(dcontext, &write, writer_tag);
     executable_write_list_insert(executable_write_list, write, write.start);
+#ifdef GENCODE_CHUNK_STUDY
+    mark_dirty_chunks(write.start, write.end);
+#endif
     MODULE_UNLOCK
 }
 
@@ -985,10 +1013,16 @@ notify_shadow_page_decode(app_pc tag) {
 
         if (page->chunk_flushed[chunk_index]) {
             bb_hash_t hash = hash_chunk(((uint64*)page->start_pc) + (CHUNK_WORDS * chunk_index));
-            bb_hash_t *found = chunk_hash_vector_search(&page->chunks[chunk_index], hash);
-            if (found == NULL) {
-                chunk_hash_vector_insert(&page->chunks[chunk_index], hash, hash);
 
+            chunk_rehash_report->rehashed++;
+            if (is_report_threshold(&chunk_rehash_report->mask,
+                                    (uint) chunk_rehash_report->rehashed)) {
+                CS_LOG("Chunks rehashed after flush: %lld; skipped: %lld; untracked flushes: %d\n",
+                       chunk_rehash_report->rehashed, chunk_rehash_report->skipped,
+                       chunk_rehash_report->untracked_flushes);
+            }
+
+            if (chunk_hash_set_add(&page->chunks[chunk_index], hash)) {
                 valid_flush_report->count++;
                 if (is_report_threshold(&valid_flush_report->mask, valid_flush_report->count))
                     CS_LOG("Total chunks changed after flush: %d\n", valid_flush_report->count);
@@ -999,7 +1033,7 @@ notify_shadow_page_decode(app_pc tag) {
                         CS_LOG("Total reverted chunks: %d\n", rotation_report->count);
                 }
 
-                if (page->chunks[chunk_index].entries == 1) {
+                if (page->chunks[chunk_index].count == 1) {
                     redundant_flush_report_singleton->count++;
                     if (is_report_threshold(&redundant_flush_report_singleton->mask, redundant_flush_report_singleton->count))
                         CS_LOG("Total chunks unchanged after flush (singleton): %d\n", redundant_flush_report_singleton->count);
@@ -1018,16 +1052,14 @@ notify_shadow_page_decode(app_pc tag) {
 
 void
 notify_flush(app_pc base, size_t size) {
-    uint i, j, page_count = (size >> 0xc);
+    uint i, page_count = (size >> 0xc);
 
     MODULE_LOCK
     for (i = 0; i < page_count; i++) {
         shadow_page_t *page = shadow_page_table_search(shadow_page_table, base + (i * 0x1000));
         if (page != NULL)  {
             page->ever_flushed = true;
-            for (j = 0; j < CHUNKS_PER_PAGE; j++)
-                page->chunk_flushed[j] = true;
-            //update_shadow_page_chunks(page);
+            update_shadow_page_chunks(page);
         }
     }
     MODULE_UNLOCK
@@ -1104,6 +1136,7 @@ destroy_module_observer() {
     if (CROWD_SAFE_RECORD_XHASH()) {
         hashtable_delete(xhash_table);
         dr_global_free(xhash_table, sizeof(hashtable_t));
+        destroy_xhash_worker();
     }
 
     dr_global_free(anonymous_module_metadata, sizeof(anonymous_module_metadata_t));
@@ -1122,6 +1155,11 @@ destroy_module_observer() {
     dr_global_free(valid_flush_report, sizeof(chunk_change_t));
     dr_global_free(flush_report_counter, sizeof(chunk_change_t));
     dr_global_free(rotation_report, sizeof(chunk_change_t));
+
+    CS_LOG("Chunks rehashed after flush: %lld; skipped: %lld; untracked flushes: %d\n",
+           chunk_rehash_report->rehashed, chunk_rehash_report->skipped,
+           chunk_rehash_report->untracked_flushes);
+    dr_global_free(chunk_rehash_report, sizeof(chunk_rehash_report_t));
 #endif
 }
 
@@ -1179,8 +1217,9 @@ add_shadow_page(dcontext_t *dcontext, app_pc base, bool safe_to_read) {
         {
             uint i;
             page->ever_flushed = false;
+            memset(page->dirty_chunks, 0, sizeof(page->dirty_chunks));
             for (i = 0; i < CHUNKS_PER_PAGE; i++) {
-                chunk_hash_vector_init(&page->chunks[i], 8U, false, NULL, compare_hashes);
+                page->chunks[i].count = page->chunks[i].next = 0;
                 page->last_chunk_hash[i] = 0ULL;
                 page->chunk_flushed[i] = false;
                 page->ever_visited_after_flush[i] = false;
@@ -1242,28 +1281,77 @@ take_write_stack_snapshot(dcontext_t *dcontext, executable_write_t *write, app_p
 }
 
 #ifdef GENCODE_CHUNK_STUDY
+/* Marks the chunks overlapping [start, end) dirty on each shadow page it touches. The caller
+ * holds the module lock. */
+static void
+mark_dirty_chunks(app_pc start, app_pc end) {
+    app_pc page_start = (app_pc) (((ptr_uint_t) start) & ~((ptr_uint_t) 0xfff));
+
+    for (; page_start < end; page_start += 0x1000) {
+        shadow_page_t *page = shadow_page_table_search(shadow_page_table, page_start);
+        uint first, last, i;
+
+        if (page == NULL)
+            continue;
+
+        first = (start > page_start) ? CHUNK_INDEX(start) : 0;
+        last = ((end - page_start) < 0x1000) ? CHUNK_INDEX(end - 1) : (CHUNKS_PER_PAGE - 1);
+        for (i = first; i <= last; i++)
+            page->dirty_chunks[i / 64] |= (1ULL << (i % 64));
+    }
+}
+
+/* Flags the dirty chunks of `page` for rehashing on their next decode and skips the rest, since
+ * no observed write touched them. A flush with no dirty chunks comes from a write that was not
+ * observed, so all chunks are flagged. */
 static inline void
 update_shadow_page_chunks(shadow_page_t *page) {
-    bb_hash_t hash;
-    uint i;
-    uint64 *code = (uint64*)page->start_pc;
+    uint i, flagged = 0;
+    bool untracked = true;
 
-    for (i = 0; i < CHUNKS_PER_PAGE; i++, code += CHUNK_WORDS) {
-        page->chunk_flushed[i] = true;
-        hash = hash_chunk(code);
-        if (chunk_hash_vector_search(&page->chunks[i], hash) == 0ULL)
-            chunk_hash_vector_insert(&page->chunks[i], hash, hash);
+    for (i = 0; i < DIRTY_CHUNK_WORDS; i++) {
+        if (page->dirty_chunks[i] != 0ULL)
+            untracked = false;
     }
+    if (untracked)
+        chunk_rehash_report->untracked_flushes++;
+
+    for (i = 0; i < CHUNKS_PER_PAGE; i++) {
+        if (untracked || ((page->dirty_chunks[i / 64] & (1ULL << (i % 64))) != 0ULL)) {
+            page->chunk_flushed[i] = true;
+            flagged++;
+        }
+    }
+    memset(page->dirty_chunks, 0, sizeof(page->dirty_chunks));
+    chunk_rehash_report->skipped += (CHUNKS_PER_PAGE - flagged);
 }
 
 static inline bb_hash_t
 hash_chunk(uint64 *code) {
-    bb_hash_t hash = 0ULL;
-    uint64 *chunk_end = (code + CHUNK_WORDS);
-    for (; code < chunk_end; code++)
-        hash = hash ^ (hash << 5) ^ *code;
+    extern uint block_hash_version;
+
+    if (block_hash_version == BLOCK_HASH_LEGACY)
+        return block_hash_fold_words(code, CHUNK_WORDS);
+    else
+        return block_hash_stripe((byte *) code, CHUNK_BYTES, 0ULL);
+}
 
-    return hash;
+/* Returns true if `hash` is new to the set. */
+static bool
+chunk_hash_set_add(chunk_hash_set_t *set, bb_hash_t hash) {
+    uint i;
+
+    for (i = 0; i < set->count; i++) {
+        if (set->hashes[i] == hash)
+            return false;
+    }
+    if (set->count < CHUNK_HASH_SET_CAPACITY) {
+        set->hashes[set->count++] = hash;
+    } else {
+        set->hashes[set->next] = hash;
+        set->next = (set->next + 1) % CHUNK_HASH_SET_CAPACITY;
+    }
+    return true;
 }
 #endif
 
@@ -1494,30 +1582,10 @@ load_relocations(module_location_t *location, const char *module_path) {
             int2p(*(uint*)relocation_table_index));
 }
 
-static bool
-symbol_iteration_callback(drsym_info_t *info, drsym_error_t status, void *data) {
-    xhash_module_t *xhash = (xhash_module_t *) data;
-    function_export_t internal_export; // = { hash, str }
-    char symbol_id[256], symbol_name[256];
-    app_pc symbol_pc = xhash->module->start_pc + info->start_offs;
-
-    if (export_hashtable_lookup(export_hashes, symbol_pc) == NULL) { // ignore symbolic aliases
-        print_callback_function_id(symbol_id, 256, xhash->module, info->start_offs);
-        internal_export.hash = string_hash(symbol_id);
-
-        dr_snprintf(symbol_name, 256, "%s!%s", xhash->module->module_name, info->name);
-        internal_export.function_id = cs_strcpy(symbol_name);
-
-        add_export_hash(symbol_pc, info->start_offs, internal_export, xhash->write_xhash);
-    }
-
-    return true;
-}
-
 static void
 initialize_module_exports(module_location_t *module, const char *module_path) {
     uint i, exported_ordinal, function_id_base_length;
-    xhash_module_t xhash_module = {0};
+    xhash_job_t *xhash_job = NULL;
     app_pc exported_address;
     uint relative_address;
     size_t exports_size;
@@ -1532,11 +1600,13 @@ initialize_module_exports(module_location_t *module, const char *module_path) {
     ASSERT(strlen(module->module_name) < MAX_MODULE_NAME_LENGTH);
 
     if (CROWD_SAFE_RECORD_XHASH() && module->type == module_type_image) {
-        xhash_module.module = module;
+        bool write_xhash;
+
         if (CROWD_SAFE_MONITOR())
-            xhash_module.write_xhash = (module->monitor_data == NULL);
+            write_xhash = (module->monitor_data == NULL);
         else
-            xhash_module.write_xhash = register_xhash_module(module);
+            write_xhash = register_xhash_module(module);
+        xhash_job = create_xhash_job(module, module_path, write_xhash);
     }
 
     if (exports == NULL) {
@@ -1544,6 +1614,8 @@ initialize_module_exports(module_location_t *module, const char *module_path) {
         module_data_t *main = dr_get_main_module();
         if (main == NULL) {
             CS_WARN("Main module not found while initializing exports\n");
+            if (xhash_job != NULL)
+                delete_xhash_job(xhash_job);
             return;
         }
 
@@ -1551,6 +1623,8 @@ initialize_module_exports(module_location_t *module, const char *module_path) {
 
         if (main->start != module->start_pc) {
             CS_WARN("Exports not found for module %s\n", module->module_name);
+            if (xhash_job != NULL)
+                delete_xhash_job(xhash_job);
             return;
         }
         strcat(function_id, "!main"); // valid for the main entry point of any program
@@ -1561,7 +1635,6 @@ initialize_module_exports(module_location_t *module, const char *module_path) {
             export.function_id = cs_strcpy(function_id);
             export_hashtable_add(export_hashes, main->entry_point, export);
         }
-        hashcode_lock_release();
     } else {
         char function_id_base[256] = {0};
         PULONG functions = (PULONG)(module->start_pc + exports->AddressOfFunctions);
@@ -1587,7 +1660,7 @@ initialize_module_exports(module_location_t *module, const char *module_path) {
                 function_export_t export;
                 export.hash = hash;
                 export.function_id = cs_strcpy(function_id);
-                add_export_hash(exported_address, relative_address, export, xhash_module.write_xhash);
+                add_module_export(xhash_job, exported_address, relative_address, export);
             }
         }
 
@@ -1616,20 +1689,28 @@ initialize_module_exports(module_location_t *module, const char *module_path) {
                     function_export_t export;
                     export.hash = hash;
                     export.function_id = cs_strcpy(function_id);
-                    add_export_hash(exported_address, relative_address, export, xhash_module.write_xhash);
+                    add_module_export(xhash_job, exported_address, relative_address, export);
                 }
 
                 CS_DET("Found export ordinal %d in the noname section of module %s.\n", exported_ordinal, module->module_name);
             }
         }
-        hashcode_lock_release();
     }
 
-    if (CROWD_SAFE_RECORD_XHASH() && module->type == module_type_image &&
-        drsym_module_has_symbols(module_path)) {
-        drsym_enumerate_symbols_ex(module_path, symbol_iteration_callback,
-                                   sizeof(drsym_info_t), &xhash_module, DRSYM_PDB);
-    }
+    if (xhash_job != NULL)
+        queue_xhash_job(xhash_job); // writes the xhash records and adds the symbols
+    hashcode_lock_release();
+}
+
+/* Writing the xhash record of the export is left to the xhash worker. Caller holds the
+ * hashcode lock. */
+static inline void
+add_module_export(xhash_job_t *xhash_job, app_pc absolute_address, uint relative_address,
+                  function_export_t export) {
+    export_hashtable_add(export_hashes, absolute_address, export);
+
+    if (xhash_job != NULL)
+        xhash_job_add_export(xhash_job, relative_address, export);
 }
 
 static void
@@ -1989,17 +2070,6 @@ print_module_unload(module_location_t *module) {
     hashcode_lock_release();
 }}
 
-static int
-compare_hashes(bb_hash_t first, bb_hash_t second) {
-    uint64 delta = (first - second);
-    if (delta < 0LL)
-        return -1;
-    else if (delta > 0LL)
-        return 1;
-    else
-        return 0;
-}
-
 static int
 compare_executable_write_with_pc(executable_write_t write, app_pc second) {
     ptr_uint_t first_int = p2int(write.start), second_int = p2int(second);
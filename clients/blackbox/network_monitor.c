@@ -130,7 +130,7 @@ notify_device_io_control(dcontext_t *dcontext, uint result, HANDLE socket_handle
     IO_STATUS_BLOCK *status_block, IoControlCode control_code, byte *input_data, uint input_length,
     byte *output_data, uint output_length)
 {
-    ushort call_stack_id;
+    uint call_stack_id;
     network_socket_t *socket;
     uint64 timestamp;
     uint thread_id;
@@ -443,7 +443,7 @@ socket_handle_remove(dcontext_t *dcontext, HANDLE handle)
         network_socket_t *socket = (network_socket_t *) hashtable_lookup(socket_table, handle);
         if (socket != NULL) {
             if (socket->handle == handle) {
-                ushort call_stack_id = observe_call_stack(dcontext);
+                uint call_stack_id = observe_call_stack(dcontext);
                 uint64 timestamp = get_system_time_millis();
                 uint thread_id = current_thread_id();
 
@@ -489,7 +489,7 @@ network_socket_delete(void *socket)
 static void
 pending_operation_completed(dcontext_t *dcontext, network_socket_t *socket)
 {
-    ushort call_stack_id = observe_call_stack(dcontext);
+    uint call_stack_id = observe_call_stack(dcontext);
     uint64 timestamp = get_system_time_millis();
     uint thread_id = current_thread_id();
 
@@ -0,0 +1,244 @@
+#include "pending_edge_table.h"
+
+/**** private fields ****/
+
+#ifdef CROWD_SAFE_PORTABLE
+# define int2p(value) ((void *) (ptr_uint_t) (value))
+#endif
+
+#define PENDING_EDGE_TABLE_SIZE(bits) (1U << (bits))
+#define PENDING_EDGE_TABLE_MASK(bits) (PENDING_EDGE_TABLE_SIZE(bits) - 1)
+#define PENDING_EDGE_SLOTS_BYTES(bits) (PENDING_EDGE_TABLE_SIZE(bits) * sizeof(pending_edge_slot_t))
+
+/* Resize when live sets and tombstones exceed 3/4 of the slots. */
+#define PENDING_EDGE_TABLE_FULL(used, bits) (((used) * 4) > (PENDING_EDGE_TABLE_SIZE(bits) * 3))
+
+#define PENDING_EDGE_TOMBSTONE ((pending_edge_set_t *) int2p(1))
+#define IS_LIVE_SLOT(slot) (((slot)->set != NULL) && ((slot)->set != PENDING_EDGE_TOMBSTONE))
+
+#define PENDING_EDGE_CHUNK_COUNT 0x100
+
+struct pending_edge_chunk_t {
+    pending_edge_chunk_t *next;
+    pending_edge_set_t sets[PENDING_EDGE_CHUNK_COUNT];
+};
+
+/**** private prototypes ****/
+
+static inline uint
+hash_key(ptr_uint_t key, uint table_bits);
+
+static pending_edge_slot_t *
+find_slot(pending_edge_table_t *table, app_pc to);
+
+static void
+resize_table(pending_edge_table_t *table);
+
+static pending_edge_set_t *
+allocate_set(pending_edge_table_t *table);
+
+static void
+append_edge(pending_edge_table_t *table, pending_edge_set_t *set, incoming_edge_t *edge);
+
+/**** public functions ****/
+
+void
+pending_edge_table_init(pending_edge_table_t *table, uint table_bits) {
+    memset(table, 0, sizeof(pending_edge_table_t));
+    table->table_bits = table_bits;
+    table->slots = (pending_edge_slot_t *) CS_ALLOC(PENDING_EDGE_SLOTS_BYTES(table_bits));
+    memset(table->slots, 0, PENDING_EDGE_SLOTS_BYTES(table_bits));
+    table->chunk_position = PENDING_EDGE_CHUNK_COUNT; // allocate a chunk on first add
+}
+
+pending_edge_set_t *
+pending_edge_table_lookup(pending_edge_table_t *table, app_pc to) {
+    pending_edge_slot_t *slot = find_slot(table, to);
+
+    return (slot == NULL) ? NULL : slot->set;
+}
+
+bool
+pending_edge_table_add(pending_edge_table_t *table, app_pc to, incoming_edge_t *edge) {
+    pending_edge_slot_t *target = NULL;
+    pending_edge_set_t *set;
+    uint mask, index;
+
+    if (PENDING_EDGE_TABLE_FULL(table->used_slots + 1, table->table_bits))
+        resize_table(table);
+
+    mask = PENDING_EDGE_TABLE_MASK(table->table_bits);
+    index = hash_key((ptr_uint_t) to, table->table_bits);
+    while (true) {
+        pending_edge_slot_t *slot = &table->slots[index];
+
+        if (slot->set == NULL) {
+            if (target == NULL) {
+                target = slot;
+                table->used_slots++;
+            }
+            break;
+        }
+        if (slot->set == PENDING_EDGE_TOMBSTONE) {
+            if (target == NULL)
+                target = slot; // reuse the first tombstone, but keep looking for the tag
+        } else if (slot->to == to) {
+            incoming_edge_t *edges = PENDING_EDGES(slot->set);
+            uint i;
+
+            for (i = 0; i < slot->set->count; i++) {
+                if ((edges[i].from == edge->from) &&
+                    (edges[i].module_instance_hash == edge->module_instance_hash))
+                    return false;
+            }
+            append_edge(table, slot->set, edge);
+            return true;
+        }
+        index = (index + 1) & mask;
+    }
+
+    set = allocate_set(table);
+    set->to = to;
+    set->count = 0;
+    set->capacity = PENDING_EDGE_INLINE_COUNT;
+    set->spill = NULL;
+    target->to = to;
+    target->set = set;
+    table->sets++;
+    append_edge(table, set, edge);
+    return true;
+}
+
+void
+pending_edge_table_remove(pending_edge_table_t *table, app_pc to) {
+    pending_edge_slot_t *slot = find_slot(table, to);
+    pending_edge_set_t *set;
+
+    if (slot == NULL)
+        return;
+
+    set = slot->set;
+    slot->set = PENDING_EDGE_TOMBSTONE;
+    table->sets--;
+    table->edges -= set->count;
+    table->committed_sets++;
+
+    if (set->spill != NULL)
+        dr_global_free(set->spill, set->capacity * sizeof(incoming_edge_t));
+    set->next_free = table->free_sets;
+    table->free_sets = set;
+}
+
+void
+pending_edge_table_delete(pending_edge_table_t *table) {
+    pending_edge_chunk_t *chunk, *next;
+    uint i;
+
+    for (i = 0; i < PENDING_EDGE_TABLE_SIZE(table->table_bits); i++) {
+        pending_edge_slot_t *slot = &table->slots[i];
+
+        if (IS_LIVE_SLOT(slot) && (slot->set->spill != NULL))
+            dr_global_free(slot->set->spill, slot->set->capacity * sizeof(incoming_edge_t));
+    }
+    for (chunk = table->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        dr_global_free(chunk, sizeof(pending_edge_chunk_t));
+    }
+    dr_global_free(table->slots, PENDING_EDGE_SLOTS_BYTES(table->table_bits));
+    table->slots = NULL;
+    table->chunks = NULL;
+    table->free_sets = NULL;
+    table->sets = table->used_slots = table->edges = 0U;
+}
+
+/**** private functions ****/
+
+/* Fibonacci hashing: code addresses are clustered, so mix all bits into the top ones. */
+static inline uint
+hash_key(ptr_uint_t key, uint table_bits) {
+    return (uint) ((((uint64) key) * 0x9e3779b97f4a7c15ULL) >> (64 - table_bits));
+}
+
+static pending_edge_slot_t *
+find_slot(pending_edge_table_t *table, app_pc to) {
+    uint mask = PENDING_EDGE_TABLE_MASK(table->table_bits);
+    uint index = hash_key((ptr_uint_t) to, table->table_bits);
+
+    while (true) {
+        pending_edge_slot_t *slot = &table->slots[index];
+
+        if (slot->set == NULL)
+            return NULL;
+        if ((slot->set != PENDING_EDGE_TOMBSTONE) && (slot->to == to))
+            return slot;
+        index = (index + 1) & mask;
+    }
+}
+
+/* Rehash into a new slot array, doubling it unless most of the used slots are tombstones. */
+static void
+resize_table(pending_edge_table_t *table) {
+    pending_edge_slot_t *old_slots = table->slots;
+    uint old_bits = table->table_bits, table_bits = old_bits, i;
+
+    if (((table->sets + 1) * 2) > PENDING_EDGE_TABLE_SIZE(table_bits))
+        table_bits++;
+
+    table->slots = (pending_edge_slot_t *) CS_ALLOC(PENDING_EDGE_SLOTS_BYTES(table_bits));
+    memset(table->slots, 0, PENDING_EDGE_SLOTS_BYTES(table_bits));
+    table->table_bits = table_bits;
+    for (i = 0; i < PENDING_EDGE_TABLE_SIZE(old_bits); i++) {
+        pending_edge_slot_t *slot = &old_slots[i];
+
+        if (IS_LIVE_SLOT(slot)) {
+            uint index = hash_key((ptr_uint_t) slot->to, table_bits);
+
+            while (table->slots[index].set != NULL)
+                index = (index + 1) & PENDING_EDGE_TABLE_MASK(table_bits);
+            table->slots[index] = *slot;
+        }
+    }
+    table->used_slots = table->sets;
+    dr_global_free(old_slots, PENDING_EDGE_SLOTS_BYTES(old_bits));
+}
+
+static pending_edge_set_t *
+allocate_set(pending_edge_table_t *table) {
+    pending_edge_set_t *set = table->free_sets;
+
+    if (set != NULL) {
+        table->free_sets = set->next_free;
+        return set;
+    }
+    if (table->chunk_position == PENDING_EDGE_CHUNK_COUNT) {
+        pending_edge_chunk_t *chunk;
+
+        chunk = (pending_edge_chunk_t *) CS_ALLOC(sizeof(pending_edge_chunk_t));
+
+        chunk->next = table->chunks;
+        table->chunks = chunk;
+        table->chunk_position = 0;
+        table->chunk_allocations++;
+    }
+    return &table->chunks->sets[table->chunk_position++];
+}
+
+static void
+append_edge(pending_edge_table_t *table, pending_edge_set_t *set, incoming_edge_t *edge) {
+    if (set->count == set->capacity) {
+        uint capacity = set->capacity * 2;
+        incoming_edge_t *spill = (incoming_edge_t *) CS_ALLOC(capacity * sizeof(incoming_edge_t));
+
+        memcpy(spill, PENDING_EDGES(set), set->count * sizeof(incoming_edge_t));
+        if (set->spill != NULL)
+            dr_global_free(set->spill, set->capacity * sizeof(incoming_edge_t));
+        set->spill = spill;
+        set->capacity = capacity;
+        table->spill_allocations++;
+    }
+    PENDING_EDGES(set)[set->count++] = *edge;
+
+    table->added_edges++;
+    if (++table->edges > table->peak_edges)
+        table->peak_edges = table->edges;
+}
@@ -0,0 +1,92 @@
+#ifndef PENDING_EDGE_TABLE_H
+#define PENDING_EDGE_TABLE_H 1
+
+/* Edges waiting for their target block to be built, grouped by target tag. Each tag has one
+ * set of edges, allocated from slabs, which holds its first PENDING_EDGE_INLINE_COUNT edges
+ * inline and moves them to a heap array only when there are more. Committing a tag releases
+ * its set as a whole. The sets are found through an open-addressed table of { tag, set }
+ * slots with linear probing, like the bb_state_table.
+ *
+ * Callers serialize all access (the hashcode lock). A set pointer stays valid until its tag is
+ * removed, but its edge array may move when an edge is added to it. */
+
+#include "crowd_safe_portable.h"
+#ifdef CROWD_SAFE_PORTABLE
+typedef int graph_edge_type;
+#else
+# include "crowd_safe_util.h"
+#endif
+
+#define PENDING_EDGE_INLINE_COUNT 4
+
+typedef struct incoming_edge_t incoming_edge_t;
+struct incoming_edge_t {
+    app_pc from;
+    byte exit_ordinal;
+    graph_edge_type type;
+    ushort module_instance_hash; // from_module->image_instance_id + to_module->image_instance_id
+};
+
+typedef struct pending_edge_set_t pending_edge_set_t;
+struct pending_edge_set_t {
+    app_pc to;
+    uint count;
+    uint capacity;          // PENDING_EDGE_INLINE_COUNT until the edges spill
+    incoming_edge_t *spill; // NULL while the edges fit inline, then all of them
+    union {
+        incoming_edge_t edges[PENDING_EDGE_INLINE_COUNT];
+        pending_edge_set_t *next_free;
+    };
+};
+
+#define PENDING_EDGES(set) (((set)->spill == NULL) ? (set)->edges : (set)->spill)
+
+typedef struct pending_edge_slot_t pending_edge_slot_t;
+struct pending_edge_slot_t {
+    app_pc to;
+    pending_edge_set_t *set; // NULL: never used; PENDING_EDGE_TOMBSTONE: removed
+};
+
+typedef struct pending_edge_chunk_t pending_edge_chunk_t;
+
+typedef struct pending_edge_table_t pending_edge_table_t;
+struct pending_edge_table_t {
+    pending_edge_slot_t *slots;
+    uint table_bits;
+    uint sets;       // live sets
+    uint used_slots; // live sets and tombstones
+    pending_edge_chunk_t *chunks;
+    pending_edge_set_t *free_sets;
+    uint chunk_position; // next unused set in `chunks`
+
+    /* counters, for the log */
+    uint edges;                // pending now
+    uint peak_edges;
+    uint64 added_edges;
+    uint64 committed_sets;
+    uint chunk_allocations;
+    uint64 spill_allocations;  // heap arrays for sets beyond PENDING_EDGE_INLINE_COUNT edges
+};
+
+/**** public functions ****/
+
+void
+pending_edge_table_init(pending_edge_table_t *table, uint table_bits);
+
+/* Returns the pending edges to `to`, or NULL. */
+pending_edge_set_t *
+pending_edge_table_lookup(pending_edge_table_t *table, app_pc to);
+
+/* Adds `edge` to the pending edges of `to`, unless an edge from the same block and module
+ * instances is already pending there. Returns true if the edge was added. */
+bool
+pending_edge_table_add(pending_edge_table_t *table, app_pc to, incoming_edge_t *edge);
+
+/* Releases all pending edges to `to`. */
+void
+pending_edge_table_remove(pending_edge_table_t *table, app_pc to);
+
+void
+pending_edge_table_delete(pending_edge_table_t *table);
+
+#endif
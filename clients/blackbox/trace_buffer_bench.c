@@ -0,0 +1,253 @@
+/* Blackbox trace buffer benchmarking standalone app. */
+
+/* This is a standalone app for benchmarking the portable trace buffer and entry encoding on
+ * any build host. It replays a synthetic stream of graph nodes, intra-module edges and
+ * cross-module edges into one buffer per graph file, through each combination of buffer size
+ * and flush policy, and reports throughput in MB/s and ns/entry. With -compact the buffers
+ * write compact frames, and the output size is reported relative to the raw entries; buffer
+ * sizes that cannot hold a whole frame are skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WINDOWS
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "crowd_safe_trace_buffer.h"
+
+typedef enum flush_policy_t flush_policy_t;
+enum flush_policy_t {
+    flush_policy_full,     // flush only when the buffer fills
+    flush_policy_interval, // also flush every FLUSH_INTERVAL_ENTRIES, like the heartbeat
+    flush_policy_edge,     // also flush after every edge, like unverified edges
+    _flush_policy_count
+};
+
+static const char *flush_policy_names[] = { "full", "interval", "edge" };
+
+static const uint buffer_sizes[] = { 0x40, 0x200, 0x1000, 0x4000, 0x10000 };
+
+#define DEFAULT_ENTRY_COUNT 2000000
+#define FLUSH_INTERVAL_ENTRIES 0x2000
+#define MODULE_COUNT 8
+
+typedef struct bench_sink_t bench_sink_t;
+struct bench_sink_t {
+    FILE *file;
+    uint64 bytes;
+    uint flushes;
+};
+
+static ptr_int_t
+write_bench_sink(void *sink, const void *data, size_t size) {
+    bench_sink_t *bench_sink = (bench_sink_t *) sink;
+    size_t output_bytes = fwrite(data, 1, size, bench_sink->file);
+
+    bench_sink->bytes += output_bytes;
+    bench_sink->flushes++;
+    return (ptr_int_t) output_bytes;
+}
+
+static uint64
+now_nanos() {
+#ifdef WINDOWS
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64) ((count.QuadPart * 1000000000.0) / frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (((uint64) now.tv_sec) * 1000000000ULL) + now.tv_nsec;
+#endif
+}
+
+/* xorshift64: cheap enough not to dominate the measurement */
+static inline uint64
+next_random(uint64 *state) {
+    uint64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static inline ptr_uint_t
+random_tag(uint64 *state) {
+    uint64 r = next_random(state);
+    return (ptr_uint_t) (0x10000000ULL * (1 + (r % MODULE_COUNT)) + ((r >> 8) & 0xfffff));
+}
+
+enum {
+    bench_node_buffer,
+    bench_edge_buffer,
+    bench_cross_module_buffer,
+    _bench_buffer_count
+};
+
+static const trace_frame_format_t bench_frame_formats[] = {
+    { 2, 0x1 }, // node: { tag, hash }
+    { 2, 0x3 }, // edge: { from, to }
+    { 3, 0x3 }  // cross-module: { from, to, edge hash }
+};
+
+static uint64 raw_words;
+
+static void
+append_entry(trace_buffer_t *buffer, uint64 data) {
+    raw_words++;
+    if (trace_buffer_append(buffer, data))
+        trace_buffer_flush(buffer);
+}
+
+static void
+flush_buffers(trace_buffer_t *buffers, bool finish) {
+    uint i;
+
+    for (i = 0; i < _bench_buffer_count; i++) {
+        if (finish)
+            trace_buffer_finish(&buffers[i]);
+        else
+            trace_buffer_flush(&buffers[i]);
+    }
+}
+
+/* Consecutive blocks in a trace tend to be near each other, so tags mostly step forward
+ * within the current module and occasionally jump to another one. */
+static inline ptr_uint_t
+next_tag(uint64 *state, ptr_uint_t *tag) {
+    uint64 r = next_random(state);
+
+    if ((r & 0xf) == 0)
+        *tag = random_tag(state);
+    else
+        *tag += (ptr_uint_t) ((r >> 8) & 0xff);
+    return *tag;
+}
+
+/* Replays `entry_count` graph entries in the proportions of a typical trace: roughly 2 edges
+ * per node, and a cross-module edge for every 16 intra-module edges. */
+static void
+replay_stream(trace_buffer_t *buffers, flush_policy_t policy, uint entry_count) {
+    uint i, since_flush = 0;
+    uint64 random_state = 0x9e3779b97f4a7c15ULL;
+    ptr_uint_t tag = random_tag(&random_state);
+
+    for (i = 0; i < entry_count; i++) {
+        uint64 r = next_random(&random_state);
+        uint kind = (uint) (r & 0x1f);
+
+        if (kind < 10) { // node
+            trace_buffer_t *buffer = &buffers[bench_node_buffer];
+            append_entry(buffer, trace_encode_node_tag(next_tag(&random_state, &tag), (byte) ((r >> 8) & 3),
+                                                       (byte) ((r >> 16) & 1)));
+            append_entry(buffer, next_random(&random_state));
+        } else { // edge
+            trace_buffer_t *buffer = (kind == 31) ? &buffers[bench_cross_module_buffer] :
+                                                    &buffers[bench_edge_buffer];
+            append_entry(buffer, trace_encode_edge_from_tag(tag, (byte) ((r >> 8) & 3),
+                                                            (byte) ((r >> 16) & 0xf), (byte) ((r >> 24) & 1)));
+            append_entry(buffer, trace_encode_edge_to_tag(next_tag(&random_state, &tag), (byte) ((r >> 32) & 1)));
+            if (kind == 31) // cross-module
+                append_entry(buffer, next_random(&random_state));
+            if (policy == flush_policy_edge)
+                trace_buffer_flush(buffer);
+        }
+
+        if ((policy == flush_policy_interval) && (++since_flush == FLUSH_INTERVAL_ENTRIES)) {
+            flush_buffers(buffers, false);
+            since_flush = 0;
+        }
+    }
+    flush_buffers(buffers, true);
+}
+
+static int
+usage(const char *msg) {
+    if (msg != NULL && msg[0] != '\0')
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "usage: trace_buffer_bench [-entries <count>] [-out <path>] [-compact]\n");
+    return 1;
+}
+
+int
+main(int argc, char **argv) {
+    uint entry_count = DEFAULT_ENTRY_COUNT;
+    const char *out_path = NULL;
+    bool compact = false;
+    uint s, p, b;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-entries") == 0 && i + 1 < argc)
+            entry_count = (uint) strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc)
+            out_path = argv[++i];
+        else if (strcmp(argv[i], "-compact") == 0)
+            compact = true;
+        else
+            return usage("unknown option");
+    }
+    if (entry_count == 0)
+        return usage("-entries must be positive");
+
+    printf("%-10s %-9s %10s %10s %10s %10s %8s\n", "buffer", "policy", "entries", "flushes", "MB/s",
+           "ns/entry", "ratio");
+
+    for (s = 0; s < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); s++) {
+        if (compact && (buffer_sizes[s] < TRACE_FRAME_WORDS(bench_frame_formats[bench_cross_module_buffer])))
+            continue;
+        for (p = 0; p < _flush_policy_count; p++) {
+            trace_buffer_t buffers[_bench_buffer_count];
+            bench_sink_t sink;
+            uint64 start, elapsed;
+
+            memset(&sink, 0, sizeof(sink));
+            sink.file = (out_path == NULL) ? tmpfile() : fopen(out_path, "wb");
+            if (sink.file == NULL) {
+                fprintf(stderr, "Failed to open the output file\n");
+                return 1;
+            }
+            setvbuf(sink.file, NULL, _IONBF, 0); // one write per flush, like dr_write_file
+
+            for (b = 0; b < _bench_buffer_count; b++) {
+                uint64 *entries = (uint64 *) malloc(buffer_sizes[s] * sizeof(uint64));
+                byte *frame = compact ?
+                    (byte *) malloc(TRACE_FRAME_MAX_BYTES(TRACE_FRAME_WORDS(bench_frame_formats[b]))) : NULL;
+
+                if (entries == NULL || (compact && frame == NULL)) {
+                    fprintf(stderr, "Failed to allocate the buffers\n");
+                    return 1;
+                }
+                trace_buffer_init(&buffers[b], entries, buffer_sizes[s], write_bench_sink, &sink);
+                if (compact)
+                    trace_buffer_set_frame(&buffers[b], bench_frame_formats[b], frame);
+            }
+
+            raw_words = 0;
+            start = now_nanos();
+            replay_stream(buffers, (flush_policy_t) p, entry_count);
+            elapsed = now_nanos() - start;
+            if (elapsed == 0)
+                elapsed = 1;
+
+            printf("0x%-8x %-9s %10u %10u %10.1f %10.2f %8.3f\n", buffer_sizes[s], flush_policy_names[p],
+                   entry_count, sink.flushes, (raw_words * sizeof(uint64) / (1024.0 * 1024.0)) / (elapsed / 1e9),
+                   ((double) elapsed) / entry_count, ((double) sink.bytes) / (raw_words * sizeof(uint64)));
+
+            fclose(sink.file);
+            for (b = 0; b < _bench_buffer_count; b++) {
+                if (compact)
+                    free(buffers[b].frame);
+                free(buffers[b].entries);
+            }
+        }
+    }
+    return 0;
+}
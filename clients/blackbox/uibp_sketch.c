@@ -0,0 +1,171 @@
+#include "uibp_sketch.h"
+
+/**** private fields ****/
+
+/* One odd multiplier per row; the index is the top bits of the product. */
+static const uint64 row_multipliers[UIBP_SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xff51afd7ed558ccdULL
+};
+
+#define UIBP_SKETCH_INDEX(key, row) \
+    ((uint) (((key) * row_multipliers[row]) >> (64 - UIBP_SKETCH_WIDTH_BITS)))
+
+/**** private prototypes ****/
+
+static void
+sift_up(uibp_sketch_t *sketch, uint index);
+
+static void
+sift_down(uibp_sketch_t *sketch, uint index);
+
+static inline void
+swap_entries(uibp_sketch_t *sketch, uint a, uint b);
+
+/**** public functions ****/
+
+void
+uibp_sketch_init(uibp_sketch_t *sketch) {
+    memset(sketch, 0, sizeof(uibp_sketch_t));
+}
+
+/* Conservative update: only the counters at the current minimum grow, which keeps the rows
+ * that collide with heavier pairs from drifting further. */
+uint
+uibp_sketch_add(uibp_sketch_t *sketch, uint64 key) {
+    uint row, estimate = uibp_sketch_estimate(sketch, key);
+
+    sketch->executions++;
+    if (estimate == 0xffffffffU)
+        return estimate;
+
+    estimate++;
+    for (row = 0; row < UIBP_SKETCH_DEPTH; row++) {
+        uint *counter = &sketch->counters[row][UIBP_SKETCH_INDEX(key, row)];
+
+        if (*counter < estimate)
+            *counter = estimate;
+    }
+    return estimate;
+}
+
+uint
+uibp_sketch_estimate(uibp_sketch_t *sketch, uint64 key) {
+    uint row, estimate = 0xffffffffU;
+
+    for (row = 0; row < UIBP_SKETCH_DEPTH; row++) {
+        uint counter = sketch->counters[row][UIBP_SKETCH_INDEX(key, row)];
+
+        if (counter < estimate)
+            estimate = counter;
+    }
+    return estimate;
+}
+
+bool
+uibp_top_offer(uibp_sketch_t *sketch, uint64 key, uint estimate) {
+    uibp_top_entry_t *entry;
+
+    /* Estimates only grow, so a pair in the heap never falls below the minimum. */
+    if ((sketch->top_count == UIBP_TOP_COUNT) && (estimate < sketch->top[0].count))
+        return false;
+
+    entry = uibp_top_find(sketch, key);
+    if (entry != NULL) {
+        if (entry->count != estimate) {
+            entry->count = estimate;
+            entry->dirty = true;
+            sift_down(sketch, (uint) (entry - sketch->top));
+        }
+        return true;
+    }
+
+    if (sketch->top_count < UIBP_TOP_COUNT) {
+        entry = &sketch->top[sketch->top_count++];
+        entry->key = key;
+        entry->count = estimate;
+        entry->dirty = true;
+        sift_up(sketch, sketch->top_count - 1);
+        return true;
+    }
+
+    if (estimate > sketch->top[0].count) {
+        entry = &sketch->top[0];
+        entry->key = key;
+        entry->count = estimate;
+        entry->dirty = true;
+        sift_down(sketch, 0);
+        sketch->evictions++;
+        return true;
+    }
+    return false;
+}
+
+uibp_top_entry_t *
+uibp_top_find(uibp_sketch_t *sketch, uint64 key) {
+    uint i;
+
+    for (i = 0; i < sketch->top_count; i++) {
+        if (sketch->top[i].key == key)
+            return &sketch->top[i];
+    }
+    return NULL;
+}
+
+bool
+uibp_top_remove(uibp_sketch_t *sketch, uint64 key) {
+    uibp_top_entry_t *entry = uibp_top_find(sketch, key);
+    uint index;
+
+    if (entry == NULL)
+        return false;
+
+    index = (uint) (entry - sketch->top);
+    sketch->top_count--;
+    if (index < sketch->top_count) {
+        sketch->top[index] = sketch->top[sketch->top_count];
+        sift_down(sketch, index);
+        sift_up(sketch, index);
+    }
+    return true;
+}
+
+/**** private functions ****/
+
+static void
+sift_up(uibp_sketch_t *sketch, uint index) {
+    while (index > 0) {
+        uint parent = (index - 1) / 2;
+
+        if (sketch->top[parent].count <= sketch->top[index].count)
+            break;
+        swap_entries(sketch, parent, index);
+        index = parent;
+    }
+}
+
+static void
+sift_down(uibp_sketch_t *sketch, uint index) {
+    while (true) {
+        uint child = (index * 2) + 1, smallest = index;
+
+        if ((child < sketch->top_count) &&
+            (sketch->top[child].count < sketch->top[smallest].count))
+            smallest = child;
+        child++;
+        if ((child < sketch->top_count) &&
+            (sketch->top[child].count < sketch->top[smallest].count))
+            smallest = child;
+        if (smallest == index)
+            break;
+        swap_entries(sketch, smallest, index);
+        index = smallest;
+    }
+}
+
+static inline void
+swap_entries(uibp_sketch_t *sketch, uint a, uint b) {
+    uibp_top_entry_t swap = sketch->top[a];
+
+    sketch->top[a] = sketch->top[b];
+    sketch->top[b] = swap;
+}
@@ -0,0 +1,68 @@
+#ifndef UIBP_SKETCH_H
+#define UIBP_SKETCH_H 1
+
+/* Fixed-size execution counts for unexpected indirect branch pairs (UIBP). A count-min sketch
+ * estimates how often each pair has executed. The estimate never falls below the true count,
+ * and almost always exceeds it by less than e/UIBP_SKETCH_WIDTH of all executions (with
+ * conservative update, usually by much less). Beside the sketch, a min-heap keeps the
+ * UIBP_TOP_COUNT pairs with the highest estimates, and flags each one as dirty when its
+ * estimate changes, so a report only has to visit the heap. Portable under CROWD_SAFE_PORTABLE.
+ *
+ * The UIBP table keeps an entry per pair, because it decides which branches are unexpected. In
+ * the sketch mode, indirect_link_hashtable.c caps it by moving the pairs outside the heap to the
+ * IBP table.
+ *
+ * Callers serialize all access (the tag xref lock in indirect_link_hashtable.c). */
+
+#include "crowd_safe_portable.h"
+
+#define UIBP_SKETCH_DEPTH 4
+#define UIBP_SKETCH_WIDTH_BITS 12
+#define UIBP_SKETCH_WIDTH (1U << UIBP_SKETCH_WIDTH_BITS)
+#define UIBP_TOP_COUNT 0x40
+
+typedef struct uibp_top_entry_t uibp_top_entry_t;
+struct uibp_top_entry_t {
+    uint64 key;
+    uint count; // the estimate when the pair was last counted
+    bool dirty; // count changed since the last report
+};
+
+typedef struct uibp_sketch_t uibp_sketch_t;
+struct uibp_sketch_t {
+    uint counters[UIBP_SKETCH_DEPTH][UIBP_SKETCH_WIDTH];
+    uibp_top_entry_t top[UIBP_TOP_COUNT]; // min-heap on `count`
+    uint top_count;
+
+    /* counters, for the log */
+    uint64 executions;
+    uint64 evictions; // pairs pushed out of the heap; each keeps its last reported count
+};
+
+/**** public functions ****/
+
+void
+uibp_sketch_init(uibp_sketch_t *sketch);
+
+/* Counts one execution of the pair `key`, and returns its new estimate. */
+uint
+uibp_sketch_add(uibp_sketch_t *sketch, uint64 key);
+
+uint
+uibp_sketch_estimate(uibp_sketch_t *sketch, uint64 key);
+
+/* Keeps `key` in the heap with `estimate` if it ranks among the top pairs. Returns true if the
+ * pair is in the heap afterwards. */
+bool
+uibp_top_offer(uibp_sketch_t *sketch, uint64 key, uint estimate);
+
+/* Returns the heap entry of `key`, or NULL. The pointer is only valid until the next offer or
+ * removal. */
+uibp_top_entry_t *
+uibp_top_find(uibp_sketch_t *sketch, uint64 key);
+
+/* Returns true if `key` was in the heap. */
+bool
+uibp_top_remove(uibp_sketch_t *sketch, uint64 key);
+
+#endif
@@ -0,0 +1,106 @@
+/* Blackbox UIBP sketch test. */
+
+/* Feeds a skewed stream of pair executions through the UIBP sketch, and checks that no
+ * estimate falls below the true count, that the heaviest pairs all reach the top heap with
+ * their dirty flags set, and that the heap stays ordered through removals.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uibp_sketch.h"
+
+#define PAIR_COUNT 20000
+#define HEAVY_COUNT 0x10
+#define EXECUTION_COUNT 2000000
+
+static uint true_counts[PAIR_COUNT];
+
+static uint64
+pair_key(uint pair) {
+    return (((uint64) (0x401000 + (pair * 0x10))) << 0x20) | (pair * 0x2b);
+}
+
+/* xorshift, so the stream is the same on every host */
+static uint
+next_random(uint64 *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (uint) (*state >> 0x20);
+}
+
+static int
+check_heap(uibp_sketch_t *sketch) {
+    uint i;
+
+    for (i = 1; i < sketch->top_count; i++) {
+        if (sketch->top[(i - 1) / 2].count > sketch->top[i].count) {
+            fprintf(stderr, "Heap order broken at entry %u\n", i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+main(int argc, char **argv) {
+    uibp_sketch_t *sketch = (uibp_sketch_t *) malloc(sizeof(uibp_sketch_t));
+    uint64 state = 0x2545f4914f6cdd1dULL;
+    uint i, pair, estimate, over = 0, failures = 0;
+
+    uibp_sketch_init(sketch);
+    for (i = 0; i < EXECUTION_COUNT; i++) {
+        uint draw = next_random(&state);
+
+        /* half of the executions go to a few heavy pairs, the rest spread over all pairs */
+        if (draw & 1)
+            pair = (draw >> 1) % HEAVY_COUNT;
+        else
+            pair = (draw >> 1) % PAIR_COUNT;
+        true_counts[pair]++;
+        estimate = uibp_sketch_add(sketch, pair_key(pair));
+        uibp_top_offer(sketch, pair_key(pair), estimate);
+    }
+
+    for (pair = 0; pair < PAIR_COUNT; pair++) {
+        if (true_counts[pair] == 0)
+            continue;
+        estimate = uibp_sketch_estimate(sketch, pair_key(pair));
+        if (estimate < true_counts[pair]) {
+            fprintf(stderr, "Pair %u: estimate %u is below the true count %u\n", pair, estimate,
+                    true_counts[pair]);
+            failures++;
+        } else if (estimate > true_counts[pair]) {
+            over++;
+        }
+    }
+    for (pair = 0; pair < HEAVY_COUNT; pair++) {
+        uibp_top_entry_t *entry = uibp_top_find(sketch, pair_key(pair));
+
+        if ((entry == NULL) || !entry->dirty) {
+            fprintf(stderr, "Heavy pair %u is missing from the top heap\n", pair);
+            failures++;
+        }
+    }
+    failures += check_heap(sketch);
+
+    for (pair = 0; pair < HEAVY_COUNT; pair += 2) {
+        if (!uibp_top_remove(sketch, pair_key(pair))) {
+            fprintf(stderr, "Failed to remove heavy pair %u\n", pair);
+            failures++;
+        }
+    }
+    if (uibp_top_find(sketch, pair_key(0)) != NULL) {
+        fprintf(stderr, "Removed pair 0 is still in the top heap\n");
+        failures++;
+    }
+    failures += check_heap(sketch);
+
+    printf("%u pairs, %llu executions: %u overestimated, %llu evictions, %u failures\n",
+           PAIR_COUNT, (unsigned long long) sketch->executions, over,
+           (unsigned long long) sketch->evictions, failures);
+    free(sketch);
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,604 @@
+#include <string.h>
+
+#include "dr_api.h"
+#include "drsyms.h"
+
+#include "xhash_worker.h"
+#include "crowd_safe_trace.h"
+
+/**** private fields ****/
+
+#define XHASH_WORKER_INTERVAL_MS 10
+#define XHASH_WORKER_EXIT_WAIT_MS 10000
+#define XHASH_RECORD_INITIAL_CAPACITY 0x40
+#define XHASH_CACHE_HEADER "# xhash-cache 1"
+#define XHASH_CACHE_BUFFER_SIZE 0x4000
+#define XHASH_CACHE_LINE_MAX_LENGTH 0x200
+
+typedef struct xhash_record_t xhash_record_t;
+struct xhash_record_t {
+    bb_hash_t hash;
+    uint relative_address;
+    char *function_id;
+};
+
+struct xhash_job_t {
+    xhash_job_t *next;
+    app_pc start_pc;
+    char *module_name;
+    char *module_path;
+    char cache_path[256];
+    bool write_xhash;     // write the records to the xhash file, not only to the cache
+    bool cached;          // the records were read from a valid cache file when the module loaded
+    volatile bool loaded; // cleared on unload, under the hashcode lock
+    bool abandoned;       // left running at exit, so it no longer writes; under the worker mutex
+    bool complete;        // all symbols were enumerated, so the records can be cached
+    volatile bool enumerated; // the records are final and may be published
+    bool published;       // added to the export hashtable, under the hashcode lock
+    xhash_record_t *records; // owns each function_id
+    uint record_count;
+    uint record_capacity;
+    uint symbol_start;    // records from here on are symbols, which are dropped if not new
+};
+
+typedef struct xhash_worker_t xhash_worker_t;
+struct xhash_worker_t {
+    void *mutex;          // guards the queue, `current` and `running`
+    xhash_job_t *head;
+    xhash_job_t *tail;
+    xhash_job_t *current; // job in progress on the worker
+    bool started;
+    volatile bool running;
+    volatile bool exiting;
+    bool abandoned;       // the thread was still running a job at exit, so this is never freed
+
+    /* counters, for the log */
+    uint cached_modules;
+    uint hashed_modules;
+    uint symbol_count;
+};
+
+static xhash_worker_t *xhash_worker;
+
+/**** private prototypes ****/
+
+static void
+xhash_worker_thread(void *arg);
+
+static void
+process_xhash_job(xhash_job_t *job);
+
+static void
+enumerate_xhash_job(xhash_job_t *job);
+
+static void
+publish_xhash_job(xhash_job_t *job);
+
+static void
+append_xhash_record(xhash_job_t *job, uint relative_address, bb_hash_t hash,
+                    const char *function_id);
+
+static void
+clear_xhash_records(xhash_job_t *job);
+
+static void
+write_xhash_record(xhash_job_t *job, uint relative_address, function_export_t export);
+
+static bool
+enumerate_symbol(drsym_info_t *info, drsym_error_t status, void *data);
+
+static bool
+read_xhash_cache(xhash_job_t *job);
+
+static bool
+parse_xhash_cache_line(char *line, xhash_record_t *record);
+
+static void
+write_xhash_cache(xhash_job_t *job);
+
+/**** public functions ****/
+
+void
+init_xhash_worker(bool is_fork) {
+    if (is_fork) {
+        xhash_job_t *job = xhash_worker->current;
+
+        xhash_worker->started = false; // the worker thread does not survive the fork
+        xhash_worker->running = false;
+        xhash_worker->current = NULL;
+        if ((job != NULL) && !job->published) {
+            /* Requeue the parent's job in progress. Its symbol records may have been mid-update
+             * in the parent, so they are dropped without freeing their strings. */
+            job->record_count = job->symbol_start;
+            job->enumerated = false;
+            job->complete = true;
+            job->next = xhash_worker->head;
+            xhash_worker->head = job;
+            if (xhash_worker->tail == NULL)
+                xhash_worker->tail = job;
+        }
+    } else {
+        xhash_worker = (xhash_worker_t *) CS_ALLOC(sizeof(xhash_worker_t));
+        memset(xhash_worker, 0, sizeof(xhash_worker_t));
+    }
+    xhash_worker->mutex = dr_mutex_create();
+    CS_TRACK(xhash_worker->mutex, sizeof(mutex_t));
+}
+
+xhash_job_t *
+create_xhash_job(module_location_t *module, const char *module_path, bool write_xhash) {
+    char module_id[256];
+    xhash_job_t *job = (xhash_job_t *) CS_ALLOC(sizeof(xhash_job_t));
+
+    memset(job, 0, sizeof(xhash_job_t));
+    job->start_pc = module->start_pc;
+    job->module_name = cs_strcpy(module->module_name);
+    job->module_path = cs_strcpy(module_path);
+    job->write_xhash = write_xhash;
+    job->loaded = true;
+    job->complete = true;
+
+    print_module_id(module_id, 256, module);
+    dr_snprintf(job->cache_path, 256, "%s%s.xhash", get_xhash_cache_dir(), module_id);
+    job->cache_path[255] = '\0';
+    if (dr_file_exists(job->cache_path)) {
+        job->cached = read_xhash_cache(job);
+        if (!job->cached) {
+            CS_WARN("Discarding the xhash cache %s. The exports of %s will be hashed again.\n",
+                    job->cache_path, job->module_name);
+            dr_delete_file(job->cache_path);
+        }
+    }
+    return job;
+}
+
+void
+xhash_job_add_export(xhash_job_t *job, uint relative_address, function_export_t export) {
+    if (!job->cached)
+        append_xhash_record(job, relative_address, export.hash, export.function_id);
+}
+
+void
+queue_xhash_job(xhash_job_t *job) {
+    bool synchronous;
+
+    assert_hashcode_lock();
+
+    job->symbol_start = job->record_count;
+    if (job->cached) { // everything is in the cache, so there is nothing for the worker to do
+        xhash_worker->cached_modules++;
+        job->enumerated = true;
+        publish_xhash_job(job);
+        delete_xhash_job(job);
+        return;
+    }
+
+    dr_mutex_lock(xhash_worker->mutex);
+    if (!xhash_worker->started) {
+        xhash_worker->started = true;
+        xhash_worker->running = dr_create_client_thread(xhash_worker_thread, NULL);
+        if (!xhash_worker->running)
+            CS_ERR("Failed to start the xhash worker thread. Modules will be hashed on load.\n");
+    }
+    synchronous = !xhash_worker->running;
+    if (!synchronous) {
+        if (xhash_worker->tail == NULL)
+            xhash_worker->head = job;
+        else
+            xhash_worker->tail->next = job;
+        xhash_worker->tail = job;
+    }
+    dr_mutex_unlock(xhash_worker->mutex);
+
+    if (synchronous) {
+        process_xhash_job(job);
+        delete_xhash_job(job);
+    }
+}
+
+void
+xhash_await_module(app_pc start_pc) {
+    xhash_job_t *job, *prev = NULL;
+
+    assert_hashcode_lock();
+
+    if (xhash_worker == NULL)
+        return;
+
+    dr_mutex_lock(xhash_worker->mutex);
+    job = xhash_worker->current;
+    if ((job != NULL) && job->loaded && !job->published && (job->start_pc == start_pc)) {
+        /* The worker needs the hashcode lock to publish, so an unpublished job cannot be
+         * finished or freed while the caller holds that lock. */
+        while (!job->enumerated) {
+            dr_mutex_unlock(xhash_worker->mutex);
+            dr_sleep(1);
+            dr_mutex_lock(xhash_worker->mutex);
+        }
+        dr_mutex_unlock(xhash_worker->mutex);
+        publish_xhash_job(job);
+        return;
+    }
+
+    for (job = xhash_worker->head; job != NULL; prev = job, job = job->next) {
+        if (job->loaded && (job->start_pc == start_pc)) {
+            if (prev == NULL)
+                xhash_worker->head = job->next;
+            else
+                prev->next = job->next;
+            if (xhash_worker->tail == job)
+                xhash_worker->tail = prev;
+            break;
+        }
+    }
+    dr_mutex_unlock(xhash_worker->mutex);
+
+    if (job != NULL) { // not started yet, so take it from the worker
+        process_xhash_job(job);
+        delete_xhash_job(job);
+    }
+}
+
+void
+xhash_module_unloaded(app_pc start_pc) {
+    xhash_job_t *job;
+
+    assert_hashcode_lock();
+
+    dr_mutex_lock(xhash_worker->mutex);
+    if ((xhash_worker->current != NULL) && (xhash_worker->current->start_pc == start_pc))
+        xhash_worker->current->loaded = false;
+    for (job = xhash_worker->head; job != NULL; job = job->next) {
+        if (job->start_pc == start_pc)
+            job->loaded = false;
+    }
+    dr_mutex_unlock(xhash_worker->mutex);
+}
+
+/* If the worker is still busy after XHASH_WORKER_EXIT_WAIT_MS, its current job is abandoned:
+ * marking it unloaded (under the hashcode lock) keeps it out of the export hashtable, and
+ * marking it abandoned (under the worker mutex) keeps it out of the xhash file, which is about
+ * to close. The thread may still run for a while, so destroy_xhash_worker() leaves its state. */
+void
+stop_xhash_worker() {
+    xhash_job_t *job, *next;
+    uint64 deadline = dr_get_milliseconds() + XHASH_WORKER_EXIT_WAIT_MS;
+
+    xhash_worker->exiting = true;
+    while (xhash_worker->running && (dr_get_milliseconds() < deadline))
+        dr_sleep(1);
+
+    hashcode_lock_acquire();
+    dr_mutex_lock(xhash_worker->mutex);
+    job = xhash_worker->head;
+    xhash_worker->head = xhash_worker->tail = NULL;
+    if (xhash_worker->running) {
+        CS_WARN("xhash worker did not finish within %d ms; abandoning its current module and "
+                "hashing the queued modules on thread 0x%x\n",
+                XHASH_WORKER_EXIT_WAIT_MS, current_thread_id());
+        xhash_worker->abandoned = true;
+        if (xhash_worker->current != NULL) {
+            xhash_worker->current->loaded = false;
+            xhash_worker->current->abandoned = true;
+        }
+    }
+    xhash_worker->running = false; // later loads are hashed synchronously
+    dr_mutex_unlock(xhash_worker->mutex);
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        process_xhash_job(job);
+        delete_xhash_job(job);
+    }
+    hashcode_lock_release();
+
+    CS_LOG("xhash worker: %d modules read from the cache, %d modules hashed, %d symbols\n",
+           xhash_worker->cached_modules, xhash_worker->hashed_modules, xhash_worker->symbol_count);
+}
+
+void
+delete_xhash_job(xhash_job_t *job) {
+    clear_xhash_records(job);
+    cs_strfree(job->module_name);
+    cs_strfree(job->module_path);
+    dr_global_free(job, sizeof(xhash_job_t));
+}
+
+void
+destroy_xhash_worker() {
+    if (xhash_worker->abandoned)
+        return; // the worker thread may still use its state
+    dr_mutex_destroy(xhash_worker->mutex);
+    dr_global_free(xhash_worker, sizeof(xhash_worker_t));
+    xhash_worker = NULL;
+}
+
+/**** private functions ****/
+
+static void
+xhash_worker_thread(void *arg) {
+    xhash_job_t *job;
+
+    while (true) {
+        dr_mutex_lock(xhash_worker->mutex);
+        job = xhash_worker->head;
+        if (job == NULL) {
+            if (xhash_worker->exiting) {
+                xhash_worker->running = false; // under the mutex, so no job is queued after this
+                dr_mutex_unlock(xhash_worker->mutex);
+                break;
+            }
+        } else {
+            xhash_worker->head = job->next;
+            if (xhash_worker->head == NULL)
+                xhash_worker->tail = NULL;
+        }
+        xhash_worker->current = job;
+        dr_mutex_unlock(xhash_worker->mutex);
+
+        if (job == NULL) {
+            dr_sleep(XHASH_WORKER_INTERVAL_MS);
+            continue;
+        }
+
+        enumerate_xhash_job(job);
+        hashcode_lock_acquire();
+        publish_xhash_job(job); // unless an edge into the module already did
+        hashcode_lock_release();
+        if (job->complete && job->loaded)
+            write_xhash_cache(job);
+
+        dr_mutex_lock(xhash_worker->mutex);
+        xhash_worker->current = NULL;
+        dr_mutex_unlock(xhash_worker->mutex);
+        delete_xhash_job(job);
+    }
+}
+
+/* Hashes a job on the calling thread, which holds the hashcode lock. drsyms is only entered
+ * with the hashcode lock held, or with no lock at all on the worker, so the two locks are
+ * always acquired in that order. */
+static void
+process_xhash_job(xhash_job_t *job) {
+    assert_hashcode_lock();
+
+    enumerate_xhash_job(job);
+    publish_xhash_job(job);
+    if (job->complete && job->loaded)
+        write_xhash_cache(job);
+}
+
+/* Collects the module's symbols as records after its exports, without touching the export
+ * hashtable, which publish_xhash_job() updates in a single step. */
+static void
+enumerate_xhash_job(xhash_job_t *job) {
+    xhash_worker->hashed_modules++;
+
+    // N.B.: keeps the condition of the original load-time enumeration
+    if (drsym_module_has_symbols(job->module_path)) {
+        drsym_enumerate_symbols_ex(job->module_path, enumerate_symbol,
+                                   sizeof(drsym_info_t), job, DRSYM_PDB);
+    }
+    job->enumerated = true;
+}
+
+/* Adds the records to the export hashtable and writes them to the xhash file. Records before
+ * `symbol_start` (exports, or the whole cache) are always written. A symbol is dropped if its
+ * address already has an export or an earlier symbol, as symbolic aliases are ignored. Edges
+ * into the module wait for this (xhash_await_module()), so the result does not depend on the
+ * progress of the worker. Caller holds the hashcode lock. */
+static void
+publish_xhash_job(xhash_job_t *job) {
+    uint i, kept = 0;
+    extern export_hashtable_t *export_hashes;
+
+    assert_hashcode_lock();
+    ASSERT(job->enumerated);
+
+    if (job->published || !job->loaded)
+        return;
+
+    for (i = 0; i < job->record_count; i++) {
+        xhash_record_t *record = &job->records[i];
+        app_pc export_pc = job->start_pc + record->relative_address;
+        function_export_t export;
+
+        export.hash = record->hash;
+        if (export_hashtable_lookup(export_hashes, export_pc) == NULL) {
+            export.function_id = cs_strcpy(record->function_id);
+            export_hashtable_add(export_hashes, export_pc, export);
+            xhash_worker->symbol_count++;
+        } else if (i >= job->symbol_start) {
+            cs_strfree(record->function_id);
+            continue;
+        }
+        if (job->write_xhash) {
+            export.function_id = record->function_id; // the hashtable owns its copy
+            write_xhash_record(job, record->relative_address, export);
+        }
+        job->records[kept++] = *record;
+    }
+    job->record_count = kept;
+    job->published = true;
+}
+
+/* Copies `function_id`. The count is raised only after the record is filled in. */
+static void
+append_xhash_record(xhash_job_t *job, uint relative_address, bb_hash_t hash,
+                    const char *function_id)
+{
+    xhash_record_t *record;
+
+    if (job->record_count == job->record_capacity) {
+        uint capacity = (job->record_capacity == 0) ?
+            XHASH_RECORD_INITIAL_CAPACITY : (job->record_capacity * 2);
+        xhash_record_t *records = (xhash_record_t *) CS_ALLOC(capacity * sizeof(xhash_record_t));
+
+        if (job->records != NULL) {
+            memcpy(records, job->records, job->record_count * sizeof(xhash_record_t));
+            dr_global_free(job->records, job->record_capacity * sizeof(xhash_record_t));
+        }
+        job->records = records;
+        job->record_capacity = capacity;
+    }
+    record = &job->records[job->record_count];
+    record->hash = hash;
+    record->relative_address = relative_address;
+    record->function_id = cs_strcpy(function_id);
+    job->record_count++;
+}
+
+static void
+clear_xhash_records(xhash_job_t *job) {
+    uint i;
+
+    for (i = 0; i < job->record_count; i++)
+        cs_strfree(job->records[i].function_id);
+    if (job->records != NULL)
+        dr_global_free(job->records, job->record_capacity * sizeof(xhash_record_t));
+    job->records = NULL;
+    job->record_count = 0U;
+    job->record_capacity = 0U;
+}
+
+/* Under the worker mutex, so that no record of an abandoned job reaches the xhash file after
+ * stop_xhash_worker() returns. */
+static void
+write_xhash_record(xhash_job_t *job, uint relative_address, function_export_t export) {
+    dr_mutex_lock(xhash_worker->mutex);
+    if (!job->abandoned)
+        write_cross_module_hash(relative_address, export);
+    dr_mutex_unlock(xhash_worker->mutex);
+}
+
+static bool
+enumerate_symbol(drsym_info_t *info, drsym_error_t status, void *data) {
+    xhash_job_t *job = (xhash_job_t *) data;
+    char symbol_id[256], symbol_name[256];
+
+    if (!job->loaded) {
+        job->complete = false;
+        return false; // symbols of an unloaded module would go stale in the export hashtable
+    }
+
+    print_callback_function_id_by_name(symbol_id, 256, job->module_name, info->start_offs);
+    dr_snprintf(symbol_name, 256, "%s!%s", job->module_name, info->name);
+    append_xhash_record(job, info->start_offs, string_hash(symbol_id), symbol_name);
+    return true;
+}
+
+/* Reads the cache into the job's records while the module loads. Parses the whole cache
+ * before keeping any of it, so a damaged file leaves the job as if it were not cached. */
+static bool
+read_xhash_cache(xhash_job_t *job) {
+    char *buffer, *line, *mark;
+    xhash_record_t record;
+    uint i, line_count = 0;
+    bool valid = true;
+    file_t cache_file;
+    uint64 size;
+
+    cache_file = dr_open_file(job->cache_path, DR_FILE_READ);
+    if (cache_file == INVALID_FILE)
+        return false;
+
+    dr_file_size(cache_file, &size);
+    buffer = CS_ALLOC((size_t)size + 1);
+    if (dr_read_file(cache_file, buffer, (size_t)size) < (ssize_t)size) {
+        dr_close_file(cache_file);
+        dr_global_free(buffer, (size_t)size + 1);
+        return false;
+    }
+    dr_close_file(cache_file);
+    buffer[size] = '\0';
+
+    for (i = 0; i < size; i++) {
+        if (buffer[i] == '\n')
+            line_count++;
+    }
+
+    line = strtok_r(buffer, "\r\n", &mark);
+    if ((line == NULL) || (strcmp(line, XHASH_CACHE_HEADER) != 0))
+        valid = false;
+    while (valid) {
+        line = strtok_r(NULL, "\r\n", &mark);
+        if (line == NULL)
+            break;
+        if ((job->record_count == line_count) || !parse_xhash_cache_line(line, &record))
+            valid = false;
+        else
+            append_xhash_record(job, record.relative_address, record.hash, record.function_id);
+    }
+    if (!valid)
+        clear_xhash_records(job);
+
+    dr_global_free(buffer, (size_t)size + 1);
+    return valid;
+}
+
+/* Cache lines have the format of the xhash file, "<hash> <function-id> <offset>", where the
+ * function id may contain spaces. The line is split in place. */
+static bool
+parse_xhash_cache_line(char *line, xhash_record_t *record) {
+    char *function_id = strchr(line, ' ');
+    char *offset = strrchr(line, ' ');
+
+    if ((function_id == NULL) || (offset == function_id))
+        return false;
+
+    *function_id++ = '\0';
+    *offset++ = '\0';
+    if (dr_sscanf(line, "0x%llx", &record->hash) == 0)
+        return false;
+    if (dr_sscanf(offset, "0x%x", &record->relative_address) == 0)
+        return false;
+    record->function_id = function_id;
+    return true;
+}
+
+/* Writes the cache under a temporary name and renames it into place, so that concurrent
+ * processes never read a partial file. */
+static void
+write_xhash_cache(xhash_job_t *job) {
+    char temp_path[256], *buffer;
+    const char *cache_dir = get_xhash_cache_dir();
+    uint i, position;
+    file_t cache_file;
+    int length;
+
+    if (!dr_directory_exists(cache_dir) && !dr_create_dir(cache_dir) &&
+        !dr_directory_exists(cache_dir)) { // another process may have just created it
+        CS_WARN("Failed to create the xhash cache directory %s\n", cache_dir);
+        return;
+    }
+
+    dr_snprintf(temp_path, 256, "%s.%d", job->cache_path, dr_get_process_id());
+    temp_path[255] = '\0';
+    cache_file = dr_open_file(temp_path, DR_FILE_WRITE_OVERWRITE);
+    if (cache_file == INVALID_FILE) {
+        CS_WARN("Failed to create the xhash cache file %s\n", temp_path);
+        return;
+    }
+
+    buffer = CS_ALLOC(XHASH_CACHE_BUFFER_SIZE);
+    position = dr_snprintf(buffer, XHASH_CACHE_BUFFER_SIZE, "%s\n", XHASH_CACHE_HEADER);
+    for (i = 0; i < job->record_count; i++) {
+        if ((XHASH_CACHE_BUFFER_SIZE - position) < XHASH_CACHE_LINE_MAX_LENGTH) {
+            dr_write_file(cache_file, buffer, position);
+            position = 0;
+        }
+        length = dr_snprintf(buffer + position, XHASH_CACHE_LINE_MAX_LENGTH, "0x%llx %s 0x%x\n",
+                             job->records[i].hash, job->records[i].function_id,
+                             job->records[i].relative_address);
+        if (length > 0) // skip a record too long for a line
+            position += length;
+    }
+    dr_write_file(cache_file, buffer, position);
+    dr_global_free(buffer, XHASH_CACHE_BUFFER_SIZE);
+    dr_close_file(cache_file);
+
+    if (!dr_rename_file(temp_path, job->cache_path, true/*replace*/)) {
+        CS_WARN("Failed to move the xhash cache file into place at %s\n", job->cache_path);
+        dr_delete_file(temp_path);
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef XHASH_WORKER_H
+#define XHASH_WORKER_H 1
+
+/* Hashes the exports and symbols of each loaded image module for the cross-module hash file
+ * (xhash.tab) on a background thread. The export directory is still walked while the module
+ * loads, because edges into the module look up its exports right away, but the xhash records
+ * are only queued there. The worker then enumerates the module's symbols through drsyms,
+ * adds them to the export hashtable, writes the records, and saves everything in a cache file
+ * named by the module id (name, version, timestamp and checksum). When a later load finds a
+ * valid cache file, its records are published right away and the worker is not involved.
+ *
+ * Symbols of an uncached module therefore reach the export hashtable some time after the
+ * module is loaded. A cross-module edge into the module calls xhash_await_module() before it
+ * looks up its target, so edge hashes do not depend on the progress of the worker. */
+
+#include "crowd_safe_util.h"
+#include "module_observer.h"
+
+typedef struct xhash_job_t xhash_job_t;
+
+void
+init_xhash_worker(bool is_fork);
+
+/* Export records are collected with xhash_job_add_export() unless the module is already
+ * cached. A damaged cache file is deleted, and the module is hashed as if it were not cached.
+ * With `write_xhash` false, the symbols only go to the export hashtable. */
+xhash_job_t *
+create_xhash_job(module_location_t *module, const char *module_path, bool write_xhash);
+
+void
+xhash_job_add_export(xhash_job_t *job, uint relative_address, function_export_t export);
+
+/* Hands the job to the worker, which owns it from here. Caller holds the hashcode lock, since
+ * the module's exports were added under it, so that no edge sees the module without its job. */
+void
+queue_xhash_job(xhash_job_t *job);
+
+/* Completes the job of the loaded module at `start_pc`, if it is still pending: a queued job
+ * is taken from the worker and hashed on the calling thread, and a job in progress is waited
+ * for. Caller holds the hashcode lock. */
+void
+xhash_await_module(app_pc start_pc);
+
+/* For a job that is not queued. */
+void
+delete_xhash_job(xhash_job_t *job);
+
+/* Stops adding symbols of the module at `start_pc` to the export hashtable. Caller holds the
+ * hashcode lock, like clear_module_exports(). */
+void
+xhash_module_unloaded(app_pc start_pc);
+
+/* Finishes all queued jobs, so the xhash file is complete before it is closed. Waits at most
+ * XHASH_WORKER_EXIT_WAIT_MS for the worker, after which its current module is left out. */
+void
+stop_xhash_worker();
+
+void
+destroy_xhash_worker();
+
+#endif
@@ -34,6 +34,11 @@
 #include "utils.h"
 
 #include <string.h>
+#ifdef WINDOWS
+# include <intrin.h>
+#endif
+
+#define OFFSET_BITS (sizeof(uint) * 8)
 
 /* we use direct map cache to avoid locking */
 static inline void
@@ -66,10 +71,39 @@ thread_module_cache_add(module_entry_t **cache, uint cache_size,
     thread_module_cache_adjust(cache, entry, cache_size - 1, cache_size);
 }
 
+/* Atomically sets the bits and returns the old value of the word. */
+static inline uint
+atomic_fetch_or(volatile uint *word, uint bits)
+{
+#ifdef WINDOWS
+    return (uint)_InterlockedOr((volatile long *)word, (long)bits);
+#else
+    return __sync_fetch_and_or(word, bits);
+#endif
+}
+
+static void
+module_entry_offsets_create(module_entry_t *entry)
+{
+    size_t size = entry->data->end - entry->data->start;
+    /* Raw memory is zeroed and committed on first touch, so the bitmap
+     * only costs a page for each range of the module that holds code.
+     */
+    entry->offsets_size = ALIGN_FORWARD((size + OFFSET_BITS - 1) / OFFSET_BITS *
+                                        sizeof(uint), PAGE_SIZE);
+    entry->offsets = dr_raw_mem_alloc(entry->offsets_size,
+                                      DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+    if (entry->offsets == NULL)
+        entry->offsets_size = 0;
+}
+
 static void
 module_table_entry_free(void *entry)
 {
-    dr_free_module_data(((module_entry_t *)entry)->data);
+    module_entry_t *mod_entry = (module_entry_t *)entry;
+    if (mod_entry->offsets != NULL)
+        dr_raw_mem_free(mod_entry->offsets, mod_entry->offsets_size);
+    dr_free_module_data(mod_entry->data);
     dr_global_free(entry, sizeof(module_entry_t));
 }
 
@@ -118,6 +152,10 @@ module_table_load(module_table_t *table, const module_data_t *data)
         entry->id = table->vector.entries;
         entry->unload = false;
         entry->data = dr_copy_module_data(data);
+        entry->offsets = NULL;
+        entry->offsets_size = 0;
+        if (table->mark_offsets)
+            module_entry_offsets_create(entry);
         drvector_append(&table->vector, entry);
     }
     drvector_unlock(&table->vector);
@@ -192,6 +230,22 @@ module_table_unload(module_table_t *table, const module_data_t *data)
     }
 }
 
+bool
+module_entry_mark_offset(module_entry_t *entry, uint offset)
+{
+    volatile uint *word;
+    uint bit;
+    if (entry->offsets == NULL ||
+        offset / OFFSET_BITS >= entry->offsets_size / sizeof(uint))
+        return true; /* nothing to mark: treat every offset as new */
+    word = (volatile uint *)&entry->offsets[offset / OFFSET_BITS];
+    bit  = 1U << (offset % OFFSET_BITS);
+    /* a plain read first, so offsets seen before do not write the line */
+    if ((*word & bit) != 0)
+        return false;
+    return (atomic_fetch_or(word, bit) & bit) == 0;
+}
+
 /* assuming caller holds the lock */
 static void
 module_table_entry_print(module_entry_t *entry, file_t log, bool print_all_info)
@@ -251,10 +305,11 @@ module_table_print(module_table_t *table, file_t log, bool print_all_info)
 }
 
 module_table_t *
-module_table_create()
+module_table_create(bool mark_offsets)
 {
     module_table_t *table = dr_global_alloc(sizeof(*table));
     memset(table->cache, 0, sizeof(table->cache));
+    table->mark_offsets = mark_offsets;
     drvector_init(&table->vector, 16, false, module_table_entry_free);
     return table;
 }
@@ -44,12 +44,18 @@ typedef struct _module_entry_t {
     int  id;
     bool unload; /* if the module is unloaded */
     module_data_t *data;
+    /* One bit per byte offset from the module base, if the table marks
+     * offsets (see module_table_create()), or NULL.
+     */
+    uint *offsets;
+    size_t offsets_size;
 } module_entry_t;
 
 typedef struct _module_table_t {
     drvector_t vector;
     /* for quick query without lock, assuming pointer-aligned */
     module_entry_t *cache[NUM_GLOBAL_MODULE_CACHE];
+    bool mark_offsets;
 } module_table_t;
 
 void
@@ -65,8 +71,18 @@ module_table_unload(module_table_t *table, const module_data_t *data);
 void
 module_table_print(module_table_t *table, file_t log, bool print_all_info);
 
+/* Returns true if the offset from the module base was not marked before.
+ * The test-and-set is atomic, so threads may mark offsets of the same module
+ * concurrently without a lock.
+ */
+bool
+module_entry_mark_offset(module_entry_t *entry, uint offset);
+
+/* If mark_offsets is set, each module entry gets a bitmap of its offsets when
+ * it is created by module_table_load().
+ */
 module_table_t *
-module_table_create();
+module_table_create(bool mark_offsets);
 
 void
 module_table_destroy(module_table_t *table);
@@ -48,6 +48,33 @@
  *                    Uses nudge to notify a child process being terminated
  *                    by its parent, so that the exit event will be called.
  * -logdir <dir>      Sets log directory, which by default is ".".
+ * -dedup             Records each basic block start only the first time it
+ *                    is seen in a module, so the table and the log are
+ *                    bounded by code size rather than run length.
+ *                    Not supported with -thread_private.
+ * -hitcount          Counts the executions of each basic block with an
+ *                    inline 64-bit counter, and dumps the counts after the
+ *                    BB table. Cannot be combined with -dedup.
+ * -edges             Collects AFL-style edge coverage: each block updates a
+ *                    byte of a 64 KB per-process bitmap, indexed by its id
+ *                    xor the id of the previous block, with inline code.
+ *                    The bitmap is dumped at exit, or to a new file on a
+ *                    nudge with argument NUDGE_DUMP_EDGES (2).
+ * -shm <name>        Implies -edges, with the bitmap mapped from the shared
+ *                    file <name> (under /dev/shm on Linux unless it is a
+ *                    path), created with 64 KB of zeros if missing. A %p
+ *                    in <name> is replaced by the process id. No log
+ *                    files are written, and the previous block id is reset
+ *                    on fork, so a fork server can clear the segment between
+ *                    runs and read each child's edges from it.
+ *                    Not supported on Windows.
+ * -snapshots         Keeps the blocks added since the last snapshot in a
+ *                    delta table (per thread with -thread_private). A
+ *                    nudge with argument NUDGE_SNAPSHOT (3) swaps each
+ *                    delta table for an empty one and writes the old ones
+ *                    to a new drcov.*.snap.log file with the next sequence
+ *                    number, without stopping the process.
+ *                    Cannot be combined with -shm.
  *
  * The two options below can only be used when the client is compiled with
  * CBR_COVERAGE being defined.
@@ -95,6 +122,16 @@ typedef struct _drcov_option_t {
     bool nudge_kills;
     char logdir[MAXIMUM_PATH];
     int native_until_thread;
+    /* Keep one bb_entry_t per module offset, using a bitmap per module. */
+    bool dedup;
+    /* Count block executions inline, one counter per bb_entry_t. */
+    bool hitcount;
+    /* Count block pairs inline in a hashed bitmap. */
+    bool edges;
+    /* The shared file to map the edge bitmap from, or empty. */
+    char shm[MAXIMUM_PATH];
+    /* Keep a delta table of the blocks added since the last snapshot. */
+    bool snapshots;
 #ifdef CBR_COVERAGE
     bool check;
     bool summary;
@@ -105,8 +142,24 @@ static drcov_option_t options;
 
 #define NUM_THREAD_MODULE_CACHE 4
 
+/* With -snapshots, the bb entries added since the last snapshot. A snapshot
+ * swaps the table for an empty one, so the lock is only held to add one entry
+ * or to swap, and never while writing the old table out.
+ */
+typedef struct _delta_buffer_t {
+    void *table;
+    void *lock;
+    struct _delta_buffer_t *next;
+} delta_buffer_t;
+
 typedef struct _per_thread_t {
     void *bb_table;
+    /* The execution count of each bb_table entry at the same index, with
+     * -hitcount. Its lock keeps both tables allocating in step.
+     */
+    void *hit_table;
+    /* shared with the copies of global data, which must see the swaps */
+    delta_buffer_t *delta;
     /* for quick per-thread query without lock */
     module_entry_t *cache[NUM_THREAD_MODULE_CACHE];
     file_t  log;
@@ -125,12 +178,34 @@ static int sysnum_execve = IF_X64_ELSE(59, 11);
 static volatile bool go_native;
 static int tls_idx = -1;
 
+/* With -edges, two raw TLS slots hold the previous block id (shifted) and the
+ * bitmap address, so that the inline code needs only one scratch register.
+ */
+enum {
+    EDGE_TLS_PREV,
+    EDGE_TLS_BITMAP,
+    EDGE_TLS_COUNT,
+};
+static byte *edge_bitmap;
+static reg_id_t edge_tls_seg;
+static uint edge_tls_offs;
+
+/* The delta buffers of all live per_thread_t, and the next snapshot number.
+ * Both are guarded by snapshot_lock, which is never taken by a bb event.
+ */
+static delta_buffer_t *delta_buffers;
+static uint snapshot_seq;
+static void *snapshot_lock;
+
 static void
 event_exit(void);
 
 static void
 event_thread_exit(void *drcontext);
 
+static void
+version_print(file_t log);
+
 /****************************************************************************
  * Utility Functions
  */
@@ -354,18 +429,40 @@ bb_table_check_cbr(module_table_t *table, per_thread_t *data)
 static bool
 bb_table_entry_print(ptr_uint_t idx, void *entry, void *iter_data)
 {
-    per_thread_t *data = iter_data;
+    file_t log = *(file_t *)iter_data;
     bb_entry_t *bb_entry = (bb_entry_t *)entry;
-    dr_fprintf(data->log, "module[%3u]: "PFX", %3u",
+    dr_fprintf(log, "module[%3u]: "PFX", %3u",
                bb_entry->mod_id, bb_entry->start, bb_entry->size);
 #ifdef CBR_COVERAGE
-    dr_fprintf(data->log, ", "PFX", %2u, %3u",
+    dr_fprintf(log, ", "PFX", %2u, %3u",
                bb_entry->cbr_tgt, bb_entry->trace ? 1:0, bb_entry->num_instrs);
 #endif
-    dr_fprintf(data->log, "\n");
+    dr_fprintf(log, "\n");
     return true; /* continue iteration */
 }
 
+/* The column header of a text BB table, printed once before its entries. */
+static void
+bb_table_header_print(file_t log)
+{
+    if (options.dump_text) {
+        dr_fprintf(log, "module id, start, size");
+#ifdef CBR_COVERAGE
+        dr_fprintf(log, ", cbr tgt, trace, #instr");
+#endif
+        dr_fprintf(log, ":\n");
+    }
+}
+
+static void
+bb_table_entries_print(void *table, file_t log)
+{
+    if (options.dump_text)
+        drtable_iterate(table, &log, bb_table_entry_print);
+    else
+        drtable_dump_entries(table, log);
+}
+
 static void
 bb_table_print(void *drcontext, per_thread_t *data)
 {
@@ -376,30 +473,70 @@ bb_table_print(void *drcontext, per_thread_t *data)
     }
     dr_fprintf(data->log, "BB Table: %u bbs\n",
                drtable_num_entries(data->bb_table));
-    if (options.dump_text) {
-        dr_fprintf(data->log, "module id, start, size");
-#ifdef CBR_COVERAGE
-        dr_fprintf(data->log, ", cbr tgt, trace, #instr");
-#endif
-        dr_fprintf(data->log, ":\n");
-        drtable_iterate(data->bb_table, data, bb_table_entry_print);
-    } else
-        drtable_dump_entries(data->bb_table, data->log);
+    bb_table_header_print(data->log);
+    bb_table_entries_print(data->bb_table, data->log);
 }
 
+static bool
+hit_table_entry_print(ptr_uint_t idx, void *entry, void *iter_data)
+{
+    per_thread_t *data = iter_data;
+    dr_fprintf(data->log, "%u: %llu\n", (uint)idx, *(uint64 *)entry);
+    return true; /* continue iteration */
+}
+
+/* Threads may still be running, so a block added after bb_table_print
+ * may have a count here; readers ignore the counts past the BB table.
+ */
 static void
+hit_table_print(void *drcontext, per_thread_t *data)
+{
+    ASSERT(data != NULL, "data must not be NULL");
+    if (data->log == INVALID_FILE) {
+        ASSERT(false, "invalid log file");
+        return;
+    }
+    dr_fprintf(data->log, "Hit Count Table: version %d, %u counts\n",
+               DRCOV_HITCOUNT_VERSION, drtable_num_entries(data->hit_table));
+    if (options.dump_text)
+        drtable_iterate(data->hit_table, data, hit_table_entry_print);
+    else
+        drtable_dump_entries(data->hit_table, data->log);
+}
+
+static void
+delta_buffer_add(delta_buffer_t *delta, bb_entry_t *bb_entry);
+
+/* Returns the execution counter of the new entry with -hitcount, or NULL. */
+static uint64 *
 bb_table_entry_add(void *drcontext, per_thread_t *data, app_pc start,
 #ifdef CBR_COVERAGE
                    app_pc cbr_tgt, ushort num_instrs, bool trace,
 #endif
                    uint size)
 {
-    bb_entry_t *bb_entry = drtable_alloc(data->bb_table, 1, NULL);
+    bb_entry_t *bb_entry;
+    uint64 *hits = NULL;
     module_entry_t **mod_entry_cache = data != NULL ? data->cache : NULL;
     module_entry_t *mod_entry = module_table_lookup(mod_entry_cache,
                                                     NUM_THREAD_MODULE_CACHE,
                                                     module_table, start);
-    /* we do not de-duplicate repeated bbs */
+    /* Without -dedup we do not de-duplicate repeated bbs. With it, a repeat
+     * returns here before taking the drtable lock. Blocks outside of any
+     * module are always recorded.
+     */
+    if (options.dedup && mod_entry != NULL && mod_entry->data != NULL &&
+        !module_entry_mark_offset(mod_entry,
+                                  (uint)(start - mod_entry->data->start)))
+        return NULL;
+    if (options.hitcount) {
+        drtable_lock(data->hit_table);
+        bb_entry = drtable_alloc(data->bb_table, 1, NULL);
+        hits = drtable_alloc(data->hit_table, 1, NULL);
+        drtable_unlock(data->hit_table);
+        *hits = 0;
+    } else
+        bb_entry = drtable_alloc(data->bb_table, 1, NULL);
     ASSERT(size < USHRT_MAX, "size overflow");
     bb_entry->size = (ushort)size;
     if (mod_entry != NULL && mod_entry->data != NULL) {
@@ -429,6 +566,9 @@ bb_table_entry_add(void *drcontext, per_thread_t *data, app_pc start,
     bb_entry->trace = trace;
     bb_entry->num_instrs = num_instrs;
 #endif
+    if (data->delta != NULL)
+        delta_buffer_add(data->delta, bb_entry);
+    return hits;
 }
 
 #define INIT_BB_TABLE_ENTRIES 4096
@@ -445,6 +585,285 @@ bb_table_destroy(void *table, void *data)
     drtable_destroy(table, data);
 }
 
+/* The counters are updated by absolute address from the code cache. The table
+ * lock is taken by bb_table_entry_add(), not by the table itself.
+ */
+static void *
+hit_table_create(void)
+{
+    return drtable_create(INIT_BB_TABLE_ENTRIES, sizeof(uint64),
+                          DRTABLE_MEM_REACHABLE, false /* !synch */, NULL);
+}
+
+/****************************************************************************
+ * Snapshot Functions
+ */
+
+static delta_buffer_t *
+delta_buffer_create(void)
+{
+    delta_buffer_t *delta = dr_global_alloc(sizeof(*delta));
+    delta->table = bb_table_create(false);
+    delta->lock  = dr_mutex_create();
+    dr_mutex_lock(snapshot_lock);
+    delta->next = delta_buffers;
+    delta_buffers = delta;
+    dr_mutex_unlock(snapshot_lock);
+    return delta;
+}
+
+/* The entries not yet in a snapshot are still in the thread or process log. */
+static void
+delta_buffer_destroy(delta_buffer_t *delta)
+{
+    delta_buffer_t **link;
+    dr_mutex_lock(snapshot_lock);
+    for (link = &delta_buffers; *link != NULL; link = &(*link)->next) {
+        if (*link == delta) {
+            *link = delta->next;
+            break;
+        }
+    }
+    dr_mutex_unlock(snapshot_lock);
+    bb_table_destroy(delta->table, NULL);
+    dr_mutex_destroy(delta->lock);
+    dr_global_free(delta, sizeof(*delta));
+}
+
+static void
+delta_buffer_add(delta_buffer_t *delta, bb_entry_t *bb_entry)
+{
+    bb_entry_t *copy;
+    dr_mutex_lock(delta->lock);
+    copy = drtable_alloc(delta->table, 1, NULL);
+    *copy = *bb_entry;
+    dr_mutex_unlock(delta->lock);
+}
+
+/* Writes the blocks added since the previous snapshot to a new
+ * drcov.*.snap.log file, in the process log format with a "Snapshot: %u, pid
+ * %d" line after the version line. Its BB table has only the blocks added
+ * since the previous snapshot of this process, which was numbered one lower;
+ * the first one is 0. The delta tables are written one after another under a
+ * single BB table header. Application threads wait at most for the swap of
+ * their delta table.
+ */
+static void
+snapshot_dump(void)
+{
+    delta_buffer_t *delta;
+    void **tables;
+    uint num_tables = 0, num_bbs = 0, seq, i;
+    file_t log;
+
+    dr_mutex_lock(snapshot_lock);
+    for (delta = delta_buffers; delta != NULL; delta = delta->next)
+        num_tables++;
+    tables = dr_global_alloc((num_tables + 1) * sizeof(*tables));
+    for (i = 0, delta = delta_buffers; delta != NULL; i++, delta = delta->next) {
+        void *fresh = bb_table_create(false);
+        dr_mutex_lock(delta->lock);
+        tables[i] = delta->table;
+        delta->table = fresh;
+        dr_mutex_unlock(delta->lock);
+        num_bbs += drtable_num_entries(tables[i]);
+    }
+    seq = snapshot_seq++;
+    dr_mutex_unlock(snapshot_lock);
+
+    /* The module table is printed after the swap, so it has every module
+     * the entries refer to.
+     */
+    log = log_file_create_helper(NULL, "snap.log");
+    if (log != INVALID_FILE) {
+        version_print(log);
+        dr_fprintf(log, "Snapshot: %u, pid %d\n", seq, dr_get_process_id());
+        module_table_print(module_table, log, IF_CBR_COVERAGE_ELSE(true, false));
+        dr_fprintf(log, "BB Table: %u bbs\n", num_bbs);
+        bb_table_header_print(log);
+        for (i = 0; i < num_tables; i++)
+            bb_table_entries_print(tables[i], log);
+        dr_close_file(log);
+    } else
+        NOTIFY(0, "<failed to create snapshot %u>\n", seq);
+    for (i = 0; i < num_tables; i++)
+        bb_table_destroy(tables[i], NULL);
+    dr_global_free(tables, (num_tables + 1) * sizeof(*tables));
+}
+
+/****************************************************************************
+ * Edge Bitmap Functions
+ */
+
+static opnd_t
+edge_tls_opnd(int slot, opnd_size_t size)
+{
+    return opnd_create_far_base_disp(edge_tls_seg, DR_REG_NULL, DR_REG_NULL, 0,
+                                     edge_tls_offs + slot * sizeof(void *), size);
+}
+
+/* Derives the id of a block from its module and offset rather than picking
+ * a random one, so that a rebuilt block (after a flush, or in a trace) keeps
+ * its id and the bitmap is comparable across runs despite ASLR.
+ */
+static uint
+edge_block_id(per_thread_t *data, app_pc start)
+{
+    module_entry_t **mod_entry_cache = data != NULL ? data->cache : NULL;
+    module_entry_t *mod_entry = module_table_lookup(mod_entry_cache,
+                                                    NUM_THREAD_MODULE_CACHE,
+                                                    module_table, start);
+    uint key;
+    if (mod_entry != NULL && mod_entry->data != NULL) {
+        key = (uint)(start - mod_entry->data->start) * 0x9e3779b1 ^
+            (uint)mod_entry->id * 0x85ebca6b;
+    } else
+        key = (uint)(ptr_uint_t)start * 0x9e3779b1;
+    /* murmur3 finalizer */
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+    return key & (EDGE_BITMAP_SIZE - 1);
+}
+
+/* Inserts before where:
+ *   mov ecx, [prev] ; xor ecx, id ; add xcx, [bitmap] ; inc byte [xcx]
+ *   mov [prev], id >> 1
+ * The byte counter wraps, as in AFL, and racing threads may lose an update.
+ */
+static void
+edge_instrument(void *drcontext, instrlist_t *bb, instr_t *where, uint id)
+{
+    bool save_aflags = !drx_aflags_are_dead(where);
+    if (save_aflags) {
+        dr_save_reg(drcontext, bb, where, DR_REG_XAX, SPILL_SLOT_2);
+        dr_save_arith_flags_to_xax(drcontext, bb, where);
+    }
+    dr_save_reg(drcontext, bb, where, DR_REG_XCX, SPILL_SLOT_3);
+    instrlist_meta_preinsert
+        (bb, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(DR_REG_ECX),
+                                        edge_tls_opnd(EDGE_TLS_PREV, OPSZ_4)));
+    instrlist_meta_preinsert
+        (bb, where, INSTR_CREATE_xor(drcontext, opnd_create_reg(DR_REG_ECX),
+                                     OPND_CREATE_INT32(id)));
+    instrlist_meta_preinsert
+        (bb, where, INSTR_CREATE_add(drcontext, opnd_create_reg(DR_REG_XCX),
+                                     edge_tls_opnd(EDGE_TLS_BITMAP, OPSZ_PTR)));
+    instrlist_meta_preinsert
+        (bb, where, INSTR_CREATE_inc(drcontext, OPND_CREATE_MEM8(DR_REG_XCX, 0)));
+    instrlist_meta_preinsert
+        (bb, where, INSTR_CREATE_mov_st(drcontext,
+                                        edge_tls_opnd(EDGE_TLS_PREV, OPSZ_4),
+                                        OPND_CREATE_INT32(id >> 1)));
+    dr_restore_reg(drcontext, bb, where, DR_REG_XCX, SPILL_SLOT_3);
+    if (save_aflags) {
+        dr_restore_arith_flags_from_xax(drcontext, bb, where);
+        dr_restore_reg(drcontext, bb, where, DR_REG_XAX, SPILL_SLOT_2);
+    }
+}
+
+static void
+edge_thread_init(void *drcontext)
+{
+    byte *base = dr_get_dr_segment_base(edge_tls_seg);
+    *(uint *)(base + edge_tls_offs + EDGE_TLS_PREV * sizeof(void *)) = 0;
+    *(byte **)(base + edge_tls_offs + EDGE_TLS_BITMAP * sizeof(void *)) =
+        edge_bitmap;
+}
+
+/* Maps the bitmap from the -shm file, which the fork server reads and clears
+ * between runs. The mapping is shared, so it is inherited by forked children.
+ */
+static byte *
+edge_bitmap_map(void)
+{
+    char name[MAXIMUM_PATH];
+    char path[MAXIMUM_PATH];
+    static const byte zeros[0x1000];
+    uint64 file_size;
+    size_t map_size = EDGE_BITMAP_SIZE;
+    byte *map = NULL;
+    file_t f;
+    const char *pid = strstr(options.shm, "%p");
+    /* a %p in the name stands for the process id, so that concurrent fork
+     * servers each get a segment of their own
+     */
+    if (pid != NULL) {
+        size_t prefix = pid - options.shm;
+        memcpy(name, options.shm, prefix);
+        dr_snprintf(name + prefix, BUFFER_SIZE_ELEMENTS(name) - prefix, "%d%s",
+                    dr_get_process_id(), pid + 2);
+    } else
+        dr_snprintf(name, BUFFER_SIZE_ELEMENTS(name), "%s", options.shm);
+    NULL_TERMINATE_BUFFER(name);
+#ifdef UNIX
+    if (strchr(name, '/') == NULL) {
+        dr_snprintf(path, BUFFER_SIZE_ELEMENTS(path), "/dev/shm/%s", name);
+        NULL_TERMINATE_BUFFER(path);
+    } else
+#endif
+    {
+        dr_snprintf(path, BUFFER_SIZE_ELEMENTS(path), "%s", name);
+        NULL_TERMINATE_BUFFER(path);
+    }
+    /* appending creates the file if it is missing, and never truncates it */
+    f = dr_open_file(path, DR_FILE_READ | DR_FILE_WRITE_APPEND);
+    if (f == INVALID_FILE) {
+        NOTIFY(0, "failed to open shared bitmap %s\n", path);
+        return NULL;
+    }
+    if (dr_file_size(f, &file_size)) {
+        for (; file_size < EDGE_BITMAP_SIZE; file_size += sizeof(zeros))
+            dr_write_file(f, zeros, sizeof(zeros));
+        map = dr_map_file(f, &map_size, 0, NULL,
+                          DR_MEMPROT_READ | DR_MEMPROT_WRITE, 0);
+    }
+    dr_close_file(f);
+    if (map != NULL && map_size < EDGE_BITMAP_SIZE) {
+        /* the inline code would write past a short mapping */
+        dr_unmap_file(map, map_size);
+        map = NULL;
+    }
+    if (map == NULL)
+        NOTIFY(0, "failed to map shared bitmap %s\n", path);
+    return map;
+}
+
+static void
+edge_bitmap_print(file_t log)
+{
+    uint i;
+    if (log == INVALID_FILE) {
+        ASSERT(false, "invalid log file");
+        return;
+    }
+    dr_fprintf(log, "Edge Bitmap: version %d, %u bytes\n",
+               DRCOV_EDGE_VERSION, EDGE_BITMAP_SIZE);
+    if (options.dump_text) {
+        for (i = 0; i < EDGE_BITMAP_SIZE; i++) {
+            if (edge_bitmap[i] != 0)
+                dr_fprintf(log, "%5u: %3u\n", i, edge_bitmap[i]);
+        }
+    } else
+        dr_write_file(log, edge_bitmap, EDGE_BITMAP_SIZE);
+}
+
+/* Writes the bitmap to a file of its own, for nudges and for per-thread
+ * runs, whose logs are not per-process.
+ */
+static void
+edge_file_dump(void)
+{
+    file_t log = log_file_create_helper(NULL, "edges.log");
+    if (log == INVALID_FILE)
+        return;
+    version_print(log);
+    edge_bitmap_print(log);
+    dr_close_file(log);
+}
+
 /****************************************************************************
  * Thread/Global Data Creation/Destroy
  */
@@ -475,6 +894,8 @@ thread_data_create(void *drcontext)
      * if so, no lock is required for bb_table operation.
      */
     data->bb_table = bb_table_create(drcontext == NULL ? true : false);
+    data->hit_table = options.hitcount ? hit_table_create() : NULL;
+    data->delta = options.snapshots ? delta_buffer_create() : NULL;
     memset(data->cache, 0, sizeof(data->cache));
     log_file_create(drcontext, data);
     return data;
@@ -485,7 +906,12 @@ thread_data_destroy(void *drcontext, per_thread_t *data)
 {
     /* destroy the bb table */
     bb_table_destroy(data->bb_table, data);
-    dr_close_file(data->log);
+    if (data->hit_table != NULL)
+        drtable_destroy(data->hit_table, data);
+    if (data->delta != NULL)
+        delta_buffer_destroy(data->delta);
+    if (data->log != INVALID_FILE)
+        dr_close_file(data->log);
     /* free thread data */
     if (drcontext == NULL) {
         ASSERT(!drcov_per_thread, "drcov_per_thread should not be set");
@@ -514,6 +940,8 @@ global_data_destroy(per_thread_t *data)
 
 enum {
     NUDGE_TERMINATE_PROCESS = 1,
+    NUDGE_DUMP_EDGES        = 2,
+    NUDGE_SNAPSHOT          = 3,
 };
 
 static void
@@ -521,6 +949,14 @@ event_nudge(void *drcontext, uint64 argument)
 {
     int nudge_arg = (int)argument;
     int exit_arg  = (int)(argument >> 32);
+    if (nudge_arg == NUDGE_DUMP_EDGES && options.edges) {
+        edge_file_dump();
+        return;
+    }
+    if (nudge_arg == NUDGE_SNAPSHOT && options.snapshots) {
+        snapshot_dump();
+        return;
+    }
     if (nudge_arg == NUDGE_TERMINATE_PROCESS) {
         static int nudge_term_count;
         /* handle multiple from both NtTerminateProcess and NtTerminateJobObject */
@@ -580,7 +1016,8 @@ event_pre_syscall(void *drcontext, int sysnum)
 
 /* We collect the basic block information including offset from module base,
  * size, and num of instructions, and add it into a basic block table without
- * instrumentation.
+ * instrumentation. With -hitcount, the counter of the new entry is passed to
+ * event_app_instruction() in user_data.
  */
 static dr_emit_flags_t
 event_basic_block_analysis(void *drcontext, void *tag, instrlist_t *bb,
@@ -589,11 +1026,13 @@ event_basic_block_analysis(void *drcontext, void *tag, instrlist_t *bb,
     per_thread_t *data;
     instr_t *instr;
     app_pc start_pc, end_pc;
+    dr_emit_flags_t flags = DR_EMIT_DEFAULT;
 #ifdef CBR_COVERAGE
     ushort num_instrs = 0;
     app_pc cbr_tgt = NULL;
 #endif
 
+    *user_data = NULL;
     /* do nothing for translation */
     if (translating)
         return DR_EMIT_DEFAULT;
@@ -631,17 +1070,60 @@ event_basic_block_analysis(void *drcontext, void *tag, instrlist_t *bb,
      *    repeated bb building, etc.
      * 4. The duplication can be easily handled in a post-processing step,
      *    which is required anyway.
+     * With -dedup, only the first block seen at each module offset is kept,
+     * with its size at that time.
      */
-    bb_table_entry_add(drcontext, data, start_pc,
+    if (options.shm[0] == '\0') {
+        *user_data = bb_table_entry_add(drcontext, data, start_pc,
 #ifdef CBR_COVERAGE
-                       cbr_tgt, num_instrs, for_trace,
+                                        cbr_tgt, num_instrs, for_trace,
 #endif
-                       (uint)(end_pc - start_pc));
+                                        (uint)(end_pc - start_pc));
+    }
 
+    /* The counter address is not kept for re-creating the block, so we ask DR
+     * to store the translations instead.
+     */
+    if (options.hitcount)
+        flags |= DR_EMIT_STORE_TRANSLATIONS;
     if (go_native)
-        return DR_EMIT_GO_NATIVE;
-    else
+        flags |= DR_EMIT_GO_NATIVE;
+    return flags;
+}
+
+static instr_t *
+first_app_instr(instrlist_t *bb)
+{
+    instr_t *instr;
+    for (instr  = instrlist_first(bb);
+         instr != NULL && !instr_ok_to_mangle(instr);
+         instr  = instr_get_next(instr))
+        ; /* do nothing */
+    return instr;
+}
+
+/* With -hitcount, increments the block's counter before its first app
+ * instruction. The update is not atomic: a racing increment may be lost,
+ * which is fine for hotness data and avoids a locked add per execution.
+ * With -edges, updates the edge bitmap there too; the block id depends only
+ * on the block's address, so this is redone identically when translating.
+ */
+static dr_emit_flags_t
+event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
+                      bool for_trace, bool translating, void *user_data)
+{
+    if ((user_data == NULL && !options.edges) || instr != first_app_instr(bb))
         return DR_EMIT_DEFAULT;
+    if (user_data != NULL &&
+        !drx_insert_counter_update(drcontext, bb, instr, SPILL_SLOT_1,
+                                   user_data, 1, DRX_COUNTER_64BIT))
+        ASSERT(false, "failed to insert the hit counter");
+    if (options.edges) {
+        per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+        edge_instrument(drcontext, bb, instr,
+                        edge_block_id(data, dr_fragment_app_pc(tag)));
+    }
+    return DR_EMIT_DEFAULT;
 }
 
 static void
@@ -686,6 +1168,8 @@ event_thread_exit(void *drcontext)
             module_table_print(module_table, data->log,
                                IF_CBR_COVERAGE_ELSE(true, false));
             bb_table_print(drcontext, data);
+            if (options.hitcount)
+                hit_table_print(drcontext, data);
         }
 #ifdef CBR_COVERAGE
         if (options.check)
@@ -735,6 +1219,8 @@ event_thread_init(void *drcontext)
         }
 
     }
+    if (options.edges)
+        edge_thread_init(drcontext);
     /* allocate thread private data for per-thread cache */
     if (drcov_per_thread)
         data = thread_data_create(drcontext);
@@ -747,8 +1233,13 @@ event_thread_init(void *drcontext)
 static void
 event_fork(void *drcontext)
 {
+    /* the child's snapshots start a chain of their own */
+    snapshot_seq = 0;
     if (!drcov_per_thread) {
         log_file_create(NULL, global_data);
+        /* the child of a fork server starts a new run from no previous block */
+        if (options.edges)
+            edge_thread_init(drcontext);
     } else {
         per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
         if (data != NULL) {
@@ -768,15 +1259,29 @@ event_exit(void)
             module_table_print(module_table, global_data->log,
                                IF_CBR_COVERAGE_ELSE(true, false));
             bb_table_print(NULL, global_data);
+            if (options.hitcount)
+                hit_table_print(NULL, global_data);
+            if (options.edges)
+                edge_bitmap_print(global_data->log);
         }
 #ifdef CBR_COVERAGE
         if (options.check)
             bb_table_check_cbr(module_table, global_data);
 #endif
         global_data_destroy(global_data);
+    } else if (options.edges && options.shm[0] == '\0')
+        edge_file_dump();
+    if (options.edges) {
+        dr_raw_tls_cfree(edge_tls_offs, EDGE_TLS_COUNT);
+        if (options.shm[0] != '\0')
+            dr_unmap_file(edge_bitmap, EDGE_BITMAP_SIZE);
+        else
+            dr_raw_mem_free(edge_bitmap, EDGE_BITMAP_SIZE);
     }
     /* destroy module table */
     module_table_destroy(module_table);
+    if (options.snapshots)
+        dr_mutex_destroy(snapshot_lock);
 
     drmgr_unregister_tls_field(tls_idx);
 
@@ -796,8 +1301,22 @@ event_init(void)
            max_elide_jmp == 0 && max_elide_call == 0,
            "elision is not supported");
 #endif
+    if (options.edges) {
+        if (options.shm[0] != '\0')
+            edge_bitmap = edge_bitmap_map();
+        else {
+            edge_bitmap = dr_raw_mem_alloc(EDGE_BITMAP_SIZE,
+                                           DR_MEMPROT_READ | DR_MEMPROT_WRITE,
+                                           NULL);
+        }
+        USAGE_CHECK(edge_bitmap != NULL, "unable to create the edge bitmap");
+        if (!dr_raw_tls_calloc(&edge_tls_seg, &edge_tls_offs, EDGE_TLS_COUNT, 0))
+            ASSERT(false, "unable to reserve raw TLS slots");
+    }
+    if (options.snapshots)
+        snapshot_lock = dr_mutex_create();
     /* create module table */
-    module_table = module_table_create();
+    module_table = module_table_create(options.dedup);
     /* create process data if whole process bb coverage. */
     if (!drcov_per_thread)
         global_data = global_data_create();
@@ -831,6 +1350,19 @@ options_init(client_id_t id)
                              BUFFER_SIZE_ELEMENTS(options.logdir));
             USAGE_CHECK(s != NULL, "missing logdir path");
         }
+        else if (strcmp(token, "-dedup") == 0)
+            options.dedup = true;
+        else if (strcmp(token, "-hitcount") == 0)
+            options.hitcount = true;
+        else if (strcmp(token, "-edges") == 0)
+            options.edges = true;
+        else if (strcmp(token, "-shm") == 0) {
+            s = dr_get_token(s, options.shm, BUFFER_SIZE_ELEMENTS(options.shm));
+            USAGE_CHECK(s != NULL, "missing shm name");
+            options.edges = true;
+        }
+        else if (strcmp(token, "-snapshots") == 0)
+            options.snapshots = true;
         else if (strcmp(token, "-native_until_thread") == 0) {
             s = dr_get_token(s, token, BUFFER_SIZE_ELEMENTS(token));
             USAGE_CHECK(s != NULL, "missing -native_until_thread number");
@@ -866,12 +1398,36 @@ options_init(client_id_t id)
             USAGE_CHECK(false, "invalid option");
         }
     }
+    /* The module bitmaps are shared, so a thread would miss the blocks
+     * other threads saw first.
+     */
+    USAGE_CHECK(!options.dedup || !drcov_per_thread,
+                "-dedup is not supported with -thread_private");
+    /* A repeated build would have no counter to update. */
+    USAGE_CHECK(!options.dedup || !options.hitcount,
+                "-dedup cannot be combined with -hitcount");
+    USAGE_CHECK(options.shm[0] == '\0' || !options.hitcount,
+                "-shm cannot be combined with -hitcount");
+#ifdef WINDOWS
+    /* An append-mode handle cannot back a writable section, and a read-write
+     * open would truncate an existing segment.
+     */
+    USAGE_CHECK(options.shm[0] == '\0', "-shm is not supported on Windows");
+#endif
+    /* There is no bb table to take snapshots of. */
+    USAGE_CHECK(options.shm[0] == '\0' || !options.snapshots,
+                "-shm cannot be combined with -snapshots");
     /* If both or neither specified, we honor the binary. */
     if ((options.dump_text && options.dump_binary) ||
         (!options.dump_text && !options.dump_binary)) {
         options.dump_text   = false;
         options.dump_binary = true;
     }
+    /* With -shm the segment is the only output. */
+    if (options.shm[0] != '\0') {
+        options.dump_text   = false;
+        options.dump_binary = false;
+    }
 }
 
 DR_EXPORT void
@@ -883,7 +1439,8 @@ dr_init(client_id_t id)
     dr_register_exit_event(event_exit);
     drmgr_register_thread_init_event(event_thread_init);
     drmgr_register_thread_exit_event(event_thread_exit);
-    drmgr_register_bb_instrumentation_event(event_basic_block_analysis, NULL, NULL);
+    drmgr_register_bb_instrumentation_event(event_basic_block_analysis,
+                                            event_app_instruction, NULL);
     drmgr_register_module_load_event(event_module_load);
     drmgr_register_module_unload_event(event_module_unload);
     dr_register_filter_syscall_event(event_filter_syscall);
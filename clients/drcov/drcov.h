@@ -47,6 +47,20 @@
 # define DRCOV_VERSION 1
 #endif
 
+/* With -hitcount, the BB table is followed by a "Hit Count Table: version %d,
+ * %u counts" line and an array of uint64 execution counts, one for each
+ * bb_entry_t in the same order. There may be more counts than entries.
+ */
+#define DRCOV_HITCOUNT_VERSION 1
+
+/* With -edges, the process log ends with an "Edge Bitmap: version %d, %u
+ * bytes" line and the bitmap, where each byte counts (modulo 256) the
+ * executions of the block pairs that hash to it, as in AFL. Nudges and
+ * per-thread runs write the bitmap to a drcov.*.edges.log file of its own.
+ */
+#define DRCOV_EDGE_VERSION 1
+#define EDGE_BITMAP_SIZE   0x10000
+
 /* data structure used in drcov.log */
 typedef struct _bb_entry_t {
     uint   start;      /* offset of bb start from the image base */
@@ -50,6 +50,7 @@
 #include <string.h> /* strlen */
 #include <stdlib.h> /* malloc */
 #include <stdio.h>
+#include <stddef.h> /* offsetof */
 #include <limits.h>
 
 #ifdef UNIX
@@ -110,6 +111,8 @@ static char *src_filter;
 static char *mod_filter;
 static char *set_file;
 static file_t set_log = INVALID_FILE;
+/* Set once any input has a hit count table, to print execution counts. */
+static bool have_hitcounts;
 
 /****************************************************************************
  * Utility Functions
@@ -183,6 +186,7 @@ GetFullPathName(const char *rel, size_t abs_len, char *abs, char **ext)
  *   Not knowing the total line number, we alloc one chunk byte array first
  *   and alloc larger chunks when necessary.
  * - Chunks are linked together as a linked-list, with largest chunk at front.
+ * - With hit counts, a chunk also keeps the execution count of each line.
  */
 
 #define LINE_HASH_TABLE_BITS   10
@@ -190,7 +194,7 @@ GetFullPathName(const char *rel, size_t abs_len, char *abs, char **ext)
 #define LINE_TABLE_INIT_PRINT_BUF_SIZE (4*PAGE_SIZE)
 #define SOURCE_FILE_START_LINE_SIZE (MAXIMUM_PATH + 10) /* "SF:%s\n" */
 #define SOURCE_FILE_END_LINE_SIZE   20 /* "end_of_record\n" */
-#define MAX_CHAR_PER_LINE (3/*DA:*/+10/*line_no*/+1/*.*/+1/*0/1*/+1/*\n*/)
+#define MAX_CHAR_PER_LINE (3/*DA:*/+10/*line_no*/+1/*.*/+20/*count*/+1/*\n*/)
 #define MAX_LINE_PER_FILE 0x20000
 
 /* the hashtable for all line_table per source file */
@@ -212,6 +216,7 @@ struct _line_chunk_t {
     uint first_num;   /* the first line number of the chunk */
     uint last_num;    /* the last line number of the chunk */
     byte *line_info;  /* byte array the line execution info */
+    uint64 *line_hits; /* execution counts, if have_hitcounts */
     line_chunk_t *next;
 };
 
@@ -235,12 +240,18 @@ line_chunk_alloc(uint num_lines)
     chunk->line_info = malloc(size);
     memset(chunk->line_info, SOURCE_LINE_STATUS_NONE, size);
     ASSERT(chunk->line_info != NULL, "Failed to alloc line array\n");
+    chunk->line_hits = NULL;
+    if (have_hitcounts) {
+        chunk->line_hits = calloc(num_lines, sizeof(chunk->line_hits[0]));
+        ASSERT(chunk->line_hits != NULL, "Failed to alloc line hit array\n");
+    }
     return chunk;
 }
 
 static void
 line_chunk_free(line_chunk_t *chunk)
 {
+    free(chunk->line_hits);
     free(chunk->line_info);
     free(chunk);
 }
@@ -257,8 +268,14 @@ line_chunk_print(line_chunk_t *chunk, char *start)
          i < chunk->num_lines;
          i++, line_num++) {
         if (chunk->line_info[i] != SOURCE_LINE_STATUS_NONE) {
+            uint64 count = chunk->line_info[i];
+            /* DR builds a block right before running it, so a block that was
+             * seen without a count (or whose racy count was lost) ran once.
+             */
+            if (chunk->line_hits != NULL && chunk->line_hits[i] > count)
+                count = chunk->line_hits[i];
             res = dr_snprintf(start, MAX_CHAR_PER_LINE,
-                              "DA:%u,%u\n", line_num, chunk->line_info[i]);
+                              "DA:%u,%llu\n", line_num, count);
             ASSERT(res < MAX_CHAR_PER_LINE && res != -1, "Error on printing\n");
             start += res;
         }
@@ -331,8 +348,9 @@ line_table_delete(void *p)
     free(table);
 }
 
+/* A line takes the highest count of the blocks at its addresses. */
 static inline void
-line_table_add(line_table_t *line_table, uint64 line, int status)
+line_table_add(line_table_t *line_table, uint64 line, int status, uint64 hits)
 {
     line_chunk_t *chunk = line_table->chunk;
     /* We see this and it seems to be erroneous data from the pdb,
@@ -373,11 +391,62 @@ line_table_add(line_table_t *line_table, uint64 line, int status)
                 chunk->line_info[line - chunk->first_num] !=
                 (byte)SOURCE_LINE_STATUS_EXEC)
                 chunk->line_info[line - chunk->first_num]  = (byte)status;
+            if (chunk->line_hits != NULL &&
+                chunk->line_hits[line - chunk->first_num] < hits)
+                chunk->line_hits[line - chunk->first_num] = hits;
             return;
         }
     }
 }
 
+/****************************************************************************
+ * Snapshot Chains
+ */
+
+/* Snapshots of a process carry sequence numbers from 0, each holding only
+ * the blocks added since the previous one, so coverage is the union of the
+ * whole chain. We count the snapshots read per pid to report missing ones.
+ */
+#define SNAPSHOT_HASH_TABLE_BITS 4
+static hashtable_t snapshot_htable;
+
+typedef struct _snapshot_chain_t {
+    uint count;
+    uint max_seq;
+} snapshot_chain_t;
+
+static void
+snapshot_chain_add(uint pid, uint seq)
+{
+    snapshot_chain_t *chain = hashtable_lookup(&snapshot_htable,
+                                               (void *)(ptr_uint_t)pid);
+    if (chain == NULL) {
+        chain = calloc(1, sizeof(*chain));
+        if (!hashtable_add(&snapshot_htable, (void *)(ptr_uint_t)pid, chain))
+            ASSERT(false, "Failed to add new snapshot chain");
+    }
+    chain->count++;
+    if (seq > chain->max_seq)
+        chain->max_seq = seq;
+}
+
+static void
+snapshot_chain_check(void)
+{
+    uint i;
+    for (i = 0; i < HASHTABLE_SIZE(snapshot_htable.table_bits); i++) {
+        hashtable_entry_t *e;
+        for (e = snapshot_htable.table[i]; e != NULL; e = e->next) {
+            snapshot_chain_t *chain = e->payload;
+            if (chain->count != chain->max_seq + 1) {
+                WARN(1, "Read %u snapshots of pid %u up to snapshot %u, "
+                     "the coverage may be incomplete\n", chain->count,
+                     (uint)(ptr_uint_t)e->key, chain->max_seq);
+            }
+        }
+    }
+}
+
 /****************************************************************************
  * Basic Block Table Data Structure & Functions
  */
@@ -416,8 +485,17 @@ enum {
     BB_TABLE_ENTRY_SET     = 1,
 };
 
+/* With hit counts, each offset of a block adds the block's count to its
+ * slot in a sparse array of pages, allocated when first touched.
+ */
+#define HIT_PAGE_BITS        12
+#define HIT_PAGE_SIZE        (1 << HIT_PAGE_BITS)
+#define HIT_PAGE_INDEX(x)    ((x) >> HIT_PAGE_BITS)
+#define HIT_PAGE_OFFSET(x)   ((x) & (HIT_PAGE_SIZE - 1))
+
 typedef struct _bb_table_t {
     uint size;
+    uint64 **hits; /* NULL until a count is added */
     byte bm[1];
 } bb_table_t;
 
@@ -428,7 +506,7 @@ bb_table_create(uint mod_size)
     ASSERT(ALIGNED(mod_size, BITS_PER_BYTE), "Module size is not aligned");
 
     table = (bb_table_t *)
-        calloc(1, sizeof(uint) + (size_t)mod_size/BITS_PER_BYTE);
+        calloc(1, offsetof(bb_table_t, bm) + (size_t)mod_size/BITS_PER_BYTE);
     PRINT(3, "bb table %p, %u\n", table, mod_size/BITS_PER_BYTE);
     ASSERT(table != NULL, "Failed to create bb table");
     table->size = mod_size;
@@ -438,9 +516,17 @@ bb_table_create(uint mod_size)
 static void
 bb_table_delete(void *p)
 {
+    bb_table_t *table = (bb_table_t *)p;
+    uint i;
     PRINT(3, "Delete bb table "PFX"\n", (ptr_uint_t)p);
-    if (p != BB_TABLE_IGNORE)
-        free(p);
+    if (p == BB_TABLE_IGNORE)
+        return;
+    if (table->hits != NULL) {
+        for (i = 0; i <= HIT_PAGE_INDEX(table->size); i++)
+            free(table->hits[i]);
+        free(table->hits);
+    }
+    free(p);
 }
 
 static inline int
@@ -504,12 +590,44 @@ bb_table_add(bb_table_t *table, bb_entry_t *entry)
     return true;
 }
 
+static inline void
+bb_table_add_hits(bb_table_t *table, bb_entry_t *entry, uint64 hits)
+{
+    uint addr;
+    if (table == BB_TABLE_IGNORE || hits == 0)
+        return;
+    if (table->size <= entry->start + entry->size)
+        return; /* reported by bb_table_add */
+    if (table->hits == NULL) {
+        table->hits = calloc(HIT_PAGE_INDEX(table->size) + 1, sizeof(uint64 *));
+        ASSERT(table->hits != NULL, "Failed to alloc hit pages");
+    }
+    for (addr = entry->start; addr < entry->start + entry->size; addr++) {
+        uint64 **page = &table->hits[HIT_PAGE_INDEX(addr)];
+        if (*page == NULL) {
+            *page = calloc(HIT_PAGE_SIZE, sizeof(uint64));
+            ASSERT(*page != NULL, "Failed to alloc hit page");
+        }
+        (*page)[HIT_PAGE_OFFSET(addr)] += hits;
+    }
+}
+
+static inline uint64
+bb_table_lookup_hits(bb_table_t *table, uint addr)
+{
+    uint64 *page;
+    if (table->hits == NULL || table->size <= addr)
+        return 0;
+    page = table->hits[HIT_PAGE_INDEX(addr)];
+    return page == NULL ? 0 : page[HIT_PAGE_OFFSET(addr)];
+}
+
 static char *
 read_module_list(char *buf, void ***tables, uint *num_mods)
 {
     char  path[MAXIMUM_PATH];
     uint  i;
-    uint  version;
+    uint  version, seq, pid;
 
     PRINT(3, "Reading module table...\n");
     /* versione number */
@@ -521,6 +639,13 @@ read_module_list(char *buf, void ***tables, uint *num_mods)
     }
     buf = move_to_next_line(buf);
 
+    /* snapshot number, only in snapshot files */
+    if (dr_sscanf(buf, "Snapshot: %u, pid %u\n", &seq, &pid) == 2) {
+        PRINT(4, "Reading snapshot %u of pid %u\n", seq, pid);
+        snapshot_chain_add(pid, seq);
+        buf = move_to_next_line(buf);
+    }
+
     /* module table header */
     PRINT(4, "Reading Module Table Header\n");
     if (dr_sscanf(buf, "Module Table: %d\n", num_mods) != 1) {
@@ -563,8 +688,10 @@ read_module_list(char *buf, void ***tables, uint *num_mods)
     return buf;
 }
 
+/* hits is NULL, or holds the execution count of each bb */
 static bool
-read_bb_list(char *buf, void **tables, uint num_mods, uint num_bbs)
+read_bb_list(char *buf, void **tables, uint num_mods, uint num_bbs,
+             uint64 *hits)
 {
     uint i;
     bb_entry_t *entry;
@@ -575,8 +702,11 @@ read_bb_list(char *buf, void **tables, uint num_mods, uint num_bbs)
         PRINT(6, "BB: "PFX", %u, %u\n",
               (ptr_uint_t)entry->start, entry->size, entry->mod_id);
         /* we could have mod id USHRT_MAX for unknown module e.g., [vdso] */
-        if (entry->mod_id < num_mods)
+        if (entry->mod_id < num_mods) {
             add_new_bb = bb_table_add(tables[entry->mod_id], entry) || add_new_bb;
+            if (hits != NULL)
+                bb_table_add_hits(tables[entry->mod_id], entry, hits[i]);
+        }
     }
     free(tables);
     return add_new_bb;
@@ -626,6 +756,32 @@ close_input_file(file_t f, char *map, size_t map_size)
     dr_close_file(f);
 }
 
+/* Returns the counts of the hit count table at ptr, if there is one for
+ * all num_bbs entries, or else NULL.
+ */
+static uint64 *
+read_hit_list(char *ptr, char *map, size_t map_size, uint num_bbs)
+{
+    uint version, num_hits;
+    if (ptr + MIN_LOG_FILE_SIZE > map + map_size ||
+        dr_sscanf(ptr, "Hit Count Table: version %u, %u counts\n",
+                  &version, &num_hits) != 2)
+        return NULL;
+    if (version != DRCOV_HITCOUNT_VERSION) {
+        WARN(1, "Unsupported hit count table version %u\n", version);
+        return NULL;
+    }
+    ptr = move_to_next_line(ptr);
+    if (num_hits < num_bbs ||
+        (size_t)(map + map_size - ptr) < num_hits*sizeof(uint64)) {
+        WARN(1, "Wrong number of hit counts %u for %u bbs\n", num_hits, num_bbs);
+        return NULL;
+    }
+    PRINT(4, "Reading %u hit counts\n", num_hits);
+    have_hitcounts = true;
+    return (uint64 *)ptr;
+}
+
 static bool
 read_drcov_file(char *input)
 {
@@ -656,7 +812,9 @@ read_drcov_file(char *input)
         close_input_file(log, map, map_size);
         return false;
     }
-    res = read_bb_list(ptr, tables, num_mods, num_bbs);
+    res = read_bb_list(ptr, tables, num_mods, num_bbs,
+                       read_hit_list(ptr + num_bbs*sizeof(bb_entry_t), map,
+                                     map_size, num_bbs));
     if (res && set_log != INVALID_FILE)
         dr_fprintf(set_log, "%s\n", input);
     close_input_file(log, map, map_size);
@@ -666,9 +824,7 @@ read_drcov_file(char *input)
 static inline bool
 is_drcov_log_file(const char *fname)
 {
-    if (fname[0] == 'b' && fname[1] == 'b' &&
-        fname[2] == 'c' && fname[3] == 'o' &&
-        fname[4] == 'v' && fname[5] == '.' &&
+    if ((strncmp(fname, "bbcov.", 6) == 0 || strncmp(fname, "drcov.", 6) == 0) &&
         strstr(fname, ".log") != NULL)
         return true;
     return false;
@@ -777,6 +933,7 @@ read_drcov_input(void)
         res = res && read_drcov_list();
     if (input_dir  != NULL)
         res = res && read_drcov_dir();
+    snapshot_chain_check();
     return res;
 }
 
@@ -784,6 +941,7 @@ static bool
 enum_line_cb(drsym_line_info_t *info, void *data)
 {
     int   status;
+    uint64 hits;
     void *bb_table = data;
     line_table_t *line_table;
 
@@ -798,12 +956,13 @@ enum_line_cb(drsym_line_info_t *info, void *data)
             ASSERT(false, "Failed to add new source line table");
     }
     status = bb_table_lookup(bb_table, (uint)info->line_addr);
+    hits   = bb_table_lookup_hits(bb_table, (uint)info->line_addr);
     if (status == BB_TABLE_ENTRY_SET) {
         PRINT(5, "exec: ");
-        line_table_add(line_table, info->line, SOURCE_LINE_STATUS_EXEC);
+        line_table_add(line_table, info->line, SOURCE_LINE_STATUS_EXEC, hits);
     } else if (status == BB_TABLE_ENTRY_CLEAR) {
         PRINT(5, "skip: ");
-        line_table_add(line_table, info->line, SOURCE_LINE_STATUS_SKIP);
+        line_table_add(line_table, info->line, SOURCE_LINE_STATUS_SKIP, 0);
     } else {
         WARN(2, "Invalid bb table lookup, Table: "PFX", Addr: "PFX"\n",
              (ptr_uint_t)bb_table, (ptr_uint_t)info->line);
@@ -1049,6 +1208,9 @@ main(int argc, char *argv[])
                       true /* strdup */, false /* !synch */,
                       line_table_delete /* free */,
                       NULL /* hash */, NULL /* cmp */);
+    hashtable_init_ex(&snapshot_htable, SNAPSHOT_HASH_TABLE_BITS, HASH_INTPTR,
+                      false /* !strdup */, false /* !synch */,
+                      free /* free */, NULL /* hash */, NULL /* cmp */);
 
     PRINT(1, "Reading input files...\n");
     if (!read_drcov_input()) {
@@ -1070,6 +1232,7 @@ main(int argc, char *argv[])
 
     hashtable_delete(&module_htable);
     hashtable_delete(&line_htable);
+    hashtable_delete(&snapshot_htable);
     if (drsym_exit() != DRSYM_SUCCESS) {
         ASSERT(false, "Failed to clean up symbol library\n");
         return 1;
@@ -4253,6 +4253,10 @@ fcache_reset_all_caches_proactively(uint target)
         fragment_reset_free();
         link_reset_free();
         fcache_reset_free();
+#ifdef SECURITY_AUDIT
+        /* frees retired ibp tables, which no thread can be reading now */
+        audit_reset_free();
+#endif
         /* monitor only has thread-private data */
         /* arch and os data is all persistent */
         vm_areas_reset_free();
@@ -4295,6 +4299,9 @@ fcache_reset_all_caches_proactively(uint target)
                 monitor_thread_reset_init(dcontext);
                 fcache_thread_reset_init(dcontext);
                 fragment_thread_reset_init(dcontext);
+#ifdef SECURITY_AUDIT
+                audit_thread_reset_init(dcontext);
+#endif
             }
         }
     }
@@ -103,6 +103,10 @@
  * to obtain persistence routines, define
  *   HASHTABLE_SUPPORT_PERSISTENCE
  *
+ * to take ownership of the old table of a shared lockless table on resize
+ * (it is then never freed here, and _resized_custom must free it), define
+ *   HASHTABLE_RETAIN_OLD_TABLE
+ *
  * for custom behavior we assume that these routines exist:
  *
  *    static void
@@ -1180,6 +1184,7 @@ HTNAME(hashtable_,NAME_KEY,_check_size)(dcontext_t *dcontext,
                  table->table_flags, old_capacity);
         }
         else {
+#ifndef HASHTABLE_RETAIN_OLD_TABLE
             if (old_ref_count == 0) {
                 /* Note that a write lock is held on the table, so no danger of
                  * a double free. */
@@ -1189,6 +1194,7 @@ HTNAME(hashtable_,NAME_KEY,_check_size)(dcontext_t *dcontext,
                      table->table_flags, old_capacity);
                 STATS_INC(num_shared_ibt_tables_freed_immediately);
             }
+#endif
         }
 
         HTNAME(hashtable_,NAME_KEY,_resized_custom)
@@ -2294,6 +2300,7 @@ HTNAME(hashtable_,NAME_KEY,_resurrect)(dcontext_t *dcontext, byte *mapped_table
 #undef HASHTABLE_USE_LOOKUPTABLE
 #undef HASHTABLE_ENTRY_STATS
 #undef HASHTABLE_SUPPORT_PERSISTENCE
+#undef HASHTABLE_RETAIN_OLD_TABLE
 #undef HTLOCK_RANK
 
 #undef ALLOW_DUPLICATE_ENTRIES
@@ -2957,6 +2957,17 @@ os_get_file_size_by_handle(file_t fd, uint64 *size)
     return true;
 }
 
+bool
+os_set_file_size(file_t fd, uint64 size)
+{
+#ifdef X64
+    return (dynamorio_syscall(SYS_ftruncate, 2, fd, size) == 0);
+#else
+    return (dynamorio_syscall(SYS_ftruncate64, 3, fd, (uint)(size & 0xFFFFFFFF),
+                              (uint)((size >> 32) & 0xFFFFFFFF)) == 0);
+#endif
+}
+
 /* created directory will be owned by effective uid,
  * Note a symbolic link will never be followed.
  */
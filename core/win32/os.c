@@ -6098,7 +6098,6 @@ os_set_file_size(IN HANDLE file_handle,
 {
     NTSTATUS res;
     FILE_END_OF_FILE_INFORMATION file_end_info;
-    ASSERT_CURIOSITY(end_of_file != 0);
     file_end_info.EndOfFile.QuadPart = end_of_file;
     res = nt_set_file_info(file_handle,
                            &file_end_info,
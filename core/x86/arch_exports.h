@@ -160,14 +160,15 @@ typedef struct _ibp_metadata_t {
     app_pc xsi_temp_slot;
 } ibp_metadata_t;
 
-// x64: 96 bytes: 2 cache lines
-// x86: 56 bytes: 1 cache line
+// x64: 104 bytes: 2 cache lines
+// x86: 60 bytes: 1 cache line
 typedef struct _local_security_audit_state_t {
     void *security_audit_thread_local;
     shadow_stack_frame_t *shadow_stack;
     shadow_stack_frame_t *shadow_stack_miss_frame;
     uint stack_spy_mark;
     ibp_metadata_t ibp_data;
+    uint ibp_epoch; /* epoch of ibp_data.lookuptable (not read from the cache) */
 } local_security_audit_state_t;
 
 #endif
@@ -36,6 +36,7 @@
 #include "../module_shared.h"
 #include "../monitor.h"
 #include "../hashtable.h"
+#include "../fcache.h" /* for schedule_reset */
 #include "instr.h"
 #include "instr_create.h"
 #include "instrument.h"
@@ -122,8 +123,36 @@ do { \
 #define HASHTABLE_SUPPORT_PERSISTENCE 0
 #define DISABLE_STAT_STUDY 1
 #define FAST_CLEAR 1
+#define HASHTABLE_RETAIN_OLD_TABLE 1 /* retired in hashtable_ibp_resized_custom() */
 #include "../hashtablex.h" /*** invoke the template ***/
 
+/**** lock-free insert ****/
+
+#define IBP_LOAD(slot) ibp_load(slot)
+#ifdef WINDOWS
+/* the intrinsic returns the previous value */
+# define IBP_COMPARE_EXCHANGE(slot, compare, exchange) \
+    ((bb_tag_pairing_t) ATOMIC_COMPARE_EXCHANGE_int64(*(slot), compare, exchange))
+#else
+/* the asm form of ATOMIC_COMPARE_EXCHANGE_int64 is a statement with no value */
+# define IBP_COMPARE_EXCHANGE(slot, compare, exchange) \
+    __sync_val_compare_and_swap((slot), (compare), (exchange))
+#endif
+#define IBP_ATOMIC_ADD(var, value) atomic_add_exchange_int(&(var), value)
+
+static inline bb_tag_pairing_t
+ibp_load(bb_tag_pairing_t *slot)
+{
+#ifdef X64
+    return *(volatile bb_tag_pairing_t *) slot;
+#else
+    /* a plain 8-byte read is two loads, which can see half of a concurrent insert */
+    return IBP_COMPARE_EXCHANGE(slot, (bb_tag_pairing_t) 0, (bb_tag_pairing_t) 0);
+#endif
+}
+
+#include "ibp_lockless.h"
+
 /**** Private Fields ****/
 
 #define GENERIC_ENTRY_IS_REAL(e) ((e) != 0 && (e) != (bb_tag_pairing_t) 2)
@@ -134,6 +163,25 @@ static const uint MASK_OFFSET = 0;
 
 static ibp_table_t *ibp_table;
 
+/* Retired arrays stay allocated until every thread has loaded the new one at dispatch, or
+ * until the next reset, which frees them all. Synchronized by the table's write lock.
+ */
+static ibp_epoch_t ibp_epoch;
+
+/* A retired array that a blocked thread keeps alive for this many resizes schedules a reset.
+ * Each array is half the size of the next, so the retired arrays never add up to more than
+ * the current one in the meantime.
+ */
+#define IBP_RETIRED_RESET_EPOCHS 4
+
+/**** Private Prototypes ****/
+
+static void
+refresh_ibp_table(dcontext_t *dcontext, bool exiting);
+
+static void
+free_retired_ibp_tables(ibp_retired_t *retired);
+
 DR_API
 void
 dr_enter_fcache(dcontext_t *dcontext, app_pc tag)
@@ -177,6 +225,13 @@ dr_is_safe_to_read(byte *pc, size_t size)
     return is_readable_without_exception_query_os(pc, size);
 }
 
+DR_API
+bool
+dr_file_set_size(file_t f, uint64 size)
+{
+    return os_set_file_size(f, size);
+}
+
 DR_API
 local_security_audit_state_t *
 dcontext_get_audit_state(dcontext_t *dcontext)
@@ -421,6 +476,18 @@ dr_ibp_add_new(dcontext_t *dcontext, bb_tag_pairing_t possibly_new)
 {
     bool added = false;
     bb_tag_pairing_t value;
+    ibp_insert_result_t result;
+
+    /* new pairs are added under the read lock; only a resize needs the write lock */
+    TABLE_RWLOCK(ibp_table, read, lock);
+    result = ibp_insert_lockless(ibp_table->table,
+                                 HASH_FUNC((ptr_uint_t) possibly_new, ibp_table),
+                                 (uint) (ibp_table->hash_mask >> ibp_table->hash_mask_offset),
+                                 (volatile int *) &ibp_table->entries,
+                                 (int) ibp_table->resize_threshold, possibly_new);
+    TABLE_RWLOCK(ibp_table, read, unlock);
+    if (result != IBP_INSERT_FULL)
+        return (result == IBP_INSERT_ADDED);
 
     TABLE_RWLOCK(ibp_table, write, lock);
     value = hashtable_ibp_lookup(dcontext, possibly_new, ibp_table);
@@ -538,6 +605,10 @@ audit_init()
     flags |= HASHTABLE_SHARED;
     flags |= HASHTABLE_RELAX_CLUSTER_CHECKS;
     flags |= HASHTABLE_NOT_PRIMARY_STORAGE;
+    /* read from the code cache: a resize retires the old array instead of freeing it */
+    flags |= HASHTABLE_LOCKLESS_ACCESS;
+    /* 8-byte entries must not span cache lines, for the atomic insert */
+    flags |= HASHTABLE_ALIGN_TABLE;
     hashtable_ibp_init(GLOBAL_DCONTEXT,
         ibp_table,
         INITIAL_KEY_SIZE,
@@ -547,16 +618,48 @@ audit_init()
         flags
         _IF_DEBUG("ibp table"));
 
+    ibp_epoch_init(&ibp_epoch);
+
     SEC_LOG(3, "Allocated IBP table at "PX"\n", ibp_table);
 }
 
 void
 audit_exit()
 {
+    free_retired_ibp_tables(ibp_epoch.retired);
+    ibp_epoch.retired = NULL;
     hashtable_ibp_free(GLOBAL_DCONTEXT, ibp_table);
     dr_global_free(ibp_table, sizeof(ibp_table_t));
 }
 
+/* Called from a reset, while every other thread is suspended outside the code cache or at a
+ * syscall. No thread can be reading a retired array, and each one loads the current array in
+ * audit_thread_reset_init() before it resumes.
+ */
+void
+audit_reset_free()
+{
+    ibp_retired_t *reclaimed;
+
+    TABLE_RWLOCK(ibp_table, write, lock);
+    reclaimed = ibp_epoch_reclaim_all(&ibp_epoch);
+    TABLE_RWLOCK(ibp_table, write, unlock);
+
+    free_retired_ibp_tables(reclaimed);
+}
+
+void
+audit_thread_reset_init(dcontext_t *dcontext)
+{
+    local_security_audit_state_t *csd = dcontext_get_audit_state(dcontext);
+
+    TABLE_RWLOCK(ibp_table, write, lock);
+    csd->ibp_epoch = ibp_epoch.current;
+    csd->ibp_data.lookuptable = ibp_table->table;
+    csd->ibp_data.hash_mask = ibp_table->hash_mask;
+    TABLE_RWLOCK(ibp_table, write, unlock);
+}
+
 void
 audit_thread_init(dcontext_t *dcontext)
 {
@@ -564,8 +667,11 @@ audit_thread_init(dcontext_t *dcontext)
 
     ASSERT(csd != NULL);
 
+    TABLE_RWLOCK(ibp_table, write, lock);
+    csd->ibp_epoch = ibp_epoch_thread_init(&ibp_epoch);
     csd->ibp_data.lookuptable = ibp_table->table;
     csd->ibp_data.hash_mask = ibp_table->hash_mask;
+    TABLE_RWLOCK(ibp_table, write, unlock);
 
     audit_client_thread_init(dcontext);
 }
@@ -574,6 +680,8 @@ void
 audit_thread_exit(dcontext_t *dcontext)
 {
     audit_client_thread_exit(dcontext);
+
+    refresh_ibp_table(dcontext, true);
 }
 
 void
@@ -585,31 +693,49 @@ audit_dispatch(dcontext_t *dcontext)
         return;
     } else { /* could do this at syscalls, callbacks, etc., but ok to let them miss */
         local_security_audit_state_t *csd = dcontext_get_audit_state(dcontext);
-        if (csd->ibp_data.lookuptable != ibp_table->table) {
-            csd->ibp_data.lookuptable = ibp_table->table;
-            csd->ibp_data.hash_mask = ibp_table->hash_mask;
-        }
+        if (csd->ibp_epoch != ibp_epoch.current) /* racy read, checked again under the lock */
+            refresh_ibp_table(dcontext, false);
 
         audit_callbacks->audit_dispatch(dcontext);
     }
 }
 
-static inline void
-update_ibp_table_and_mask(dcontext_t *dcontext, ibp_table_t *htable) {
-    if (dcontext != GLOBAL_DCONTEXT) {
-        local_security_audit_state_t *csd = dcontext_get_audit_state(dcontext);
-        csd->ibp_data.lookuptable = htable->table;
-        csd->ibp_data.hash_mask = htable->hash_mask;
-    }
+/* Loads the current table for the code cache of this thread, and frees any retired table
+ * that was only waiting on this thread.
+ */
+static void
+refresh_ibp_table(dcontext_t *dcontext, bool exiting)
+{
+    local_security_audit_state_t *csd = dcontext_get_audit_state(dcontext);
+    ibp_retired_t *reclaimed;
 
-    // cs-todo: is it better to hvae a separate ibp table on each thread?
-    SEC_LOG(3, "ibp update: table is now at "PX" with mask %x\n",
-            htable->table, htable->hash_mask);
+    TABLE_RWLOCK(ibp_table, write, lock);
+    reclaimed = ibp_epoch_advance(&ibp_epoch, csd->ibp_epoch, exiting);
+    csd->ibp_epoch = ibp_epoch.current;
+    csd->ibp_data.lookuptable = ibp_table->table;
+    csd->ibp_data.hash_mask = ibp_table->hash_mask;
+    TABLE_RWLOCK(ibp_table, write, unlock);
+
+    free_retired_ibp_tables(reclaimed);
+}
+
+static void
+free_retired_ibp_tables(ibp_retired_t *retired)
+{
+    while (retired != NULL) {
+        ibp_retired_t *next = retired->next;
+
+        SEC_LOG(3, "ibp update: freeing retired table at "PX"\n", retired->table);
+        hashtable_ibp_free_table(GLOBAL_DCONTEXT, (bb_tag_pairing_t *) retired->table,
+                                 ibp_table->table_flags, retired->capacity);
+        dr_global_free(retired, sizeof(ibp_retired_t));
+        retired = next;
+    }
 }
 
 static void
 hashtable_ibp_init_internal_custom(dcontext_t *dcontext, ibp_table_t *htable) {
-    // update_ibp_table_and_mask(dcontext, htable);
+    /* threads load the table in audit_thread_init() */
 }
 
 static void
@@ -617,7 +743,21 @@ hashtable_ibp_resized_custom(dcontext_t *dcontext, ibp_table_t *htable,
                                 uint old_capacity, bb_tag_pairing_t *old_table,
                                 bb_tag_pairing_t *old_table_unaligned,
                                 uint old_ref_count, uint old_table_flags) {
-    update_ibp_table_and_mask(dcontext, htable);
+    ibp_retired_t *retired = (ibp_retired_t *) dr_global_alloc(sizeof(ibp_retired_t));
+
+    /* The template leaves the old array to us (HASHTABLE_RETAIN_OLD_TABLE). Threads load
+     * the new one at their next dispatch.
+     */
+    retired->table = old_table_unaligned;
+    retired->capacity = old_capacity;
+    if (!ibp_epoch_retire(&ibp_epoch, retired))
+        free_retired_ibp_tables(retired);
+    else if (DYNAMO_OPTION(enable_reset) &&
+             (ibp_epoch.current - ibp_epoch.retired->epoch) > IBP_RETIRED_RESET_EPOCHS)
+        schedule_reset(RESET_ALL); /* some thread has not dispatched for a while */
+
+    SEC_LOG(3, "ibp update: table is now at "PX" with mask %x\n",
+            htable->table, htable->hash_mask);
 }
 
 static void
@@ -197,6 +197,11 @@ DR_API
 bool
 dr_is_safe_to_read(byte *pc, size_t size);
 
+/* Sets the end of file \p f to \p size bytes, extending or truncating it. */
+DR_API
+bool
+dr_file_set_size(file_t f, uint64 size);
+
 DR_API
 ibp_metadata_t *
 dcontext_get_ibp_data(dcontext_t *dcontext);
@@ -332,6 +337,12 @@ audit_thread_init(dcontext_t *dcontext);
 void
 audit_thread_exit(dcontext_t *dcontext);
 
+void
+audit_reset_free();
+
+void
+audit_thread_reset_init(dcontext_t *dcontext);
+
 /****************************************************************************
  * SECURITY AUDITING INTERNAL_CALLBACKS
  */
@@ -0,0 +1,190 @@
+/* **********************************************************
+ * Copyright (c) 2016 UCI PLRG.  All rights reserved.
+ * **********************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of VMware, Inc. nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL VMWARE, INC. OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* Lock-free insert and deferred table reclamation for the IBP table (audit.c).
+ *
+ * Inserts of new pairs hold only the table's read lock, so they run in parallel with each
+ * other and with lookups. Anything that moves entries (resize, remove, clear) still holds
+ * the write lock. A slot goes from ENTRY_EMPTY to a key exactly once while the read lock is
+ * held, so a reader probing from the home index (including the in-cache lookup, which holds
+ * no lock at all) meets either an empty slot or the key; the sentinel past the last index
+ * and the tagging of keys are unchanged.
+ *
+ * A resize publishes a new array and retires the old one, which stays allocated until every
+ * thread that could still be reading it from the code cache has loaded the new one. Threads
+ * record the epoch of the table they loaded; each retirement ends an epoch.
+ *
+ * This file depends only on what the includer defines beforehand, so that the blackbox
+ * stress test can exercise it outside of the core:
+ *   bb_tag_pairing_t, uint, bool
+ *   IBP_LOAD(slot): reads *slot in one access (two halves may tear on 32-bit)
+ *   IBP_COMPARE_EXCHANGE(slot, compare, exchange): returns the previous value of *slot
+ *   IBP_ATOMIC_ADD(var, value): adds to the int `var` and returns the sum
+ */
+
+#ifndef _IBP_LOCKLESS_H_
+#define _IBP_LOCKLESS_H_ 1
+
+typedef enum _ibp_insert_result_t {
+    IBP_INSERT_ADDED,
+    IBP_INSERT_FOUND,
+    IBP_INSERT_FULL, /* at the resize threshold: add under the write lock instead */
+} ibp_insert_result_t;
+
+/* A retired table and the number of threads that may still be reading it. */
+typedef struct _ibp_retired_t {
+    struct _ibp_retired_t *next;
+    void *table;
+    uint capacity;
+    uint epoch;   /* the table was current until this epoch ended */
+    uint holders;
+} ibp_retired_t;
+
+/* Synchronized by the includer (audit.c uses the table's write lock). */
+typedef struct _ibp_epoch_t {
+    uint current;
+    uint thread_count;
+    ibp_retired_t *retired; /* oldest first */
+} ibp_epoch_t;
+
+/* Inserts `key` into `table` starting at its home `index`, unless it is already there.
+ * The caller holds the read lock. `entries` is reserved before a slot is claimed, so the
+ * table never holds more than `limit` entries.
+ */
+static inline ibp_insert_result_t
+ibp_insert_lockless(bb_tag_pairing_t *table, uint index, uint index_mask,
+                    volatile int *entries, int limit, bb_tag_pairing_t key)
+{
+    bool reserved = false;
+    bb_tag_pairing_t e;
+
+    while (true) {
+        e = IBP_LOAD(&table[index]);
+        if (e == key)
+            break;
+        if (e == (bb_tag_pairing_t) 0) {
+            if (!reserved) {
+                if (IBP_ATOMIC_ADD(*entries, 1) > limit) {
+                    IBP_ATOMIC_ADD(*entries, -1);
+                    return IBP_INSERT_FULL;
+                }
+                reserved = true;
+            }
+            e = IBP_COMPARE_EXCHANGE(&table[index], (bb_tag_pairing_t) 0, key);
+            if (e == (bb_tag_pairing_t) 0)
+                return IBP_INSERT_ADDED;
+            if (e == key) /* another thread added the same pair */
+                break;
+        }
+        index = (index + 1) & index_mask;
+    }
+
+    if (reserved)
+        IBP_ATOMIC_ADD(*entries, -1);
+    return IBP_INSERT_FOUND;
+}
+
+static inline void
+ibp_epoch_init(ibp_epoch_t *epoch)
+{
+    epoch->current = 0;
+    epoch->thread_count = 0;
+    epoch->retired = NULL;
+}
+
+/* Returns the epoch of the current table, which the new thread is about to load. */
+static inline uint
+ibp_epoch_thread_init(ibp_epoch_t *epoch)
+{
+    epoch->thread_count++;
+    return epoch->current;
+}
+
+/* Ends the current epoch, retiring `node->table` until every thread has moved past it.
+ * Returns false if no thread could be reading it, in which case it was not retired.
+ */
+static inline bool
+ibp_epoch_retire(ibp_epoch_t *epoch, ibp_retired_t *node)
+{
+    ibp_retired_t **tail = &epoch->retired;
+
+    node->epoch = epoch->current++;
+    node->holders = epoch->thread_count;
+    node->next = NULL;
+    if (node->holders == 0)
+        return false;
+
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = node;
+    return true;
+}
+
+/* Moves a thread from `thread_epoch` to the current epoch (or out of the table, when
+ * `exiting`). Returns the list of retired tables that no thread can be reading anymore,
+ * for the caller to free.
+ */
+static inline ibp_retired_t *
+ibp_epoch_advance(ibp_epoch_t *epoch, uint thread_epoch, bool exiting)
+{
+    ibp_retired_t **link = &epoch->retired, *reclaimed = NULL;
+
+    while (*link != NULL) {
+        ibp_retired_t *node = *link;
+
+        if (node->epoch >= thread_epoch && --node->holders == 0) {
+            *link = node->next;
+            node->next = reclaimed;
+            reclaimed = node;
+        } else {
+            link = &node->next;
+        }
+    }
+    if (exiting)
+        epoch->thread_count--;
+    return reclaimed;
+}
+
+/* Detaches every retired table for the caller to free. Only for a point where no thread can
+ * be reading a retired table (audit.c uses a reset, when all threads are suspended out of the
+ * code cache); each thread must then be given the current table and epoch.
+ */
+static inline ibp_retired_t *
+ibp_epoch_reclaim_all(ibp_epoch_t *epoch)
+{
+    ibp_retired_t *reclaimed = epoch->retired;
+
+    epoch->retired = NULL;
+    return reclaimed;
+}
+
+#endif /* _IBP_LOCKLESS_H_ */
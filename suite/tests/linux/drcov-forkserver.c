@@ -0,0 +1,175 @@
+/* ***************************************************************************
+ * Copyright (c) 2012-2013 Google, Inc.  All rights reserved.
+ * ***************************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Google, Inc. nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL GOOGLE, INC. OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/*
+ * Test of drcov -shm: this app acts as a fork server, clearing the shared
+ * edge bitmap before each run and reading the edges the child recorded.
+ * Runs alternate between two code paths, which must leave different edges.
+ * The server itself also records edges while it forks and waits, so a first
+ * run whose child exits at once gives a baseline, and each later run must
+ * record edges beyond it.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+/* drcov creates the segment at init from "-shm drcov-forkserver-%p", so each
+ * run of the test has a segment of its own
+ */
+#define SHM_PATH    "/dev/shm/drcov-forkserver-%d"
+#define BITMAP_SIZE 0x10000
+#define NUM_RUNS    8
+
+static unsigned char baseline[BITMAP_SIZE];
+static unsigned char runs[2][BITMAP_SIZE];
+
+static int
+path_a(int x)
+{
+    int i, sum = 0;
+    for (i = 0; i < 100; i++) {
+        if (i % 3 == x % 3)
+            sum += i;
+        else
+            sum -= x;
+    }
+    return sum;
+}
+
+static int
+path_b(int x)
+{
+    int i, sum = 1;
+    for (i = 0; i < 100; i++) {
+        switch (i % 4) {
+        case 0: sum *= 3; break;
+        case 1: sum ^= x; break;
+        default: sum += i; break;
+        }
+    }
+    return sum;
+}
+
+/* Returns the number of edges in a that are not in b. */
+static int
+count_new_edges(unsigned char *a, unsigned char *b)
+{
+    int i, count = 0;
+    for (i = 0; i < BITMAP_SIZE; i++) {
+        if (a[i] != 0 && b[i] == 0)
+            count++;
+    }
+    return count;
+}
+
+/* Runs one child on the cleared bitmap: path_a or path_b by the parity of run,
+ * or nothing at all for a negative run. Returns 0 on success.
+ */
+static int
+run_child(unsigned char *bitmap, int run)
+{
+    pid_t child;
+    memset(bitmap, 0, BITMAP_SIZE);
+    child = fork();
+    if (child < 0) {
+        perror("ERROR on fork");
+        return 1;
+    } else if (child == 0) {
+        int res = 0;
+        if (run >= 0)
+            res = (run % 2 == 0) ? path_a(run) : path_b(run);
+        _exit(res == 0x7fffffff ? 1 : 0);
+    }
+    if (waitpid(child, NULL, 0) != child) {
+        perror("ERROR on waitpid");
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned char *bitmap;
+    char path[64];
+    int fd, run, missing = 0;
+
+    snprintf(path, sizeof(path), SHM_PATH, (int)getpid());
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        printf("shared bitmap is missing\n");
+        return 1;
+    }
+    /* the mappings of drcov, this process and its children keep the segment
+     * alive, so it can go now, whatever happens next
+     */
+    unlink(path);
+    bitmap = mmap(NULL, BITMAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bitmap == MAP_FAILED) {
+        printf("failed to map the shared bitmap\n");
+        return 1;
+    }
+    fflush(stdout);
+
+    /* the edges of the server and of a child that does nothing */
+    if (run_child(bitmap, -1) != 0)
+        return 1;
+    memcpy(baseline, bitmap, BITMAP_SIZE);
+
+    for (run = 0; run < NUM_RUNS; run++) {
+        if (run_child(bitmap, run) != 0)
+            return 1;
+        if (count_new_edges(bitmap, baseline) == 0)
+            missing++;
+        if (run < 2)
+            memcpy(runs[run], bitmap, BITMAP_SIZE);
+    }
+
+    printf("%d runs\n", NUM_RUNS);
+    if (missing == 0)
+        printf("every run recorded edges\n");
+    else
+        printf("%d runs recorded no edges beyond the baseline\n", missing);
+    if (count_new_edges(runs[0], runs[1]) > 0 && count_new_edges(runs[1], runs[0]) > 0)
+        printf("the two paths recorded different edges\n");
+    else
+        printf("the two paths recorded the same edges\n");
+
+    munmap(bitmap, BITMAP_SIZE);
+    return 0;
+}